@@ -5623,6 +5623,9 @@ int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     if (bs->drv->bdrv_co_check == NULL) {
         return -ENOTSUP;
     }
+    if ((fix & BDRV_CHECK_DATA) && !bs->drv->supports_check_data) {
+        return -ENOTSUP;
+    }
 
     memset(res, 0, sizeof(*res));
     return bs->drv->bdrv_co_check(bs, res, fix);
@@ -28,6 +28,7 @@
 #include "block/aio_task.h"
 #include "qemu/error-report.h"
 #include "qemu/memalign.h"
+#include "crypto/hash.h"
 
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
@@ -35,6 +36,7 @@
 #define BLOCK_COPY_MAX_WORKERS 64
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 #define BLOCK_COPY_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BLOCK_COPY_HASH_SIZE 32 /* SHA-256 */
 
 typedef enum {
     COPY_READ_WRITE_CLUSTER,
@@ -120,6 +122,11 @@ typedef struct BlockCopyState {
      */
     BdrvChild *source;
     BdrvChild *target;
+    /*
+     * Optional store of per-cluster content hashes, see
+     * block_copy_set_hashes().  Set before any copy request is issued.
+     */
+    BdrvChild *hashes;
 
     /*
      * Fields initialized in block_copy_state_new()
@@ -299,6 +306,9 @@ void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
     } else if (compress) {
         /* Compression supports only cluster-size writes and no copy-range. */
         s->method = COPY_READ_WRITE_CLUSTER;
+    } else if (s->hashes) {
+        /* Data has to pass through our buffer to be hashed. */
+        s->method = COPY_READ_WRITE;
     } else {
         /*
          * If copy range enabled, start with COPY_RANGE_SMALL, until first
@@ -427,6 +437,43 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
     return s;
 }
 
+int block_copy_set_hashes(BlockCopyState *s, BdrvChild *hashes, Error **errp)
+{
+    int64_t required, len;
+
+    GLOBAL_STATE_CODE();
+
+    if (s->write_flags & BDRV_REQ_SERIALISING) {
+        /*
+         * A fleecing target does not keep the data of the previous copy, what
+         * it doesn't have is read through from the (changing) source.
+         */
+        error_setg(errp, "Content hashes cannot be used for image fleecing");
+        return -EINVAL;
+    }
+
+    required = DIV_ROUND_UP(s->len, s->cluster_size) * BLOCK_COPY_HASH_SIZE;
+    len = bdrv_getlength(hashes->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Cannot get the length of the hash node");
+        return len;
+    }
+    if (len < required) {
+        error_setg(errp, "Hash node '%s' is too small: %" PRId64 " bytes are "
+                   "needed for %" PRId64 " clusters",
+                   bdrv_get_node_name(hashes->bs), required,
+                   required / BLOCK_COPY_HASH_SIZE);
+        return -EINVAL;
+    }
+
+    s->hashes = hashes;
+    if (s->method != COPY_READ_WRITE_CLUSTER) {
+        s->method = COPY_READ_WRITE;
+    }
+
+    return 0;
+}
+
 /* Only set before running the job, no need for locking. */
 void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm)
 {
@@ -465,6 +512,122 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
     return 0;
 }
 
+static int block_copy_hash_cluster(const void *buf, size_t bytes, uint8_t *hash)
+{
+    uint8_t *result = NULL;
+    size_t result_len = 0;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, buf, bytes,
+                           &result, &result_len, NULL) < 0) {
+        return -EIO;
+    }
+
+    assert(result_len == BLOCK_COPY_HASH_SIZE);
+    memcpy(hash, result, BLOCK_COPY_HASH_SIZE);
+    g_free(result);
+
+    return 0;
+}
+
+/*
+ * Forget the stored hashes of the clusters in @offset/@bytes, so that they
+ * are copied again next time.  A zeroed entry never matches any content.
+ */
+int coroutine_fn GRAPH_RDLOCK
+block_copy_invalidate_hashes(BlockCopyState *s, int64_t offset, int64_t bytes)
+{
+    int64_t start, end;
+
+    if (!s->hashes) {
+        return 0;
+    }
+
+    start = offset / s->cluster_size;
+    end = DIV_ROUND_UP(MIN(offset + bytes, s->len), s->cluster_size);
+    if (end <= start) {
+        return 0;
+    }
+
+    return bdrv_co_pwrite_zeroes(s->hashes, start * BLOCK_COPY_HASH_SIZE,
+                                 (end - start) * BLOCK_COPY_HASH_SIZE, 0);
+}
+
+/*
+ * Write the data in @buf to the target, skipping the clusters whose hash
+ * matches the one recorded by a previous copy, and record the new hashes.
+ *
+ * The hashes are only updated after the data has reached the target.  If
+ * writing the data fails, the target may have been partially modified, so the
+ * hashes of the range are forgotten.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+block_copy_write_changed(BlockCopyState *s, int64_t offset, int64_t nbytes,
+                         void *buf)
+{
+    int64_t nb_clusters = DIV_ROUND_UP(nbytes, s->cluster_size);
+    int64_t hash_offset = offset / s->cluster_size * BLOCK_COPY_HASH_SIZE;
+    int64_t hash_bytes = nb_clusters * BLOCK_COPY_HASH_SIZE;
+    g_autofree uint8_t *old_hashes = g_malloc(hash_bytes);
+    g_autofree uint8_t *new_hashes = g_malloc(hash_bytes);
+    int64_t i, run_start = -1, skipped = 0;
+    int ret;
+
+    ret = bdrv_co_pread(s->hashes, hash_offset, hash_bytes, old_hashes, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < nb_clusters; i++) {
+        int64_t cluster_offset = i * s->cluster_size;
+
+        ret = block_copy_hash_cluster(buf + cluster_offset,
+                                      MIN(s->cluster_size,
+                                          nbytes - cluster_offset),
+                                      new_hashes + i * BLOCK_COPY_HASH_SIZE);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i <= nb_clusters; i++) {
+        bool changed = i < nb_clusters &&
+            memcmp(old_hashes + i * BLOCK_COPY_HASH_SIZE,
+                   new_hashes + i * BLOCK_COPY_HASH_SIZE,
+                   BLOCK_COPY_HASH_SIZE) != 0;
+
+        if (changed) {
+            if (run_start < 0) {
+                run_start = i;
+            }
+            continue;
+        }
+
+        if (run_start >= 0) {
+            int64_t run_offset = run_start * s->cluster_size;
+
+            ret = bdrv_co_pwrite(s->target, offset + run_offset,
+                                 MIN((i - run_start) * s->cluster_size,
+                                     nbytes - run_offset),
+                                 buf + run_offset, s->write_flags);
+            if (ret < 0) {
+                block_copy_invalidate_hashes(s, offset, nbytes);
+                return ret;
+            }
+            run_start = -1;
+        }
+        if (i < nb_clusters) {
+            skipped++;
+        }
+    }
+
+    trace_block_copy_hash_skip(s, offset, nb_clusters, skipped);
+    if (skipped == nb_clusters) {
+        return 0;
+    }
+
+    return bdrv_co_pwrite(s->hashes, hash_offset, hash_bytes, new_hashes, 0);
+}
+
 /*
  * block_copy_do_copy
  *
@@ -496,8 +659,17 @@ block_copy_do_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
 
     switch (*method) {
     case COPY_WRITE_ZEROES:
-        ret = bdrv_co_pwrite_zeroes(s->target, offset, nbytes, s->write_flags &
-                                    ~BDRV_REQ_WRITE_COMPRESSED);
+        /*
+         * Forget the hashes first: if the target is modified but the hashes
+         * still describe the old content, a later copy of that content would
+         * be skipped.
+         */
+        ret = block_copy_invalidate_hashes(s, offset, nbytes);
+        if (ret >= 0) {
+            ret = bdrv_co_pwrite_zeroes(s->target, offset, nbytes,
+                                        s->write_flags &
+                                        ~BDRV_REQ_WRITE_COMPRESSED);
+        }
         if (ret < 0) {
             trace_block_copy_write_zeroes_fail(s, offset, ret);
             *error_is_read = false;
@@ -539,8 +711,12 @@ block_copy_do_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
             goto out;
         }
 
-        ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer,
-                             s->write_flags);
+        if (s->hashes) {
+            ret = block_copy_write_changed(s, offset, nbytes, bounce_buffer);
+        } else {
+            ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer,
+                                 s->write_flags);
+        }
         if (ret < 0) {
             trace_block_copy_write_fail(s, offset, ret);
             *error_is_read = false;
@@ -42,6 +42,7 @@
 typedef struct BDRVCopyBeforeWriteState {
     BlockCopyState *bcs;
     BdrvChild *target;
+    BdrvChild *hashes;
     OnCbwError on_cbw_error;
     uint32_t cbw_timeout_ns;
 
@@ -325,6 +326,7 @@ static int coroutine_fn GRAPH_RDLOCK
 cbw_co_pdiscard_snapshot(BlockDriverState *bs, int64_t offset, int64_t bytes)
 {
     BDRVCopyBeforeWriteState *s = bs->opaque;
+    int ret;
 
     WITH_QEMU_LOCK_GUARD(&s->lock) {
         bdrv_reset_dirty_bitmap(s->access_bitmap, offset, bytes);
@@ -332,6 +334,11 @@ cbw_co_pdiscard_snapshot(BlockDriverState *bs, int64_t offset, int64_t bytes)
 
     block_copy_reset(s->bcs, offset, bytes);
 
+    ret = block_copy_invalidate_hashes(s->bcs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
     return bdrv_co_pdiscard(s->target, offset, bytes);
 }
 
@@ -349,7 +356,7 @@ cbw_child_perm(BlockDriverState *bs, BdrvChild *c, BdrvChildRole role,
 {
     if (!(role & BDRV_CHILD_FILTERED)) {
         /*
-         * Target child
+         * Target or hashes child
          *
          * Share write to target (child_file), to not interfere
          * with guest writes to its disk which may be in target backing chain.
@@ -433,6 +440,12 @@ static int cbw_open(BlockDriverState *bs, QDict *options, int flags,
         return -EINVAL;
     }
 
+    s->hashes = bdrv_open_child(NULL, options, "hashes", bs, &child_of_bds,
+                                BDRV_CHILD_METADATA, true, errp);
+    if (*errp) {
+        return -EINVAL;
+    }
+
     GRAPH_RDLOCK_GUARD_MAINLOOP();
 
     if (opts->bitmap) {
@@ -460,6 +473,13 @@ static int cbw_open(BlockDriverState *bs, QDict *options, int flags,
         return -EINVAL;
     }
 
+    if (s->hashes) {
+        ret = block_copy_set_hashes(s->bcs, s->hashes, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     cluster_size = block_copy_cluster_size(s->bcs);
 
     s->done_bitmap = bdrv_create_dirty_bitmap(bs, cluster_size, NULL, errp);
@@ -520,6 +540,7 @@ static BlockDriver bdrv_cbw_filter = {
 
 BlockDriverState *bdrv_cbw_append(BlockDriverState *source,
                                   BlockDriverState *target,
+                                  BlockDriverState *hashes,
                                   const char *filter_node_name,
                                   BlockCopyState **bcs,
                                   Error **errp)
@@ -538,6 +559,9 @@ BlockDriverState *bdrv_cbw_append(BlockDriverState *source,
     }
     qdict_put_str(opts, "file", bdrv_get_node_name(source));
     qdict_put_str(opts, "target", bdrv_get_node_name(target));
+    if (hashes) {
+        qdict_put_str(opts, "hashes", bdrv_get_node_name(hashes));
+    }
 
     top = bdrv_insert_node(source, opts, BDRV_O_RDWR, errp);
     if (!top) {
@@ -38,6 +38,7 @@
 
 BlockDriverState *bdrv_cbw_append(BlockDriverState *source,
                                   BlockDriverState *target,
+                                  BlockDriverState *hashes,
                                   const char *filter_node_name,
                                   BlockCopyState **bcs,
                                   Error **errp);
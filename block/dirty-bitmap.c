@@ -253,6 +253,27 @@ void bdrv_dirty_bitmap_enable_successor(BdrvDirtyBitmap *bitmap)
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
 }
 
+/*
+ * Hand the meta bitmap of @from over to @to, which is about to replace it as
+ * the implementation of a BdrvDirtyBitmap of @size bytes.  As we don't know
+ * what differs between the two, all of the new meta bitmap is marked.
+ */
+static void bdrv_dirty_bitmap_move_meta(HBitmap *from, HBitmap *to,
+                                        int64_t size)
+{
+    HBitmap *meta = hbitmap_meta(from);
+    int chunk_size;
+
+    if (!meta) {
+        return;
+    }
+
+    chunk_size = 1 << (hbitmap_granularity(meta) - hbitmap_granularity(from));
+    hbitmap_free_meta(from);
+    meta = hbitmap_create_meta(to, chunk_size);
+    hbitmap_set(meta, 0, size);
+}
+
 /* Called within bdrv_dirty_bitmap_lock..unlock and with BQL taken.  */
 static void bdrv_release_dirty_bitmap_locked(BdrvDirtyBitmap *bitmap)
 {
@@ -260,6 +281,9 @@ static void bdrv_release_dirty_bitmap_locked(BdrvDirtyBitmap *bitmap)
     assert(!bdrv_dirty_bitmap_busy(bitmap));
     assert(!bdrv_dirty_bitmap_has_successor(bitmap));
     QLIST_REMOVE(bitmap, list);
+    if (hbitmap_meta(bitmap->bitmap)) {
+        hbitmap_free_meta(bitmap->bitmap);
+    }
     hbitmap_free(bitmap->bitmap);
     g_free(bitmap->name);
     g_free(bitmap);
@@ -582,6 +606,7 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
         HBitmap *backup = bitmap->bitmap;
         bitmap->bitmap = hbitmap_alloc(bitmap->size,
                                        hbitmap_granularity(backup));
+        bdrv_dirty_bitmap_move_meta(backup, bitmap->bitmap, bitmap->size);
         *out = backup;
     }
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
@@ -593,6 +618,7 @@ void bdrv_restore_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *backup)
     assert(!bdrv_dirty_bitmap_readonly(bitmap));
     GLOBAL_STATE_CODE();
     bitmap->bitmap = backup;
+    bdrv_dirty_bitmap_move_meta(tmp, backup, bitmap->size);
     hbitmap_free(tmp);
 }
 
@@ -653,6 +679,76 @@ void bdrv_dirty_bitmap_deserialize_finish(BdrvDirtyBitmap *bitmap)
     hbitmap_deserialize_finish(bitmap->bitmap);
 }
 
+/**
+ * Start tracking which parts of @bitmap change, in chunks of @chunk_size
+ * bitmap bits (a power of two).  Lets persistent storage write back only the
+ * parts of a bitmap that differ from what it has loaded or stored before.
+ * Called with BQL taken.
+ */
+void bdrv_create_meta_dirty_bitmap(BdrvDirtyBitmap *bitmap, int chunk_size)
+{
+    GLOBAL_STATE_CODE();
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    hbitmap_create_meta(bitmap->bitmap, chunk_size);
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+}
+
+/* Called with BQL taken. */
+void bdrv_release_meta_dirty_bitmap(BdrvDirtyBitmap *bitmap)
+{
+    GLOBAL_STATE_CODE();
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    if (hbitmap_meta(bitmap->bitmap)) {
+        hbitmap_free_meta(bitmap->bitmap);
+    }
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+}
+
+bool bdrv_dirty_bitmap_has_meta(BdrvDirtyBitmap *bitmap)
+{
+    bool ret;
+
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    ret = hbitmap_meta(bitmap->bitmap) != NULL;
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+
+    return ret;
+}
+
+/**
+ * Return whether any bit of @bitmap in @offset/@bytes may have changed since
+ * change tracking was started or last reset for this range.  Without a meta
+ * bitmap, this is always true.
+ */
+bool bdrv_dirty_bitmap_get_meta(BdrvDirtyBitmap *bitmap, int64_t offset,
+                                int64_t bytes)
+{
+    HBitmap *meta;
+    bool ret = true;
+
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    meta = hbitmap_meta(bitmap->bitmap);
+    if (meta) {
+        ret = hbitmap_next_dirty(meta, offset, bytes) >= 0;
+    }
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+
+    return ret;
+}
+
+void bdrv_dirty_bitmap_reset_meta(BdrvDirtyBitmap *bitmap, int64_t offset,
+                                  int64_t bytes)
+{
+    HBitmap *meta;
+
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    meta = hbitmap_meta(bitmap->bitmap);
+    if (meta) {
+        hbitmap_reset(meta, offset, bytes);
+    }
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+}
+
 void bdrv_set_dirty(BlockDriverState *bs, int64_t offset, int64_t bytes)
 {
     BdrvDirtyBitmap *bitmap;
@@ -876,6 +972,7 @@ void bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
     if (backup) {
         *backup = dest->bitmap;
         dest->bitmap = hbitmap_alloc(dest->size, hbitmap_granularity(*backup));
+        bdrv_dirty_bitmap_move_meta(*backup, dest->bitmap, dest->size);
         hbitmap_merge(*backup, src->bitmap, dest->bitmap);
     } else {
         hbitmap_merge(dest->bitmap, src->bitmap, dest->bitmap);
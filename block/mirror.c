@@ -24,6 +24,7 @@
 #include "qemu/ratelimit.h"
 #include "qemu/bitmap.h"
 #include "qemu/memalign.h"
+#include "sysemu/iothread.h"
 
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
@@ -93,6 +94,22 @@ typedef struct MirrorBlockJob {
     int64_t active_write_bytes_in_flight;
     bool prepared;
     bool in_drain;
+
+    /* IOThreads across which copy requests are distributed */
+    IOThread **iothreads;
+    size_t nr_iothreads;
+    size_t next_iothread;
+
+    /*
+     * With adaptive request sizing, the request size limit grows while
+     * copying sequential data for the first time and shrinks for areas that
+     * are dirtied again after they have been copied.  copied_bitmap has a bit
+     * set for each chunk that has been copied at least once.
+     */
+    bool adaptive_request_size;
+    int64_t max_io_bytes;
+    int64_t last_iteration_end;
+    unsigned long *copied_bitmap;
 } MirrorBlockJob;
 
 typedef struct MirrorBDSOpaque {
@@ -118,6 +135,9 @@ struct MirrorOp {
     Coroutine *co;
     MirrorOp *waiting_for_op;
 
+    /* Set while the I/O of the operation runs in one of the job's IOThreads */
+    AioContext *home_ctx;
+
     QTAILQ_ENTRY(MirrorOp) next;
 };
 
@@ -220,6 +240,9 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
         if (s->cow_bitmap) {
             bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
         }
+        if (s->copied_bitmap) {
+            bitmap_set(s->copied_bitmap, chunk_num, nb_chunks);
+        }
         if (!s->initial_zeroing_ongoing) {
             job_progress_update(&s->common.job, op->bytes);
         }
@@ -230,10 +253,40 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
     g_free(op);
 }
 
+/*
+ * Move the coroutine of @op to the next of the job's IOThreads, if any, so
+ * that the requests to source and target are submitted and completed there.
+ * Everything that touches job state must run after
+ * mirror_op_leave_iothread() has moved it back to the job's AioContext.
+ */
+static void coroutine_fn mirror_op_enter_iothread(MirrorOp *op)
+{
+    MirrorBlockJob *s = op->s;
+    IOThread *iothread;
+
+    if (!s->nr_iothreads) {
+        return;
+    }
+
+    iothread = s->iothreads[s->next_iothread++ % s->nr_iothreads];
+    op->home_ctx = qemu_get_current_aio_context();
+    aio_co_reschedule_self(iothread_get_aio_context(iothread));
+}
+
+static void coroutine_fn mirror_op_leave_iothread(MirrorOp *op)
+{
+    if (op->home_ctx) {
+        aio_co_reschedule_self(op->home_ctx);
+        op->home_ctx = NULL;
+    }
+}
+
 static void coroutine_fn mirror_write_complete(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
 
+    mirror_op_leave_iothread(op);
+
     if (ret < 0) {
         BlockErrorAction action;
 
@@ -254,6 +307,7 @@ static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
     if (ret < 0) {
         BlockErrorAction action;
 
+        mirror_op_leave_iothread(op);
         bdrv_set_dirty_bitmap(s->dirty_bitmap, op->offset, op->bytes);
         action = mirror_error_action(s, true, -ret);
         if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
@@ -397,6 +451,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     op->is_in_flight = true;
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
+    mirror_op_enter_iothread(op);
     WITH_GRAPH_RDLOCK_GUARD() {
         ret = bdrv_co_preadv(s->mirror_top_bs->backing, op->offset, op->bytes,
                              &op->qiov, 0);
@@ -414,6 +469,7 @@ static void coroutine_fn mirror_co_zero(void *opaque)
     *op->bytes_handled = op->bytes;
     op->is_in_flight = true;
 
+    mirror_op_enter_iothread(op);
     ret = blk_co_pwrite_zeroes(op->s->target, op->offset, op->bytes,
                                op->s->unmap ? BDRV_REQ_MAY_UNMAP : 0);
     mirror_write_complete(op, ret);
@@ -429,6 +485,7 @@ static void coroutine_fn mirror_co_discard(void *opaque)
     *op->bytes_handled = op->bytes;
     op->is_in_flight = true;
 
+    mirror_op_enter_iothread(op);
     ret = blk_co_pdiscard(op->s->target, op->offset, op->bytes);
     mirror_write_complete(op, ret);
 }
@@ -479,6 +536,31 @@ static unsigned mirror_perform(MirrorBlockJob *s, int64_t offset,
     return bytes_handled;
 }
 
+/*
+ * Adjust the request size limit for an iteration starting at @offset.  Data
+ * that is copied for the first time and continues where the last iteration
+ * ended is cold sequential data, for which large requests are most efficient.
+ * Areas that were dirtied again after being copied are hot; copying them in
+ * small requests means that less data is copied again on the next write and
+ * that guest writes wait for shorter copy operations.
+ */
+static void mirror_adapt_request_size(MirrorBlockJob *s, int64_t offset)
+{
+    int64_t min_io_bytes = s->granularity;
+    int64_t max_io_bytes = MAX(s->buf_size / 4, MAX_IO_BYTES);
+    int64_t old = s->max_io_bytes;
+
+    if (test_bit(offset / s->granularity, s->copied_bitmap)) {
+        s->max_io_bytes = MAX(s->max_io_bytes / 2, min_io_bytes);
+    } else if (offset == s->last_iteration_end) {
+        s->max_io_bytes = MIN(s->max_io_bytes * 2, max_io_bytes);
+    }
+
+    if (s->max_io_bytes != old) {
+        trace_mirror_adapt_request_size(s, offset, s->max_io_bytes);
+    }
+}
+
 static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source;
@@ -487,7 +569,7 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
 
     bdrv_graph_co_rdlock();
     source = s->mirror_top_bs->backing->bs;
@@ -514,6 +596,11 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
 
     job_pause_point(&s->common.job);
 
+    if (s->adaptive_request_size) {
+        mirror_adapt_request_size(s, offset);
+        max_io_bytes = s->max_io_bytes;
+    }
+
     /* Find the number of consecutive dirty chunks following the first dirty
      * one, and wait for in flight requests in them. */
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
@@ -621,6 +708,7 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
         nb_chunks -= DIV_ROUND_UP(io_bytes, s->granularity);
         block_job_ratelimit_processed_bytes(&s->common, io_bytes_acct);
     }
+    s->last_iteration_end = offset;
 
 fail:
     QTAILQ_REMOVE(&s->ops_in_flight, pseudo_op, next);
@@ -656,6 +744,18 @@ static void coroutine_fn mirror_wait_for_all_io(MirrorBlockJob *s)
     }
 }
 
+static void mirror_release_iothreads(MirrorBlockJob *s)
+{
+    size_t i;
+
+    for (i = 0; i < s->nr_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
+    s->iothreads = NULL;
+    s->nr_iothreads = 0;
+}
+
 /**
  * mirror_exit_common: handle both abort() and prepare() cases.
  * for .prepare, returns 0 on success and -errno on failure.
@@ -783,6 +883,7 @@ static int mirror_exit_common(Job *job)
         bdrv_unref(s->to_replace);
     }
     g_free(s->replaces);
+    mirror_release_iothreads(s);
 
     /*
      * Remove the mirror filter driver from the graph. Before this, get rid of
@@ -985,6 +1086,9 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     length = DIV_ROUND_UP(s->bdev_length, s->granularity);
     s->in_flight_bitmap = bitmap_new(length);
+    if (s->adaptive_request_size) {
+        s->copied_bitmap = bitmap_new(length);
+    }
 
     /* If we have no backing file yet in the destination, we cannot let
      * the destination do COW.  Instead, we copy sectors around the
@@ -1006,6 +1110,8 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     s->max_iov = MIN(bs->bl.max_iov, target_bs->bl.max_iov);
     bdrv_graph_co_rdunlock();
 
+    s->max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+
     s->buf = qemu_try_blockalign(bs, s->buf_size);
     if (s->buf == NULL) {
         ret = -ENOMEM;
@@ -1158,6 +1264,7 @@ immediate_exit:
     assert(s->in_flight == 0);
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
+    g_free(s->copied_bitmap);
     g_free(s->in_flight_bitmap);
     bdrv_dirty_iter_free(s->dbi);
 
@@ -1717,6 +1824,8 @@ static BlockJob *mirror_start_job(
                              bool is_none_mode, BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
                              bool is_mirror, MirrorCopyMode copy_mode,
+                             bool adaptive_request_size,
+                             IOThread **iothreads, size_t nr_iothreads,
                              Error **errp)
 {
     MirrorBlockJob *s;
@@ -1724,6 +1833,7 @@ static BlockJob *mirror_start_job(
     BlockDriverState *mirror_top_bs;
     bool target_is_backing;
     uint64_t target_perms, target_shared_perms;
+    size_t i;
     int ret;
 
     GLOBAL_STATE_CODE();
@@ -1885,6 +1995,15 @@ static BlockJob *mirror_start_job(
     }
     bdrv_graph_rdunlock_main_loop();
 
+    s->adaptive_request_size = adaptive_request_size;
+    s->nr_iothreads = nr_iothreads;
+    s->iothreads = g_new(IOThread *, nr_iothreads);
+    for (i = 0; i < nr_iothreads; i++) {
+        /* Released in mirror_release_iothreads() */
+        s->iothreads[i] = iothreads[i];
+        object_ref(OBJECT(s->iothreads[i]));
+    }
+
     s->dirty_bitmap = bdrv_create_dirty_bitmap(s->mirror_top_bs, granularity,
                                                NULL, errp);
     if (!s->dirty_bitmap) {
@@ -1974,6 +2093,7 @@ fail:
         bdrv_ref(mirror_top_bs);
 
         g_free(s->replaces);
+        mirror_release_iothreads(s);
         blk_unref(s->target);
         bs_opaque->job = NULL;
         if (s->dirty_bitmap) {
@@ -2006,7 +2126,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp)
+                  MirrorCopyMode copy_mode, bool adaptive_request_size,
+                  IOThread **iothreads, size_t nr_iothreads, Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -2029,7 +2150,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                      speed, granularity, buf_size, backing_mode, zero_target,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
-                     filter_node_name, true, copy_mode, errp);
+                     filter_node_name, true, copy_mode,
+                     adaptive_request_size, iothreads, nr_iothreads, errp);
 }
 
 BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -2058,7 +2180,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
                      filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
-                     errp);
+                     false, NULL, 0, errp);
     if (!job) {
         goto error_restore_flags;
     }
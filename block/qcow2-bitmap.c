@@ -30,6 +30,7 @@
 #include "block/dirty-bitmap.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
+#include "trace.h"
 
 #include "qcow2.h"
 
@@ -91,6 +92,8 @@ typedef struct Qcow2Bitmap {
     char *name;
 
     BdrvDirtyBitmap *dirty_bitmap;
+    /* Only the changed parts of @table are rewritten on store */
+    bool store_in_place;
 
     QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
 } Qcow2Bitmap;
@@ -156,6 +159,14 @@ static int64_t get_bitmap_bytes_needed(int64_t len, uint32_t granularity)
     return DIV_ROUND_UP(num_bits, 8);
 }
 
+/* Number of bitmap bits that are stored in one data cluster */
+static int bitmap_cluster_bits(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return s->cluster_size * 8;
+}
+
 static int GRAPH_RDLOCK
 check_constraints_on_bitmap(BlockDriverState *bs, const char *name,
                             uint32_t granularity, Error **errp)
@@ -373,6 +384,12 @@ BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
         goto fail;
     }
 
+    /*
+     * Track which bitmap clusters change from now on, so that storing the
+     * bitmap only has to write those.
+     */
+    bdrv_create_meta_dirty_bitmap(bitmap, bitmap_cluster_bits(bs));
+
     g_free(bitmap_table);
     return bitmap;
 
@@ -1371,6 +1388,164 @@ fail:
     return NULL;
 }
 
+/*
+ * Returns whether bm->dirty_bitmap can be stored by updating the bitmap table
+ * that is in the image already: the table must have been loaded into
+ * bm->dirty_bitmap (so that we know which parts changed since) and the layout
+ * must not have changed.
+ */
+static bool GRAPH_RDLOCK
+can_store_bitmap_in_place(BlockDriverState *bs, Qcow2Bitmap *bm,
+                          BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+
+    return bm->table.offset != 0 &&
+        bdrv_dirty_bitmap_has_meta(bitmap) &&
+        bm->granularity_bits == ctz32(bdrv_dirty_bitmap_granularity(bitmap)) &&
+        bm->table.size ==
+            size_to_clusters(s, bdrv_dirty_bitmap_serialization_size(
+                                    bitmap, 0, bm_size));
+}
+
+/*
+ * store_bitmap_in_place()
+ * Store bm->dirty_bitmap to qcow2, writing only the bitmap clusters that
+ * changed since the bitmap was loaded or last stored.  Existing data clusters
+ * are overwritten, which is safe because the bitmap is marked in-use in the
+ * image until the bitmap directory is updated.
+ */
+static int GRAPH_RDLOCK
+store_bitmap_in_place(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = bm->dirty_bitmap;
+    const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t limit;
+    uint64_t *old_tb = NULL, *tb = NULL;
+    uint8_t *buf = NULL;
+    uint64_t i, offset, nb_written = 0;
+
+    ret = bitmap_table_load(bs, &bm->table, &old_tb);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap_table table from "
+                         "image for bitmap '%s'", bm_name);
+        return ret;
+    }
+
+    tb = g_memdup2(old_tb, bm->table.size * sizeof(tb[0]));
+    buf = g_malloc(s->cluster_size);
+    limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
+
+    for (i = 0, offset = 0; i < bm->table.size; ++i, offset += limit) {
+        uint64_t end = MIN(bm_size, offset + limit);
+        uint64_t write_size;
+        int64_t off;
+
+        if (!bdrv_dirty_bitmap_get_meta(bitmap, offset, end - offset)) {
+            continue;
+        }
+
+        if (bdrv_dirty_bitmap_next_dirty(bitmap, offset, end - offset) < 0) {
+            /* Zero entries describe clean areas without any data cluster */
+            tb[i] = 0;
+            continue;
+        }
+
+        off = old_tb[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        if (!off) {
+            off = qcow2_alloc_clusters(bs, s->cluster_size);
+            if (off < 0) {
+                error_setg_errno(errp, -off,
+                                 "Failed to allocate clusters for bitmap '%s'",
+                                 bm_name);
+                ret = off;
+                goto fail;
+            }
+        }
+        tb[i] = off;
+
+        write_size = bdrv_dirty_bitmap_serialization_size(bitmap, offset,
+                                                          end - offset);
+        assert(write_size <= s->cluster_size);
+
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, offset, end - offset);
+        if (write_size < s->cluster_size) {
+            memset(buf + write_size, 0, s->cluster_size - write_size);
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size, false);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file, off, s->cluster_size, buf, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            goto fail;
+        }
+        nb_written++;
+    }
+
+    trace_qcow2_store_bitmap_in_place(bs, bm_name, bm->table.size, nb_written);
+
+    if (memcmp(tb, old_tb, bm->table.size * sizeof(tb[0])) != 0) {
+        ret = qcow2_pre_write_overlap_check(bs, 0, bm->table.offset,
+                                            bm->table.size * sizeof(tb[0]),
+                                            false);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto fail;
+        }
+
+        bitmap_table_bswap_be(tb, bm->table.size);
+        ret = bdrv_pwrite(bs->file, bm->table.offset,
+                          bm->table.size * sizeof(tb[0]), tb, 0);
+        bitmap_table_bswap_be(tb, bm->table.size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            goto fail;
+        }
+
+        /* Only drop the data clusters once the table doesn't refer to them */
+        for (i = 0; i < bm->table.size; ++i) {
+            uint64_t old_off = old_tb[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (old_off && !(tb[i] & BME_TABLE_ENTRY_OFFSET_MASK)) {
+                qcow2_free_clusters(bs, old_off, s->cluster_size,
+                                    QCOW2_DISCARD_ALWAYS);
+            }
+        }
+    }
+
+    ret = 0;
+    goto out;
+
+fail:
+    /* Free the data clusters that we have allocated */
+    for (i = 0; i < bm->table.size; ++i) {
+        uint64_t new_off = tb[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (new_off && !(old_tb[i] & BME_TABLE_ENTRY_OFFSET_MASK)) {
+            qcow2_free_clusters(bs, new_off, s->cluster_size,
+                                QCOW2_DISCARD_ALWAYS);
+        }
+    }
+
+out:
+    g_free(buf);
+    g_free(tb);
+    g_free(old_tb);
+
+    return ret;
+}
+
 /* store_bitmap()
  * Store bm->dirty_bitmap to qcow2.
  * Set bm->table_offset and bm->table_size accordingly.
@@ -1609,10 +1784,14 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
                            name);
                 goto fail;
             }
-            tb = g_memdup(&bm->table, sizeof(bm->table));
-            bm->table.offset = 0;
-            bm->table.size = 0;
-            QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+            if (can_store_bitmap_in_place(bs, bm, bitmap)) {
+                bm->store_in_place = true;
+            } else {
+                tb = g_memdup2(&bm->table, sizeof(bm->table));
+                bm->table.offset = 0;
+                bm->table.size = 0;
+                QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+            }
         }
         bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
         bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
@@ -1636,7 +1815,11 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
             continue;
         }
 
-        ret = store_bitmap(bs, bm, errp);
+        if (bm->store_in_place) {
+            ret = store_bitmap_in_place(bs, bm, errp);
+        } else {
+            ret = store_bitmap(bs, bm, errp);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1655,6 +1838,23 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
         g_free(tb);
     }
 
+    /* The image now matches the bitmaps, start tracking changes afresh */
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        bitmap = bm->dirty_bitmap;
+
+        if (bitmap == NULL || release_stored ||
+            bdrv_dirty_bitmap_readonly(bitmap)) {
+            continue;
+        }
+
+        if (bdrv_dirty_bitmap_has_meta(bitmap)) {
+            bdrv_dirty_bitmap_reset_meta(bitmap, 0,
+                                         bdrv_dirty_bitmap_size(bitmap));
+        } else {
+            bdrv_create_meta_dirty_bitmap(bitmap, bitmap_cluster_bits(bs));
+        }
+    }
+
 success:
     if (release_stored) {
         QSIMPLEQ_FOREACH(bm, bm_list, entry) {
@@ -1672,6 +1872,7 @@ success:
 fail:
     QSIMPLEQ_FOREACH(bm, bm_list, entry) {
         if (bm->dirty_bitmap == NULL || bm->table.offset == 0 ||
+            bm->store_in_place ||
             bdrv_dirty_bitmap_readonly(bm->dirty_bitmap))
         {
             continue;
@@ -0,0 +1,802 @@
+/*
+ * Data checksums for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Images with a data checksums header extension keep the CRC-32C of the host
+ * cluster of every guest cluster that was written since the feature was
+ * enabled.  The checksum of a cluster is known after a write to it has
+ * completed: for fully written clusters it is calculated from the written
+ * data, for partially written clusters the host cluster is read back.  Writes
+ * that bypass the normal write path (zero writes, discards, compressed
+ * clusters) make the checksum unknown again, as does any write that overlaps
+ * with another write to the same cluster.
+ *
+ * A bitmap next to the table records which checksums are known; clusters
+ * without a known checksum are never verified.  Any 32-bit value, including
+ * 0, is a valid checksum.
+ *
+ * The table is stored in the image only while it is not in use: it is written
+ * on close/inactivation, and dropped from the image as soon as it is opened
+ * read-write.  An autoclear bit marks the stored table as valid, so that
+ * programs that don't know about data checksums invalidate it when they
+ * modify the image.  The header extension itself remains present as long as
+ * the feature is enabled.
+ */
+
+#include "qemu/osdep.h"
+#include "block/aio_task.h"
+#include "block/block-io.h"
+#include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/crc32c.h"
+#include "qemu/memalign.h"
+
+#include "qcow2.h"
+
+/* Maximum amount of data verified by a single qemu-img check task */
+#define QCOW2_CHECK_DATA_MAX_BYTES (1 * MiB)
+
+/* A guest cluster that is being written to */
+typedef struct Qcow2DataChecksumWrite {
+    uint64_t index;
+    unsigned int count;
+    /* Set if the cluster was modified by anything but a single write */
+    bool conflict;
+} Qcow2DataChecksumWrite;
+
+static uint32_t data_checksum_qiov(QEMUIOVector *qiov, size_t qiov_offset,
+                                   size_t bytes)
+{
+    uint32_t crc = 0xffffffff;
+    size_t iov_offset;
+    int i = 0;
+
+    for (iov_offset = qiov_offset; iov_offset >= qiov->iov[i].iov_len; i++) {
+        iov_offset -= qiov->iov[i].iov_len;
+    }
+
+    while (bytes > 0) {
+        size_t len = MIN(bytes, qiov->iov[i].iov_len - iov_offset);
+
+        crc = crc32c(crc, qiov->iov[i].iov_base + iov_offset, len);
+        crc ^= 0xffffffff;
+        bytes -= len;
+        iov_offset = 0;
+        i++;
+    }
+
+    return crc ^ 0xffffffff;
+}
+
+/*
+ * The validity bitmap immediately follows the table of @table_size bytes in
+ * the image file.  Returns the size of both together.
+ */
+static uint64_t data_checksums_stored_size(uint64_t table_size)
+{
+    return table_size + DIV_ROUND_UP(table_size / sizeof(uint32_t),
+                                     BITS_PER_BYTE);
+}
+
+static uint64_t data_checksums_nb_entries(BlockDriverState *bs,
+                                          int64_t disk_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    /* Clusters beyond what fits into the table are just never verified */
+    return MIN(size_to_clusters(s, disk_size),
+               QCOW2_MAX_DATA_CHECKSUMS_SIZE / sizeof(uint32_t));
+}
+
+void qcow2_free_data_checksums(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->data_checksums_writes) {
+        assert(g_hash_table_size(s->data_checksums_writes) == 0);
+        g_hash_table_destroy(s->data_checksums_writes);
+        qemu_mutex_destroy(&s->data_checksums_lock);
+        s->data_checksums_writes = NULL;
+    }
+
+    g_free(s->data_checksums_table);
+    g_free(s->data_checksums_valid);
+    s->data_checksums_table = NULL;
+    s->data_checksums_valid = NULL;
+    s->data_checksums_entries = 0;
+}
+
+/*
+ * Removes the table from the image file, so that it cannot become stale
+ * while the image is written to.  The in-memory copy is kept.
+ */
+static int GRAPH_RDLOCK data_checksums_drop_stored(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset = s->data_checksums_offset;
+    uint64_t size = s->data_checksums_size;
+    uint64_t autoclear_features = s->autoclear_features;
+    int ret;
+
+    if (offset == 0 &&
+        !(s->autoclear_features & QCOW2_AUTOCLEAR_DATA_CHECKSUMS)) {
+        return 0;
+    }
+
+    s->data_checksums_offset = 0;
+    s->data_checksums_size = 0;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_DATA_CHECKSUMS;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->data_checksums_offset = offset;
+        s->data_checksums_size = size;
+        s->autoclear_features = autoclear_features;
+        return ret;
+    }
+
+    if (offset) {
+        qcow2_free_clusters(bs, offset, data_checksums_stored_size(size),
+                            QCOW2_DISCARD_OTHER);
+    }
+    return 0;
+}
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_load_data_checksums(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_entries, nb_stored, i;
+    g_autofree unsigned long *valid = NULL;
+    int ret;
+
+    if (!has_data_checksums(s)) {
+        return 0;
+    }
+
+    assert(!s->data_checksums_writes);
+
+    nb_entries = data_checksums_nb_entries(bs, bs->total_sectors *
+                                               BDRV_SECTOR_SIZE);
+    s->data_checksums_table = g_try_new0(uint32_t, nb_entries);
+    s->data_checksums_valid = bitmap_try_new(nb_entries);
+    if (nb_entries &&
+        (s->data_checksums_table == NULL || s->data_checksums_valid == NULL))
+    {
+        error_setg(errp, "Could not allocate memory for the data checksums");
+        qcow2_free_data_checksums(bs);
+        return -ENOMEM;
+    }
+    s->data_checksums_entries = nb_entries;
+
+    qemu_mutex_init(&s->data_checksums_lock);
+    s->data_checksums_writes = g_hash_table_new_full(g_int64_hash,
+                                                     g_int64_equal,
+                                                     NULL, g_free);
+
+    /* Without the autoclear bit, the image may have changed behind our back */
+    if (s->data_checksums_offset &&
+        (s->autoclear_features & QCOW2_AUTOCLEAR_DATA_CHECKSUMS)) {
+        nb_stored = MIN(s->data_checksums_size / sizeof(uint32_t), nb_entries);
+
+        ret = bdrv_co_pread(bs->file, s->data_checksums_offset,
+                            nb_stored * sizeof(uint32_t),
+                            s->data_checksums_table, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the data checksums");
+            goto fail;
+        }
+
+        for (i = 0; i < nb_stored; i++) {
+            be32_to_cpus(&s->data_checksums_table[i]);
+        }
+
+        valid = bitmap_try_new(nb_stored);
+        if (nb_stored && valid == NULL) {
+            error_setg(errp, "Could not allocate memory for the data "
+                       "checksums");
+            ret = -ENOMEM;
+            goto fail;
+        }
+
+        ret = bdrv_co_pread(bs->file,
+                            s->data_checksums_offset + s->data_checksums_size,
+                            DIV_ROUND_UP(nb_stored, BITS_PER_BYTE), valid, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the data checksums");
+            goto fail;
+        }
+
+        /* Bits beyond the stored entries may be garbage */
+        bitmap_from_le(s->data_checksums_valid, valid, nb_stored);
+        bitmap_clear(s->data_checksums_valid, nb_stored,
+                     BITS_TO_LONGS(nb_stored) * BITS_PER_LONG - nb_stored);
+    }
+
+    if (bdrv_is_writable(bs)) {
+        ret = data_checksums_drop_stored(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret,
+                             "Could not update the data checksums");
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    qcow2_free_data_checksums(bs);
+    return ret;
+}
+
+int GRAPH_RDLOCK qcow2_reopen_data_checksums_rw(BlockDriverState *bs,
+                                                Error **errp)
+{
+    int ret;
+
+    ret = data_checksums_drop_stored(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the data checksums");
+    }
+    return ret;
+}
+
+/* Removes the data checksums feature from the image */
+int GRAPH_RDLOCK qcow2_disable_data_checksums(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!has_data_checksums(s)) {
+        return 0;
+    }
+
+    ret = data_checksums_drop_stored(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qcow2_free_data_checksums(bs);
+    s->data_checksums = false;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->data_checksums = true;
+        return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the in-memory table to the image file, replacing any table that may
+ * still be stored there.
+ */
+int GRAPH_RDLOCK qcow2_store_data_checksums(BlockDriverState *bs,
+                                            Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t old_offset = s->data_checksums_offset;
+    uint64_t old_size = s->data_checksums_size;
+    g_autofree unsigned long *valid = NULL;
+    uint32_t *table;
+    int64_t offset;
+    uint64_t i;
+    size_t table_size, size;
+    int ret;
+
+    if (!has_data_checksums(s) || !s->data_checksums_writes ||
+        !bdrv_is_writable(bs))
+    {
+        return 0;
+    }
+
+    if (s->data_checksums_entries == 0) {
+        ret = data_checksums_drop_stored(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not update the qcow2 header");
+        }
+        return ret;
+    }
+
+    table_size = s->data_checksums_entries * sizeof(uint32_t);
+    size = data_checksums_stored_size(table_size);
+    table = g_try_malloc(size);
+    valid = bitmap_try_new(s->data_checksums_entries);
+    if (table == NULL || valid == NULL) {
+        error_setg(errp, "Could not allocate memory for the data checksums");
+        g_free(table);
+        return -ENOMEM;
+    }
+
+    qemu_mutex_lock(&s->data_checksums_lock);
+    for (i = 0; i < s->data_checksums_entries; i++) {
+        table[i] = cpu_to_be32(s->data_checksums_table[i]);
+    }
+    bitmap_to_le(valid, s->data_checksums_valid, s->data_checksums_entries);
+    qemu_mutex_unlock(&s->data_checksums_lock);
+    memcpy((uint8_t *)table + table_size, valid, size - table_size);
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        ret = offset;
+        error_setg_errno(errp, -ret, "Could not allocate the data checksums");
+        goto out;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, size, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the data checksums");
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, offset, size, table, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the data checksums");
+        goto fail;
+    }
+
+    /* Make sure that the table is on disk before it is declared valid */
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the data checksums");
+        goto fail;
+    }
+
+    s->data_checksums_offset = offset;
+    s->data_checksums_size = table_size;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_DATA_CHECKSUMS;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the qcow2 header");
+        s->data_checksums_offset = old_offset;
+        s->data_checksums_size = old_size;
+        if (!old_offset) {
+            s->autoclear_features &= ~QCOW2_AUTOCLEAR_DATA_CHECKSUMS;
+        }
+        goto fail;
+    }
+
+    if (old_offset) {
+        qcow2_free_clusters(bs, old_offset,
+                            data_checksums_stored_size(old_size),
+                            QCOW2_DISCARD_OTHER);
+    }
+
+    ret = 0;
+    goto out;
+
+fail:
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+out:
+    g_free(table);
+    return ret;
+}
+
+int qcow2_resize_data_checksums(BlockDriverState *bs, int64_t new_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_entries, old_entries;
+    unsigned long *valid;
+    uint32_t *table;
+
+    if (!s->data_checksums_writes) {
+        return 0;
+    }
+
+    nb_entries = data_checksums_nb_entries(bs, new_size);
+    valid = bitmap_try_new(nb_entries);
+    if (nb_entries && valid == NULL) {
+        return -ENOMEM;
+    }
+
+    qemu_mutex_lock(&s->data_checksums_lock);
+    old_entries = s->data_checksums_entries;
+    table = g_try_renew(uint32_t, s->data_checksums_table, nb_entries);
+    if (nb_entries && table == NULL) {
+        qemu_mutex_unlock(&s->data_checksums_lock);
+        g_free(valid);
+        return -ENOMEM;
+    }
+    if (nb_entries > old_entries) {
+        memset(table + old_entries, 0,
+               (nb_entries - old_entries) * sizeof(uint32_t));
+    }
+    if (valid) {
+        bitmap_copy(valid, s->data_checksums_valid,
+                    MIN(old_entries, nb_entries));
+    }
+    g_free(s->data_checksums_valid);
+    s->data_checksums_table = table;
+    s->data_checksums_valid = valid;
+    s->data_checksums_entries = nb_entries;
+    qemu_mutex_unlock(&s->data_checksums_lock);
+
+    return 0;
+}
+
+/*
+ * Returns the range of table indices covering the guest range
+ * [@offset, @offset + @bytes), with *@end being exclusive.  The range is
+ * empty if the request lies beyond the end of the table.
+ */
+static void data_checksums_range(BDRVQcow2State *s, uint64_t offset,
+                                 uint64_t bytes, uint64_t *start,
+                                 uint64_t *end)
+{
+    *start = offset >> s->cluster_bits;
+    *end = MIN(DIV_ROUND_UP(offset + bytes, s->cluster_size),
+               s->data_checksums_entries);
+    *start = MIN(*start, *end);
+}
+
+/*
+ * Must be called before the guest range [@offset, @offset + @bytes) is
+ * written.  Each call must be paired with qcow2_co_data_checksums_end().
+ */
+void qcow2_data_checksums_begin(BlockDriverState *bs, uint64_t offset,
+                                uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DataChecksumWrite *w;
+    uint64_t i, start, end;
+
+    if (!s->data_checksums_writes) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->data_checksums_lock);
+    data_checksums_range(s, offset, bytes, &start, &end);
+    for (i = start; i < end; i++) {
+        w = g_hash_table_lookup(s->data_checksums_writes, &i);
+        if (w) {
+            w->conflict = true;
+        } else {
+            w = g_new0(Qcow2DataChecksumWrite, 1);
+            w->index = i;
+            g_hash_table_insert(s->data_checksums_writes, &w->index, w);
+        }
+        w->count++;
+        clear_bit(i, s->data_checksums_valid);
+    }
+    qemu_mutex_unlock(&s->data_checksums_lock);
+}
+
+/*
+ * Updates the checksums of the guest clusters that a write to the guest range
+ * [@offset, @offset + @bytes) at @host_offset has touched.  @qiov must
+ * contain the data exactly as it was written to the host clusters.  If
+ * @success is false, the clusters are only marked as unknown.
+ */
+void coroutine_fn GRAPH_RDLOCK
+qcow2_co_data_checksums_end(BlockDriverState *bs, uint64_t host_offset,
+                            uint64_t offset, uint64_t bytes,
+                            QEMUIOVector *qiov, size_t qiov_offset,
+                            bool success)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DataChecksumWrite *w;
+    uint64_t i, start, end;
+    void *buf = NULL;
+
+    if (!s->data_checksums_writes) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->data_checksums_lock);
+    data_checksums_range(s, offset, bytes, &start, &end);
+    qemu_mutex_unlock(&s->data_checksums_lock);
+
+    for (i = start; i < end; i++) {
+        uint64_t cluster_offset = i << s->cluster_bits;
+        uint32_t crc = 0;
+        bool known = false;
+        bool conflict;
+
+        qemu_mutex_lock(&s->data_checksums_lock);
+        w = g_hash_table_lookup(s->data_checksums_writes, &i);
+        conflict = w->conflict;
+        qemu_mutex_unlock(&s->data_checksums_lock);
+
+        if (!success || conflict) {
+            /* Leave the checksum unknown */
+        } else if (cluster_offset >= offset &&
+                   cluster_offset + s->cluster_size <= offset + bytes)
+        {
+            crc = data_checksum_qiov(qiov,
+                                     qiov_offset + cluster_offset - offset,
+                                     s->cluster_size);
+            known = true;
+        } else {
+            /*
+             * Partially written cluster: the rest of it may come from COW or
+             * from earlier writes, so look at what actually is on disk.  Any
+             * write that starts in the meantime sets w->conflict.
+             */
+            if (!buf) {
+                buf = qemu_try_blockalign(s->data_file->bs, s->cluster_size);
+            }
+            if (buf &&
+                bdrv_co_pread(s->data_file,
+                              host_offset + cluster_offset - offset,
+                              s->cluster_size, buf, 0) >= 0)
+            {
+                crc = crc32c(0xffffffff, buf, s->cluster_size);
+                known = true;
+            }
+        }
+
+        qemu_mutex_lock(&s->data_checksums_lock);
+        w = g_hash_table_lookup(s->data_checksums_writes, &i);
+        if (known && !w->conflict && i < s->data_checksums_entries) {
+            s->data_checksums_table[i] = crc;
+            set_bit(i, s->data_checksums_valid);
+        }
+        if (--w->count == 0) {
+            g_hash_table_remove(s->data_checksums_writes, &i);
+        }
+        qemu_mutex_unlock(&s->data_checksums_lock);
+    }
+
+    qemu_vfree(buf);
+}
+
+static void data_checksums_invalidate_locked(BDRVQcow2State *s,
+                                             uint64_t start, uint64_t end)
+{
+    Qcow2DataChecksumWrite *w;
+
+    bitmap_clear(s->data_checksums_valid, start, end - start);
+
+    if (g_hash_table_size(s->data_checksums_writes)) {
+        GHashTableIter iter;
+
+        g_hash_table_iter_init(&iter, s->data_checksums_writes);
+        while (g_hash_table_iter_next(&iter, NULL, (void **)&w)) {
+            if (w->index >= start && w->index < end) {
+                w->conflict = true;
+            }
+        }
+    }
+}
+
+/*
+ * Forgets the checksums of all clusters in the guest range
+ * [@offset, @offset + @bytes), for writes that bypass the normal write path.
+ */
+void qcow2_data_checksums_invalidate(BlockDriverState *bs, uint64_t offset,
+                                     uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t start, end;
+
+    if (!s->data_checksums_writes || bytes == 0) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->data_checksums_lock);
+    data_checksums_range(s, offset, bytes, &start, &end);
+    data_checksums_invalidate_locked(s, start, end);
+    qemu_mutex_unlock(&s->data_checksums_lock);
+}
+
+void qcow2_data_checksums_clear(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->data_checksums_writes) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->data_checksums_lock);
+    data_checksums_invalidate_locked(s, 0, s->data_checksums_entries);
+    qemu_mutex_unlock(&s->data_checksums_lock);
+}
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_data_checksums_refcounts(BlockDriverState *bs,
+                                     BdrvCheckResult *res,
+                                     void **refcount_table,
+                                     int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->data_checksums_offset == 0) {
+        return 0;
+    }
+
+    return qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                    refcount_table_size,
+                                    s->data_checksums_offset,
+                                    data_checksums_stored_size(
+                                        s->data_checksums_size));
+}
+
+typedef struct Qcow2CheckDataTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    BdrvCheckResult *res;
+    uint64_t offset;
+    uint64_t host_offset;
+    uint64_t bytes;
+} Qcow2CheckDataTask;
+
+/*
+ * This function can count as GRAPH_RDLOCK because qcow2_co_check_data() holds
+ * the graph lock and keeps it until this coroutine has terminated.
+ */
+static coroutine_fn GRAPH_RDLOCK int qcow2_check_data_task_entry(AioTask *task)
+{
+    Qcow2CheckDataTask *t = container_of(task, Qcow2CheckDataTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+    uint64_t pos;
+    uint8_t *buf;
+    int ret;
+
+    buf = qemu_try_blockalign(s->data_file->bs, t->bytes);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(s->data_file, t->host_offset, t->bytes, buf, 0);
+    if (ret < 0) {
+        fprintf(stderr, "ERROR could not read data at offset 0x%" PRIx64
+                ": %s\n", t->offset, strerror(-ret));
+        t->res->check_errors++;
+        goto out;
+    }
+
+    for (pos = 0; pos < t->bytes; pos += s->cluster_size) {
+        uint64_t index = (t->offset + pos) >> s->cluster_bits;
+        uint32_t expected, crc;
+        bool known;
+
+        qemu_mutex_lock(&s->data_checksums_lock);
+        known = test_bit(index, s->data_checksums_valid);
+        expected = s->data_checksums_table[index];
+        qemu_mutex_unlock(&s->data_checksums_lock);
+
+        if (!known) {
+            continue;
+        }
+
+        crc = crc32c(0xffffffff, buf + pos, s->cluster_size);
+        if (crc != expected) {
+            fprintf(stderr, "ERROR data checksum mismatch in cluster at "
+                    "offset 0x%" PRIx64 " (host offset 0x%" PRIx64 "): "
+                    "expected 0x%08" PRIx32 ", got 0x%08" PRIx32 "\n",
+                    t->offset + pos, t->host_offset + pos, expected, crc);
+            t->res->corruptions++;
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    return 0;
+}
+
+static coroutine_fn GRAPH_RDLOCK void
+qcow2_check_data_add_task(BlockDriverState *bs, BdrvCheckResult *res,
+                          AioTaskPool *pool, uint64_t offset,
+                          uint64_t host_offset, uint64_t bytes)
+{
+    Qcow2CheckDataTask *task = g_new(Qcow2CheckDataTask, 1);
+
+    *task = (Qcow2CheckDataTask) {
+        .task.func = qcow2_check_data_task_entry,
+        .bs = bs,
+        .res = res,
+        .offset = offset,
+        .host_offset = host_offset,
+        .bytes = bytes,
+    };
+
+    aio_task_pool_start_task(pool, &task->task);
+}
+
+/*
+ * Verifies all data clusters with a known checksum against it.  Mismatches
+ * are reported as corruptions.  Reads of host clusters are merged where they
+ * are contiguous and run in parallel.
+ *
+ * Must be called with s->lock held.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_check_data(BlockDriverState *bs, BdrvCheckResult *res)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t run_offset = 0, run_host_offset = 0, run_bytes = 0;
+    AioTaskPool *pool;
+    uint64_t i;
+    int ret = 0;
+
+    if (!s->data_checksums_writes) {
+        return 0;
+    }
+
+    pool = aio_task_pool_new(QCOW2_MAX_WORKERS);
+
+    for (i = 0; i < s->data_checksums_entries; i++) {
+        uint64_t offset = i << s->cluster_bits;
+        unsigned int bytes = s->cluster_size;
+        QCow2SubclusterType type;
+        uint64_t host_offset;
+        bool known;
+
+        if (aio_task_pool_status(pool) < 0) {
+            break;
+        }
+
+        qemu_mutex_lock(&s->data_checksums_lock);
+        known = test_bit(i, s->data_checksums_valid);
+        qemu_mutex_unlock(&s->data_checksums_lock);
+        if (!known) {
+            continue;
+        }
+
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &host_offset, &type);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR could not look up cluster at offset "
+                    "0x%" PRIx64 ": %s\n", offset, strerror(-ret));
+            res->check_errors++;
+            continue;
+        }
+
+        if (type != QCOW2_SUBCLUSTER_NORMAL &&
+            type != QCOW2_SUBCLUSTER_ZERO_ALLOC &&
+            type != QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC)
+        {
+            /* No host cluster (any more), so there is nothing to verify */
+            continue;
+        }
+
+        if (run_bytes && run_offset + run_bytes == offset &&
+            run_host_offset + run_bytes == host_offset &&
+            run_bytes < QCOW2_CHECK_DATA_MAX_BYTES)
+        {
+            run_bytes += s->cluster_size;
+            continue;
+        }
+
+        if (run_bytes) {
+            qcow2_check_data_add_task(bs, res, pool, run_offset,
+                                      run_host_offset, run_bytes);
+        }
+        run_offset = offset;
+        run_host_offset = host_offset;
+        run_bytes = s->cluster_size;
+    }
+
+    if (run_bytes && aio_task_pool_status(pool) == 0) {
+        qcow2_check_data_add_task(bs, res, pool, run_offset, run_host_offset,
+                                  run_bytes);
+    }
+
+    aio_task_pool_wait_all(pool);
+    ret = aio_task_pool_status(pool);
+    g_free(pool);
+
+    return ret;
+}
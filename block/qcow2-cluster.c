@@ -1081,7 +1081,12 @@ int coroutine_fn qcow2_alloc_cluster_link_l2(BlockDriverState *bs,
         /* The offset must fit in the offset field of the L2 table entry */
         assert((offset & L2E_OFFSET_MASK) == offset);
 
-        set_l2_entry(s, l2_slice, l2_index + i, offset | QCOW_OFLAG_COPIED);
+        /*
+         * Clusters that go into the dedup index must never be written in
+         * place, so they don't get QCOW_OFLAG_COPIED
+         */
+        set_l2_entry(s, l2_slice, l2_index + i,
+                     offset | (m->dedup_hash ? 0 : QCOW_OFLAG_COPIED));
 
         /* Update bitmap with the subclusters that were just written */
         if (has_subclusters(s) && !m->prealloc) {
@@ -1893,6 +1898,126 @@ again:
     return 0;
 }
 
+/*
+ * Points the guest cluster at @guest_offset to the existing host cluster at
+ * @host_offset, which the dedup index maps @hash to and which therefore
+ * contains exactly the data that is to be written there, and takes a
+ * reference to it.  Used for deduplication.
+ *
+ * Returns:
+ *   1       if the L2 entry has been updated
+ *
+ *   0       if the guest cluster should rather be written normally, e.g.
+ *           because it can be overwritten in place or the host cluster
+ *           cannot take any more references
+ *
+ *   -errno  on failure
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_link_dedup_cluster(BlockDriverState *bs, uint64_t guest_offset,
+                         const uint8_t *hash, uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QCowL2Meta *m = NULL;
+    QCow2ClusterType type;
+    uint64_t *l2_slice;
+    uint64_t old_l2_entry;
+    uint64_t bytes;
+    uint64_t refcount;
+    int l2_index;
+    int ret;
+
+    assert(offset_into_cluster(s, guest_offset) == 0);
+    assert(offset_into_cluster(s, host_offset) == 0);
+    assert(!has_data_file(bs));
+
+    /* Wait for in-flight allocating writes to the same guest cluster */
+    do {
+        bytes = s->cluster_size;
+        ret = handle_dependencies(bs, guest_offset, &bytes, &m);
+        if (ret == -EAGAIN &&
+            qcow2_dedup_lookup(bs, hash) != (int64_t)host_offset) {
+            /*
+             * s->lock was dropped while waiting, so the host cluster may
+             * have been freed and reused for other data in the meantime
+             */
+            return 0;
+        }
+    } while (ret == -EAGAIN);
+    if (ret < 0) {
+        return ret;
+    }
+    assert(bytes == s->cluster_size);
+
+    ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+    old_l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    type = qcow2_get_cluster_type(bs, old_l2_entry);
+    if (type == QCOW2_CLUSTER_NORMAL || type == QCOW2_CLUSTER_ZERO_ALLOC) {
+        if (old_l2_entry & QCOW_OFLAG_COPIED) {
+            /*
+             * Other requests may be writing to that cluster in place right
+             * now, so we must not free it under their feet
+             */
+            return 0;
+        }
+        if (type == QCOW2_CLUSTER_NORMAL &&
+            (old_l2_entry & L2E_OFFSET_MASK) == host_offset) {
+            return 1;
+        }
+    }
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        return ret;
+    }
+    if (refcount == 0 || refcount >= s->refcount_max) {
+        return 0;
+    }
+
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                        1, false, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->use_lazy_refcounts) {
+        qcow2_mark_dirty(bs);
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+
+    ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                      1, true, QCOW2_DISCARD_NEVER);
+        return ret;
+    }
+    assert(get_l2_entry(s, l2_slice, l2_index) == old_l2_entry);
+
+    /* The cluster is shared now, so it must not get QCOW_OFLAG_COPIED */
+    BLKDBG_CO_EVENT(bs->file, BLKDBG_L2_UPDATE);
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, host_offset);
+    if (has_subclusters(s)) {
+        set_l2_bitmap(s, l2_slice, l2_index, QCOW_L2_BITMAP_ALL_ALLOC);
+    }
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    /* Drop the reference to the cluster that was replaced */
+    if (old_l2_entry != 0) {
+        qcow2_free_any_cluster(bs, old_l2_entry, QCOW2_DISCARD_NEVER);
+    }
+
+    return 1;
+}
+
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
  * all clusters in the same L2 slice) and returns the number of discarded
@@ -1980,7 +2105,8 @@ discard_in_l2_slice(BlockDriverState *bs, uint64_t offset, uint64_t nb_clusters,
             qcow2_free_any_cluster(bs, old_l2_entry, type);
         } else if (s->discard_passthrough[type] &&
                    (cluster_type == QCOW2_CLUSTER_NORMAL ||
-                    cluster_type == QCOW2_CLUSTER_ZERO_ALLOC)) {
+                    cluster_type == QCOW2_CLUSTER_ZERO_ALLOC) &&
+                   (!has_dedup(s) || (old_l2_entry & QCOW_OFLAG_COPIED))) {
             /* If we keep the reference, pass on the discard still */
             bdrv_pdiscard(s->data_file, old_l2_entry & L2E_OFFSET_MASK,
                           s->cluster_size);
@@ -2094,7 +2220,8 @@ zero_in_l2_slice(BlockDriverState *bs, uint64_t offset,
                 qcow2_free_any_cluster(bs, old_l2_entry, QCOW2_DISCARD_REQUEST);
             } else if (s->discard_passthrough[QCOW2_DISCARD_REQUEST] &&
                        (type == QCOW2_CLUSTER_NORMAL ||
-                        type == QCOW2_CLUSTER_ZERO_ALLOC)) {
+                        type == QCOW2_CLUSTER_ZERO_ALLOC) &&
+                       (!has_dedup(s) || (old_l2_entry & QCOW_OFLAG_COPIED))) {
                 /* If we keep the reference, pass on the discard still */
                 bdrv_pdiscard(s->data_file, old_l2_entry & L2E_OFFSET_MASK,
                             s->cluster_size);
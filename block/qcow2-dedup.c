@@ -0,0 +1,390 @@
+/*
+ * Cluster deduplication for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Images with the deduplication feature bit keep an index from the SHA-256
+ * hash of a data cluster to its host offset.  When a full cluster is written
+ * whose hash is already in the index, the guest cluster is pointed at the
+ * existing host cluster (whose refcount is increased) instead of writing the
+ * data again.
+ *
+ * Clusters only enter the index when they are freshly allocated by such a
+ * full-cluster write, and they are then linked without QCOW_OFLAG_COPIED.
+ * This makes sure that no guest write ever modifies an indexed cluster in
+ * place; overwriting it always goes through copy-on-write.  A cluster leaves
+ * the index once its refcount drops to zero.  Operations that may set
+ * QCOW_OFLAG_COPIED on arbitrary clusters (internal snapshots, repairing
+ * the image) simply clear the whole index.
+ *
+ * The index is stored in the image only while it is not in use: it is
+ * written on close/inactivation and dropped from the image as soon as it
+ * is opened read-write, so a crash can never leave a stale index behind.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "crypto/hash.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+
+#include "qcow2.h"
+
+typedef struct Qcow2DedupEntry {
+    uint8_t hash[QCOW2_DEDUP_HASH_SIZE];
+    uint64_t host_offset;
+} Qcow2DedupEntry;
+
+static guint dedup_hash_func(gconstpointer key)
+{
+    guint h;
+
+    /* The key is a cryptographic hash, so any part of it is good enough */
+    memcpy(&h, key, sizeof(h));
+    return h;
+}
+
+static gboolean dedup_hash_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, QCOW2_DEDUP_HASH_SIZE) == 0;
+}
+
+static void dedup_index_init(BDRVQcow2State *s)
+{
+    if (s->dedup_index) {
+        return;
+    }
+
+    /* Both tables share the entries, which are owned by dedup_offsets */
+    s->dedup_index = g_hash_table_new(dedup_hash_func, dedup_hash_equal);
+    s->dedup_offsets = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                             NULL, g_free);
+}
+
+void qcow2_free_dedup_index(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->dedup_index) {
+        g_hash_table_destroy(s->dedup_index);
+        g_hash_table_destroy(s->dedup_offsets);
+        s->dedup_index = NULL;
+        s->dedup_offsets = NULL;
+    }
+}
+
+int qcow2_dedup_hash(const void *buf, size_t bytes, uint8_t *hash)
+{
+    uint8_t *result = NULL;
+    size_t result_len = 0;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, buf, bytes,
+                           &result, &result_len, NULL) < 0) {
+        return -EIO;
+    }
+
+    assert(result_len == QCOW2_DEDUP_HASH_SIZE);
+    memcpy(hash, result, QCOW2_DEDUP_HASH_SIZE);
+    g_free(result);
+
+    return 0;
+}
+
+/*
+ * Returns the host offset of a cluster with the given content hash, or -1 if
+ * there is none.
+ */
+int64_t qcow2_dedup_lookup(BlockDriverState *bs, const uint8_t *hash)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupEntry *e;
+
+    if (!s->dedup_index) {
+        return -1;
+    }
+
+    e = g_hash_table_lookup(s->dedup_index, hash);
+    return e ? e->host_offset : -1;
+}
+
+void qcow2_dedup_insert(BlockDriverState *bs, const uint8_t *hash,
+                        uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupEntry *e;
+
+    assert(offset_into_cluster(s, host_offset) == 0);
+
+    dedup_index_init(s);
+
+    /*
+     * Two concurrent writes with the same contents may both have missed the
+     * index; keep the cluster that was entered first.
+     */
+    if (g_hash_table_contains(s->dedup_index, hash)) {
+        return;
+    }
+
+    qcow2_dedup_forget(bs, host_offset);
+
+    e = g_new(Qcow2DedupEntry, 1);
+    memcpy(e->hash, hash, QCOW2_DEDUP_HASH_SIZE);
+    e->host_offset = host_offset;
+
+    g_hash_table_insert(s->dedup_offsets, &e->host_offset, e);
+    g_hash_table_insert(s->dedup_index, e->hash, e);
+}
+
+/* Called whenever the cluster at @host_offset has become free */
+void qcow2_dedup_forget(BlockDriverState *bs, uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupEntry *e;
+
+    if (!s->dedup_offsets) {
+        return;
+    }
+
+    e = g_hash_table_lookup(s->dedup_offsets, &host_offset);
+    if (e) {
+        g_hash_table_remove(s->dedup_index, e->hash);
+        g_hash_table_remove(s->dedup_offsets, &host_offset);
+    }
+}
+
+void qcow2_dedup_clear(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->dedup_index) {
+        g_hash_table_remove_all(s->dedup_index);
+        g_hash_table_remove_all(s->dedup_offsets);
+    }
+}
+
+/*
+ * Removes the index from the image file, so that it cannot become stale
+ * while the image is written to.  The in-memory copy is kept.
+ */
+static int GRAPH_RDLOCK dedup_index_drop_stored(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset = s->dedup_index_offset;
+    uint64_t size = s->dedup_index_size;
+    int ret;
+
+    if (offset == 0) {
+        return 0;
+    }
+
+    s->dedup_index_offset = 0;
+    s->dedup_index_size = 0;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->dedup_index_offset = offset;
+        s->dedup_index_size = size;
+        return ret;
+    }
+
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    return 0;
+}
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_load_dedup_index(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupIndexEntry *table;
+    uint64_t nb_entries, i;
+    int ret;
+
+    if (!has_dedup(s)) {
+        return 0;
+    }
+
+    dedup_index_init(s);
+
+    if (s->dedup_index_size == 0) {
+        return 0;
+    }
+
+    table = g_try_malloc(s->dedup_index_size);
+    if (table == NULL) {
+        error_setg(errp, "Could not allocate memory for the dedup index");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, s->dedup_index_offset, s->dedup_index_size,
+                        table, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the dedup index");
+        goto out;
+    }
+
+    nb_entries = s->dedup_index_size / sizeof(*table);
+    for (i = 0; i < nb_entries; i++) {
+        uint64_t host_offset = be64_to_cpu(table[i].host_offset);
+
+        if (host_offset == 0 || offset_into_cluster(s, host_offset) ||
+            host_offset > QCOW_MAX_CLUSTER_OFFSET) {
+            error_setg(errp, "Dedup index entry %" PRIu64 " has an invalid "
+                       "host offset 0x%" PRIx64, i, host_offset);
+            qcow2_dedup_clear(bs);
+            ret = -EINVAL;
+            goto out;
+        }
+
+        qcow2_dedup_insert(bs, table[i].hash, host_offset);
+    }
+
+    if (bdrv_is_writable(bs)) {
+        ret = dedup_index_drop_stored(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not update the dedup index");
+            goto out;
+        }
+    }
+
+    ret = 0;
+out:
+    g_free(table);
+    return ret;
+}
+
+int GRAPH_RDLOCK qcow2_reopen_dedup_index_rw(BlockDriverState *bs,
+                                             Error **errp)
+{
+    int ret;
+
+    ret = dedup_index_drop_stored(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the dedup index");
+    }
+    return ret;
+}
+
+/*
+ * Writes the in-memory index to the image file, replacing any index that
+ * may still be stored there.
+ */
+int GRAPH_RDLOCK qcow2_store_dedup_index(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupIndexEntry *table;
+    Qcow2DedupEntry *e;
+    GHashTableIter iter;
+    uint64_t old_offset = s->dedup_index_offset;
+    uint64_t old_size = s->dedup_index_size;
+    uint64_t nb_entries, i = 0;
+    int64_t offset;
+    size_t size;
+    int ret;
+
+    if (!has_dedup(s) || !s->dedup_index || !bdrv_is_writable(bs)) {
+        return 0;
+    }
+
+    /* The index is only a cache, so it is fine to store part of it */
+    nb_entries = MIN(g_hash_table_size(s->dedup_offsets),
+                     QCOW2_MAX_DEDUP_INDEX_SIZE / sizeof(*table));
+    if (nb_entries == 0) {
+        ret = dedup_index_drop_stored(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not update the qcow2 header");
+        }
+        return ret;
+    }
+
+    size = nb_entries * sizeof(*table);
+    table = g_try_malloc(size);
+    if (table == NULL) {
+        error_setg(errp, "Could not allocate memory for the dedup index");
+        return -ENOMEM;
+    }
+
+    g_hash_table_iter_init(&iter, s->dedup_offsets);
+    while (i < nb_entries && g_hash_table_iter_next(&iter, NULL, (void **)&e)) {
+        memcpy(table[i].hash, e->hash, QCOW2_DEDUP_HASH_SIZE);
+        table[i].host_offset = cpu_to_be64(e->host_offset);
+        i++;
+    }
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        ret = offset;
+        error_setg_errno(errp, -ret, "Could not allocate the dedup index");
+        goto out;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, size, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the dedup index");
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, offset, size, table, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the dedup index");
+        goto fail;
+    }
+
+    s->dedup_index_offset = offset;
+    s->dedup_index_size = size;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the qcow2 header");
+        s->dedup_index_offset = old_offset;
+        s->dedup_index_size = old_size;
+        goto fail;
+    }
+
+    if (old_offset) {
+        qcow2_free_clusters(bs, old_offset, old_size, QCOW2_DISCARD_OTHER);
+    }
+
+    ret = 0;
+    goto out;
+
+fail:
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+out:
+    g_free(table);
+    return ret;
+}
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_dedup_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                            void **refcount_table,
+                            int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->dedup_index_offset == 0) {
+        return 0;
+    }
+
+    return qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                    refcount_table_size,
+                                    s->dedup_index_offset,
+                                    s->dedup_index_size);
+}
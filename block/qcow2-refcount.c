@@ -904,6 +904,8 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
+
+            qcow2_dedup_forget(bs, cluster_offset);
         }
     }
 
@@ -1254,6 +1256,12 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     assert(addend >= -1 && addend <= 1);
 
+    /*
+     * This may set QCOW_OFLAG_COPIED on clusters from the dedup index, which
+     * would allow them to be modified in place
+     */
+    qcow2_dedup_clear(bs);
+
     l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * L1E_SIZE;
@@ -2032,6 +2040,14 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
                         continue;
                     }
                 }
+                /*
+                 * Deduplicated images deliberately leave clusters from the
+                 * dedup index without the flag even if they aren't shared
+                 */
+                if (has_dedup(s) && refcount == 1 &&
+                    !(l2_entry & QCOW_OFLAG_COPIED)) {
+                    continue;
+                }
                 if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
                     res->corruptions++;
                     fprintf(stderr, "%s OFLAG_COPIED data cluster: "
@@ -2293,6 +2309,19 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* dedup index */
+    ret = qcow2_check_dedup_refcounts(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* data checksums */
+    ret = qcow2_check_data_checksums_refcounts(bs, res, refcount_table,
+                                               nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
 }
 
@@ -2804,6 +2833,11 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
     res->bfi.total_clusters =
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
+    if (fix) {
+        /* Repairs may change refcounts behind the back of the dedup index */
+        qcow2_dedup_clear(bs);
+    }
+
     ret = calculate_refcounts(bs, res, fix, &rebuild, &refcount_table,
                               &nb_clusters);
     if (ret < 0) {
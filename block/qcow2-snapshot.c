@@ -786,6 +786,9 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
         goto fail;
     }
 
+    /* All guest clusters are about to point somewhere else */
+    qcow2_data_checksums_clear(bs);
+
     if (sn->disk_size != bs->total_sectors * BDRV_SECTOR_SIZE) {
         BlockBackend *blk = blk_new_with_bs(bs, BLK_PERM_RESIZE, BLK_PERM_ALL,
                                             &local_err);
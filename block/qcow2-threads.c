@@ -38,14 +38,19 @@
 #include "block/thread-pool.h"
 #include "crypto.h"
 
+/*
+ * @max_threads limits the number of requests of this image that may occupy
+ * worker threads at the same time.
+ */
 static int coroutine_fn
-qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
+qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg,
+                 int max_threads)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
 
     qemu_co_mutex_lock(&s->lock);
-    while (s->nb_threads >= QCOW2_MAX_THREADS) {
+    while (s->nb_threads >= max_threads) {
         qemu_co_queue_wait(&s->thread_task_queue, &s->lock);
     }
     s->nb_threads++;
@@ -347,7 +352,13 @@ qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
         .func = func,
     };
 
-    qcow2_co_process(bs, qcow2_compress_pool_func, &arg);
+    /*
+     * (De)compression does not use any per-image resources, so it may use
+     * as much of the thread pool as the AioContext allows (thread-pool-max).
+     */
+    qcow2_co_process(bs, qcow2_compress_pool_func, &arg,
+                     MAX(qemu_get_current_aio_context()->thread_pool_max,
+                         QCOW2_MAX_THREADS));
 
     return arg.ret;
 }
@@ -475,7 +486,9 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
     assert(QEMU_IS_ALIGNED(host_offset, sector_size));
     assert(QEMU_IS_ALIGNED(len, sector_size));
 
-    return len == 0 ? 0 : qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    /* limited by the number of ciphers allocated for s->crypto */
+    return len == 0 ? 0 : qcow2_co_process(bs, qcow2_encdec_pool_func, &arg,
+                                           QCOW2_MAX_THREADS);
 }
 
 /*
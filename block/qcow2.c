@@ -36,6 +36,7 @@
 #include "qapi/qmp/qstring.h"
 #include "trace.h"
 #include "qemu/option_int.h"
+#include "qemu/bitmap.h"
 #include "qemu/cutils.h"
 #include "qemu/bswap.h"
 #include "qemu/memalign.h"
@@ -73,6 +74,8 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_DEDUP_INDEX 0x44454455
+#define  QCOW2_EXT_MAGIC_DATA_CHECKSUMS 0x44435243
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -432,6 +435,93 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_DEDUP_INDEX:
+        {
+            Qcow2DedupHeaderExt dedup_ext;
+
+            if (ext.len != sizeof(dedup_ext)) {
+                error_setg(errp, "dedup_ext: Invalid extension length");
+                return -EINVAL;
+            }
+
+            ret = bdrv_co_pread(bs->file, offset, ext.len, &dedup_ext, 0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "dedup_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            dedup_ext.index_offset = be64_to_cpu(dedup_ext.index_offset);
+            dedup_ext.index_size = be64_to_cpu(dedup_ext.index_size);
+
+            if (offset_into_cluster(s, dedup_ext.index_offset)) {
+                error_setg(errp, "dedup_ext: invalid dedup index offset");
+                return -EINVAL;
+            }
+
+            if (dedup_ext.index_size > QCOW2_MAX_DEDUP_INDEX_SIZE ||
+                dedup_ext.index_size % sizeof(Qcow2DedupIndexEntry)) {
+                error_setg(errp, "dedup_ext: invalid dedup index size "
+                           "(%" PRIu64 ")", dedup_ext.index_size);
+                return -EINVAL;
+            }
+
+            s->dedup_index_offset = dedup_ext.index_offset;
+            s->dedup_index_size = dedup_ext.index_size;
+
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got dedup index extension: "
+                   "offset=%" PRIu64 " size=%" PRIu64 "\n",
+                   s->dedup_index_offset, s->dedup_index_size);
+#endif
+            break;
+        }
+
+        case QCOW2_EXT_MAGIC_DATA_CHECKSUMS:
+        {
+            Qcow2DataChecksumsHeaderExt csum_ext;
+
+            if (ext.len != sizeof(csum_ext)) {
+                error_setg(errp, "data_checksums_ext: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+
+            ret = bdrv_co_pread(bs->file, offset, ext.len, &csum_ext, 0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "data_checksums_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            csum_ext.table_offset = be64_to_cpu(csum_ext.table_offset);
+            csum_ext.table_size = be64_to_cpu(csum_ext.table_size);
+
+            if (offset_into_cluster(s, csum_ext.table_offset)) {
+                error_setg(errp, "data_checksums_ext: invalid table offset");
+                return -EINVAL;
+            }
+
+            if (csum_ext.table_size > QCOW2_MAX_DATA_CHECKSUMS_SIZE ||
+                csum_ext.table_size % sizeof(uint32_t) ||
+                (csum_ext.table_offset == 0) != (csum_ext.table_size == 0)) {
+                error_setg(errp, "data_checksums_ext: invalid table size "
+                           "(%" PRIu64 ")", csum_ext.table_size);
+                return -EINVAL;
+            }
+
+            s->data_checksums = true;
+            s->data_checksums_offset = csum_ext.table_offset;
+            s->data_checksums_size = csum_ext.table_size;
+
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got data checksums extension: "
+                   "offset=%" PRIu64 " size=%" PRIu64 "\n",
+                   s->data_checksums_offset, s->data_checksums_size);
+#endif
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -648,10 +738,19 @@ qcow2_co_check(BlockDriverState *bs, BdrvCheckResult *result,
                BdrvCheckMode fix)
 {
     BDRVQcow2State *s = bs->opaque;
+    bool check_data = fix & BDRV_CHECK_DATA;
     int ret;
 
+    fix &= ~BDRV_CHECK_DATA;
+    if (check_data && !has_data_checksums(s)) {
+        return -ENOTSUP;
+    }
+
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_co_check_locked(bs, result, fix);
+    if (ret == 0 && check_data) {
+        ret = qcow2_co_check_data(bs, result);
+    }
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -1836,6 +1935,16 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         }
 
         update_header = update_header && !header_updated;
+
+        ret = qcow2_load_dedup_index(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        ret = qcow2_load_data_checksums(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     if (update_header) {
@@ -1874,6 +1983,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    qemu_co_queue_init(&s->compressed_seq_queue);
 
     return ret;
 
@@ -1887,6 +1997,8 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     }
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    qcow2_free_dedup_index(bs);
+    qcow2_free_data_checksums(bs);
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     qemu_vfree(s->l1_table);
@@ -1997,6 +2109,16 @@ qcow2_reopen_prepare(BDRVReopenState *state,BlockReopenQueue *queue,
             goto fail;
         }
 
+        ret = qcow2_store_dedup_index(state->bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        ret = qcow2_store_data_checksums(state->bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2060,6 +2182,25 @@ static void qcow2_reopen_commit_post(BDRVReopenState *state)
                               "%s: Failed to make dirty bitmaps writable: ",
                               bdrv_get_node_name(state->bs));
         }
+
+        if (qcow2_reopen_dedup_index_rw(state->bs, &local_err) < 0) {
+            /*
+             * The stored index may become stale now, so don't trust any of
+             * it; it is replaced when the image is closed.
+             */
+            qcow2_dedup_clear(state->bs);
+            error_reportf_err(local_err,
+                              "%s: Failed to drop the stored dedup index: ",
+                              bdrv_get_node_name(state->bs));
+        }
+
+        if (qcow2_reopen_data_checksums_rw(state->bs, &local_err) < 0) {
+            /* Same as above: the stored table is replaced on close */
+            qcow2_data_checksums_clear(state->bs);
+            error_reportf_err(local_err,
+                              "%s: Failed to drop the stored data checksums: ",
+                              bdrv_get_node_name(state->bs));
+        }
     }
 }
 
@@ -2076,6 +2217,15 @@ static void qcow2_reopen_abort(BDRVReopenState *state)
          */
         s->data_file = state->bs->file;
     }
+    if (!(state->flags & BDRV_O_RDWR) && bdrv_is_writable(state->bs)) {
+        /* qcow2_reopen_prepare() has stored the dedup index, drop it again */
+        if (qcow2_reopen_dedup_index_rw(state->bs, NULL) < 0) {
+            qcow2_dedup_clear(state->bs);
+        }
+        if (qcow2_reopen_data_checksums_rw(state->bs, NULL) < 0) {
+            qcow2_data_checksums_clear(state->bs);
+        }
+    }
     qcow2_update_options_abort(state->bs, state->opaque);
     g_free(state->opaque);
 }
@@ -2193,6 +2343,10 @@ qcow2_handle_l2meta(BlockDriverState *bs, QCowL2Meta **pl2meta, bool link_l2)
             if (ret) {
                 goto out;
             }
+            if (l2meta->dedup_hash) {
+                qcow2_dedup_insert(bs, l2meta->dedup_hash,
+                                   l2meta->alloc_offset);
+            }
         } else {
             qcow2_alloc_cluster_abort(bs, l2meta);
         }
@@ -2582,26 +2736,35 @@ int qcow2_co_pwritev_task(BlockDriverState *bs, uint64_t host_offset,
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
-    void *crypt_buf = NULL;
-    QEMUIOVector encrypted_qiov;
+    void *bounce_buf = NULL;
+    QEMUIOVector bounce_qiov;
 
-    if (bs->encrypted) {
-        assert(s->crypto);
+    qcow2_data_checksums_begin(bs, offset, bytes);
+
+    /*
+     * Data checksums are calculated from a copy of the data because the
+     * guest may modify its buffer while the request is in flight.
+     */
+    if (bs->encrypted || has_data_checksums(s)) {
         assert(bytes <= QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
-        crypt_buf = qemu_try_blockalign(bs->file->bs, bytes);
-        if (crypt_buf == NULL) {
+        bounce_buf = qemu_try_blockalign(bs->file->bs, bytes);
+        if (bounce_buf == NULL) {
             ret = -ENOMEM;
             goto out_unlocked;
         }
-        qemu_iovec_to_buf(qiov, qiov_offset, crypt_buf, bytes);
+        qemu_iovec_to_buf(qiov, qiov_offset, bounce_buf, bytes);
 
-        if (qcow2_co_encrypt(bs, host_offset, offset, crypt_buf, bytes) < 0) {
-            ret = -EIO;
-            goto out_unlocked;
+        if (bs->encrypted) {
+            assert(s->crypto);
+            if (qcow2_co_encrypt(bs, host_offset, offset, bounce_buf,
+                                 bytes) < 0) {
+                ret = -EIO;
+                goto out_unlocked;
+            }
         }
 
-        qemu_iovec_init_buf(&encrypted_qiov, crypt_buf, bytes);
-        qiov = &encrypted_qiov;
+        qemu_iovec_init_buf(&bounce_qiov, bounce_buf, bytes);
+        qiov = &bounce_qiov;
         qiov_offset = 0;
     }
 
@@ -2639,7 +2802,9 @@ out_locked:
     qcow2_handle_l2meta(bs, &l2meta, false);
     qemu_co_mutex_unlock(&s->lock);
 
-    qemu_vfree(crypt_buf);
+    qcow2_co_data_checksums_end(bs, host_offset, offset, bytes, qiov,
+                                qiov_offset, ret >= 0);
+    qemu_vfree(bounce_buf);
 
     return ret;
 }
@@ -2659,6 +2824,89 @@ static coroutine_fn GRAPH_RDLOCK int qcow2_co_pwritev_task_entry(AioTask *task)
                                  t->l2meta);
 }
 
+/*
+ * Writes one full, cluster aligned cluster of guest data to an image with
+ * deduplication.  If a cluster with the same contents is already known, the
+ * guest cluster is just pointed at it.  Otherwise, the data is written like
+ * any other data, but if this results in a newly allocated cluster, that
+ * cluster becomes available for deduplication of later writes.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_pwritev_dedup(BlockDriverState *bs, uint64_t offset,
+                       QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t hash[QCOW2_DEDUP_HASH_SIZE];
+    unsigned int cur_bytes = s->cluster_size;
+    QCowL2Meta *l2meta = NULL;
+    QEMUIOVector local_qiov;
+    uint64_t host_offset;
+    int64_t dedup_offset;
+    void *buf;
+    int ret;
+
+    /*
+     * Work on a copy of the data: the guest may modify its buffer while the
+     * request is in flight, and what is written must match the hash that
+     * goes into the dedup index.
+     */
+    buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+    qemu_iovec_to_buf(qiov, qiov_offset, buf, s->cluster_size);
+    qemu_iovec_init_buf(&local_qiov, buf, s->cluster_size);
+
+    ret = qcow2_dedup_hash(buf, s->cluster_size, hash);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    dedup_offset = qcow2_dedup_lookup(bs, hash);
+    if (dedup_offset >= 0) {
+        qcow2_data_checksums_begin(bs, offset, s->cluster_size);
+        ret = qcow2_link_dedup_cluster(bs, offset, hash, dedup_offset);
+        qcow2_co_data_checksums_end(bs, dedup_offset, offset, s->cluster_size,
+                                    &local_qiov, 0, ret > 0);
+        if (ret != 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            ret = MIN(ret, 0);
+            goto out;
+        }
+    }
+
+    ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes, &host_offset,
+                                  &l2meta);
+    if (ret < 0) {
+        goto out_locked;
+    }
+    assert(cur_bytes == s->cluster_size);
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, host_offset, cur_bytes, true);
+    if (ret < 0) {
+        goto out_locked;
+    }
+
+    if (l2meta && !l2meta->next && !l2meta->keep_old_clusters) {
+        l2meta->dedup_hash = hash;
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    ret = qcow2_co_pwritev_task(bs, host_offset, offset, cur_bytes,
+                                &local_qiov, 0, l2meta);
+    goto out;
+
+out_locked:
+    qcow2_handle_l2meta(bs, &l2meta, false);
+    qemu_co_mutex_unlock(&s->lock);
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                       QEMUIOVector *qiov, size_t qiov_offset,
@@ -2671,6 +2919,7 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
     uint64_t host_offset;
     QCowL2Meta *l2meta = NULL;
     AioTaskPool *aio = NULL;
+    bool dedup = has_dedup(s) && !bs->encrypted && !has_data_file(bs);
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
@@ -2680,12 +2929,26 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
 
         trace_qcow2_writev_start_part(qemu_coroutine_self());
         offset_in_cluster = offset_into_cluster(s, offset);
+
+        if (dedup && offset_in_cluster == 0 && bytes >= s->cluster_size) {
+            ret = qcow2_co_pwritev_dedup(bs, offset, qiov, qiov_offset);
+            if (ret < 0) {
+                goto fail_nometa;
+            }
+            cur_bytes = s->cluster_size;
+            goto next;
+        }
+
         cur_bytes = MIN(bytes, INT_MAX);
-        if (bs->encrypted) {
+        if (bs->encrypted || has_data_checksums(s)) {
             cur_bytes = MIN(cur_bytes,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
                             - offset_in_cluster);
         }
+        if (dedup) {
+            /* Give the following full clusters a chance to be deduplicated */
+            cur_bytes = MIN(cur_bytes, s->cluster_size - offset_in_cluster);
+        }
 
         qemu_co_mutex_lock(&s->lock);
 
@@ -2714,6 +2977,7 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
             goto fail_nometa;
         }
 
+next:
         bytes -= cur_bytes;
         offset += cur_bytes;
         qiov_offset += cur_bytes;
@@ -2756,6 +3020,22 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    qcow2_store_dedup_index(bs, &local_err);
+    if (local_err != NULL) {
+        result = -EINVAL;
+        error_reportf_err(local_err, "Lost the dedup index during "
+                          "inactivation of node '%s': ",
+                          bdrv_get_device_or_node_name(bs));
+    }
+
+    qcow2_store_data_checksums(bs, &local_err);
+    if (local_err != NULL) {
+        result = -EINVAL;
+        error_reportf_err(local_err, "Lost the data checksums during "
+                          "inactivation of node '%s': ",
+                          bdrv_get_device_or_node_name(bs));
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2816,6 +3096,8 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
 
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_dedup_index(bs);
+    qcow2_free_data_checksums(bs);
 }
 
 static void GRAPH_UNLOCKED qcow2_close(BlockDriverState *bs)
@@ -3033,12 +3315,11 @@ int qcow2_update_header(BlockDriverState *bs)
     }
 
     /*
-     * Feature table.  A mere 8 feature names occupies 392 bytes, and
+     * Feature table.  A mere 10 feature names occupies 488 bytes, and
      * when coupled with the v3 minimum header of 104 bytes plus the
-     * 8-byte end-of-extension marker, that would leave only 8 bytes
-     * for a backing file name in an image with 512-byte clusters.
-     * Thus, we choose to omit this header for cluster sizes 4k and
-     * smaller.
+     * 8-byte end-of-extension marker, that would not even fit into an
+     * image with 512-byte clusters.  Thus, we choose to omit this
+     * header for cluster sizes 4k and smaller.
      */
     if (s->qcow_version >= 3 && s->cluster_size > 4096) {
         static const Qcow2Feature features[] = {
@@ -3067,6 +3348,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
                 .name = "extended L2 entries",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_DEDUP_BITNR,
+                .name = "deduplication",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -3082,6 +3368,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
                 .name = "raw external data",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_DATA_CHECKSUMS_BITNR,
+                .name = "data checksums",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -3112,6 +3403,38 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Dedup index extension */
+    if (s->dedup_index_offset) {
+        Qcow2DedupHeaderExt dedup_header = {
+            .index_offset = cpu_to_be64(s->dedup_index_offset),
+            .index_size = cpu_to_be64(s->dedup_index_size),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DEDUP_INDEX,
+                             &dedup_header, sizeof(dedup_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Data checksums extension */
+    if (has_data_checksums(s)) {
+        Qcow2DataChecksumsHeaderExt csum_header = {
+            .table_offset = cpu_to_be64(s->data_checksums_offset),
+            .table_size = cpu_to_be64(s->data_checksums_size),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DATA_CHECKSUMS,
+                             &csum_header, sizeof(csum_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -3565,6 +3888,41 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         goto out;
     }
 
+    if (!qcow2_opts->has_dedup) {
+        qcow2_opts->dedup = false;
+    }
+    if (qcow2_opts->dedup) {
+        if (version < 3) {
+            error_setg(errp, "Deduplication is only supported with "
+                       "compatibility level 1.1 and above (use version=v3 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+        if (qcow2_opts->data_file) {
+            error_setg(errp, "Deduplication cannot be used with an external "
+                       "data file");
+            ret = -EINVAL;
+            goto out;
+        }
+        if (qcow2_opts->encrypt) {
+            error_setg(errp, "Deduplication cannot be used with encryption");
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    if (!qcow2_opts->has_data_checksums) {
+        qcow2_opts->data_checksums = false;
+    }
+    if (qcow2_opts->data_checksums && version < 3) {
+        error_setg(errp, "Data checksums are only supported with "
+                   "compatibility level 1.1 and above (use version=v3 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto out;
+    }
+
     if (!qcow2_opts->has_preallocation) {
         qcow2_opts->preallocation = PREALLOC_MODE_OFF;
     }
@@ -3739,6 +4097,11 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
             cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
     }
 
+    if (qcow2_opts->dedup) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_DEDUP);
+    }
+
     ret = blk_co_pwrite(blk, 0, cluster_size, header, 0);
     g_free(header);
     if (ret < 0) {
@@ -3798,6 +4161,12 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         s->image_data_file = g_strdup(data_bs->filename);
     }
 
+    /* The checksum table itself is created when the image is next opened */
+    if (qcow2_opts->data_checksums) {
+        BDRVQcow2State *s = blk_bs(blk)->opaque;
+        s->data_checksums = true;
+    }
+
     /* Create a full header (including things like feature table) */
     ret = qcow2_update_header(blk_bs(blk));
     bdrv_graph_co_rdunlock();
@@ -3926,6 +4295,8 @@ qcow2_co_create_opts(BlockDriver *drv, const char *filename, QemuOpts *opts,
         { BLOCK_OPT_CLUSTER_SIZE,       "cluster-size" },
         { BLOCK_OPT_LAZY_REFCOUNTS,     "lazy-refcounts" },
         { BLOCK_OPT_EXTL2,              "extended-l2" },
+        { BLOCK_OPT_DEDUP,              "dedup" },
+        { BLOCK_OPT_DATA_CHECKSUMS,     "data-checksums" },
         { BLOCK_OPT_REFCOUNT_BITS,      "refcount-bits" },
         { BLOCK_OPT_ENCRYPT,            BLOCK_OPT_ENCRYPT_FORMAT },
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
@@ -4095,6 +4466,7 @@ qcow2_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
 
     /* Whatever is left can use real zero subclusters */
     ret = qcow2_subcluster_zeroize(bs, offset, bytes, flags);
+    qcow2_data_checksums_invalidate(bs, offset, bytes);
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -4125,6 +4497,7 @@ qcow2_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_cluster_discard(bs, offset, bytes, QCOW2_DISCARD_REQUEST,
                                 false);
+    qcow2_data_checksums_invalidate(bs, offset, bytes);
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -4224,6 +4597,7 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
     unsigned int cur_bytes; /* number of sectors in current iteration */
     uint64_t host_offset;
     QCowL2Meta *l2meta = NULL;
+    int64_t start_offset = dst_offset, total_bytes = bytes;
 
     assert(!bs->encrypted);
 
@@ -4273,6 +4647,9 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
 fail:
     qcow2_handle_l2meta(bs, &l2meta, false);
 
+    /* The data never passes through qcow2, so no checksum is known */
+    qcow2_data_checksums_invalidate(bs, start_offset, total_bytes);
+
     qemu_co_mutex_unlock(&s->lock);
 
     trace_qcow2_writev_done_req(qemu_coroutine_self(), ret);
@@ -4323,6 +4700,12 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
         goto fail;
     }
 
+    ret = qcow2_resize_data_checksums(bs, offset);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to resize the data checksums");
+        goto fail;
+    }
+
     old_length = bs->total_sectors * BDRV_SECTOR_SIZE;
     new_l1_size = size_to_l1(s, offset);
 
@@ -4631,6 +5014,11 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
         }
     }
 
+    if (offset > old_length) {
+        /* Preallocation and zeroing may have changed the last old cluster */
+        qcow2_data_checksums_invalidate(bs, old_length, offset - old_length);
+    }
+
     bs->total_sectors = offset / BDRV_SECTOR_SIZE;
 
     /* write updated header.size */
@@ -4657,6 +5045,13 @@ fail:
     return ret;
 }
 
+/* Called with s->lock held */
+static void coroutine_fn qcow2_compressed_seq_done(BDRVQcow2State *s)
+{
+    s->compressed_seq_alloc++;
+    qemu_co_queue_restart_all(&s->compressed_seq_queue);
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
                                  uint64_t offset, uint64_t bytes,
@@ -4667,6 +5062,7 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
     ssize_t out_len;
     uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
+    unsigned seq = qatomic_fetch_inc(&s->compressed_seq_next);
 
     assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
            (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
@@ -4682,21 +5078,37 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
                                 buf, s->cluster_size);
-    if (out_len == -ENOMEM) {
+
+    /*
+     * Wait for the clusters submitted before this one, so that the image
+     * layout does not depend on which compression finished first.
+     */
+    qemu_co_mutex_lock(&s->lock);
+    while (s->compressed_seq_alloc != seq) {
+        qemu_co_queue_wait(&s->compressed_seq_queue, &s->lock);
+    }
+
+    if (out_len < 0) {
+        qcow2_compressed_seq_done(s);
+        qemu_co_mutex_unlock(&s->lock);
+        if (out_len != -ENOMEM) {
+            ret = -EINVAL;
+            goto fail;
+        }
+
         /* could not compress: write normal cluster */
         ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
         if (ret < 0) {
             goto fail;
         }
         goto success;
-    } else if (out_len < 0) {
-        ret = -EINVAL;
-        goto fail;
     }
 
-    qemu_co_mutex_lock(&s->lock);
     ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
                                                 &cluster_offset);
+    qcow2_compressed_seq_done(s);
+    /* Checksums are only kept for uncompressed clusters */
+    qcow2_data_checksums_invalidate(bs, offset, bytes);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
         goto fail;
@@ -4780,7 +5192,7 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         uint64_t chunk_size = MIN(bytes, s->cluster_size);
 
         if (!aio && chunk_size != bytes) {
-            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+            aio = aio_task_pool_new(QCOW2_MAX_COMPRESS_WORKERS);
         }
 
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
@@ -5007,6 +5419,8 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
+    qcow2_data_checksums_clear(bs);
+
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
@@ -5020,6 +5434,7 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
          * refcount block) have to fit inside one refcount block. It
          * only resets the image file, i.e. does not work with an
          * external data file. */
+        qcow2_dedup_clear(bs);
         return make_completely_empty(bs);
     }
 
@@ -5222,6 +5637,204 @@ err:
     return NULL;
 }
 
+/*
+ * Sequential output: all metadata is placed in front of the guest data, so
+ * that nothing ever has to be rewritten or relocated:
+ *
+ *   header | refcount table | refcount blocks | L1 | L2 tables | data
+ *
+ * Data clusters are stored in guest order.  Clusters without data stay
+ * unallocated; the image has no backing file, so they read as zeroes.
+ */
+typedef struct Qcow2SeqWriter {
+    int cluster_bits;
+    int64_t cluster_size;
+    int64_t l2_entries;
+    int64_t l1_size;
+    int64_t l1_clusters;
+    int64_t l2_tables;
+    int64_t data_clusters;
+    int64_t rt_clusters;
+    int64_t rb_clusters;
+    int64_t total_clusters;
+} Qcow2SeqWriter;
+
+static int qcow2_seq_writer_open(BlockSeqWriter *w, QemuOpts *opts,
+                                 Error **errp)
+{
+    Qcow2SeqWriter *s = w->opaque;
+    QemuOpt *opt;
+
+    s->cluster_size = qcow2_opt_get_cluster_size_del(opts, false, errp);
+    if (!s->cluster_size) {
+        return -EINVAL;
+    }
+
+    /* Everything else is fixed */
+    opt = QTAILQ_FIRST(&opts->head);
+    if (opt) {
+        error_setg(errp, "Option '%s' is not supported for sequential output",
+                   opt->name);
+        return -ENOTSUP;
+    }
+
+    s->cluster_bits = ctz64(s->cluster_size);
+    s->l2_entries = s->cluster_size / sizeof(uint64_t);
+    s->l1_size = DIV_ROUND_UP(DIV_ROUND_UP(w->size, s->cluster_size),
+                              s->l2_entries);
+    if (s->l1_size > QCOW_MAX_L1_SIZE / sizeof(uint64_t)) {
+        error_setg(errp, "Image size is too large for this cluster size");
+        return -EINVAL;
+    }
+
+    w->granularity = s->cluster_size;
+    return 0;
+}
+
+static bool qcow2_seq_writer_l2_used(BlockSeqWriter *w, int64_t l1_index)
+{
+    Qcow2SeqWriter *s = w->opaque;
+    int64_t start = l1_index * s->l2_entries;
+    int64_t end = MIN(start + s->l2_entries, w->nb_chunks);
+
+    return find_next_bit(w->data_map, end, start) < end;
+}
+
+static void qcow2_seq_writer_layout(BlockSeqWriter *w)
+{
+    Qcow2SeqWriter *s = w->opaque;
+    int64_t rb_entries, prev_rt, prev_rb, fixed;
+
+    s->data_clusters = bitmap_count_one(w->data_map, w->nb_chunks);
+    s->l1_clusters = MAX(1, DIV_ROUND_UP(s->l1_size * sizeof(uint64_t),
+                                         s->cluster_size));
+    for (int64_t i = 0; i < s->l1_size; i++) {
+        s->l2_tables += qcow2_seq_writer_l2_used(w, i);
+    }
+
+    /*
+     * The refcount structures cover themselves, so grow them until they are
+     * large enough to describe the whole image including themselves.
+     */
+    rb_entries = s->cluster_size / sizeof(uint16_t);
+    fixed = 1 + s->l1_clusters + s->l2_tables + s->data_clusters;
+    s->rt_clusters = 1;
+    s->rb_clusters = 0;
+    do {
+        prev_rt = s->rt_clusters;
+        prev_rb = s->rb_clusters;
+        s->rb_clusters = DIV_ROUND_UP(fixed + prev_rt + prev_rb, rb_entries);
+        s->rt_clusters = MAX(1, DIV_ROUND_UP(s->rb_clusters * sizeof(uint64_t),
+                                             s->cluster_size));
+    } while (s->rt_clusters != prev_rt || s->rb_clusters != prev_rb);
+
+    s->total_clusters = fixed + s->rt_clusters + s->rb_clusters;
+}
+
+static int qcow2_seq_writer_start(BlockSeqWriter *w, Error **errp)
+{
+    Qcow2SeqWriter *s = w->opaque;
+    int64_t cs = s->cluster_size;
+    int64_t rb_start, l1_start, l2_start, data_start;
+    int64_t rt_entries = cs / sizeof(uint64_t);
+    int64_t rb_entries = cs / sizeof(uint16_t);
+    int64_t l2_index = 0, data_index = 0, i, j;
+    g_autofree uint8_t *buf = g_malloc(cs);
+    QCowHeader *header = (QCowHeader *)buf;
+    uint64_t *table = (uint64_t *)buf;
+    uint16_t *refblock = (uint16_t *)buf;
+    int ret;
+
+    qcow2_seq_writer_layout(w);
+    rb_start = 1 + s->rt_clusters;
+    l1_start = rb_start + s->rb_clusters;
+    l2_start = l1_start + s->l1_clusters;
+    data_start = l2_start + s->l2_tables;
+
+    /* Header; the zeroes following it terminate the extension list */
+    memset(buf, 0, cs);
+    *header = (QCowHeader) {
+        .magic                  = cpu_to_be32(QCOW_MAGIC),
+        .version                = cpu_to_be32(3),
+        .cluster_bits           = cpu_to_be32(s->cluster_bits),
+        .size                   = cpu_to_be64(w->size),
+        .l1_size                = cpu_to_be32(s->l1_size),
+        .l1_table_offset        = cpu_to_be64(l1_start * cs),
+        .refcount_table_offset  = cpu_to_be64(cs),
+        .refcount_table_clusters = cpu_to_be32(s->rt_clusters),
+        .refcount_order         = cpu_to_be32(4),
+        .header_length          = cpu_to_be32(sizeof(*header)),
+    };
+    ret = bdrv_seq_writer_output(w, buf, cs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Refcount table */
+    for (i = 0; i < s->rt_clusters; i++) {
+        for (j = 0; j < rt_entries; j++) {
+            int64_t rb = i * rt_entries + j;
+            table[j] = rb < s->rb_clusters ?
+                       cpu_to_be64((rb_start + rb) * cs) : 0;
+        }
+        ret = bdrv_seq_writer_output(w, buf, cs, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* Refcount blocks: every cluster of the image is used exactly once */
+    for (i = 0; i < s->rb_clusters; i++) {
+        for (j = 0; j < rb_entries; j++) {
+            refblock[j] = i * rb_entries + j < s->total_clusters ?
+                          cpu_to_be16(1) : 0;
+        }
+        ret = bdrv_seq_writer_output(w, buf, cs, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* L1 table */
+    for (i = 0; i < s->l1_clusters; i++) {
+        for (j = 0; j < rt_entries; j++) {
+            int64_t l1_index = i * rt_entries + j;
+            table[j] = 0;
+            if (l1_index < s->l1_size &&
+                qcow2_seq_writer_l2_used(w, l1_index)) {
+                table[j] = cpu_to_be64(((l2_start + l2_index++) * cs) |
+                                       QCOW_OFLAG_COPIED);
+            }
+        }
+        ret = bdrv_seq_writer_output(w, buf, cs, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* L2 tables */
+    for (i = 0; i < s->l1_size; i++) {
+        if (!qcow2_seq_writer_l2_used(w, i)) {
+            continue;
+        }
+        for (j = 0; j < s->l2_entries; j++) {
+            int64_t cluster = i * s->l2_entries + j;
+            table[j] = 0;
+            if (cluster < w->nb_chunks && test_bit(cluster, w->data_map)) {
+                table[j] = cpu_to_be64(((data_start + data_index++) * cs) |
+                                       QCOW_OFLAG_COPIED);
+            }
+        }
+        ret = bdrv_seq_writer_output(w, buf, cs, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    assert(l2_index == s->l2_tables && data_index == s->data_clusters);
+    return 0;
+}
+
 static int coroutine_fn
 qcow2_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
@@ -5230,6 +5843,7 @@ qcow2_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     bdi->subcluster_size = s->subcluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
     bdi->is_dirty = s->incompatible_features & QCOW2_INCOMPAT_DIRTY;
+    bdi->multi_cluster_compressed_writes = true;
     return 0;
 }
 
@@ -5281,6 +5895,10 @@ qcow2_get_specific_info(BlockDriverState *bs, Error **errp)
             .has_data_file_raw  = has_data_file(bs),
             .data_file_raw      = data_file_is_raw(bs),
             .compression_type   = s->compression_type,
+            .has_dedup          = has_dedup(s),
+            .dedup              = has_dedup(s),
+            .has_data_checksums = has_data_checksums(s),
+            .data_checksums     = has_data_checksums(s),
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -5494,6 +6112,13 @@ qcow2_downgrade(BlockDriverState *bs, int target_version,
     /* if lazy refcounts have been used, they have already been fixed through
      * clearing the dirty flag */
 
+    /* v2 has no autoclear bits, so the data checksums could not be trusted */
+    ret = qcow2_disable_data_checksums(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to remove the data checksums");
+        return ret;
+    }
+
     /* clearing autoclear features is trivial */
     s->autoclear_features = 0;
 
@@ -5679,6 +6304,7 @@ qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     const char *backing_file = NULL, *backing_format = NULL, *data_file = NULL;
     bool lazy_refcounts = s->use_lazy_refcounts;
     bool data_file_raw = data_file_is_raw(bs);
+    bool data_checksums = has_data_checksums(s);
     const char *compat = NULL;
     int refcount_bits = s->refcount_bits;
     int ret;
@@ -5752,6 +6378,9 @@ qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                                  "images");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_DATA_CHECKSUMS)) {
+            data_checksums = qemu_opt_get_bool(opts, BLOCK_OPT_DATA_CHECKSUMS,
+                                               data_checksums);
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -5888,6 +6517,36 @@ qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         }
     }
 
+    if (has_data_checksums(s) != data_checksums) {
+        if (data_checksums) {
+            if (new_version < 3) {
+                error_setg(errp, "Data checksums are only supported with "
+                           "compatibility level 1.1 and above (use compat=1.1 "
+                           "or greater)");
+                return -EINVAL;
+            }
+            /*
+             * Only new writes get a checksum; the table itself is set up
+             * when the image is opened the next time.
+             */
+            s->data_checksums = true;
+            ret = qcow2_update_header(bs);
+            if (ret < 0) {
+                s->data_checksums = false;
+                error_setg_errno(errp, -ret,
+                                 "Failed to update the image header");
+                return ret;
+            }
+        } else {
+            ret = qcow2_disable_data_checksums(bs);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Failed to remove the data "
+                                 "checksums");
+                return ret;
+            }
+        }
+    }
+
     if (new_size) {
         BlockBackend *blk = blk_new_with_bs(bs, BLK_PERM_RESIZE, BLK_PERM_ALL,
                                             errp);
@@ -6045,6 +6704,11 @@ void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
         .help = "Postpone refcount updates",                        \
         .def_value_str = "off"                                      \
     },                                                              \
+    {                                                               \
+        .name = BLOCK_OPT_DATA_CHECKSUMS,                           \
+        .type = QEMU_OPT_BOOL,                                      \
+        .help = "Keep a checksum of each data cluster",             \
+    },                                                              \
     {                                                               \
         .name = BLOCK_OPT_REFCOUNT_BITS,                            \
         .type = QEMU_OPT_NUMBER,                                    \
@@ -6087,6 +6751,11 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Extended L2 tables",                               \
             .def_value_str = "off"                                      \
         },                                                              \
+        {                                                               \
+            .name = BLOCK_OPT_DEDUP,                                    \
+            .type = QEMU_OPT_BOOL,                                      \
+            .help = "Deduplicate identical clusters on write",          \
+        },                                                              \
         {                                                               \
             .name = BLOCK_OPT_PREALLOC,                                 \
             .type = QEMU_OPT_STRING,                                    \
@@ -6139,6 +6808,9 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_child_perm                    = bdrv_default_perms,
     .bdrv_co_create_opts                = qcow2_co_create_opts,
     .bdrv_co_create                     = qcow2_co_create,
+    .seq_writer_instance_size           = sizeof(Qcow2SeqWriter),
+    .bdrv_seq_writer_open               = qcow2_seq_writer_open,
+    .bdrv_seq_writer_start              = qcow2_seq_writer_start,
     .bdrv_has_zero_init                 = qcow2_has_zero_init,
     .bdrv_co_block_status               = qcow2_co_block_status,
 
@@ -6179,6 +6851,7 @@ BlockDriver bdrv_qcow2 = {
     .strong_runtime_opts                = qcow2_strong_runtime_opts,
     .mutable_opts                       = mutable_opts,
     .bdrv_co_check                      = qcow2_co_check,
+    .supports_check_data                = true,
     .bdrv_amend_options                 = qcow2_amend_options,
     .bdrv_co_amend                      = qcow2_co_amend,
 
@@ -68,9 +68,22 @@
 #define QCOW2_MAX_BITMAPS 65535
 #define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
 
+/* Deduplication index header extension constraints */
+#define QCOW2_DEDUP_HASH_SIZE 32 /* SHA-256 */
+#define QCOW2_MAX_DEDUP_INDEX_SIZE (256 * MiB)
+
+/* Data checksums header extension constraints */
+#define QCOW2_MAX_DATA_CHECKSUMS_SIZE (256 * MiB)
+
 /* Maximum of parallel sub-request per guest request */
 #define QCOW2_MAX_WORKERS 8
 
+/*
+ * Maximum of clusters compressed in parallel per request; they do not wait
+ * for any I/O, so it is only bounded by the thread pool
+ */
+#define QCOW2_MAX_COMPRESS_WORKERS 64
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -256,17 +269,20 @@ enum {
     QCOW2_INCOMPAT_DATA_FILE_BITNR  = 2,
     QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
     QCOW2_INCOMPAT_EXTL2_BITNR      = 4,
+    QCOW2_INCOMPAT_DEDUP_BITNR      = 5,
     QCOW2_INCOMPAT_DIRTY            = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT          = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
     QCOW2_INCOMPAT_DATA_FILE        = 1 << QCOW2_INCOMPAT_DATA_FILE_BITNR,
     QCOW2_INCOMPAT_COMPRESSION      = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
     QCOW2_INCOMPAT_EXTL2            = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_DEDUP            = 1 << QCOW2_INCOMPAT_DEDUP_BITNR,
 
     QCOW2_INCOMPAT_MASK             = QCOW2_INCOMPAT_DIRTY
                                     | QCOW2_INCOMPAT_CORRUPT
                                     | QCOW2_INCOMPAT_DATA_FILE
                                     | QCOW2_INCOMPAT_COMPRESSION
-                                    | QCOW2_INCOMPAT_EXTL2,
+                                    | QCOW2_INCOMPAT_EXTL2
+                                    | QCOW2_INCOMPAT_DEDUP,
 };
 
 /* Compatible feature bits */
@@ -281,11 +297,15 @@ enum {
 enum {
     QCOW2_AUTOCLEAR_BITMAPS_BITNR       = 0,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR = 1,
+    QCOW2_AUTOCLEAR_DATA_CHECKSUMS_BITNR = 2,
     QCOW2_AUTOCLEAR_BITMAPS             = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW       = 1 << QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
+    QCOW2_AUTOCLEAR_DATA_CHECKSUMS      =
+        1 << QCOW2_AUTOCLEAR_DATA_CHECKSUMS_BITNR,
 
     QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_BITMAPS
-                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW,
+                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW
+                                        | QCOW2_AUTOCLEAR_DATA_CHECKSUMS,
 };
 
 enum qcow2_discard_type {
@@ -322,6 +342,22 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+typedef struct Qcow2DedupHeaderExt {
+    uint64_t index_offset;
+    uint64_t index_size;
+} QEMU_PACKED Qcow2DedupHeaderExt;
+
+typedef struct Qcow2DataChecksumsHeaderExt {
+    uint64_t table_offset;
+    uint64_t table_size;
+} QEMU_PACKED Qcow2DataChecksumsHeaderExt;
+
+/* On-disk entry of the deduplication index */
+typedef struct Qcow2DedupIndexEntry {
+    uint8_t hash[QCOW2_DEDUP_HASH_SIZE];
+    uint64_t host_offset;
+} QEMU_PACKED Qcow2DedupIndexEntry;
+
 #define QCOW2_MAX_THREADS 4
 
 typedef struct BDRVQcow2State {
@@ -374,6 +410,33 @@ typedef struct BDRVQcow2State {
     uint64_t bitmap_directory_size;
     uint64_t bitmap_directory_offset;
 
+    /*
+     * Deduplication index: maps the hash of a data cluster to its host
+     * offset (dedup_index) and back (dedup_offsets).  Only clusters whose
+     * L2 entries are all without QCOW_OFLAG_COPIED are listed, so that
+     * their contents can never change while they are in the index.
+     */
+    GHashTable *dedup_index;
+    GHashTable *dedup_offsets;
+    uint64_t dedup_index_offset;
+    uint64_t dedup_index_size;
+
+    /*
+     * Data checksums: CRC-32C of the host cluster of each guest cluster,
+     * indexed by guest cluster.  A table entry is only meaningful if its bit
+     * in data_checksums_valid is set.  data_checksums_writes keeps track of
+     * the guest clusters that are currently being written to.  All of them
+     * are protected by data_checksums_lock.
+     */
+    bool data_checksums;
+    uint32_t *data_checksums_table;
+    unsigned long *data_checksums_valid;
+    uint64_t data_checksums_entries;
+    GHashTable *data_checksums_writes;
+    QemuMutex data_checksums_lock;
+    uint64_t data_checksums_offset;
+    uint64_t data_checksums_size;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -411,6 +474,16 @@ typedef struct BDRVQcow2State {
     CoQueue thread_task_queue;
     int nb_threads;
 
+    /*
+     * Compressed clusters are compressed in parallel, but allocated in the
+     * order in which they were submitted. compressed_seq_next is the next
+     * ticket to hand out (atomic), compressed_seq_alloc the ticket whose
+     * turn it is to allocate (protected by lock).
+     */
+    unsigned compressed_seq_next;
+    unsigned compressed_seq_alloc;
+    CoQueue compressed_seq_queue;
+
     BdrvChild *data_file;
 
     bool metadata_preallocation_checked;
@@ -496,6 +569,13 @@ typedef struct QCowL2Meta
     QEMUIOVector *data_qiov;
     size_t data_qiov_offset;
 
+    /**
+     * If non-NULL, this is a deduplicating write of a single, fully
+     * written cluster with the given content hash.  The cluster is linked
+     * without QCOW_OFLAG_COPIED and entered into the deduplication index.
+     */
+    const uint8_t *dedup_hash;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -647,6 +727,16 @@ static inline bool GRAPH_RDLOCK has_data_file(BlockDriverState *bs)
     return (s->data_file != bs->file);
 }
 
+static inline bool has_dedup(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_DEDUP;
+}
+
+static inline bool has_data_checksums(BDRVQcow2State *s)
+{
+    return s->data_checksums;
+}
+
 static inline bool data_file_is_raw(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -963,6 +1053,10 @@ qcow2_expand_zero_clusters(BlockDriverState *bs,
                            BlockDriverAmendStatusCB *status_cb,
                            void *cb_opaque);
 
+int coroutine_fn GRAPH_RDLOCK
+qcow2_link_dedup_cluster(BlockDriverState *bs, uint64_t guest_offset,
+                         const uint8_t *hash, uint64_t host_offset);
+
 /* qcow2-snapshot.c functions */
 int GRAPH_RDLOCK
 qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
@@ -1058,6 +1152,58 @@ bool qcow2_supports_persistent_dirty_bitmap(BlockDriverState *bs);
 uint64_t qcow2_get_persistent_dirty_bitmap_size(BlockDriverState *bs,
                                                 uint32_t cluster_size);
 
+/* qcow2-dedup.c functions */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_load_dedup_index(BlockDriverState *bs, Error **errp);
+
+int GRAPH_RDLOCK qcow2_reopen_dedup_index_rw(BlockDriverState *bs,
+                                             Error **errp);
+int GRAPH_RDLOCK qcow2_store_dedup_index(BlockDriverState *bs, Error **errp);
+void qcow2_free_dedup_index(BlockDriverState *bs);
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_dedup_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                            void **refcount_table,
+                            int64_t *refcount_table_size);
+
+int qcow2_dedup_hash(const void *buf, size_t bytes, uint8_t *hash);
+int64_t qcow2_dedup_lookup(BlockDriverState *bs, const uint8_t *hash);
+void qcow2_dedup_insert(BlockDriverState *bs, const uint8_t *hash,
+                        uint64_t host_offset);
+void qcow2_dedup_forget(BlockDriverState *bs, uint64_t host_offset);
+void qcow2_dedup_clear(BlockDriverState *bs);
+
+/* qcow2-checksum.c functions */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_load_data_checksums(BlockDriverState *bs, Error **errp);
+
+int GRAPH_RDLOCK qcow2_reopen_data_checksums_rw(BlockDriverState *bs,
+                                                Error **errp);
+int GRAPH_RDLOCK qcow2_store_data_checksums(BlockDriverState *bs,
+                                            Error **errp);
+void qcow2_free_data_checksums(BlockDriverState *bs);
+int GRAPH_RDLOCK qcow2_disable_data_checksums(BlockDriverState *bs);
+int qcow2_resize_data_checksums(BlockDriverState *bs, int64_t new_size);
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_data_checksums_refcounts(BlockDriverState *bs,
+                                     BdrvCheckResult *res,
+                                     void **refcount_table,
+                                     int64_t *refcount_table_size);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_check_data(BlockDriverState *bs, BdrvCheckResult *res);
+
+void qcow2_data_checksums_begin(BlockDriverState *bs, uint64_t offset,
+                                uint64_t bytes);
+void coroutine_fn GRAPH_RDLOCK
+qcow2_co_data_checksums_end(BlockDriverState *bs, uint64_t host_offset,
+                            uint64_t offset, uint64_t bytes,
+                            QEMUIOVector *qiov, size_t qiov_offset,
+                            bool success);
+void qcow2_data_checksums_invalidate(BlockDriverState *bs, uint64_t offset,
+                                     uint64_t bytes);
+void qcow2_data_checksums_clear(BlockDriverState *bs);
+
 ssize_t coroutine_fn
 qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                   const void *src, size_t src_size);
@@ -0,0 +1,204 @@
+/*
+ * Sequential image output
+ *
+ * Writes a complete image strictly sequentially, e.g. to a pipe, without
+ * ever seeking back.  The caller first registers all guest areas that contain
+ * data, so that the format driver can write its metadata up front.  The data
+ * then follows in guest order.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/units.h"
+#include "block/block_int.h"
+
+static int seq_writer_output(BlockSeqWriter *w, const void *buf, size_t len)
+{
+    if (qemu_write_full(w->fd, buf, len) != len) {
+        return -errno;
+    }
+    return 0;
+}
+
+int bdrv_seq_writer_output(BlockSeqWriter *w, const void *buf, size_t len,
+                           Error **errp)
+{
+    int ret = seq_writer_output(w, buf, len);
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write image");
+    }
+    return ret;
+}
+
+/*
+ * Writes zeroes for the parts of registered chunks between the current
+ * position and @end that the caller didn't provide any data for.
+ */
+static int seq_writer_fill(BlockSeqWriter *w, int64_t end)
+{
+    g_autofree uint8_t *zeroes = NULL;
+    int ret;
+
+    while (w->pos < end) {
+        int64_t chunk = w->pos / w->granularity;
+        int64_t len;
+
+        if (!test_bit(chunk, w->data_map)) {
+            chunk = find_next_bit(w->data_map, w->nb_chunks, chunk);
+            w->pos = MIN(chunk * w->granularity, end);
+            continue;
+        }
+
+        len = MIN((chunk + 1) * w->granularity, end) - w->pos;
+        len = MIN(len, 1 * MiB);
+        if (!zeroes) {
+            zeroes = g_malloc0(1 * MiB);
+        }
+
+        ret = seq_writer_output(w, zeroes, len);
+        if (ret < 0) {
+            return ret;
+        }
+        w->pos += len;
+    }
+
+    return 0;
+}
+
+/*
+ * Creates a writer that outputs an image of format @drv and virtual size
+ * @size to @fd, which doesn't need to be seekable.  @opts are the creation
+ * options of the image.
+ */
+BlockSeqWriter *bdrv_seq_writer_new(BlockDriver *drv, int fd, int64_t size,
+                                    QemuOpts *opts, Error **errp)
+{
+    BlockSeqWriter *w;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    if (!drv->bdrv_seq_writer_open) {
+        error_setg(errp, "Format driver '%s' does not support sequential "
+                   "output", drv->format_name);
+        return NULL;
+    }
+
+    w = g_new0(BlockSeqWriter, 1);
+    w->drv = drv;
+    w->fd = fd;
+    w->size = size;
+    w->opaque = g_malloc0(drv->seq_writer_instance_size);
+
+    ret = drv->bdrv_seq_writer_open(w, opts, errp);
+    if (ret < 0) {
+        g_free(w->opaque);
+        g_free(w);
+        return NULL;
+    }
+
+    assert(is_power_of_2(w->granularity));
+    w->nb_chunks = DIV_ROUND_UP(size, w->granularity);
+    w->data_map = bitmap_new(w->nb_chunks);
+
+    return w;
+}
+
+/* Registers that the guest range [@offset, @offset + @bytes) has data */
+void bdrv_seq_writer_add_data(BlockSeqWriter *w, int64_t offset,
+                              int64_t bytes)
+{
+    int64_t first = offset / w->granularity;
+    int64_t last = (offset + bytes - 1) / w->granularity;
+
+    GLOBAL_STATE_CODE();
+    assert(bytes > 0 && offset + bytes <= w->size);
+
+    bitmap_set(w->data_map, first, last - first + 1);
+}
+
+/*
+ * Writes the image metadata.  No more data can be registered after this.
+ */
+int bdrv_seq_writer_start(BlockSeqWriter *w, Error **errp)
+{
+    GLOBAL_STATE_CODE();
+    return w->drv->bdrv_seq_writer_start(w, errp);
+}
+
+/*
+ * Writes guest data.  Requests must be made in ascending order and only
+ * cover registered ranges; parts of registered chunks that are skipped read
+ * as zeroes.  Returns -errno on failure.
+ */
+int bdrv_seq_writer_write(BlockSeqWriter *w, int64_t offset, int64_t bytes,
+                          const void *buf)
+{
+    int64_t first = offset / w->granularity;
+    int64_t end = DIV_ROUND_UP(offset + bytes, w->granularity);
+    int ret;
+
+    GLOBAL_STATE_CODE();
+    assert(offset >= w->pos && offset + bytes <= w->size);
+    assert(find_next_zero_bit(w->data_map, end, first) == end);
+
+    ret = seq_writer_fill(w, offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = seq_writer_output(w, buf, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    w->pos = offset + bytes;
+
+    return 0;
+}
+
+/* Completes the image after the last bdrv_seq_writer_write() */
+int bdrv_seq_writer_finish(BlockSeqWriter *w, Error **errp)
+{
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    ret = seq_writer_fill(w, w->nb_chunks * w->granularity);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write image");
+    }
+    return ret;
+}
+
+void bdrv_seq_writer_free(BlockSeqWriter *w)
+{
+    GLOBAL_STATE_CODE();
+
+    if (!w) {
+        return;
+    }
+
+    if (w->drv->bdrv_seq_writer_close) {
+        w->drv->bdrv_seq_writer_close(w);
+    }
+    g_free(w->data_map);
+    g_free(w->opaque);
+    g_free(w);
+}
@@ -0,0 +1,698 @@
+/*
+ * Shared read-only block cache filter driver
+ *
+ * The driver is injected above a read-only node, typically a backing file
+ * that is shared by many VMs on the same host, and caches the data read
+ * from it in a shared memory region.  All QEMU processes that open the same
+ * cache file share the cached data, so that the image is read only once
+ * when many VMs boot from it at the same time.
+ *
+ * The cache file is expected to live on a memory backed file system (e.g.
+ * /dev/shm), or it can be a memfd that a management daemon passes to QEMU
+ * with add-fd and that is referred to as /dev/fdset/N.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+/*
+ * Layout of the cache file:
+ *
+ *   SharedCacheHeader, padded to SHARED_CACHE_HEADER_SIZE
+ *   nb_slots * SharedCacheSlot, padded to SHARED_CACHE_HEADER_SIZE
+ *   nb_slots * block_size bytes of data
+ *
+ * The cache is direct mapped: block n of the image can only be stored in
+ * slot (n % nb_slots).  Each slot is protected by a sequence counter that
+ * is shared between all processes that map the cache file: a writer makes
+ * the counter odd before modifying the slot and even again when it is done,
+ * and readers retry (i.e. treat the access as a miss) when the counter was
+ * odd or has changed while they were copying the data.
+ *
+ * Readers trust the cached data, so only processes that are opened with
+ * populate=on map the cache writable and fill it.  VMs are expected to use
+ * populate=off, which opens and maps the cache file read-only, and to leave
+ * populating the cache to a trusted process such as qemu-storage-daemon.
+ *
+ * Writers serialize on an exclusive fcntl() lock on byte
+ * (SHARED_CACHE_SLOT_LOCK_BASE + slot index).  They never wait for each
+ * other; a writer that doesn't get the lock simply doesn't populate the slot.
+ * The lock is dropped by the kernel when a writer dies, so if the next
+ * writer that takes the lock finds the counter odd, it knows that the slot
+ * was left behind half written and can take it over.
+ *
+ * The cache file is only meant to be shared between processes on the same
+ * host, so all values are stored in native endianness.
+ *
+ * Besides the slot locks, two kinds of locks are used on the cache file:
+ * flock() serializes opening the cache between processes, and every user
+ * holds a shared fcntl() lock on SHARED_CACHE_LOCK_BYTE for as long as it has
+ * the cache mapped.  When nobody else holds the byte lock, a populating
+ * process invalidates and initializes anew a cache file that was set up for
+ * a different image (or a different version of the same image).
+ */
+
+#define SHARED_CACHE_MAGIC          0x5145534843414348ULL /* "QESHCACH" */
+#define SHARED_CACHE_VERSION        2
+#define SHARED_CACHE_HEADER_SIZE    4096
+#define SHARED_CACHE_BLOCK_SIZE     (64 * KiB)
+#define SHARED_CACHE_ID_LEN         64 /* hex encoded SHA-256 */
+#define SHARED_CACHE_DEFAULT_SIZE   (256 * MiB)
+#define SHARED_CACHE_LOCK_BYTE      0
+#define SHARED_CACHE_SLOT_LOCK_BASE 1
+
+typedef struct SharedCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t nb_slots;
+    uint64_t image_size;
+    char image_id[SHARED_CACHE_ID_LEN];
+} SharedCacheHeader;
+
+typedef struct SharedCacheSlot {
+    /* Odd while a writer modifies the slot */
+    uint32_t seq;
+    uint32_t reserved;
+    /* Image block number + 1, or 0 if the slot is empty */
+    uint64_t tag;
+} SharedCacheSlot;
+
+QEMU_BUILD_BUG_ON(sizeof(SharedCacheHeader) > SHARED_CACHE_HEADER_SIZE);
+
+typedef struct BDRVSharedCacheState {
+    /* Kept open to hold the shared lock that marks the cache as in use */
+    int fd;
+    void *map;
+    size_t map_size;
+
+    SharedCacheSlot *slots;
+    uint8_t *data;
+    uint64_t nb_slots;
+    uint32_t block_size;
+
+    /* The cache is mapped writable and filled on misses */
+    bool populate;
+    /* fcntl() locks don't exclude other threads that use the same fd */
+    QemuMutex fill_lock;
+} BDRVSharedCacheState;
+
+#define SHARED_CACHE_OPT_PATH "path"
+#define SHARED_CACHE_OPT_SIZE "size"
+#define SHARED_CACHE_OPT_IMAGE_ID "image-id"
+#define SHARED_CACHE_OPT_POPULATE "populate"
+static QemuOptsList runtime_opts = {
+    .name = "shared-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = SHARED_CACHE_OPT_PATH,
+            .type = QEMU_OPT_STRING,
+            .help = "path of the shared cache file",
+        },
+        {
+            .name = SHARED_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the cached data if the cache file is created, "
+                "default 256M",
+        },
+        {
+            .name = SHARED_CACHE_OPT_IMAGE_ID,
+            .type = QEMU_OPT_STRING,
+            .help = "identity of the cached image, default is derived from "
+                "the file name, inode and modification time of the image "
+                "file",
+        },
+        {
+            .name = SHARED_CACHE_OPT_POPULATE,
+            .type = QEMU_OPT_BOOL,
+            .help = "fill the cache with the data read from the image, "
+                "default off",
+        },
+        { /* end of list */ }
+    },
+};
+
+static size_t shared_cache_slots_size(uint64_t nb_slots)
+{
+    return ROUND_UP(nb_slots * sizeof(SharedCacheSlot),
+                    SHARED_CACHE_HEADER_SIZE);
+}
+
+static size_t shared_cache_file_size(uint64_t nb_slots, uint32_t block_size)
+{
+    return SHARED_CACHE_HEADER_SIZE + shared_cache_slots_size(nb_slots) +
+        nb_slots * block_size;
+}
+
+/*
+ * Checks that the cache file @fd is set up for the image identified by
+ * @image_id, or initializes it if it is still empty.  Returns the cache
+ * geometry in @header.  The caller holds an exclusive flock() on the file.
+ *
+ * If @exclusive is true, no other process uses the cache, and a cache file
+ * that belongs to a different image is invalidated instead of failing.
+ *
+ * If @populate is false, @fd is read-only and the cache file must already
+ * have been set up by a populating process.
+ */
+static int shared_cache_setup_file(int fd, const char *path,
+                                   const char *image_id, uint64_t image_size,
+                                   uint64_t cache_size, bool exclusive,
+                                   bool populate, SharedCacheHeader *header,
+                                   Error **errp)
+{
+    struct stat st;
+    ssize_t len;
+
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Could not stat cache file '%s'", path);
+        return -errno;
+    }
+
+    if (st.st_size == 0 && !populate) {
+        error_setg(errp, "Cache file '%s' has not been populated", path);
+        return -ENOENT;
+    }
+
+    if (st.st_size != 0 && exclusive && populate) {
+        len = pread(fd, header, sizeof(*header), 0);
+        if (len == sizeof(*header) &&
+            header->magic == SHARED_CACHE_MAGIC &&
+            header->version == SHARED_CACHE_VERSION &&
+            (memcmp(header->image_id, image_id, SHARED_CACHE_ID_LEN) ||
+             header->image_size != image_size))
+        {
+            trace_shared_cache_invalidate(path);
+            if (ftruncate(fd, 0) < 0) {
+                error_setg_errno(errp, errno,
+                                 "Could not invalidate cache file '%s'", path);
+                return -errno;
+            }
+            st.st_size = 0;
+        }
+    }
+
+    if (st.st_size == 0) {
+        *header = (SharedCacheHeader) {
+            .magic      = SHARED_CACHE_MAGIC,
+            .version    = SHARED_CACHE_VERSION,
+            .block_size = SHARED_CACHE_BLOCK_SIZE,
+            .nb_slots   = cache_size / SHARED_CACHE_BLOCK_SIZE,
+            .image_size = image_size,
+        };
+        memcpy(header->image_id, image_id, SHARED_CACHE_ID_LEN);
+
+        /* Newly allocated space reads as zero, i.e. all slots are empty */
+        if (ftruncate(fd, shared_cache_file_size(header->nb_slots,
+                                                 header->block_size)) < 0) {
+            error_setg_errno(errp, errno, "Could not resize cache file '%s'",
+                             path);
+            return -errno;
+        }
+
+        len = pwrite(fd, header, sizeof(*header), 0);
+        if (len != sizeof(*header)) {
+            error_setg_errno(errp, len < 0 ? errno : EIO,
+                             "Could not write cache file header");
+            return len < 0 ? -errno : -EIO;
+        }
+        return 0;
+    }
+
+    len = pread(fd, header, sizeof(*header), 0);
+    if (len != sizeof(*header)) {
+        error_setg_errno(errp, len < 0 ? errno : EIO,
+                         "Could not read cache file header");
+        return len < 0 ? -errno : -EIO;
+    }
+
+    if (header->magic != SHARED_CACHE_MAGIC) {
+        error_setg(errp, "'%s' is not a shared cache file", path);
+        return -EINVAL;
+    }
+    if (header->version != SHARED_CACHE_VERSION) {
+        error_setg(errp, "Unsupported shared cache version %" PRIu32,
+                   header->version);
+        return -ENOTSUP;
+    }
+    if (header->block_size != SHARED_CACHE_BLOCK_SIZE ||
+        header->nb_slots == 0 ||
+        header->nb_slots > SIZE_MAX / 2 / header->block_size ||
+        st.st_size != shared_cache_file_size(header->nb_slots,
+                                             header->block_size)) {
+        error_setg(errp, "Invalid shared cache geometry in '%s'", path);
+        return -EINVAL;
+    }
+    if (memcmp(header->image_id, image_id, SHARED_CACHE_ID_LEN) ||
+        header->image_size != image_size) {
+        if (!populate) {
+            error_setg(errp, "Cache file '%s' was populated for a different "
+                       "image", path);
+        } else {
+            error_setg(errp, "Cache file '%s' is in use for a different image",
+                       path);
+        }
+        return -EBUSY;
+    }
+
+    return 0;
+}
+
+/*
+ * Computes the default identity of the image from the protocol node below
+ * @bs.  Besides the file name, this includes the inode and the modification
+ * time of the file so that a cache filled from an image that has since been
+ * replaced or modified is not used.
+ */
+static char * GRAPH_RDLOCK
+shared_cache_default_image_id(BlockDriverState *bs, Error **errp)
+{
+    BlockDriverState *file = bs->file->bs;
+    struct timespec mtime;
+    struct stat st;
+
+    while (file->file) {
+        file = file->file->bs;
+    }
+
+    if (stat(file->filename, &st) < 0) {
+        error_setg_errno(errp, errno, "Could not identify image file '%s', "
+                         "'" SHARED_CACHE_OPT_IMAGE_ID "' must be specified",
+                         file->filename);
+        return NULL;
+    }
+
+#ifdef CONFIG_DARWIN
+    mtime = st.st_mtimespec;
+#else
+    mtime = st.st_mtim;
+#endif
+
+    return g_strdup_printf("%s:%" PRIu64 ":%" PRIu64 ":%" PRId64 ".%09ld",
+                           file->filename, (uint64_t)st.st_dev,
+                           (uint64_t)st.st_ino, (int64_t)mtime.tv_sec,
+                           (long)mtime.tv_nsec);
+}
+
+static int GRAPH_RDLOCK
+shared_cache_map(BlockDriverState *bs, const char *path, const char *image_id,
+                 uint64_t cache_size, bool populate, Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    SharedCacheHeader header;
+    g_autofree char *default_id = NULL;
+    g_autofree char *id_hash = NULL;
+    int64_t image_size;
+    bool in_use;
+    int fd;
+    int ret;
+
+    image_size = bdrv_getlength(bs->file->bs);
+    if (image_size < 0) {
+        error_setg_errno(errp, -image_size, "Could not get image size");
+        return image_size;
+    }
+
+    if (!image_id) {
+        default_id = shared_cache_default_image_id(bs, errp);
+        if (!default_id) {
+            return -EINVAL;
+        }
+        image_id = default_id;
+    }
+    id_hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, image_id, -1);
+    assert(strlen(id_hash) == SHARED_CACHE_ID_LEN);
+
+    if (populate) {
+        fd = qemu_create(path, O_RDWR, 0600, errp);
+    } else {
+        fd = qemu_open(path, O_RDONLY, errp);
+    }
+    if (fd < 0) {
+        return -errno;
+    }
+
+    /* Serialize initialization of a new cache file against other processes */
+    if (flock(fd, LOCK_EX) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not lock cache file '%s'", path);
+        goto out;
+    }
+
+    ret = qemu_lock_fd_test(fd, SHARED_CACHE_LOCK_BYTE, 1, true);
+    if (ret < 0 && ret != -EAGAIN) {
+        error_setg_errno(errp, -ret, "Could not test lock on cache file '%s'",
+                         path);
+        goto out;
+    }
+    in_use = ret == -EAGAIN;
+
+    ret = shared_cache_setup_file(fd, path, id_hash, image_size, cache_size,
+                                  !in_use, populate, &header, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Taken before the flock() is dropped so nobody can invalidate the cache */
+    ret = qemu_lock_fd(fd, SHARED_CACHE_LOCK_BYTE, 1, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not lock cache file '%s'", path);
+        goto out;
+    }
+
+    s->block_size = header.block_size;
+    s->nb_slots = header.nb_slots;
+    s->map_size = shared_cache_file_size(s->nb_slots, s->block_size);
+    s->map = mmap(NULL, s->map_size,
+                  populate ? PROT_READ | PROT_WRITE : PROT_READ,
+                  MAP_SHARED, fd, 0);
+    if (s->map == MAP_FAILED) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not map cache file '%s'", path);
+        s->map = NULL;
+        goto out;
+    }
+
+    s->slots = s->map + SHARED_CACHE_HEADER_SIZE;
+    s->data = s->map + SHARED_CACHE_HEADER_SIZE +
+        shared_cache_slots_size(s->nb_slots);
+    s->fd = fd;
+    s->populate = populate;
+    flock(fd, LOCK_UN);
+    return 0;
+
+out:
+    /* Closing the fd drops all locks */
+    qemu_close(fd);
+    return ret;
+}
+
+static int GRAPH_UNLOCKED
+shared_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                  Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    const char *path;
+    uint64_t cache_size;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    s->fd = -1;
+    qemu_mutex_init(&s->fill_lock);
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_apply_auto_read_only(bs, "The shared-cache filter does not "
+                                    "support writes", errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    path = qemu_opt_get(opts, SHARED_CACHE_OPT_PATH);
+    if (!path) {
+        error_setg(errp, "Parameter '" SHARED_CACHE_OPT_PATH "' is required");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    cache_size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_SIZE,
+                                   SHARED_CACHE_DEFAULT_SIZE);
+    if (cache_size < SHARED_CACHE_BLOCK_SIZE ||
+        cache_size > SIZE_MAX / 2) {
+        error_setg(errp, "Invalid shared cache size %" PRIu64, cache_size);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    bdrv_graph_rdlock_main_loop();
+    ret = shared_cache_map(bs, path,
+                           qemu_opt_get(opts, SHARED_CACHE_OPT_IMAGE_ID),
+                           cache_size,
+                           qemu_opt_get_bool(opts, SHARED_CACHE_OPT_POPULATE,
+                                             false),
+                           errp);
+    bdrv_graph_rdunlock_main_loop();
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void shared_cache_close(BlockDriverState *bs)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+
+    if (s->map) {
+        munmap(s->map, s->map_size);
+        s->map = NULL;
+    }
+    if (s->fd >= 0) {
+        qemu_close(s->fd);
+        s->fd = -1;
+    }
+    qemu_mutex_destroy(&s->fill_lock);
+}
+
+static int shared_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                       BlockReopenQueue *queue, Error **errp)
+{
+    if (reopen_state->flags & BDRV_O_RDWR) {
+        error_setg(errp, "The shared-cache filter does not support writes");
+        return -EACCES;
+    }
+
+    return 0;
+}
+
+/*
+ * Copies the cached data of block @block_nr in the range
+ * [@offset_in_block, @offset_in_block + @bytes) to @qiov.  Returns false if
+ * the block is not in the cache; @qiov may have been modified in this case.
+ */
+static bool shared_cache_lookup(BDRVSharedCacheState *s, uint64_t block_nr,
+                                size_t offset_in_block, size_t bytes,
+                                QEMUIOVector *qiov, size_t qiov_offset)
+{
+    SharedCacheSlot *slot = &s->slots[block_nr % s->nb_slots];
+    uint8_t *data = s->data + (block_nr % s->nb_slots) * s->block_size;
+    uint32_t seq;
+
+    seq = qatomic_load_acquire(&slot->seq);
+    if ((seq & 1) || slot->tag != block_nr + 1) {
+        return false;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, data + offset_in_block, bytes);
+
+    smp_rmb();
+    return qatomic_read(&slot->seq) == seq;
+}
+
+static void shared_cache_fill(BlockDriverState *bs, uint64_t block_nr,
+                              const void *buf)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    uint64_t slot_nr = block_nr % s->nb_slots;
+    SharedCacheSlot *slot = &s->slots[slot_nr];
+    uint8_t *data = s->data + slot_nr * s->block_size;
+    uint32_t seq;
+
+    /* If someone else is populating the slot right now, just skip it */
+    if (qemu_mutex_trylock(&s->fill_lock)) {
+        return;
+    }
+    if (qemu_lock_fd(s->fd, SHARED_CACHE_SLOT_LOCK_BASE + slot_nr, 1,
+                     true) < 0) {
+        goto out;
+    }
+
+    seq = qatomic_read(&slot->seq);
+    if (seq & 1) {
+        /*
+         * The writer that made the counter odd must have died, or it would
+         * still hold the lock.  Readers have never seen seq + 1, so the slot
+         * can be filled as if the counter had been even.
+         */
+        trace_shared_cache_recover(bs, slot_nr);
+        seq++;
+    }
+
+    qatomic_set(&slot->seq, seq + 1);
+    /* Pairs with smp_rmb() in shared_cache_lookup() */
+    smp_wmb();
+
+    slot->tag = block_nr + 1;
+    memcpy(data, buf, s->block_size);
+
+    qatomic_store_release(&slot->seq, seq + 2);
+    qemu_unlock_fd(s->fd, SHARED_CACHE_SLOT_LOCK_BASE + slot_nr, 1);
+out:
+    qemu_mutex_unlock(&s->fill_lock);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+shared_cache_co_preadv_part(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, QEMUIOVector *qiov,
+                            size_t qiov_offset, BdrvRequestFlags flags)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    int64_t image_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    void *buf = NULL;
+    int ret = 0;
+
+    while (bytes) {
+        uint64_t block_nr = offset / s->block_size;
+        int64_t block_start = block_nr * s->block_size;
+        size_t offset_in_block = offset - block_start;
+        size_t cur_bytes = MIN(bytes, s->block_size - offset_in_block);
+        int64_t block_bytes;
+
+        if (shared_cache_lookup(s, block_nr, offset_in_block, cur_bytes,
+                                qiov, qiov_offset)) {
+            trace_shared_cache_hit(bs, block_nr);
+            goto next;
+        }
+
+        trace_shared_cache_miss(bs, block_nr);
+
+        /*
+         * Read the whole block so that it can be cached.  The image size is
+         * not necessarily a multiple of the block size, and a partial block
+         * at the end of the image is never cached.
+         */
+        block_bytes = MIN(s->block_size, image_size - block_start);
+        if (block_bytes < s->block_size) {
+            ret = bdrv_co_preadv_part(bs->file, offset, cur_bytes, qiov,
+                                      qiov_offset, flags);
+            if (ret < 0) {
+                break;
+            }
+            goto next;
+        }
+
+        if (!buf) {
+            buf = qemu_try_blockalign(bs->file->bs, s->block_size);
+            if (!buf) {
+                ret = -ENOMEM;
+                break;
+            }
+        }
+
+        ret = bdrv_co_pread(bs->file, block_start, s->block_size, buf, flags);
+        if (ret < 0) {
+            break;
+        }
+
+        if (s->populate) {
+            shared_cache_fill(bs, block_nr, buf);
+        }
+        qemu_iovec_from_buf(qiov, qiov_offset, buf + offset_in_block,
+                            cur_bytes);
+
+next:
+        offset += cur_bytes;
+        bytes -= cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    qemu_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+shared_cache_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+shared_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void shared_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                    BdrvChildRole role,
+                                    BlockReopenQueue *reopen_queue,
+                                    uint64_t perm, uint64_t shared,
+                                    uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /*
+     * Cached data would become stale if the image changed, so don't let
+     * anyone write to it or resize it.  With image locking, this extends to
+     * other processes.
+     */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static const char *const shared_cache_strong_runtime_opts[] = {
+    SHARED_CACHE_OPT_PATH,
+    SHARED_CACHE_OPT_IMAGE_ID,
+    SHARED_CACHE_OPT_POPULATE,
+
+    NULL
+};
+
+static BlockDriver bdrv_shared_cache = {
+    .format_name            = "shared-cache",
+    .instance_size          = sizeof(BDRVSharedCacheState),
+
+    .bdrv_open              = shared_cache_open,
+    .bdrv_close             = shared_cache_close,
+    .bdrv_reopen_prepare    = shared_cache_reopen_prepare,
+    .bdrv_child_perm        = shared_cache_child_perm,
+
+    .bdrv_co_getlength      = shared_cache_co_getlength,
+    .bdrv_co_preadv_part    = shared_cache_co_preadv_part,
+    .bdrv_co_flush          = shared_cache_co_flush,
+
+    .strong_runtime_opts    = shared_cache_strong_runtime_opts,
+    .is_filter              = true,
+};
+
+static void bdrv_shared_cache_init(void)
+{
+    bdrv_register(&bdrv_shared_cache);
+}
+
+block_init(bdrv_shared_cache_init);
@@ -2621,6 +2621,7 @@ static BlockJob *do_backup_common(BackupCommon *backup,
 {
     BlockJob *job = NULL;
     BdrvDirtyBitmap *bmap = NULL;
+    BlockDriverState *hashes_bs = NULL;
     BackupPerf perf = { .max_workers = 64 };
     int job_flags = JOB_DEFAULT;
 
@@ -2717,6 +2718,13 @@ static BlockJob *do_backup_common(BackupCommon *backup,
         return NULL;
     }
 
+    if (backup->hash_node) {
+        hashes_bs = bdrv_lookup_bs(NULL, backup->hash_node, errp);
+        if (!hashes_bs) {
+            return NULL;
+        }
+    }
+
     if (!backup->auto_finalize) {
         job_flags |= JOB_MANUAL_FINALIZE;
     }
@@ -2726,7 +2734,7 @@ static BlockJob *do_backup_common(BackupCommon *backup,
 
     job = backup_job_create(backup->job_id, bs, target_bs, backup->speed,
                             backup->sync, bmap, backup->bitmap_mode,
-                            backup->compress,
+                            backup->compress, hashes_bs,
                             backup->filter_node_name,
                             &perf,
                             backup->on_source_error,
@@ -2790,10 +2798,16 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                                    bool has_copy_mode, MirrorCopyMode copy_mode,
                                    bool has_auto_finalize, bool auto_finalize,
                                    bool has_auto_dismiss, bool auto_dismiss,
+                                   bool adaptive_request_size,
+                                   strList *iothreads,
                                    Error **errp)
 {
     BlockDriverState *unfiltered_bs;
     int job_flags = JOB_DEFAULT;
+    g_autofree IOThread **iothread_objs = NULL;
+    size_t nr_iothreads = QAPI_LIST_LENGTH(iothreads);
+    strList *it;
+    size_t i;
 
     GLOBAL_STATE_CODE();
     GRAPH_RDLOCK_GUARD_MAINLOOP();
@@ -2837,6 +2851,16 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
         return;
     }
 
+    iothread_objs = g_new(IOThread *, nr_iothreads);
+    for (i = 0, it = iothreads; it; i++, it = it->next) {
+        iothread_objs[i] = iothread_by_id(it->value);
+        if (!iothread_objs[i]) {
+            error_setg(errp, "IOThread \"%s\" object does not exist",
+                       it->value);
+            return;
+        }
+    }
+
     if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_MIRROR_SOURCE, errp)) {
         return;
     }
@@ -2892,7 +2916,8 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                  replaces, job_flags,
                  speed, granularity, buf_size, sync, backing_mode, zero_target,
                  on_source_error, on_target_error, unmap, filter_node_name,
-                 copy_mode, errp);
+                 copy_mode, adaptive_request_size, iothread_objs, nr_iothreads,
+                 errp);
 }
 
 void qmp_drive_mirror(DriveMirror *arg, Error **errp)
@@ -3045,7 +3070,7 @@ void qmp_drive_mirror(DriveMirror *arg, Error **errp)
                            arg->has_copy_mode, arg->copy_mode,
                            arg->has_auto_finalize, arg->auto_finalize,
                            arg->has_auto_dismiss, arg->auto_dismiss,
-                           errp);
+                           false, NULL, errp);
     bdrv_unref(target_bs);
 }
 
@@ -3064,6 +3089,9 @@ void qmp_blockdev_mirror(const char *job_id,
                          bool has_copy_mode, MirrorCopyMode copy_mode,
                          bool has_auto_finalize, bool auto_finalize,
                          bool has_auto_dismiss, bool auto_dismiss,
+                         bool has_adaptive_request_size,
+                         bool adaptive_request_size,
+                         bool has_iothreads, strList *iothreads,
                          Error **errp)
 {
     BlockDriverState *bs;
@@ -3103,7 +3131,8 @@ void qmp_blockdev_mirror(const char *job_id,
                            has_copy_mode, copy_mode,
                            has_auto_finalize, auto_finalize,
                            has_auto_dismiss, auto_dismiss,
-                           errp);
+                           has_adaptive_request_size && adaptive_request_size,
+                           iothreads, errp);
 }
 
 /*
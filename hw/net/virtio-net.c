@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/atomic.h"
+#include "qemu/defer-call.h"
 #include "qemu/iov.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
@@ -34,6 +35,7 @@
 #include "qapi/error.h"
 #include "qapi/qapi-events-net.h"
 #include "hw/qdev-properties.h"
+#include "hw/qdev-properties-system.h"
 #include "qapi/qapi-types-migration.h"
 #include "qapi/qapi-events-migration.h"
 #include "hw/virtio/virtio-access.h"
@@ -47,6 +49,9 @@
 #include "net_rx_pkt.h"
 #include "hw/virtio/vhost.h"
 #include "sysemu/qtest.h"
+#include "sysemu/iothread.h"
+#include "block/aio-wait.h"
+#include "exec/memory.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -54,6 +59,9 @@
 #define VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE 256
 #define VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE 256
 
+/* Maximum number of TX descriptors popped at once */
+#define VIRTIO_NET_TX_BATCH 32
+
 /* for now, only allow larger queue_pairs; with virtio-1, guest can downsize */
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
@@ -133,6 +141,20 @@ static void flush_or_purge_queued_packets(NetClientState *nc)
     assert(!virtio_net_get_subqueue(nc)->async_tx.elem);
 }
 
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
+static void virtio_net_dataplane_pause(VirtIONet *n);
+static void virtio_net_dataplane_resume(VirtIONet *n);
+
 /* TODO
  * - we could suppress RX interrupt if we were so inclined.
  */
@@ -376,7 +398,7 @@ static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(VIRTIO_NET(vdev), vq);
     }
 }
 
@@ -387,6 +409,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     int i;
     uint8_t queue_status;
 
+    virtio_net_dataplane_pause(n);
+
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
@@ -435,6 +459,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+
+    virtio_net_dataplane_resume(n);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -569,7 +595,9 @@ static void virtio_net_queue_reset(VirtIODevice *vdev, uint32_t queue_index)
         vhost_net_virtqueue_reset(vdev, nc, queue_index);
     }
 
+    virtio_net_dataplane_pause(n);
     flush_or_purge_queued_packets(nc);
+    virtio_net_dataplane_resume(n);
 }
 
 static void virtio_net_queue_enable(VirtIODevice *vdev, uint32_t queue_index)
@@ -1282,6 +1310,16 @@ static void virtio_net_disable_rss(VirtIONet *n)
     virtio_net_detach_epbf_rss(n);
 }
 
+static void virtio_net_rss_update_key_table(VirtIONet *n)
+{
+    QEMU_BUILD_BUG_ON(sizeof(n->rss_data.key) < NET_TOEPLITZ_MAX_INPUT + 4);
+
+    if (!n->rss_data.key_table) {
+        n->rss_data.key_table = g_new(NetToeplitzTable, 1);
+    }
+    net_toeplitz_table_init(n->rss_data.key_table, n->rss_data.key);
+}
+
 static bool virtio_net_attach_ebpf_to_backend(NICState *nic, int prog_fd)
 {
     NetClientState *nc = qemu_get_peer(qemu_get_queue(nic), 0);
@@ -1495,6 +1533,7 @@ static uint16_t virtio_net_handle_rss(VirtIONet *n,
         err_value = (uint32_t)s;
         goto error;
     }
+    virtio_net_rss_update_key_table(n);
     n->rss_data.enabled = true;
 
     if (!n->rss_data.populate_hash) {
@@ -1623,8 +1662,12 @@ size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
 
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
+    VirtIONet *n = VIRTIO_NET(vdev);
     VirtQueueElement *elem;
 
+    /* Control commands change filters and queues used by the datapath */
+    virtio_net_dataplane_pause(n);
+
     for (;;) {
         size_t written;
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
@@ -1644,6 +1687,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             break;
         }
     }
+
+    virtio_net_dataplane_resume(n);
 }
 
 /* RX */
@@ -1914,7 +1959,8 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
         return n->rss_data.redirect ? n->rss_data.default_queue : -1;
     }
 
-    hash = net_rx_pkt_calc_rss_hash(pkt, net_hash_type, n->rss_data.key);
+    hash = net_rx_pkt_calc_rss_hash_table(pkt, net_hash_type,
+                                          n->rss_data.key_table);
 
     if (n->rss_data.populate_hash) {
         virtio_set_packet_hash(buf, reports[net_hash_type], hash);
@@ -2058,7 +2104,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    virtio_net_notify(n, q->rx_vq);
 
     return size;
 
@@ -2689,11 +2735,10 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
     int ret;
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
     g_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
@@ -2718,11 +2763,43 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+static void virtio_net_tx_push_batch(VirtIONetQueue *q,
+                                     VirtQueueElement **elems,
+                                     unsigned int count)
+{
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+
+    virtqueue_push_batch(q->tx_vq, elems, NULL, count);
+    virtio_net_notify(q->n, q->tx_vq);
+    for (i = 0; i < count; i++) {
+        g_free(elems[i]);
+    }
+}
+
+static void virtio_net_tx_detach_batch(VirtIONetQueue *q,
+                                       VirtQueueElement **elems,
+                                       unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        virtqueue_detach_element(q->tx_vq, elems[i], 0);
+        g_free(elems[i]);
+    }
+}
+
+static int32_t virtio_net_do_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    VirtQueueElement *done[VIRTIO_NET_TX_BATCH];
     VirtQueueElement *elem;
+    unsigned int count, ndone, i, j;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -2735,82 +2812,124 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
     }
 
     for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_v1_hash vhdr;
-
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+        count = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                    (void **)elems,
+                                    MIN(VIRTIO_NET_TX_BATCH,
+                                        n->tx_burst - num_packets));
+        if (!count) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            virtio_error(vdev, "virtio-net header not in first element");
-            virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
-            return -EINVAL;
-        }
-
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &vhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                virtio_error(vdev, "virtio-net header incorrect");
-                virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
-                return -EINVAL;
+        ndone = 0;
+        for (i = 0; i < count; i++) {
+            ssize_t ret;
+            unsigned int out_num;
+            struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1];
+            struct iovec *out_sg;
+            struct virtio_net_hdr_v1_hash vhdr;
+            bool borrow = true;
+
+            elem = elems[i];
+            out_num = elem->out_num;
+            out_sg = elem->out_sg;
+            if (out_num < 1) {
+                virtio_error(vdev, "virtio-net header not in first element");
+                goto err;
             }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &vhdr);
-                sg2[0].iov_base = &vhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
+
+            if (n->has_vnet_hdr) {
+                if (iov_to_buf(out_sg, out_num, 0, &vhdr, n->guest_hdr_len) <
+                    n->guest_hdr_len) {
+                    virtio_error(vdev, "virtio-net header incorrect");
+                    goto err;
                 }
-                out_num += 1;
-                out_sg = sg2;
-            }
-        }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                if (n->needs_vnet_hdr_swap) {
+                    virtio_net_hdr_swap(vdev, (void *) &vhdr);
+                    sg2[0].iov_base = &vhdr;
+                    sg2[0].iov_len = n->guest_hdr_len;
+                    out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
                                        out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
+                                       n->guest_hdr_len, -1);
+                    if (out_num == VIRTQUEUE_MAX_SIZE) {
+                        goto drop;
+                    }
+                    out_num += 1;
+                    out_sg = sg2;
+                    /* vhdr lives on the stack, the queue must copy it */
+                    borrow = false;
+                }
+            }
+            /*
+             * If host wants to see the guest header as is, we can
+             * pass it on unchanged. Otherwise, copy just the parts
+             * that host is interested in.
+             */
+            assert(n->host_hdr_len <= n->guest_hdr_len);
+            if (n->host_hdr_len != n->guest_hdr_len) {
+                unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                           out_sg, out_num,
+                                           0, n->host_hdr_len);
+                sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                                 out_sg, out_num,
+                                 n->guest_hdr_len, -1);
+                out_num = sg_num;
+                out_sg = sg;
+            }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            return -EBUSY;
-        }
+            /*
+             * The element stays mapped until virtio_net_tx_complete(), so a
+             * queued packet can point into guest memory.
+             */
+            if (borrow) {
+                ret = qemu_sendv_packet_async_borrow(
+                    qemu_get_subqueue(n->nic, queue_index),
+                    out_sg, out_num, virtio_net_tx_complete);
+            } else {
+                ret = qemu_sendv_packet_async(
+                    qemu_get_subqueue(n->nic, queue_index),
+                    out_sg, out_num, virtio_net_tx_complete);
+            }
+            if (ret == 0) {
+                virtio_queue_set_notification(q->tx_vq, 0);
+                q->async_tx.elem = elem;
+
+                /* Give back the rest of the batch, last element first */
+                for (j = count - 1; j > i; j--) {
+                    virtqueue_unpop(q->tx_vq, elems[j], 0);
+                    g_free(elems[j]);
+                }
+                virtio_net_tx_push_batch(q, done, ndone);
+                return -EBUSY;
+            }
 
 drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+            done[ndone++] = elem;
+            num_packets++;
+        }
 
-        if (++num_packets >= n->tx_burst) {
+        virtio_net_tx_push_batch(q, done, ndone);
+        if (num_packets >= n->tx_burst) {
             break;
         }
     }
     return num_packets;
+
+err:
+    virtio_net_tx_detach_batch(q, done, ndone);
+    virtio_net_tx_detach_batch(q, elems + i, count - i);
+    return -EINVAL;
+}
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    int32_t ret;
+
+    /* Let the backend submit the whole burst at once */
+    defer_call_begin();
+    ret = virtio_net_do_flush_tx(q);
+    defer_call_end();
+
+    return ret;
 }
 
 static void virtio_net_tx_timer(void *opaque);
@@ -3060,6 +3179,349 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
     virtio_net_set_queue_pairs(n);
 }
 
+/* Context: BQL held, queue pair not being processed */
+static void virtio_net_tx_set_aio_context(VirtIONetQueue *q, AioContext *ctx)
+{
+    DeviceState *dev = DEVICE(q->n);
+
+    if (q->tx_timer) {
+        timer_free(q->tx_timer);
+        q->tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                    virtio_net_tx_timer, q);
+    } else {
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = aio_bh_new_guarded(ctx, virtio_net_tx_bh, q,
+                                      &dev->mem_reentrancy_guard);
+    }
+}
+
+/*
+ * Hand each queue pair, together with the peer polling it, over to the
+ * IOThread it is mapped to.
+ *
+ * Context: BQL held
+ */
+static void virtio_net_dataplane_attach(VirtIONet *n)
+{
+    int max_queue_pairs = n->multiqueue ? n->max_queue_pairs : 1;
+    int i;
+
+    for (i = 0; i < max_queue_pairs; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+        AioContext *ctx = n->vq_aio_context[i];
+
+        virtio_net_tx_set_aio_context(q, ctx);
+        if (q->tx_waiting) {
+            if (q->tx_timer) {
+                timer_mod(q->tx_timer,
+                          qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                          n->tx_timeout);
+            } else {
+                qemu_bh_schedule(q->tx_bh);
+            }
+        }
+
+        qemu_set_aio_context(nc->peer, ctx);
+
+        /* The rx handler leaves buffers in the ring, so do not poll it */
+        virtio_queue_aio_attach_host_notifier_no_poll(q->rx_vq, ctx);
+        virtio_queue_aio_attach_host_notifier(q->tx_vq, ctx);
+    }
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_dataplane_detach_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    AioContext *ctx = qemu_get_current_aio_context();
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+
+    virtio_queue_aio_detach_host_notifier(q->rx_vq, ctx);
+    virtio_queue_aio_detach_host_notifier(q->tx_vq, ctx);
+
+    /* tx_waiting stays set, virtio_net_dataplane_attach() reschedules */
+    if (q->tx_timer) {
+        timer_del(q->tx_timer);
+    } else {
+        qemu_bh_cancel(q->tx_bh);
+    }
+
+    qemu_set_aio_context(nc->peer, NULL);
+}
+
+/*
+ * Bring all queue pairs back into the main loop.  On return no IOThread
+ * touches the datapath anymore.
+ *
+ * Context: BQL held
+ */
+static void virtio_net_dataplane_detach(VirtIONet *n)
+{
+    int max_queue_pairs = n->multiqueue ? n->max_queue_pairs : 1;
+    int i;
+
+    for (i = 0; i < max_queue_pairs; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_wait_bh_oneshot(n->vq_aio_context[i],
+                            virtio_net_dataplane_detach_bh, q);
+        virtio_net_tx_set_aio_context(q, qemu_get_aio_context());
+    }
+}
+
+/*
+ * Temporarily move the datapath into the main loop so that device state it
+ * reads can be changed safely.  Calls nest.
+ *
+ * Context: BQL held
+ */
+static void virtio_net_dataplane_pause(VirtIONet *n)
+{
+    if (!n->dataplane_started || n->dataplane_paused++) {
+        return;
+    }
+
+    virtio_net_dataplane_detach(n);
+}
+
+/* Context: BQL held */
+static void virtio_net_dataplane_resume(VirtIONet *n)
+{
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    assert(n->dataplane_paused > 0);
+    if (--n->dataplane_paused == 0) {
+        virtio_net_dataplane_attach(n);
+    }
+}
+
+/* Context: BQL held */
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    EventNotifier *ctrl_notifier;
+    int nvqs, i, r;
+
+    if (!n->vq_aio_context) {
+        return virtio_device_start_ioeventfd_impl(vdev);
+    }
+
+    if (n->dataplane_started) {
+        return 0;
+    }
+
+    nvqs = virtio_get_num_queues(vdev);
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -accel kvm is set.", r);
+        return -ENOSYS;
+    }
+
+    /*
+     * Batch all the host notifiers in a single transaction to avoid
+     * quadratic time complexity in address_space_update_ioeventfds().
+     */
+    memory_region_transaction_begin();
+
+    for (i = 0; i < nvqs; i++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (r != 0) {
+            int j = i;
+
+            error_report("virtio-net failed to set host notifier (%d)", r);
+            while (i--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+            }
+
+            /*
+             * The transaction expects the ioeventfds to be open when it
+             * commits. Do it now, before the cleanup loop.
+             */
+            memory_region_transaction_commit();
+
+            while (j--) {
+                virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), j);
+            }
+            k->set_guest_notifiers(qbus->parent, nvqs, false);
+            return -ENOSYS;
+        }
+    }
+
+    memory_region_transaction_commit();
+
+    /* The control virtqueue is always processed in the main loop */
+    ctrl_notifier = virtio_queue_get_host_notifier(n->ctrl_vq);
+    event_notifier_set_handler(ctrl_notifier, virtio_queue_host_notifier_read);
+    event_notifier_set(ctrl_notifier);
+
+    n->dataplane_started = true;
+    smp_wmb(); /* paired with aio_notify_accept() on the read side */
+
+    virtio_net_dataplane_attach(n);
+    return 0;
+}
+
+/* Context: BQL held */
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs, i;
+
+    if (!n->vq_aio_context) {
+        virtio_device_stop_ioeventfd_impl(vdev);
+        return;
+    }
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    assert(!n->dataplane_paused);
+    virtio_net_dataplane_detach(n);
+    event_notifier_set_handler(virtio_queue_get_host_notifier(n->ctrl_vq),
+                               NULL);
+
+    nvqs = virtio_get_num_queues(vdev);
+
+    /*
+     * Batch all the host notifiers in a single transaction to avoid
+     * quadratic time complexity in address_space_update_ioeventfds().
+     */
+    memory_region_transaction_begin();
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+    }
+
+    /*
+     * The transaction expects the ioeventfds to be open when it
+     * commits. Do it now, before the cleanup loop.
+     */
+    memory_region_transaction_commit();
+
+    /* This also processes kicks that arrived after detaching */
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+    }
+
+    n->dataplane_started = false;
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+}
+
+/* Context: BQL held */
+static bool virtio_net_vq_aio_context_init(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    if (!n->iothread_vq_mapping_list) {
+        return true;
+    }
+
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp,
+                   "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return false;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothread");
+        return false;
+    }
+
+    /* These keep per-device datapath state that is shared by all queues */
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS) ||
+        virtio_has_feature(n->host_features, VIRTIO_NET_F_HASH_REPORT) ||
+        virtio_has_feature(n->host_features, VIRTIO_NET_F_RSC_EXT)) {
+        error_setg(errp, "iothread-vq-mapping cannot be used together with "
+                   "rss, hash or guest_rsc_ext");
+        return false;
+    }
+
+    for (i = 0; i < n->max_ncs; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (!peer) {
+            continue;
+        }
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "iothread-vq-mapping cannot be used with vhost "
+                       "(netdev '%s')", peer->name);
+            return false;
+        }
+        if (!qemu_can_set_aio_context(peer)) {
+            error_setg(errp, "netdev '%s' does not support iothread-vq-mapping",
+                       peer->name);
+            return false;
+        }
+        /* Filters run in the main loop, see netfilter_complete() */
+        if (!QTAILQ_EMPTY(&peer->filters)) {
+            error_setg(errp, "iothread-vq-mapping cannot be used with filters "
+                       "(netdev '%s')", peer->name);
+            return false;
+        }
+    }
+
+    n->vq_aio_context = g_new(AioContext *, n->max_queue_pairs);
+    if (!iothread_vq_mapping_apply(n->iothread_vq_mapping_list,
+                                   n->vq_aio_context,
+                                   n->max_queue_pairs,
+                                   errp)) {
+        g_free(n->vq_aio_context);
+        n->vq_aio_context = NULL;
+        return false;
+    }
+
+    for (i = 0; i < n->max_ncs; i++) {
+        if (n->nic_conf.peers.ncs[i]) {
+            n->nic_conf.peers.ncs[i]->aio_context_mapped = true;
+        }
+    }
+
+    /* There is no vhost backend to mask guest notifiers for us */
+    vdev->use_guest_notifier_mask = false;
+    return true;
+}
+
+/* Context: BQL held */
+static void virtio_net_vq_aio_context_cleanup(VirtIONet *n)
+{
+    int i;
+
+    assert(!n->dataplane_started);
+
+    if (n->iothread_vq_mapping_list) {
+        iothread_vq_mapping_cleanup(n->iothread_vq_mapping_list);
+    }
+
+    /* The netdevs outlive the NIC and may get filters now */
+    if (n->vq_aio_context) {
+        for (i = 0; i < n->max_ncs; i++) {
+            if (n->nic_conf.peers.ncs[i]) {
+                n->nic_conf.peers.ncs[i]->aio_context_mapped = false;
+            }
+        }
+    }
+
+    g_free(n->vq_aio_context);
+    n->vq_aio_context = NULL;
+}
+
 static int virtio_net_post_load_device(void *opaque, int version_id)
 {
     VirtIONet *n = opaque;
@@ -3121,6 +3583,7 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
     }
 
     if (n->rss_data.enabled) {
+        virtio_net_rss_update_key_table(n);
         n->rss_data.enabled_software_rss = n->rss_data.populate_hash;
         if (!n->rss_data.populate_hash) {
             if (!virtio_net_attach_epbf_rss(n)) {
@@ -3731,6 +4194,12 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+
+    if (!virtio_net_vq_aio_context_init(n, errp)) {
+        virtio_cleanup(vdev);
+        return;
+    }
+
     n->vqs = g_new0(VirtIONetQueue, n->max_queue_pairs);
     n->curr_queue_pairs = 1;
     n->tx_timeout = n->net_conf.txtimer;
@@ -3853,9 +4322,12 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     virtio_del_queue(vdev, max_queue_pairs * 2);
     qemu_announce_timer_del(&n->announce_timer, false);
     g_free(n->vqs);
+    /* Before qemu_del_nic(), which may free the peers */
+    virtio_net_vq_aio_context_cleanup(n);
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
     g_free(n->rss_data.indirections_table);
+    g_free(n->rss_data.key_table);
     net_rx_pkt_uninit(n->rx_pkt);
     virtio_cleanup(vdev);
 }
@@ -4001,6 +4473,11 @@ static Property virtio_net_properties[] = {
                       VIRTIO_NET_F_GUEST_USO6, true),
     DEFINE_PROP_BIT64("host_uso", VirtIONet, host_features,
                       VIRTIO_NET_F_HOST_USO, true),
+    DEFINE_PROP_BIT64("in_order", VirtIONet, host_features,
+                      VIRTIO_F_IN_ORDER, false),
+    DEFINE_VIRTIO_IRQ_COALESCE_PROPERTIES(VirtIONet, parent_obj.irq_coalesce),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", VirtIONet,
+                                         iothread_vq_mapping_list),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -4023,6 +4500,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     vdc->queue_reset = virtio_net_queue_reset;
     vdc->queue_enable = virtio_net_queue_enable;
     vdc->set_status = virtio_net_set_status;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
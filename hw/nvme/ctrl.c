@@ -201,6 +201,8 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/block-backend.h"
 #include "sysemu/hostmem.h"
+#include "sysemu/iothread.h"
+#include "block/aio-wait.h"
 #include "hw/pci/msix.h"
 #include "hw/pci/pcie_sriov.h"
 #include "migration/vmstate.h"
@@ -311,6 +313,7 @@ static const uint32_t nvme_cse_iocs_zoned[256] = {
 };
 
 static void nvme_process_sq(void *opaque);
+static void nvme_update_sq_eventidx(const NvmeSQueue *sq);
 static void nvme_ctrl_reset(NvmeCtrl *n, NvmeResetType rst);
 static inline uint64_t nvme_get_timestamp(const NvmeCtrl *n);
 
@@ -1522,6 +1525,11 @@ static void nvme_post_cqes(void *opaque)
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
     if (cq->tail != cq->head) {
+        if (cq->irq_bh) {
+            qemu_bh_schedule(cq->irq_bh);
+            return;
+        }
+
         if (cq->irq_enabled && !pending) {
             n->cq_pending++;
         }
@@ -1530,6 +1538,19 @@ static void nvme_post_cqes(void *opaque)
     }
 }
 
+/*
+ * msix_notify() may need the BQL, which must not be taken from an IOThread
+ * while the main loop waits for it in aio_wait_bh_oneshot(). Completion queues
+ * that live in an IOThread therefore inject their interrupt from the main loop.
+ * Only MSI-X is supported there, so there is no cq_pending accounting to do.
+ */
+static void nvme_cq_irq_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    nvme_irq_assert(cq->ctrl, cq);
+}
+
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
 {
     assert(cq->cqid == req->sq->cqid);
@@ -4497,7 +4518,7 @@ static void nvme_cq_notifier(EventNotifier *e)
 
     nvme_update_cq_head(cq);
 
-    if (cq->tail == cq->head) {
+    if (cq->tail == cq->head && !cq->irq_bh) {
         if (cq->irq_enabled) {
             n->cq_pending--;
         }
@@ -4508,6 +4529,17 @@ static void nvme_cq_notifier(EventNotifier *e)
     qemu_bh_schedule(cq->bh);
 }
 
+static void nvme_cq_set_notifier_handler(NvmeCQueue *cq, bool attach)
+{
+    if (cq->ctx == qemu_get_aio_context()) {
+        event_notifier_set_handler(&cq->notifier,
+                                   attach ? nvme_cq_notifier : NULL);
+    } else {
+        aio_set_event_notifier(cq->ctx, &cq->notifier,
+                               attach ? nvme_cq_notifier : NULL, NULL, NULL);
+    }
+}
+
 static int nvme_init_cq_ioeventfd(NvmeCQueue *cq)
 {
     NvmeCtrl *n = cq->ctrl;
@@ -4519,7 +4551,7 @@ static int nvme_init_cq_ioeventfd(NvmeCQueue *cq)
         return ret;
     }
 
-    event_notifier_set_handler(&cq->notifier, nvme_cq_notifier);
+    nvme_cq_set_notifier_handler(cq, true);
     memory_region_add_eventfd(&n->iomem,
                               0x1000 + offset, 4, false, 0, &cq->notifier);
 
@@ -4537,6 +4569,73 @@ static void nvme_sq_notifier(EventNotifier *e)
     nvme_process_sq(sq);
 }
 
+/*
+ * Submission queues in an IOThread poll the shadow doorbell while the event
+ * loop is polling. In the meantime the event index is kept one entry behind
+ * the tail so that the host never has to ring the MMIO doorbell.
+ */
+static bool nvme_sq_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+    uint32_t tail;
+
+    /* commands may be left over from running out of requests */
+    if (!nvme_sq_empty(sq) && !QTAILQ_EMPTY(&sq->req_list)) {
+        return true;
+    }
+
+    ldl_le_pci_dma(PCI_DEVICE(sq->ctrl), sq->db_addr, &tail,
+                   MEMTXATTRS_UNSPECIFIED);
+
+    return tail != sq->tail;
+}
+
+static void nvme_sq_poll_ready(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    nvme_process_sq(sq);
+}
+
+static void nvme_sq_poll_begin(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    sq->polling = true;
+    nvme_update_sq_eventidx(sq);
+}
+
+static void nvme_sq_poll_end(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    sq->polling = false;
+    nvme_update_sq_eventidx(sq);
+
+    /*
+     * The event loop polls once more after this. Make sure the event index is
+     * visible to the host before the shadow doorbell is read again, otherwise
+     * a submission may be missed without the host ringing the doorbell.
+     */
+    smp_mb();
+}
+
+static void nvme_sq_set_notifier_handler(NvmeSQueue *sq, bool attach)
+{
+    if (sq->ctx == qemu_get_aio_context()) {
+        event_notifier_set_handler(&sq->notifier,
+                                   attach ? nvme_sq_notifier : NULL);
+    } else if (attach) {
+        aio_set_event_notifier(sq->ctx, &sq->notifier, nvme_sq_notifier,
+                               nvme_sq_poll, nvme_sq_poll_ready);
+        aio_set_event_notifier_poll(sq->ctx, &sq->notifier,
+                                    nvme_sq_poll_begin, nvme_sq_poll_end);
+    } else {
+        aio_set_event_notifier(sq->ctx, &sq->notifier, NULL, NULL, NULL);
+    }
+}
+
 static int nvme_init_sq_ioeventfd(NvmeSQueue *sq)
 {
     NvmeCtrl *n = sq->ctrl;
@@ -4548,23 +4647,51 @@ static int nvme_init_sq_ioeventfd(NvmeSQueue *sq)
         return ret;
     }
 
-    event_notifier_set_handler(&sq->notifier, nvme_sq_notifier);
+    nvme_sq_set_notifier_handler(sq, true);
     memory_region_add_eventfd(&n->iomem,
                               0x1000 + offset, 4, false, 0, &sq->notifier);
 
     return 0;
 }
 
+/*
+ * Queues that live in an IOThread are only ever touched from that IOThread,
+ * the main loop synchronously hands over queue teardown to it.
+ */
+static void nvme_run_in_aio_context(AioContext *ctx, QEMUBHFunc *fn,
+                                    void *opaque)
+{
+    if (ctx == qemu_get_current_aio_context()) {
+        fn(opaque);
+    } else {
+        aio_wait_bh_oneshot(ctx, fn, opaque);
+    }
+}
+
+/* Runs in the AioContext of the submission queue */
+static void nvme_sq_stop_bh(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+
+    if (sq->ioeventfd_enabled) {
+        nvme_sq_set_notifier_handler(sq, false);
+    }
+
+    qemu_bh_delete(sq->bh);
+    sq->bh = NULL;
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     uint16_t offset = sq->sqid << 3;
 
     n->sq[sq->sqid] = NULL;
-    qemu_bh_delete(sq->bh);
+    if (sq->bh) {
+        nvme_run_in_aio_context(sq->ctx, nvme_sq_stop_bh, sq);
+    }
     if (sq->ioeventfd_enabled) {
         memory_region_del_eventfd(&n->iomem,
                                   0x1000 + offset, 4, false, 0, &sq->notifier);
-        event_notifier_set_handler(&sq->notifier, NULL);
         event_notifier_cleanup(&sq->notifier);
     }
     g_free(sq->io_req);
@@ -4573,29 +4700,23 @@ static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
     }
 }
 
-static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
+/* Runs in the AioContext of the submission queue */
+static void nvme_del_sq_bh(void *opaque)
 {
-    NvmeDeleteQ *c = (NvmeDeleteQ *)&req->cmd;
+    NvmeSQueue *sq = opaque;
+    NvmeCtrl *n = sq->ctrl;
     NvmeRequest *r, *next;
-    NvmeSQueue *sq;
     NvmeCQueue *cq;
-    uint16_t qid = le16_to_cpu(c->qid);
-
-    if (unlikely(!qid || nvme_check_sqid(n, qid))) {
-        trace_pci_nvme_err_invalid_del_sq(qid);
-        return NVME_INVALID_QID | NVME_DNR;
-    }
 
-    trace_pci_nvme_del_sq(qid);
+    /* stop processing new commands before cancelling the outstanding ones */
+    nvme_sq_stop_bh(sq);
 
-    sq = n->sq[qid];
-    while (!QTAILQ_EMPTY(&sq->out_req_list)) {
-        r = QTAILQ_FIRST(&sq->out_req_list);
+    QTAILQ_FOREACH_SAFE(r, &sq->out_req_list, entry, next) {
         assert(r->aiocb);
-        blk_aio_cancel(r->aiocb);
+        blk_aio_cancel_async(r->aiocb);
     }
 
-    assert(QTAILQ_EMPTY(&sq->out_req_list));
+    AIO_WAIT_WHILE_UNLOCKED(sq->ctx, !QTAILQ_EMPTY(&sq->out_req_list));
 
     if (!nvme_check_cqid(n, sq->cqid)) {
         cq = n->cq[sq->cqid];
@@ -4609,7 +4730,23 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
             }
         }
     }
+}
+
+static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
+{
+    NvmeDeleteQ *c = (NvmeDeleteQ *)&req->cmd;
+    NvmeSQueue *sq;
+    uint16_t qid = le16_to_cpu(c->qid);
+
+    if (unlikely(!qid || nvme_check_sqid(n, qid))) {
+        trace_pci_nvme_err_invalid_del_sq(qid);
+        return NVME_INVALID_QID | NVME_DNR;
+    }
 
+    trace_pci_nvme_del_sq(qid);
+
+    sq = n->sq[qid];
+    nvme_run_in_aio_context(sq->ctx, nvme_del_sq_bh, sq);
     nvme_free_sq(sq, n);
     return NVME_SUCCESS;
 }
@@ -4635,8 +4772,21 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
 
-    sq->bh = qemu_bh_new_guarded(nvme_process_sq, sq,
-                                 &DEVICE(sq->ctrl)->mem_reentrancy_guard);
+    assert(n->cq[cqid]);
+    cq = n->cq[cqid];
+    sq->ctx = cq->ctx;
+
+    if (sq->ctx == qemu_get_aio_context()) {
+        sq->bh = qemu_bh_new_guarded(nvme_process_sq, sq,
+                                     &DEVICE(sq->ctrl)->mem_reentrancy_guard);
+    } else {
+        /*
+         * The reentrancy guard is per device and would block MMIO from vCPUs
+         * while the bottom half runs. Instead, nvme_mmio_write() refuses
+         * accesses from IOThreads.
+         */
+        sq->bh = aio_bh_new(sq->ctx, nvme_process_sq, sq);
+    }
 
     if (n->dbbuf_enabled) {
         sq->db_addr = n->dbbuf_dbs + (sqid << 3);
@@ -4649,8 +4799,6 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         }
     }
 
-    assert(n->cq[cqid]);
-    cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
 }
@@ -5209,17 +5357,35 @@ static uint16_t nvme_get_log(NvmeCtrl *n, NvmeRequest *req)
     }
 }
 
+/* Runs in the AioContext of the completion queue */
+static void nvme_cq_stop_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    if (cq->ioeventfd_enabled) {
+        nvme_cq_set_notifier_handler(cq, false);
+    }
+
+    qemu_bh_delete(cq->bh);
+    cq->bh = NULL;
+}
+
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     PCIDevice *pci = PCI_DEVICE(n);
     uint16_t offset = (cq->cqid << 3) + (1 << 2);
 
     n->cq[cq->cqid] = NULL;
-    qemu_bh_delete(cq->bh);
+    if (cq->bh) {
+        nvme_run_in_aio_context(cq->ctx, nvme_cq_stop_bh, cq);
+    }
+    if (cq->irq_bh) {
+        qemu_bh_delete(cq->irq_bh);
+        cq->irq_bh = NULL;
+    }
     if (cq->ioeventfd_enabled) {
         memory_region_del_eventfd(&n->iomem,
                                   0x1000 + offset, 4, false, 0, &cq->notifier);
-        event_notifier_set_handler(&cq->notifier, NULL);
         event_notifier_cleanup(&cq->notifier);
     }
     if (msix_enabled(pci)) {
@@ -5247,16 +5413,58 @@ static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeRequest *req)
         return NVME_INVALID_QUEUE_DEL;
     }
 
-    if (cq->irq_enabled && cq->tail != cq->head) {
-        n->cq_pending--;
+    if (!cq->irq_bh) {
+        if (cq->irq_enabled && cq->tail != cq->head) {
+            n->cq_pending--;
+        }
+
+        nvme_irq_deassert(n, cq);
     }
 
-    nvme_irq_deassert(n, cq);
     trace_pci_nvme_del_cq(qid);
     nvme_free_cq(cq, n);
     return NVME_SUCCESS;
 }
 
+/*
+ * Zone and reclaim unit state is shared by all queues without any locking, so
+ * namespaces using them keep all I/O queues of the controller in the main loop.
+ */
+static bool nvme_ns_needs_main_loop(NvmeNamespace *ns)
+{
+    return ns->params.zoned || (ns->endgrp && ns->endgrp->fdp.enabled);
+}
+
+static bool nvme_has_iothread_queues(NvmeCtrl *n)
+{
+    for (int i = 1; i <= n->params.max_ioqpairs; i++) {
+        if (n->cq[i] && n->cq[i]->ctx != qemu_get_aio_context()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static AioContext *nvme_ioq_aio_context(NvmeCtrl *n, uint16_t cqid)
+{
+    NvmeNamespace *ns;
+
+    /* interrupts are injected from the main loop, see nvme_cq_irq_bh() */
+    if (!n->ioq_aio_context || !msix_enabled(PCI_DEVICE(n))) {
+        return qemu_get_aio_context();
+    }
+
+    for (int i = 1; i <= NVME_MAX_NAMESPACES; i++) {
+        ns = nvme_ns(n, i);
+        if (ns && nvme_ns_needs_main_loop(ns)) {
+            return qemu_get_aio_context();
+        }
+    }
+
+    return n->ioq_aio_context[cqid - 1];
+}
+
 static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
                          uint16_t cqid, uint16_t vector, uint16_t size,
                          uint16_t irq_enabled)
@@ -5276,19 +5484,33 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->head = cq->tail = 0;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
+    cq->ctx = qemu_get_aio_context();
     if (n->dbbuf_enabled) {
         cq->db_addr = n->dbbuf_dbs + (cqid << 3) + (1 << 2);
         cq->ei_addr = n->dbbuf_eis + (cqid << 3) + (1 << 2);
 
         if (n->params.ioeventfd && cqid != 0) {
+            /*
+             * Only queues whose doorbells never trap into the main loop can
+             * be moved to an IOThread.
+             */
+            cq->ctx = nvme_ioq_aio_context(n, cqid);
             if (!nvme_init_cq_ioeventfd(cq)) {
                 cq->ioeventfd_enabled = true;
+            } else {
+                cq->ctx = qemu_get_aio_context();
             }
         }
     }
     n->cq[cqid] = cq;
-    cq->bh = qemu_bh_new_guarded(nvme_post_cqes, cq,
-                                 &DEVICE(cq->ctrl)->mem_reentrancy_guard);
+    if (cq->ctx == qemu_get_aio_context()) {
+        cq->bh = qemu_bh_new_guarded(nvme_post_cqes, cq,
+                                     &DEVICE(cq->ctrl)->mem_reentrancy_guard);
+    } else {
+        cq->bh = aio_bh_new(cq->ctx, nvme_post_cqes, cq);
+        cq->irq_bh = qemu_bh_new_guarded(nvme_cq_irq_bh, cq,
+                                         &DEVICE(n)->mem_reentrancy_guard);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeRequest *req)
@@ -6417,6 +6639,10 @@ static uint16_t nvme_ns_attachment(NvmeCtrl *n, NvmeRequest *req)
                 return NVME_NS_PRIVATE | NVME_DNR;
             }
 
+            if (nvme_ns_needs_main_loop(ns) && nvme_has_iothread_queues(ctrl)) {
+                return NVME_INVALID_FIELD | NVME_DNR;
+            }
+
             nvme_attach_ns(ctrl, ns);
             nvme_select_iocs_ns(ctrl, ns);
 
@@ -6816,9 +7042,38 @@ static uint16_t nvme_virt_mngmt(NvmeCtrl *n, NvmeRequest *req)
     }
 }
 
+/* Runs in the AioContext of the submission queue */
+static void nvme_sq_dbbuf_config_bh(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+    NvmeCtrl *n = sq->ctrl;
+
+    /*
+     * CAP.DSTRD is 0, so offset of ith sq db_addr is (i<<3)
+     * nvme_process_db() uses this hard-coded way to calculate
+     * doorbell offsets. Be consistent with that here.
+     */
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    stl_le_pci_dma(PCI_DEVICE(n), sq->db_addr, sq->tail,
+                   MEMTXATTRS_UNSPECIFIED);
+}
+
+/* Runs in the AioContext of the completion queue */
+static void nvme_cq_dbbuf_config_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    NvmeCtrl *n = cq->ctrl;
+
+    /* CAP.DSTRD is 0, so offset of ith cq db_addr is (i<<3)+(1<<2) */
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    stl_le_pci_dma(PCI_DEVICE(n), cq->db_addr, cq->head,
+                   MEMTXATTRS_UNSPECIFIED);
+}
+
 static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeRequest *req)
 {
-    PCIDevice *pci = PCI_DEVICE(n);
     uint64_t dbs_addr = le64_to_cpu(req->cmd.dptr.prp1);
     uint64_t eis_addr = le64_to_cpu(req->cmd.dptr.prp2);
     int i;
@@ -6838,16 +7093,10 @@ static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeRequest *req)
         NvmeCQueue *cq = n->cq[i];
 
         if (sq) {
-            /*
-             * CAP.DSTRD is 0, so offset of ith sq db_addr is (i<<3)
-             * nvme_process_db() uses this hard-coded way to calculate
-             * doorbell offsets. Be consistent with that here.
-             */
-            sq->db_addr = dbs_addr + (i << 3);
-            sq->ei_addr = eis_addr + (i << 3);
-            stl_le_pci_dma(pci, sq->db_addr, sq->tail, MEMTXATTRS_UNSPECIFIED);
+            nvme_run_in_aio_context(sq->ctx, nvme_sq_dbbuf_config_bh, sq);
 
-            if (n->params.ioeventfd && sq->sqid != 0) {
+            if (n->params.ioeventfd && sq->sqid != 0 &&
+                !sq->ioeventfd_enabled) {
                 if (!nvme_init_sq_ioeventfd(sq)) {
                     sq->ioeventfd_enabled = true;
                 }
@@ -6855,12 +7104,10 @@ static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeRequest *req)
         }
 
         if (cq) {
-            /* CAP.DSTRD is 0, so offset of ith cq db_addr is (i<<3)+(1<<2) */
-            cq->db_addr = dbs_addr + (i << 3) + (1 << 2);
-            cq->ei_addr = eis_addr + (i << 3) + (1 << 2);
-            stl_le_pci_dma(pci, cq->db_addr, cq->head, MEMTXATTRS_UNSPECIFIED);
+            nvme_run_in_aio_context(cq->ctx, nvme_cq_dbbuf_config_bh, cq);
 
-            if (n->params.ioeventfd && cq->cqid != 0) {
+            if (n->params.ioeventfd && cq->cqid != 0 &&
+                !cq->ioeventfd_enabled) {
                 if (!nvme_init_cq_ioeventfd(cq)) {
                     cq->ioeventfd_enabled = true;
                 }
@@ -6989,9 +7236,16 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeRequest *req)
 
 static void nvme_update_sq_eventidx(const NvmeSQueue *sq)
 {
-    trace_pci_nvme_update_sq_eventidx(sq->sqid, sq->tail);
+    uint32_t ei = sq->tail;
+
+    /* suppress doorbell writes while the shadow doorbell is polled */
+    if (sq->polling) {
+        ei = (sq->tail + sq->size - 1) % sq->size;
+    }
+
+    trace_pci_nvme_update_sq_eventidx(sq->sqid, ei);
 
-    stl_le_pci_dma(PCI_DEVICE(sq->ctrl), sq->ei_addr, sq->tail,
+    stl_le_pci_dma(PCI_DEVICE(sq->ctrl), sq->ei_addr, ei,
                    MEMTXATTRS_UNSPECIFIED);
 }
 
@@ -7094,6 +7348,13 @@ static void nvme_ctrl_reset(NvmeCtrl *n, NvmeResetType rst)
     NvmeNamespace *ns;
     int i;
 
+    /* IOThreads must not submit new requests while draining */
+    for (i = 1; i < n->params.max_ioqpairs + 1; i++) {
+        if (n->sq[i] != NULL) {
+            nvme_run_in_aio_context(n->sq[i]->ctx, nvme_sq_stop_bh, n->sq[i]);
+        }
+    }
+
     for (i = 1; i <= NVME_MAX_NAMESPACES; i++) {
         ns = nvme_ns(n, i);
         if (!ns) {
@@ -7103,6 +7364,16 @@ static void nvme_ctrl_reset(NvmeCtrl *n, NvmeResetType rst)
         nvme_ns_drain(ns);
     }
 
+    /*
+     * Completion queues hold requests that live in the submission queues, so
+     * their bottom halves must be gone before the submission queues are freed
+     */
+    for (i = 1; i < n->params.max_ioqpairs + 1; i++) {
+        if (n->cq[i] != NULL) {
+            nvme_run_in_aio_context(n->cq[i]->ctx, nvme_cq_stop_bh, n->cq[i]);
+        }
+    }
+
     for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
         if (n->sq[i] != NULL) {
             nvme_free_sq(n->sq[i], n);
@@ -7694,7 +7965,13 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
         trace_pci_nvme_mmio_doorbell_sq(sq->sqid, new_tail);
 
-        sq->tail = new_tail;
+        /*
+         * Queues in an IOThread always have shadow doorbells enabled and the
+         * tail is picked up from there by nvme_process_sq().
+         */
+        if (sq->ctx == qemu_get_aio_context()) {
+            sq->tail = new_tail;
+        }
         if (!qid && n->dbbuf_enabled) {
             /*
              * The spec states "the host shall also update the controller's
@@ -7723,6 +8000,17 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
 
     trace_pci_nvme_mmio_write(addr, data, size);
 
+    /*
+     * I/O queues in IOThreads are not covered by the reentrancy guard, so
+     * refuse DMA from them into our own registers.
+     */
+    if (qemu_in_iothread()) {
+        NVME_GUEST_ERR(pci_nvme_ub_mmiowr_iothread,
+                       "MMIO write from an IOThread, offset=0x%"PRIx64","
+                       " ignoring", addr);
+        return;
+    }
+
     if (pci_is_vf(PCI_DEVICE(n)) && !nvme_sctrl(n)->scs &&
         addr != NVME_REG_CSTS) {
         trace_pci_nvme_err_ignored_mmio_vf_offline(addr, size);
@@ -7836,6 +8124,20 @@ static bool nvme_check_params(NvmeCtrl *n, Error **errp)
         return false;
     }
 
+    if (params->iothread_queue_mapping_list) {
+        if (!params->ioeventfd) {
+            error_setg(errp, "ioeventfd is required for "
+                       "iothread-queue-mapping");
+            return false;
+        }
+
+        if (params->sriov_max_vfs) {
+            error_setg(errp, "iothread-queue-mapping is not supported with "
+                       "SR-IOV");
+            return false;
+        }
+    }
+
     if (params->sriov_max_vfs) {
         if (!n->subsys) {
             error_setg(errp, "subsystem is required for the use of SR-IOV");
@@ -8378,6 +8680,17 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
 
         nvme_attach_ns(n, ns);
     }
+
+    if (n->params.iothread_queue_mapping_list) {
+        n->ioq_aio_context = g_new(AioContext *, n->params.max_ioqpairs);
+        if (!iothread_vq_mapping_apply(n->params.iothread_queue_mapping_list,
+                                       n->ioq_aio_context,
+                                       n->params.max_ioqpairs, errp)) {
+            g_free(n->ioq_aio_context);
+            n->ioq_aio_context = NULL;
+            return;
+        }
+    }
 }
 
 static void nvme_exit(PCIDevice *pci_dev)
@@ -8403,6 +8716,11 @@ static void nvme_exit(PCIDevice *pci_dev)
     g_free(n->sq);
     g_free(n->aer_reqs);
 
+    if (n->ioq_aio_context) {
+        iothread_vq_mapping_cleanup(n->params.iothread_queue_mapping_list);
+        g_free(n->ioq_aio_context);
+    }
+
     if (n->params.cmb_size_mb) {
         g_free(n->cmb.buf);
     }
@@ -8451,6 +8769,8 @@ static Property nvme_props[] = {
                       params.sriov_max_vq_per_vf, 0),
     DEFINE_PROP_BOOL("msix-exclusive-bar", NvmeCtrl, params.msix_exclusive_bar,
                      false),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-queue-mapping", NvmeCtrl,
+                                         params.iothread_queue_mapping_list),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -487,6 +487,8 @@ typedef struct NvmeSQueue {
     QEMUBH      *bh;
     EventNotifier notifier;
     bool        ioeventfd_enabled;
+    AioContext  *ctx;       /* inherited from the completion queue */
+    bool        polling;    /* shadow doorbell is being polled */
     NvmeRequest *io_req;
     QTAILQ_HEAD(, NvmeRequest) req_list;
     QTAILQ_HEAD(, NvmeRequest) out_req_list;
@@ -508,6 +510,8 @@ typedef struct NvmeCQueue {
     QEMUBH      *bh;
     EventNotifier notifier;
     bool        ioeventfd_enabled;
+    AioContext  *ctx;
+    QEMUBH      *irq_bh;    /* main loop interrupt injection, IOThread only */
     QTAILQ_HEAD(, NvmeSQueue) sq_list;
     QTAILQ_HEAD(, NvmeRequest) req_list;
 } NvmeCQueue;
@@ -537,6 +541,7 @@ typedef struct NvmeParams {
     uint8_t  sriov_max_vq_per_vf;
     uint8_t  sriov_max_vi_per_vf;
     bool     msix_exclusive_bar;
+    IOThreadVirtQueueMappingList *iothread_queue_mapping_list;
 } NvmeParams;
 
 typedef struct NvmeCtrl {
@@ -597,6 +602,7 @@ typedef struct NvmeCtrl {
     NvmeNamespace   *namespaces[NVME_MAX_NAMESPACES + 1];
     NvmeSQueue      **sq;
     NvmeCQueue      **cq;
+    AioContext      **ioq_aio_context;  /* indexed by I/O queue id - 1 */
     NvmeSQueue      admin_sq;
     NvmeCQueue      admin_cq;
     NvmeIdCtrl      id_ctrl;
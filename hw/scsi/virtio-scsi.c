@@ -21,6 +21,7 @@
 #include "qemu/defer-call.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
+#include "qemu/lockable.h"
 #include "qemu/module.h"
 #include "sysemu/block-backend.h"
 #include "sysemu/dma.h"
@@ -47,7 +48,10 @@ typedef struct VirtIOSCSIReq {
     /* Used for two-stage request submission and TMFs deferred to BH */
     QTAILQ_ENTRY(VirtIOSCSIReq) next;
 
-    /* Used for cancellation of request during TMFs */
+    /*
+     * Used for cancellation of request during TMFs. Cancellation runs in the
+     * AioContext of each request, so this is accessed atomically.
+     */
     int remaining;
 
     SCSIRequest *sreq;
@@ -131,19 +135,24 @@ static void virtio_scsi_complete_req_bh(void *opaque)
 }
 
 /*
- * Called from virtio_scsi_do_one_tmf_bh() in main loop thread. The main loop
- * thread cannot touch the virtqueue since that could race with an IOThread.
+ * Complete a request from a thread that may not be processing its virtqueue,
+ * like the main loop thread in virtio_scsi_do_one_tmf_bh() or the IOThread
+ * that cancelled the last command of a TMF. Only the AioContext that
+ * processes the virtqueue may touch it, so hand over to that AioContext.
  */
-static void virtio_scsi_complete_req_from_main_loop(VirtIOSCSIReq *req)
+static void virtio_scsi_complete_req_in_vq_ctx(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
+    AioContext *ctx = s->vq_aio_context[virtio_get_queue_index(req->vq)];
 
-    if (!s->ctx || s->ctx == qemu_get_aio_context()) {
-        /* No need to schedule a BH when there is no IOThread */
+    if (ctx == qemu_get_current_aio_context()) {
+        /* No need to schedule a BH when already in the right thread */
         virtio_scsi_complete_req(req);
-    } else {
+    } else if (qemu_in_main_thread()) {
         /* Run request completion in the IOThread */
-        aio_wait_bh_oneshot(s->ctx, virtio_scsi_complete_req_bh, req);
+        aio_wait_bh_oneshot(ctx, virtio_scsi_complete_req_bh, req);
+    } else {
+        aio_bh_schedule_oneshot(ctx, virtio_scsi_complete_req_bh, req);
     }
 }
 
@@ -283,6 +292,10 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
 
     scsi_req_ref(sreq);
     req->sreq = sreq;
+
+    /* Restart and complete the request in the command virtqueue's thread */
+    sreq->ctx = s->vq_aio_context[VIRTIO_SCSI_VQ_NUM_FIXED + n];
+
     if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
         assert(req->sreq->cmd.mode == req->mode);
     }
@@ -294,19 +307,23 @@ typedef struct {
     VirtIOSCSIReq  *tmf_req;
 } VirtIOSCSICancelNotifier;
 
+/* Drop a reference to a TMF and complete it once the last one is gone */
+static void virtio_scsi_tmf_dec_remaining(VirtIOSCSIReq *tmf)
+{
+    if (qatomic_fetch_dec(&tmf->remaining) == 1) {
+        trace_virtio_scsi_tmf_resp(virtio_scsi_get_lun(tmf->req.tmf.lun),
+                                   tmf->req.tmf.tag, tmf->resp.tmf.response);
+        virtio_scsi_complete_req_in_vq_ctx(tmf);
+    }
+}
+
 static void virtio_scsi_cancel_notify(Notifier *notifier, void *data)
 {
     VirtIOSCSICancelNotifier *n = container_of(notifier,
                                                VirtIOSCSICancelNotifier,
                                                notifier);
 
-    if (--n->tmf_req->remaining == 0) {
-        VirtIOSCSIReq *req = n->tmf_req;
-
-        trace_virtio_scsi_tmf_resp(virtio_scsi_get_lun(req->req.tmf.lun),
-                                   req->req.tmf.tag, req->resp.tmf.response);
-        virtio_scsi_complete_req(req);
-    }
+    virtio_scsi_tmf_dec_remaining(n->tmf_req);
     g_free(n);
 }
 
@@ -362,7 +379,7 @@ static void virtio_scsi_do_one_tmf_bh(VirtIOSCSIReq *req)
 
 out:
     object_unref(OBJECT(d));
-    virtio_scsi_complete_req_from_main_loop(req);
+    virtio_scsi_complete_req_in_vq_ctx(req);
 }
 
 /* Some TMFs must be processed from the main loop thread */
@@ -427,13 +444,121 @@ static void virtio_scsi_defer_tmf_to_bh(VirtIOSCSIReq *req)
     }
 }
 
+/* Does SCSI request @r fall under the task(s) addressed by @tmf? */
+static bool virtio_scsi_tmf_match(VirtIOSCSIReq *tmf, SCSIRequest *r)
+{
+    VirtIOSCSIReq *cmd_req = r->hba_private;
+
+    if (!cmd_req) {
+        return false; /* already completed */
+    }
+
+    switch (tmf->req.tmf.subtype) {
+    case VIRTIO_SCSI_T_TMF_ABORT_TASK:
+    case VIRTIO_SCSI_T_TMF_QUERY_TASK:
+        return cmd_req->req.cmd.tag == tmf->req.tmf.tag;
+    default:
+        return true;
+    }
+}
+
+typedef struct {
+    VirtIOSCSIReq *tmf_req;
+    SCSIDevice *d;
+} VirtIOSCSICancelBHData;
+
+/* Cancel the requests matching a TMF that run in the current AioContext */
+static void virtio_scsi_tmf_cancel_bh(void *opaque)
+{
+    g_autofree VirtIOSCSICancelBHData *data = opaque;
+    VirtIOSCSIReq *tmf = data->tmf_req;
+    SCSIDevice *d = data->d;
+    AioContext *ctx = qemu_get_current_aio_context();
+    GList *reqs = NULL;
+    GList *elem;
+    SCSIRequest *r;
+
+    /*
+     * scsi_req_cancel_async() takes requests_lock, so collect the requests
+     * first. Only requests belonging to this AioContext may be touched here.
+     */
+    WITH_QEMU_LOCK_GUARD(&d->requests_lock) {
+        QTAILQ_FOREACH(r, &d->requests, next) {
+            if (r->ctx == ctx && virtio_scsi_tmf_match(tmf, r)) {
+                scsi_req_ref(r);
+                reqs = g_list_prepend(reqs, r);
+            }
+        }
+    }
+
+    for (elem = reqs; elem; elem = elem->next) {
+        r = elem->data;
+
+        /* The request may have completed in the meantime */
+        if (r->hba_private) {
+            VirtIOSCSICancelNotifier *notifier;
+
+            qatomic_inc(&tmf->remaining);
+            notifier = g_new(VirtIOSCSICancelNotifier, 1);
+            notifier->notifier.notify = virtio_scsi_cancel_notify;
+            notifier->tmf_req = tmf;
+            scsi_req_cancel_async(r, &notifier->notifier);
+        }
+        scsi_req_unref(r);
+    }
+    g_list_free(reqs);
+
+    /* Paired with qatomic_inc() in virtio_scsi_defer_tmf_cancel() */
+    virtio_scsi_tmf_dec_remaining(tmf);
+
+    /* Paired with blk_inc_in_flight() in virtio_scsi_defer_tmf_cancel() */
+    blk_dec_in_flight(d->conf.blk);
+    object_unref(OBJECT(d));
+}
+
+/*
+ * SCSI requests may only be cancelled from the AioContext that runs them, so
+ * schedule a BH in each AioContext that has requests matching @tmf. Each BH
+ * holds a reference to @tmf->remaining.
+ */
+static void virtio_scsi_defer_tmf_cancel(VirtIOSCSIReq *tmf, SCSIDevice *d)
+{
+    g_autoptr(GHashTable) aio_contexts = g_hash_table_new(NULL, NULL);
+    GHashTableIter iter;
+    gpointer key;
+    SCSIRequest *r;
+
+    WITH_QEMU_LOCK_GUARD(&d->requests_lock) {
+        QTAILQ_FOREACH(r, &d->requests, next) {
+            if (virtio_scsi_tmf_match(tmf, r)) {
+                g_hash_table_add(aio_contexts, r->ctx);
+            }
+        }
+    }
+
+    g_hash_table_iter_init(&iter, aio_contexts);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        VirtIOSCSICancelBHData *data = g_new(VirtIOSCSICancelBHData, 1);
+
+        data->tmf_req = tmf;
+        data->d = d;
+        object_ref(OBJECT(d));
+
+        /* Let blk_drain() wait for the cancellation to settle */
+        blk_inc_in_flight(d->conf.blk);
+
+        qatomic_inc(&tmf->remaining);
+        aio_bh_schedule_oneshot(key, virtio_scsi_tmf_cancel_bh, data);
+    }
+}
+
 /* Return 0 if the request is ready to be completed and return to guest;
  * -EINPROGRESS if the request is submitted and will be completed later, in the
  *  case of async cancellation. */
 static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
     SCSIDevice *d = virtio_scsi_device_get(s, req->req.tmf.lun);
-    SCSIRequest *r, *next;
+    SCSIRequest *r;
     int ret = 0;
 
     virtio_scsi_ctx_check(s, d);
@@ -453,88 +578,52 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
     switch (req->req.tmf.subtype) {
     case VIRTIO_SCSI_T_TMF_ABORT_TASK:
     case VIRTIO_SCSI_T_TMF_QUERY_TASK:
+    case VIRTIO_SCSI_T_TMF_ABORT_TASK_SET:
+    case VIRTIO_SCSI_T_TMF_CLEAR_TASK_SET:
+    case VIRTIO_SCSI_T_TMF_QUERY_TASK_SET:
         if (!d) {
             goto fail;
         }
         if (d->lun != virtio_scsi_get_lun(req->req.tmf.lun)) {
             goto incorrect_lun;
         }
-        QTAILQ_FOREACH_SAFE(r, &d->requests, next, next) {
-            VirtIOSCSIReq *cmd_req = r->hba_private;
-            if (cmd_req && cmd_req->req.cmd.tag == req->req.tmf.tag) {
-                break;
-            }
-        }
-        if (r) {
+
+        if (req->req.tmf.subtype == VIRTIO_SCSI_T_TMF_QUERY_TASK ||
+            req->req.tmf.subtype == VIRTIO_SCSI_T_TMF_QUERY_TASK_SET) {
             /*
-             * Assert that the request has not been completed yet, we
-             * check for it in the loop above.
+             * "If the specified command is present in the task set, then
+             * return a service response set to FUNCTION SUCCEEDED".
              */
-            assert(r->hba_private);
-            if (req->req.tmf.subtype == VIRTIO_SCSI_T_TMF_QUERY_TASK) {
-                /* "If the specified command is present in the task set, then
-                 * return a service response set to FUNCTION SUCCEEDED".
-                 */
-                req->resp.tmf.response = VIRTIO_SCSI_S_FUNCTION_SUCCEEDED;
-            } else {
-                VirtIOSCSICancelNotifier *notifier;
-
-                req->remaining = 1;
-                notifier = g_new(VirtIOSCSICancelNotifier, 1);
-                notifier->tmf_req = req;
-                notifier->notifier.notify = virtio_scsi_cancel_notify;
-                scsi_req_cancel_async(r, &notifier->notifier);
-                ret = -EINPROGRESS;
+            WITH_QEMU_LOCK_GUARD(&d->requests_lock) {
+                QTAILQ_FOREACH(r, &d->requests, next) {
+                    if (virtio_scsi_tmf_match(req, r)) {
+                        req->resp.tmf.response =
+                            VIRTIO_SCSI_S_FUNCTION_SUCCEEDED;
+                        break;
+                    }
+                }
             }
-        }
-        break;
-
-    case VIRTIO_SCSI_T_TMF_LOGICAL_UNIT_RESET:
-    case VIRTIO_SCSI_T_TMF_I_T_NEXUS_RESET:
-        virtio_scsi_defer_tmf_to_bh(req);
-        ret = -EINPROGRESS;
-        break;
-
-    case VIRTIO_SCSI_T_TMF_ABORT_TASK_SET:
-    case VIRTIO_SCSI_T_TMF_CLEAR_TASK_SET:
-    case VIRTIO_SCSI_T_TMF_QUERY_TASK_SET:
-        if (!d) {
-            goto fail;
-        }
-        if (d->lun != virtio_scsi_get_lun(req->req.tmf.lun)) {
-            goto incorrect_lun;
+            break;
         }
 
         /* Add 1 to "remaining" until virtio_scsi_do_tmf returns.
          * This way, if the bus starts calling back to the notifiers
-         * even before we finish the loop, virtio_scsi_cancel_notify
-         * will not complete the TMF too early.
+         * even before we finish scheduling cancellation,
+         * virtio_scsi_cancel_notify will not complete the TMF too early.
          */
         req->remaining = 1;
-        QTAILQ_FOREACH_SAFE(r, &d->requests, next, next) {
-            if (r->hba_private) {
-                if (req->req.tmf.subtype == VIRTIO_SCSI_T_TMF_QUERY_TASK_SET) {
-                    /* "If there is any command present in the task set, then
-                     * return a service response set to FUNCTION SUCCEEDED".
-                     */
-                    req->resp.tmf.response = VIRTIO_SCSI_S_FUNCTION_SUCCEEDED;
-                    break;
-                } else {
-                    VirtIOSCSICancelNotifier *notifier;
-
-                    req->remaining++;
-                    notifier = g_new(VirtIOSCSICancelNotifier, 1);
-                    notifier->notifier.notify = virtio_scsi_cancel_notify;
-                    notifier->tmf_req = req;
-                    scsi_req_cancel_async(r, &notifier->notifier);
-                }
-            }
-        }
-        if (--req->remaining > 0) {
+        virtio_scsi_defer_tmf_cancel(req, d);
+        if (qatomic_fetch_dec(&req->remaining) > 1) {
             ret = -EINPROGRESS;
         }
         break;
 
+    case VIRTIO_SCSI_T_TMF_LOGICAL_UNIT_RESET:
+    case VIRTIO_SCSI_T_TMF_I_T_NEXUS_RESET:
+        virtio_scsi_defer_tmf_to_bh(req);
+        ret = -EINPROGRESS;
+        break;
+
     case VIRTIO_SCSI_T_TMF_CLEAR_ACA:
     default:
         req->resp.tmf.response = VIRTIO_SCSI_S_FUNCTION_REJECTED;
@@ -1141,7 +1230,7 @@ static void virtio_scsi_drained_begin(SCSIBus *bus)
 
     for (uint32_t i = 0; i < total_queues; i++) {
         VirtQueue *vq = virtio_get_queue(vdev, i);
-        virtio_queue_aio_detach_host_notifier(vq, s->ctx);
+        virtio_queue_aio_detach_host_notifier(vq, s->vq_aio_context[i]);
     }
 }
 
@@ -1167,10 +1256,12 @@ static void virtio_scsi_drained_end(SCSIBus *bus)
 
     for (uint32_t i = 0; i < total_queues; i++) {
         VirtQueue *vq = virtio_get_queue(vdev, i);
+        AioContext *ctx = s->vq_aio_context[i];
+
         if (vq == vs->event_vq) {
-            virtio_queue_aio_attach_host_notifier_no_poll(vq, s->ctx);
+            virtio_queue_aio_attach_host_notifier_no_poll(vq, ctx);
         } else {
-            virtio_queue_aio_attach_host_notifier(vq, s->ctx);
+            virtio_queue_aio_attach_host_notifier(vq, ctx);
         }
     }
 }
@@ -1280,6 +1371,7 @@ static void virtio_scsi_device_unrealize(DeviceState *dev)
     VirtIOSCSI *s = VIRTIO_SCSI(dev);
 
     virtio_scsi_reset_tmf_bh(s);
+    virtio_scsi_dataplane_cleanup(s);
 
     qbus_set_hotplug_handler(BUS(&s->bus), NULL);
     virtio_scsi_common_unrealize(dev);
@@ -1303,6 +1395,10 @@ static Property virtio_scsi_properties[] = {
                                                 VIRTIO_SCSI_F_CHANGE, true),
     DEFINE_PROP_LINK("iothread", VirtIOSCSI, parent_obj.conf.iothread,
                      TYPE_IOTHREAD, IOThread *),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", VirtIOSCSI,
+            parent_obj.conf.iothread_vq_mapping_list),
+    DEFINE_VIRTIO_IRQ_COALESCE_PROPERTIES(VirtIOSCSI,
+                                          parent_obj.parent_obj.irq_coalesce),
     DEFINE_PROP_END_OF_LIST(),
 };
 
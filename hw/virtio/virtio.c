@@ -17,9 +17,11 @@
 #include "trace.h"
 #include "qemu/defer-call.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/timer.h"
 #include "qom/object_interfaces.h"
 #include "hw/core/cpu.h"
 #include "hw/virtio/virtio.h"
@@ -152,6 +154,14 @@ struct VirtQueue
     EventNotifier host_notifier;
     bool host_notifier_enabled;
     QLIST_ENTRY(VirtQueue) node;
+
+    /* Interrupt coalescing, only set up if irq_coalesce.usecs is not 0 */
+    QEMUTimer *irq_timer;
+    QemuMutex irq_lock;
+    unsigned int irq_pending; /* completions since the held back interrupt */
+    bool irq_pending_irqfd;
+    int64_t irq_last_ns;
+    int64_t irq_gap_ns; /* moving average of the time between completions */
 };
 
 const char *virtio_device_names[] = {
@@ -910,6 +920,132 @@ static void virtqueue_packed_fill_desc(VirtQueue *vq,
     vring_packed_desc_write(vq->vdev, &desc, &caches->desc, head, strict_order);
 }
 
+/*
+ * With VIRTIO_F_IN_ORDER, used_elems has one slot per ring position and
+ * remembers the elements in the order they were popped.  A completed element
+ * is only marked in its slot; it is published once every element popped
+ * before it has completed, too.  This lets backends complete requests out of
+ * order while the guest sees them in order.
+ */
+static void virtqueue_in_order_record(VirtQueue *vq,
+                                      const VirtQueueElement *elem,
+                                      unsigned int slot)
+{
+    VirtQueueElement *used = &vq->used_elems[slot];
+
+    used->index = elem->index;
+    used->len = 0;
+    used->ndescs = elem->ndescs;
+    used->in_order_filled = false;
+}
+
+/* Number of ring positions between the next used and the next avail entry */
+static unsigned int virtqueue_in_order_pending(VirtQueue *vq)
+{
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        unsigned int pending = vq->last_avail_idx + vq->vring.num -
+                               vq->used_idx;
+
+        if (vq->last_avail_wrap_counter == vq->used_wrap_counter) {
+            pending -= vq->vring.num;
+        }
+        return pending;
+    }
+
+    return (uint16_t)(vq->last_avail_idx - vq->used_idx);
+}
+
+static void virtqueue_ordered_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                   unsigned int len)
+{
+    unsigned int pending = virtqueue_in_order_pending(vq);
+    unsigned int slot = vq->used_idx % vq->vring.num;
+    unsigned int steps = 0;
+
+    while (steps < pending) {
+        VirtQueueElement *used = &vq->used_elems[slot];
+
+        if (!used->ndescs) {
+            break;
+        }
+        if (used->index == elem->index && !used->in_order_filled) {
+            used->len = len;
+            used->in_order_filled = true;
+            return;
+        }
+
+        steps += used->ndescs;
+        slot = (slot + used->ndescs) % vq->vring.num;
+    }
+
+    virtio_error(vq->vdev, "Completed element %u is not in flight",
+                 elem->index);
+}
+
+/* Called within rcu_read_lock().  */
+static void virtqueue_ordered_flush(VirtQueue *vq)
+{
+    bool packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+    unsigned int first = vq->used_idx % vq->vring.num;
+    unsigned int slot = first;
+    unsigned int count = 0, ndescs = 0;
+    VirtQueueElement *used;
+    uint16_t old, new;
+
+    if (unlikely(packed ? !vq->vring.desc : !vq->vring.used)) {
+        return;
+    }
+
+    /* Publish the completed elements up to the first one still in flight */
+    for (used = &vq->used_elems[slot]; used->in_order_filled;
+         used = &vq->used_elems[slot]) {
+        used->in_order_filled = false;
+        if (!packed) {
+            VRingUsedElem uelem = {
+                .id = used->index,
+                .len = used->len,
+            };
+
+            vring_used_write(vq, &uelem, slot);
+        } else if (count) {
+            virtqueue_packed_fill_desc(vq, used, ndescs, false);
+        }
+
+        count++;
+        ndescs += used->ndescs;
+        slot = (slot + used->ndescs) % vq->vring.num;
+    }
+
+    if (!count) {
+        return;
+    }
+
+    trace_virtqueue_flush(vq, count);
+    if (packed) {
+        /* The first descriptor makes the others visible, write it last */
+        virtqueue_packed_fill_desc(vq, &vq->used_elems[first], 0, true);
+
+        vq->inuse -= ndescs;
+        vq->used_idx += ndescs;
+        if (vq->used_idx >= vq->vring.num) {
+            vq->used_idx -= vq->vring.num;
+            vq->used_wrap_counter ^= 1;
+            vq->signalled_used_valid = false;
+        }
+        return;
+    }
+
+    /* Make sure buffer is written before we update index. */
+    smp_wmb();
+    old = vq->used_idx;
+    new = old + count;
+    vring_used_idx_set(vq, new);
+    vq->inuse -= count;
+    if (unlikely((int16_t)(new - vq->signalled_used) < (uint16_t)(new - old))) {
+        vq->signalled_used_valid = false;
+    }
+}
+
 /* Called within rcu_read_lock().  */
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx)
@@ -922,7 +1058,9 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         return;
     }
 
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_ordered_fill(vq, elem, len);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
         virtqueue_packed_fill(vq, elem, len, idx);
     } else {
         virtqueue_split_fill(vq, elem, len, idx);
@@ -988,7 +1126,9 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
         return;
     }
 
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_ordered_flush(vq);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
         virtqueue_packed_flush(vq, count);
     } else {
         virtqueue_split_flush(vq, count);
@@ -1003,6 +1143,32 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/*
+ * virtqueue_push_batch:
+ * @vq: The #VirtQueue
+ * @elems: The elements to complete, in order
+ * @lens: The number of bytes written to each element, or NULL for none
+ * @count: The number of elements
+ *
+ * Complete @count elements with a single used index update and barrier.
+ * The caller decides once afterwards whether to notify the guest.
+ */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement *const *elems,
+                          const unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    for (i = 0; i < count; i++) {
+        virtqueue_fill(vq, elems[i], lens ? lens[i] : 0, i);
+    }
+    virtqueue_flush(vq, count);
+}
+
 /* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
@@ -1503,10 +1669,16 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+/*
+ * Called within rcu_read_lock().  Read and map the descriptor chain that
+ * starts at @head.  Returns NULL if the chain is invalid, in which case
+ * the device has been marked broken.
+ */
+static VirtQueueElement *
+virtqueue_split_read_elem(VirtQueue *vq, size_t sz,
+                          VRingMemoryRegionCaches *caches, unsigned int head)
 {
-    unsigned int i, head, max;
-    VRingMemoryRegionCaches *caches;
+    unsigned int i, max;
     MemoryRegionCache indirect_desc_cache;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1520,45 +1692,12 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
 
     address_space_cache_init_empty(&indirect_desc_cache);
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
     max = vq->vring.num;
-
-    if (vq->inuse >= vq->vring.num) {
-        virtio_error(vdev, "Virtqueue size exceeded");
-        goto done;
-    }
-
-    if (!virtqueue_get_head(vq, vq->last_avail_idx++, &head)) {
-        goto done;
-    }
-
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_split_desc_read(vdev, &desc, desc_cache, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
@@ -1630,6 +1769,11 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     }
 
     vq->inuse++;
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_in_order_record(vq, elem,
+                                  (uint16_t)(vq->last_avail_idx - 1) %
+                                  vq->vring.num);
+    }
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
 done:
@@ -1642,6 +1786,129 @@ err_undo_map:
     goto done;
 }
 
+/* Called within rcu_read_lock().  */
+static VRingMemoryRegionCaches *virtqueue_split_get_caches(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+
+    if (!caches) {
+        virtio_error(vq->vdev, "Region caches not initialized");
+        return NULL;
+    }
+
+    if (caches->desc.len < vq->vring.num * sizeof(VRingDesc)) {
+        virtio_error(vq->vdev, "Cannot map descriptor ring");
+        return NULL;
+    }
+
+    return caches;
+}
+
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    VRingMemoryRegionCaches *caches;
+    unsigned int head;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    if (vq->inuse >= vq->vring.num) {
+        virtio_error(vq->vdev, "Virtqueue size exceeded");
+        return NULL;
+    }
+
+    if (!virtqueue_get_head(vq, vq->last_avail_idx++, &head)) {
+        return NULL;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    caches = virtqueue_split_get_caches(vq);
+    if (!caches) {
+        return NULL;
+    }
+
+    return virtqueue_split_read_elem(vq, sz, caches, head);
+}
+
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
+{
+    VRingMemoryRegionCaches *caches;
+    unsigned int heads[VIRTQUEUE_MAX_SIZE];
+    unsigned int i, n, count = 0;
+    uint16_t avail_idx;
+
+    RCU_READ_LOCK_GUARD();
+    if (unlikely(!vq->vring.avail)) {
+        return 0;
+    }
+
+    /* Read the avail index once for the whole batch */
+    avail_idx = vring_avail_idx(vq);
+    n = (uint16_t)(avail_idx - vq->last_avail_idx);
+    if (n > vq->vring.num) {
+        virtio_error(vq->vdev, "Guest moved used index from %u to %u",
+                     vq->last_avail_idx, avail_idx);
+        return 0;
+    }
+    if (!n) {
+        return 0;
+    }
+    /* Make sure descriptor reads do not bypass the avail index read */
+    smp_rmb();
+
+    if (vq->inuse >= vq->vring.num) {
+        virtio_error(vq->vdev, "Virtqueue size exceeded");
+        return 0;
+    }
+    n = MIN(n, MIN(max, vq->vring.num - vq->inuse));
+
+    caches = virtqueue_split_get_caches(vq);
+    if (!caches) {
+        return 0;
+    }
+
+    /*
+     * Collect the heads first and prefetch their descriptors, so that the
+     * cache misses on the descriptor table overlap with mapping the
+     * elements before them.
+     */
+    for (i = 0; i < n; i++) {
+        if (!virtqueue_get_head(vq, vq->last_avail_idx + i, &heads[i])) {
+            n = i;
+            break;
+        }
+        if (likely(caches->desc.ptr)) {
+            __builtin_prefetch(caches->desc.ptr +
+                               heads[i] * sizeof(VRingDesc));
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        vq->last_avail_idx++;
+        elems[count] = virtqueue_split_read_elem(vq, sz, caches, heads[i]);
+        if (!elems[count]) {
+            break;
+        }
+        count++;
+    }
+
+    /* One avail event update for the whole batch */
+    if (n && virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return count;
+}
+
 static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, max;
@@ -1757,6 +2024,9 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     elem->index = id;
     elem->ndescs = (desc_cache == &indirect_desc_cache) ? 1 : elem_entries;
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_in_order_record(vq, elem, vq->last_avail_idx);
+    }
     vq->last_avail_idx += elem->ndescs;
     vq->inuse += elem->ndescs;
 
@@ -1792,6 +2062,43 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 }
 
+/*
+ * virtqueue_pop_batch:
+ * @vq: The #VirtQueue
+ * @sz: The size of each element, as for virtqueue_pop()
+ * @elems: Array that receives the elements
+ * @max: The maximum number of elements to pop
+ *
+ * Pop up to @max elements like repeated virtqueue_pop() calls would, but
+ * read the avail index and update the avail event only once per batch.
+ *
+ * Returns: the number of elements stored in @elems.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int count = 0;
+
+    if (virtio_device_disabled(vq->vdev)) {
+        return 0;
+    }
+
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_split_pop_batch(vq, sz, elems,
+                                         MIN(max, VIRTQUEUE_MAX_SIZE));
+    }
+
+    /* Packed descriptors are only valid one by one, read them in turn */
+    while (count < max) {
+        elems[count] = virtqueue_packed_pop(vq, sz);
+        if (!elems[count]) {
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -1829,17 +2136,21 @@ static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
                                                vq->vring.num, &idx, false)) {
             ++elem.ndescs;
         }
+        if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+            virtqueue_in_order_record(vq, &elem, vq->last_avail_idx);
+        }
+        vq->inuse += elem.ndescs;
+        vq->last_avail_idx += elem.ndescs;
+        if (vq->last_avail_idx >= vq->vring.num) {
+            vq->last_avail_idx -= vq->vring.num;
+            vq->last_avail_wrap_counter ^= 1;
+        }
         /*
          * immediately push the element, nothing to unmap
          * as both in_num and out_num are set to 0.
          */
         virtqueue_push(vq, &elem, 0);
         dropped++;
-        vq->last_avail_idx += elem.ndescs;
-        if (vq->last_avail_idx >= vq->vring.num) {
-            vq->last_avail_idx -= vq->vring.num;
-            vq->last_avail_wrap_counter ^= 1;
-        }
     }
 
     return dropped;
@@ -1848,7 +2159,7 @@ static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 static unsigned int virtqueue_split_drop_all(VirtQueue *vq)
 {
     unsigned int dropped = 0;
-    VirtQueueElement elem = {};
+    VirtQueueElement elem = { .ndescs = 1 };
     VirtIODevice *vdev = vq->vdev;
     bool fEventIdx = virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
 
@@ -1864,6 +2175,11 @@ static unsigned int virtqueue_split_drop_all(VirtQueue *vq)
         if (fEventIdx) {
             vring_set_avail_event(vq, vq->last_avail_idx);
         }
+        if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+            virtqueue_in_order_record(vq, &elem,
+                                      (uint16_t)(vq->last_avail_idx - 1) %
+                                      vq->vring.num);
+        }
         /* immediately push the element, nothing to unmap
          * as both in_num and out_num are set to 0 */
         virtqueue_push(vq, &elem, 0);
@@ -2078,6 +2394,51 @@ static enum virtio_device_endian virtio_current_cpu_endian(void)
     }
 }
 
+static void virtio_irq_coalesce_flush(VirtQueue *vq);
+
+static void virtio_irq_coalesce_timer(void *opaque)
+{
+    virtio_irq_coalesce_flush(opaque);
+}
+
+/* Drop a held back interrupt, e.g. on reset */
+static void virtio_irq_coalesce_reset(VirtQueue *vq)
+{
+    if (!vq->irq_timer) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&vq->irq_lock) {
+        timer_del(vq->irq_timer);
+        vq->irq_pending = 0;
+        vq->irq_last_ns = 0;
+        vq->irq_gap_ns = (int64_t)vq->vdev->irq_coalesce.usecs * SCALE_US;
+    }
+}
+
+static void virtio_irq_coalesce_init(VirtQueue *vq)
+{
+    if (!vq->vdev->irq_coalesce.usecs) {
+        return;
+    }
+
+    qemu_mutex_init(&vq->irq_lock);
+    vq->irq_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                 virtio_irq_coalesce_timer, vq);
+    virtio_irq_coalesce_reset(vq);
+}
+
+static void virtio_irq_coalesce_cleanup(VirtQueue *vq)
+{
+    if (!vq->irq_timer) {
+        return;
+    }
+
+    timer_free(vq->irq_timer);
+    vq->irq_timer = NULL;
+    qemu_mutex_destroy(&vq->irq_lock);
+}
+
 static void __virtio_queue_reset(VirtIODevice *vdev, uint32_t i)
 {
     vdev->vq[i].vring.desc = 0;
@@ -2095,6 +2456,11 @@ static void __virtio_queue_reset(VirtIODevice *vdev, uint32_t i)
     vdev->vq[i].notification = true;
     vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
     vdev->vq[i].inuse = 0;
+    virtio_irq_coalesce_reset(&vdev->vq[i]);
+    if (vdev->vq[i].used_elems) {
+        memset(vdev->vq[i].used_elems, 0,
+               vdev->vq[i].vring.num * sizeof(VirtQueueElement));
+    }
     virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
 }
 
@@ -2195,6 +2561,18 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     virtio_init_region_cache(vdev, n);
 }
 
+/*
+ * used_elems is sized for the default ring size, but the guest may configure
+ * a bigger ring.  In-order completion needs one slot per ring position.
+ */
+static void virtio_queue_resize_used_elems(VirtQueue *vq)
+{
+    unsigned int num = MAX(vq->vring.num, vq->vring.num_default);
+
+    vq->used_elems = g_renew(VirtQueueElement, vq->used_elems, num);
+    memset(vq->used_elems, 0, num * sizeof(VirtQueueElement));
+}
+
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
 {
     /* Don't allow guest to flip queue between existent and
@@ -2206,6 +2584,9 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         return;
     }
     vdev->vq[n].vring.num = num;
+    if (num > vdev->vq[n].vring.num_default) {
+        virtio_queue_resize_used_elems(&vdev->vq[n]);
+    }
 }
 
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector)
@@ -2342,6 +2723,7 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].used_elems = g_new0(VirtQueueElement, queue_size);
+    virtio_irq_coalesce_init(&vdev->vq[i]);
 
     return &vdev->vq[i];
 }
@@ -2353,6 +2735,7 @@ void virtio_delete_queue(VirtQueue *vq)
     vq->handle_output = NULL;
     g_free(vq->used_elems);
     vq->used_elems = NULL;
+    virtio_irq_coalesce_cleanup(vq);
     virtio_virtqueue_reset_region_cache(vq);
 }
 
@@ -2454,6 +2837,82 @@ static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
+/*
+ * Interrupt coalescing holds back a queue interrupt for up to
+ * irq_coalesce.usecs, or until irq_coalesce.frames more completions are
+ * waiting, like interrupt throttling on a physical NIC.  In adaptive mode
+ * the number of completions to wait for is what the current completion rate
+ * yields within irq_coalesce.usecs, so a lightly loaded queue still gets its
+ * interrupt right away.
+ *
+ * The timer runs in the main loop, while completions may come from an
+ * IOThread, hence the lock.
+ *
+ * @notify is the result of virtio_should_notify().  Returns true if the
+ * caller must not inject the interrupt now.
+ */
+static bool virtio_irq_coalesce(VirtQueue *vq, bool notify, bool irqfd)
+{
+    VirtIOIRQCoalesce *conf = &vq->vdev->irq_coalesce;
+    int64_t window = (int64_t)conf->usecs * SCALE_US;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t budget = conf->frames ? conf->frames : INT64_MAX;
+    bool defer;
+
+    QEMU_LOCK_GUARD(&vq->irq_lock);
+
+    vq->irq_gap_ns += (MIN(now - vq->irq_last_ns, window) - vq->irq_gap_ns) / 8;
+    vq->irq_last_ns = now;
+    if (conf->adaptive) {
+        budget = MIN(budget, window / MAX(vq->irq_gap_ns, 1));
+    }
+
+    if (vq->irq_pending) {
+        /* Already held back, the completion is covered by it */
+        defer = ++vq->irq_pending < budget;
+        if (!defer) {
+            timer_del(vq->irq_timer);
+            vq->irq_pending = 0;
+        }
+    } else if (notify && budget > 1) {
+        vq->irq_pending = 1;
+        vq->irq_pending_irqfd = irqfd;
+        timer_mod(vq->irq_timer, now + window);
+        defer = true;
+    } else {
+        defer = !notify;
+    }
+    return defer;
+}
+
+/* Inject a held back interrupt now.  Called with the BQL held. */
+static void virtio_irq_coalesce_flush(VirtQueue *vq)
+{
+    bool irqfd = false;
+
+    if (!vq->irq_timer) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&vq->irq_lock) {
+        if (!vq->irq_pending) {
+            return;
+        }
+        timer_del(vq->irq_timer);
+        vq->irq_pending = 0;
+        irqfd = vq->irq_pending_irqfd;
+    }
+
+    virtio_set_isr(vq->vdev, 0x1);
+    if (irqfd) {
+        trace_virtio_notify_irqfd(vq->vdev, vq);
+        event_notifier_set(&vq->guest_notifier);
+    } else {
+        trace_virtio_notify(vq->vdev, vq);
+        virtio_notify_vector(vq->vdev, vq->vector);
+    }
+}
+
 /* Batch irqs while inside a defer_call_begin()/defer_call_end() section */
 static void virtio_notify_irqfd_deferred_fn(void *opaque)
 {
@@ -2466,10 +2925,13 @@ static void virtio_notify_irqfd_deferred_fn(void *opaque)
 
 void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
 {
+    bool notify;
+
     WITH_RCU_READ_LOCK_GUARD() {
-        if (!virtio_should_notify(vdev, vq)) {
-            return;
-        }
+        notify = virtio_should_notify(vdev, vq);
+    }
+    if (vq->irq_timer ? virtio_irq_coalesce(vq, notify, true) : !notify) {
+        return;
     }
 
     trace_virtio_notify_irqfd(vdev, vq);
@@ -2501,10 +2963,13 @@ static void virtio_irq(VirtQueue *vq)
 
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
+    bool notify;
+
     WITH_RCU_READ_LOCK_GUARD() {
-        if (!virtio_should_notify(vdev, vq)) {
-            return;
-        }
+        notify = virtio_should_notify(vdev, vq);
+    }
+    if (vq->irq_timer ? virtio_irq_coalesce(vq, notify, false) : !notify) {
+        return;
     }
 
     trace_virtio_notify(vdev, vq);
@@ -2598,6 +3063,53 @@ static bool virtio_disabled_needed(void *opaque)
     return vdev->disabled;
 }
 
+/*
+ * Calls @fn for every element of @vq that completed out of order and waits
+ * for an earlier one before it can be published.
+ */
+static void virtqueue_in_order_foreach_filled(VirtQueue *vq,
+                                              void (*fn)(VirtQueue *vq,
+                                                         unsigned int slot,
+                                                         void *opaque),
+                                              void *opaque)
+{
+    unsigned int pending = virtqueue_in_order_pending(vq);
+    unsigned int slot = vq->used_idx % vq->vring.num;
+    unsigned int steps = 0;
+
+    while (steps < pending && vq->used_elems[slot].ndescs) {
+        if (vq->used_elems[slot].in_order_filled) {
+            fn(vq, slot, opaque);
+        }
+        steps += vq->used_elems[slot].ndescs;
+        slot = (slot + vq->used_elems[slot].ndescs) % vq->vring.num;
+    }
+}
+
+static void virtqueue_in_order_count_filled(VirtQueue *vq, unsigned int slot,
+                                            void *opaque)
+{
+    (*(unsigned int *)opaque)++;
+}
+
+static bool virtio_in_order_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+    unsigned int filled = 0;
+    int i;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+        return false;
+    }
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX && vdev->vq[i].vring.num; i++) {
+        virtqueue_in_order_foreach_filled(&vdev->vq[i],
+                                          virtqueue_in_order_count_filled,
+                                          &filled);
+    }
+    return filled;
+}
+
 static const VMStateDescription vmstate_virtqueue = {
     .name = "virtqueue_state",
     .version_id = 1,
@@ -2719,6 +3231,93 @@ static const VMStateDescription vmstate_virtio_extra_state = {
     }
 };
 
+/*
+ * Elements that completed out of order have already written their data to
+ * guest memory, but are held back until the elements popped before them
+ * complete.  The destination cannot find them in the ring, so send their
+ * slots and lengths for each virtqueue.
+ */
+static void put_in_order_slot(VirtQueue *vq, unsigned int slot, void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_put_be16(f, slot);
+    qemu_put_be32(f, vq->used_elems[slot].len);
+}
+
+static int put_in_order_state(QEMUFile *f, void *pv, size_t size,
+                              const VMStateField *field, JSONWriter *vmdesc)
+{
+    VirtIODevice *vdev = pv;
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX && vdev->vq[i].vring.num; i++) {
+        unsigned int filled = 0;
+
+        virtqueue_in_order_foreach_filled(&vdev->vq[i],
+                                          virtqueue_in_order_count_filled,
+                                          &filled);
+        qemu_put_be16(f, filled);
+        virtqueue_in_order_foreach_filled(&vdev->vq[i], put_in_order_slot, f);
+    }
+    return 0;
+}
+
+/*
+ * The slots are only marked here; virtqueue_in_order_restore() checks them
+ * against the ring once the rest of the state has been loaded.
+ */
+static int get_in_order_state(QEMUFile *f, void *pv, size_t size,
+                              const VMStateField *field)
+{
+    VirtIODevice *vdev = pv;
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX && vdev->vq[i].vring.num; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        uint16_t filled = qemu_get_be16(f);
+
+        while (filled--) {
+            uint16_t slot = qemu_get_be16(f);
+            uint32_t len = qemu_get_be32(f);
+
+            if (slot >= vq->vring.num) {
+                error_report("VQ %d in-order slot 0x%x out of range "
+                             "(size 0x%x)", i, slot, vq->vring.num);
+                return -EINVAL;
+            }
+            vq->used_elems[slot].in_order_filled = true;
+            vq->used_elems[slot].len = len;
+        }
+    }
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_in_order_state = {
+    .name = "virtqueue_in_order_state",
+    .get = get_in_order_state,
+    .put = put_in_order_state,
+};
+
+static const VMStateDescription vmstate_virtio_in_order = {
+    .name = "virtio/in_order",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_in_order_needed,
+    .fields = (const VMStateField[]) {
+        {
+            .name         = "in_order_state",
+            .version_id   = 0,
+            .field_exists = NULL,
+            .size         = 0,
+            .info         = &vmstate_info_in_order_state,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_virtio_device_endian = {
     .name = "virtio/device_endian",
     .version_id = 1,
@@ -2791,6 +3390,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_started,
         &vmstate_virtio_packed_virtqueues,
         &vmstate_virtio_disabled,
+        &vmstate_virtio_in_order,
         NULL
     }
 };
@@ -2978,6 +3578,95 @@ size_t virtio_get_config_size(const VirtIOConfigSizeParams *params,
     return config_size;
 }
 
+/*
+ * Like virtqueue_in_order_record(), but keeps the completion that the
+ * virtio/in_order subsection loaded into @slot.
+ */
+static void virtqueue_in_order_record_loaded(VirtQueue *vq,
+                                             const VirtQueueElement *elem,
+                                             unsigned int slot,
+                                             unsigned int *filled)
+{
+    VirtQueueElement *used = &vq->used_elems[slot];
+    bool in_order_filled = used->in_order_filled;
+    unsigned int len = used->len;
+
+    virtqueue_in_order_record(vq, elem, slot);
+    if (in_order_filled) {
+        used->in_order_filled = true;
+        used->len = len;
+        (*filled)++;
+    }
+}
+
+/*
+ * Only the elements that completed out of order are migrated.  Rebuild the
+ * rest of the in-order bookkeeping from the ring: the guest does not touch
+ * the entries between the used and the avail index until the device has
+ * used them.  Called within rcu_read_lock().
+ */
+static int virtqueue_in_order_restore(VirtQueue *vq)
+{
+    VirtQueueElement elem = { .ndescs = 1 };
+    VRingMemoryRegionCaches *caches;
+    unsigned int pending, steps, slot;
+    unsigned int loaded = 0, filled = 0;
+
+    for (slot = 0; slot < vq->vring.num; slot++) {
+        loaded += vq->used_elems[slot].in_order_filled;
+    }
+    pending = virtqueue_in_order_pending(vq);
+
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        for (steps = 0; steps < pending; steps++) {
+            if (!virtqueue_get_head(vq, vq->used_idx + steps, &elem.index)) {
+                return 0;
+            }
+            virtqueue_in_order_record_loaded(vq, &elem,
+                                             (uint16_t)(vq->used_idx + steps) %
+                                             vq->vring.num, &filled);
+        }
+        goto out;
+    }
+
+    caches = vring_get_region_caches(vq);
+    if (!caches ||
+        caches->desc.len < vq->vring.num * sizeof(VRingPackedDesc)) {
+        return 0;
+    }
+
+    slot = vq->used_idx;
+    for (steps = 0; steps < pending; steps += elem.ndescs) {
+        VRingPackedDesc desc;
+
+        vring_packed_desc_read(vq->vdev, &desc, &caches->desc, slot, false);
+        elem.index = desc.id;
+        elem.ndescs = 1;
+        if (!(desc.flags & VRING_DESC_F_INDIRECT)) {
+            while ((desc.flags & VRING_DESC_F_NEXT) &&
+                   steps + elem.ndescs < pending) {
+                vring_packed_desc_read(vq->vdev, &desc, &caches->desc,
+                                       (slot + elem.ndescs) % vq->vring.num,
+                                       false);
+                elem.ndescs++;
+            }
+        }
+        virtqueue_in_order_record_loaded(vq, &elem, slot, &filled);
+        slot = (slot + elem.ndescs) % vq->vring.num;
+    }
+    vq->inuse = pending;
+
+out:
+    /* Every completion must belong to an element that is still in flight */
+    if (filled != loaded) {
+        error_report("VQ %d has %u in-order completions outside of the "
+                     "%u in flight elements", vq->queue_index,
+                     loaded - filled, pending);
+        return -EINVAL;
+    }
+    return 0;
+}
+
 int coroutine_mixed_fn
 virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 {
@@ -3049,6 +3738,11 @@ virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
         qemu_get_be16s(f, &vdev->vq[i].last_avail_idx);
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
+        /*
+         * Size used_elems for the ring and drop stale in-order state before
+         * the virtio/in_order subsection is loaded.
+         */
+        virtio_queue_resize_used_elems(&vdev->vq[i]);
 
         if (!vdev->vq[i].vring.desc && vdev->vq[i].last_avail_idx) {
             error_report("VQ %d address 0x0 "
@@ -3137,6 +3831,10 @@ virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                 vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
                 vdev->vq[i].shadow_avail_wrap_counter =
                                         vdev->vq[i].last_avail_wrap_counter;
+                if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER) &&
+                    virtqueue_in_order_restore(&vdev->vq[i]) < 0) {
+                    return -1;
+                }
                 continue;
             }
 
@@ -3172,6 +3870,10 @@ virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                              vdev->vq[i].used_idx);
                 return -1;
             }
+            if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER) &&
+                virtqueue_in_order_restore(&vdev->vq[i]) < 0) {
+                return -1;
+            }
         }
     }
 
@@ -3209,6 +3911,15 @@ static void virtio_vmstate_change(void *opaque, bool running, RunState state)
     if (!backend_run) {
         virtio_set_status(vdev, vdev->status);
     }
+
+    /* Interrupts held back by the stopped clock must not wait for resume */
+    if (!running) {
+        int i;
+
+        for (i = 0; i < VIRTIO_QUEUE_MAX && vdev->vq[i].vring.num; i++) {
+            virtio_irq_coalesce_flush(&vdev->vq[i]);
+        }
+    }
 }
 
 void virtio_instance_init_common(Object *proxy_obj, void *data,
@@ -3504,6 +4215,8 @@ void virtio_queue_set_guest_notifier_fd_handler(VirtQueue *vq, bool assign,
         event_notifier_set_handler(&vq->guest_notifier, NULL);
     }
     if (!assign) {
+        /* An interrupt held back for the irqfd must not get lost */
+        virtio_irq_coalesce_flush(vq);
         /* Test and clear notifier before closing it,
          * in case poll callback didn't have time to run. */
         virtio_queue_guest_notifier_read(&vq->guest_notifier);
@@ -3713,6 +4426,12 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
     /* Devices should either use vmsd or the load/save methods */
     assert(!vdc->vmsd || !vdc->load);
 
+    if (vdev->irq_coalesce.usecs > VIRTIO_IRQ_COALESCE_MAX_USECS) {
+        error_setg(errp, "irq-coalesce-usecs must not exceed %u",
+                   VIRTIO_IRQ_COALESCE_MAX_USECS);
+        return;
+    }
+
     if (vdc->realize != NULL) {
         vdc->realize(dev, &err);
         if (err != NULL) {
@@ -3760,6 +4479,7 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
         if (vdev->vq[i].vring.num == 0) {
             break;
         }
+        virtio_irq_coalesce_cleanup(&vdev->vq[i]);
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
     g_free(vdev->vq);
@@ -3784,7 +4504,7 @@ static Property virtio_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
-static int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int i, n, r, err;
@@ -3854,7 +4574,7 @@ int virtio_device_start_ioeventfd(VirtIODevice *vdev)
     return virtio_bus_start_ioeventfd(vbus);
 }
 
-static void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r;
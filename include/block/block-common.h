@@ -79,6 +79,7 @@
 
 /* block.c */
 typedef struct BlockDriver BlockDriver;
+typedef struct BlockSeqWriter BlockSeqWriter;
 typedef struct BdrvChild BdrvChild;
 typedef struct BdrvChildClass BdrvChildClass;
 
@@ -148,6 +149,11 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * True if a compressed write may span multiple clusters. The clusters
+     * are compressed in parallel and allocated in order.
+     */
+    bool multi_cluster_compressed_writes;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
@@ -522,6 +528,8 @@ typedef struct BdrvCheckResult {
 typedef enum {
     BDRV_FIX_LEAKS    = 1,
     BDRV_FIX_ERRORS   = 2,
+    /* Not a repair mode: also verify the data itself, where supported */
+    BDRV_CHECK_DATA   = 4,
 } BdrvCheckMode;
 
 typedef struct BlockSizes {
@@ -33,6 +33,22 @@ void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
                               bool compress);
 void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm);
 
+/*
+ * Keep a SHA-256 hash of every cluster in @hashes (one 32-byte entry per
+ * cluster, indexed by cluster number) and don't write clusters to the target
+ * whose content hash is unchanged since they were last copied.  This is only
+ * valid if the target still contains, or is backed by, the data written by
+ * the copies that recorded the hashes.  All-zero entries mean "unknown".
+ *
+ * Must be called prior to any actual copy request.  Copy offloading is not
+ * used while hashes are kept, as the data has to be read to be hashed.
+ */
+int GRAPH_RDLOCK
+block_copy_set_hashes(BlockCopyState *s, BdrvChild *hashes, Error **errp);
+
+int coroutine_fn GRAPH_RDLOCK
+block_copy_invalidate_hashes(BlockCopyState *s, int64_t offset, int64_t bytes);
+
 void block_copy_state_free(BlockCopyState *s);
 
 void block_copy_reset(BlockCopyState *s, int64_t offset, int64_t bytes);
@@ -67,6 +67,16 @@ int co_wrapper bdrv_create(BlockDriver *drv, const char *filename,
 int coroutine_fn GRAPH_UNLOCKED
 bdrv_co_create_file(const char *filename, QemuOpts *opts, Error **errp);
 
+BlockSeqWriter *bdrv_seq_writer_new(BlockDriver *drv, int fd, int64_t size,
+                                    QemuOpts *opts, Error **errp);
+void bdrv_seq_writer_add_data(BlockSeqWriter *w, int64_t offset,
+                              int64_t bytes);
+int bdrv_seq_writer_start(BlockSeqWriter *w, Error **errp);
+int bdrv_seq_writer_write(BlockSeqWriter *w, int64_t offset, int64_t bytes,
+                          const void *buf);
+int bdrv_seq_writer_finish(BlockSeqWriter *w, Error **errp);
+void bdrv_seq_writer_free(BlockSeqWriter *w);
+
 BlockDriverState *bdrv_new(void);
 int bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top,
                 Error **errp);
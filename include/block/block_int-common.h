@@ -57,6 +57,8 @@
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
 #define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 #define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_DEDUP             "dedup"
+#define BLOCK_OPT_DATA_CHECKSUMS    "data_checksums"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -90,6 +92,29 @@ typedef struct BdrvTrackedRequest {
     struct BdrvTrackedRequest *waiting_for;
 } BdrvTrackedRequest;
 
+/*
+ * Sequential image output, see bdrv_seq_writer_new().  The guest areas that
+ * contain data are registered first; the format driver then writes its
+ * metadata, which is followed by the data of every registered chunk in guest
+ * order.
+ */
+struct BlockSeqWriter {
+    BlockDriver *drv;
+    void *opaque;
+    int fd;
+
+    /* Virtual disk size in bytes */
+    int64_t size;
+
+    /* Size of the chunks in @data_map, set by .bdrv_seq_writer_open() */
+    int64_t granularity;
+    unsigned long *data_map;
+    int64_t nb_chunks;
+
+    /* Guest offset up to which all data has been written */
+    int64_t pos;
+};
+
 
 struct BlockDriver {
     /*
@@ -163,6 +188,12 @@ struct BlockDriver {
      */
     bool supports_backing;
 
+    /*
+     * Set if .bdrv_co_check() can verify guest data (BDRV_CHECK_DATA).  For
+     * other drivers, bdrv_co_check() rejects requests that include it.
+     */
+    bool supports_check_data;
+
     /*
      * Drivers setting this field must be able to work with just a plain
      * filename with '<protocol_name>:' as a prefix, and no other options.
@@ -259,6 +290,21 @@ struct BlockDriver {
     int coroutine_fn GRAPH_UNLOCKED_PTR (*bdrv_co_create_opts)(
         BlockDriver *drv, const char *filename, QemuOpts *opts, Error **errp);
 
+    /*
+     * Sequential image output, see struct BlockSeqWriter.
+     *
+     * .bdrv_seq_writer_open() checks the creation options @opts and sets
+     * w->granularity.  .bdrv_seq_writer_start() writes everything that
+     * precedes the guest data with bdrv_seq_writer_output(), once the data
+     * map is complete.  Every chunk set in the data map is then written as a
+     * whole, in guest order.
+     */
+    int seq_writer_instance_size;
+    int (*bdrv_seq_writer_open)(BlockSeqWriter *w, QemuOpts *opts,
+                                Error **errp);
+    int (*bdrv_seq_writer_start)(BlockSeqWriter *w, Error **errp);
+    void (*bdrv_seq_writer_close)(BlockSeqWriter *w);
+
     int GRAPH_RDLOCK_PTR (*bdrv_amend_options)(
         BlockDriverState *bs, QemuOpts *opts,
         BlockDriverAmendStatusCB *status_cb, void *cb_opaque,
@@ -147,6 +147,11 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
  * driver that the mirror job inserts into the graph above @bs. NULL means that
  * a node name should be autogenerated.
  * @copy_mode: When to trigger writes to the target.
+ * @adaptive_request_size: Whether to adapt the size of copy requests to the
+ * access pattern instead of using a fixed maximum.
+ * @iothreads: IOThreads across which copy requests are distributed, or NULL
+ * to issue them in the job's AioContext.
+ * @nr_iothreads: The number of elements in @iothreads.
  * @errp: Error object.
  *
  * Start a mirroring operation on @bs.  Clusters that are allocated
@@ -163,7 +168,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp);
+                  MirrorCopyMode copy_mode, bool adaptive_request_size,
+                  IOThread **iothreads, size_t nr_iothreads, Error **errp);
 
 /*
  * backup_job_create:
@@ -175,6 +181,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is 'bitmap' or 'incremental'
  * @bitmap_mode: The bitmap synchronization policy to use.
+ * @hashes: Node keeping per-cluster content hashes of the previous backup,
+ *          clusters whose hash didn't change are skipped (may be NULL).
  * @perf: Performance options. All actual fields assumed to be present,
  *        all ".has_*" fields are ignored.
  * @on_source_error: The action to take upon error reading from the source.
@@ -194,6 +202,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                             BdrvDirtyBitmap *sync_bitmap,
                             BitmapSyncMode bitmap_mode,
                             bool compress,
+                            BlockDriverState *hashes,
                             const char *filter_node_name,
                             BackupPerf *perf,
                             BlockdevOnError on_source_error,
@@ -323,4 +332,7 @@ void bdrv_remove_aio_context_notifier(BlockDriverState *bs,
  */
 void bdrv_drain_all_end_quiesce(BlockDriverState *bs);
 
+int bdrv_seq_writer_output(BlockSeqWriter *w, const void *buf, size_t len,
+                           Error **errp);
+
 #endif /* BLOCK_INT_GLOBAL_STATE_H */
@@ -79,6 +79,14 @@ void bdrv_dirty_bitmap_deserialize_ones(BdrvDirtyBitmap *bitmap,
                                         bool finish);
 void bdrv_dirty_bitmap_deserialize_finish(BdrvDirtyBitmap *bitmap);
 
+void bdrv_create_meta_dirty_bitmap(BdrvDirtyBitmap *bitmap, int chunk_size);
+void bdrv_release_meta_dirty_bitmap(BdrvDirtyBitmap *bitmap);
+bool bdrv_dirty_bitmap_has_meta(BdrvDirtyBitmap *bitmap);
+bool bdrv_dirty_bitmap_get_meta(BdrvDirtyBitmap *bitmap, int64_t offset,
+                                int64_t bytes);
+void bdrv_dirty_bitmap_reset_meta(BdrvDirtyBitmap *bitmap, int64_t offset,
+                                  int64_t bytes);
+
 void bdrv_dirty_bitmap_set_readonly(BdrvDirtyBitmap *bitmap, bool value);
 void bdrv_dirty_bitmap_set_persistence(BdrvDirtyBitmap *bitmap,
                                        bool persistent);
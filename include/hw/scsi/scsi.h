@@ -33,6 +33,8 @@ struct SCSIRequest {
     uint64_t          residual;
     SCSICommand       cmd;
     NotifierList      cancel_notifiers;
+    /* AioContext that submitted and completes this request */
+    AioContext        *ctx;
 
     /* Note:
      * - fields before sense are initialized by scsi_req_alloc;
@@ -77,9 +79,12 @@ struct SCSIDevice
     uint32_t sense_len;
 
     /*
-     * The requests list is only accessed from the AioContext that executes
-     * requests or from the main loop when IOThread processing is stopped.
+     * Requests may be submitted from several AioContexts at once (e.g. when
+     * an HBA maps its queues to different IOThreads), so the list is
+     * protected by requests_lock. Each request itself is only touched from
+     * its own SCSIRequest->ctx.
      */
+    QemuMutex requests_lock;
     QTAILQ_HEAD(, SCSIRequest) requests;
 
     uint32_t channel;
@@ -18,8 +18,11 @@
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
 #include "net/announce.h"
+#include "net/checksum.h"
 #include "qemu/option_int.h"
 #include "qom/object.h"
+#include "sysemu/iothread.h"
+#include "qapi/qapi-types-virtio.h"
 
 #include "ebpf/ebpf_rss.h"
 
@@ -146,6 +149,8 @@ typedef struct VirtioNetRssData {
     bool    populate_hash;
     uint32_t hash_types;
     uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    /* Precomputed from @key for software RSS */
+    NetToeplitzTable *key_table;
     uint16_t indirections_len;
     uint16_t *indirections_table;
     uint16_t default_queue;
@@ -227,6 +232,12 @@ struct VirtIONet {
     struct EBPFRSSContext ebpf_rss;
     uint32_t nr_ebpf_rss_fds;
     char **ebpf_rss_fds;
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
+    /* AioContext of each queue pair, NULL without iothread-vq-mapping */
+    AioContext **vq_aio_context;
+    bool dataplane_started;
+    /* Nesting level of virtio_net_dataplane_pause() */
+    unsigned dataplane_paused;
 };
 
 size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
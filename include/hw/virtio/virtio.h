@@ -69,6 +69,7 @@ typedef struct VirtQueueElement
     unsigned int ndescs;
     unsigned int out_num;
     unsigned int in_num;
+    bool in_order_filled;
     hwaddr *in_addr;
     hwaddr *out_addr;
     struct iovec *in_sg;
@@ -96,6 +97,22 @@ enum virtio_device_endian {
     VIRTIO_DEVICE_ENDIAN_BIG,
 };
 
+/* Upper limit for the irq-coalesce-usecs property */
+#define VIRTIO_IRQ_COALESCE_MAX_USECS 100000
+
+/**
+ * struct VirtIOIRQCoalesce - interrupt coalescing settings
+ * @usecs: how long a queue interrupt may be held back, 0 to disable
+ * @frames: inject the interrupt once this many completions are waiting,
+ * 0 for no limit
+ * @adaptive: wait for fewer completions when the queue is lightly loaded
+ */
+typedef struct VirtIOIRQCoalesce {
+    uint32_t usecs;
+    uint32_t frames;
+    bool adaptive;
+} VirtIOIRQCoalesce;
+
 /**
  * struct VirtIODevice - common VirtIO structure
  * @name: name of the device
@@ -165,6 +182,8 @@ struct VirtIODevice
      */
     EventNotifier config_notifier;
     bool device_iotlb_enabled;
+    /* Set through DEFINE_VIRTIO_IRQ_COALESCE_PROPERTIES() */
+    VirtIOIRQCoalesce irq_coalesce;
 };
 
 struct VirtioDeviceClass {
@@ -254,6 +273,8 @@ void virtio_delete_queue(VirtQueue *vq);
 
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len);
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement *const *elems,
+                          const unsigned int *lens, unsigned int count);
 void virtqueue_flush(VirtQueue *vq, unsigned int count);
 void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
                               unsigned int len);
@@ -265,6 +286,8 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
 void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem);
 void *virtqueue_pop(VirtQueue *vq, size_t sz);
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max);
 unsigned int virtqueue_drop_all(VirtQueue *vq);
 void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz);
 void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
@@ -371,6 +394,15 @@ typedef struct VirtIORNGConf VirtIORNGConf;
     DEFINE_PROP_BIT64("queue_reset", _state, _field, \
                       VIRTIO_F_RING_RESET, true)
 
+/*
+ * Interrupt coalescing for devices that complete requests in QEMU.  @_field
+ * is the path to the VirtIODevice irq_coalesce member of @_state.
+ */
+#define DEFINE_VIRTIO_IRQ_COALESCE_PROPERTIES(_state, _field) \
+    DEFINE_PROP_UINT32("irq-coalesce-usecs", _state, _field.usecs, 0), \
+    DEFINE_PROP_UINT32("irq-coalesce-frames", _state, _field.frames, 64), \
+    DEFINE_PROP_BOOL("irq-coalesce-adaptive", _state, _field.adaptive, true)
+
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n);
 bool virtio_queue_enabled_legacy(VirtIODevice *vdev, int n);
 bool virtio_queue_enabled(VirtIODevice *vdev, int n);
@@ -391,6 +423,8 @@ EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq);
 void virtio_queue_set_guest_notifier_fd_handler(VirtQueue *vq, bool assign,
                                                 bool with_irqfd);
 int virtio_device_start_ioeventfd(VirtIODevice *vdev);
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev);
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev);
 int virtio_device_grab_ioeventfd(VirtIODevice *vdev);
 void virtio_device_release_ioeventfd(VirtIODevice *vdev);
 bool virtio_device_ioeventfd_enabled(VirtIODevice *vdev);
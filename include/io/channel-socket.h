@@ -262,4 +262,43 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
 
+/**
+ * qio_channel_socket_set_zero_copy:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Enable zero copy transmission on a connected socket, so
+ * that QIO_CHANNEL_WRITE_FLAG_ZERO_COPY can be used for
+ * writes. Sockets created by qio_channel_socket_connect_sync()
+ * already have it enabled where available; this is for
+ * sockets obtained by other means, such as an accepted
+ * client connection.
+ *
+ * Returns: 0 on success, -1 if the host does not support
+ * zero copy on this socket
+ */
+int
+qio_channel_socket_set_zero_copy(QIOChannelSocket *ioc,
+                                 Error **errp);
+
+/**
+ * qio_channel_socket_zero_copy_reap:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Process the completion notifications for zero copy
+ * writes that have already arrived, without waiting for
+ * more. Unlike qio_channel_flush(), this never blocks, so
+ * coroutines can use it to wait for completion without
+ * stalling their thread.
+ *
+ * Returns: QIO_CHANNEL_ERR_BLOCK if some zero copy writes
+ * have not completed yet, -1 on error, otherwise the same
+ * as qio_channel_flush()
+ */
+int
+qio_channel_socket_zero_copy_reap(QIOChannelSocket *ioc,
+                                  Error **errp);
+
+
 #endif /* QIO_CHANNEL_SOCKET_H */
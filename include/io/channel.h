@@ -31,6 +31,7 @@ OBJECT_DECLARE_TYPE(QIOChannel, QIOChannelClass,
 
 
 #define QIO_CHANNEL_ERR_BLOCK -2
+#define QIO_CHANNEL_ERR_NOBUFS -3
 
 #define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY 0x1
 
@@ -278,6 +279,12 @@ ssize_t qio_channel_readv_full(QIOChannel *ioc,
  * unless qio_channel_has_feature() returns a true
  * value for the QIO_CHANNEL_FEATURE_FD_PASS constant.
  *
+ * If QIO_CHANNEL_WRITE_FLAG_ZERO_COPY is given and the
+ * kernel cannot pin any more memory for zero copy
+ * writes, nothing is sent and QIO_CHANNEL_ERR_NOBUFS
+ * is returned. The caller may then flush and retry
+ * without the flag.
+ *
  * Returns: the number of bytes sent, or -1 on error,
  * or QIO_CHANNEL_ERR_BLOCK if no data is can be sent
  * and the channel is non-blocking
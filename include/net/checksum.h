@@ -108,4 +108,62 @@ void net_toeplitz_add(uint32_t *result,
     *result = accumulator;
 }
 
+/* Longest RSS input: IPv6 source and destination addresses and ports */
+#define NET_TOEPLITZ_MAX_INPUT 36
+
+/*
+ * Toeplitz hash contribution of every possible value of every input byte.
+ * Hashing then costs one table lookup per input byte instead of a loop
+ * over the bits of the input and of the key.
+ */
+typedef struct NetToeplitzTable {
+    uint32_t t[NET_TOEPLITZ_MAX_INPUT][256];
+} NetToeplitzTable;
+
+/*
+ * Precompute @table for @key_bytes, which must hold at least
+ * NET_TOEPLITZ_MAX_INPUT + 4 bytes.
+ */
+static inline
+void net_toeplitz_table_init(NetToeplitzTable *table,
+                             const uint8_t *key_bytes)
+{
+    uint32_t byte, bit, value;
+
+    for (byte = 0; byte < NET_TOEPLITZ_MAX_INPUT; byte++) {
+        uint64_t window = (uint64_t)key_bytes[byte] << 32 |
+                          (uint64_t)ldl_be_p(&key_bytes[byte + 1]);
+        uint32_t *t = table->t[byte];
+
+        /* Input bit 7 - bit selects the key window starting at that bit */
+        t[0] = 0;
+        for (bit = 0; bit < 8; bit++) {
+            t[0x80 >> bit] = window >> (8 - bit);
+        }
+
+        /* Other values are the XOR of the windows of their set bits */
+        for (value = 1; value < 256; value++) {
+            uint32_t lowest = value & -value;
+
+            t[value] = t[value ^ lowest] ^ t[lowest];
+        }
+    }
+}
+
+static inline
+uint32_t net_toeplitz_table_hash(const NetToeplitzTable *table,
+                                 const uint8_t *input, uint32_t len)
+{
+    uint32_t result = 0;
+    uint32_t byte;
+
+    assert(len <= NET_TOEPLITZ_MAX_INPUT);
+
+    for (byte = 0; byte < len; byte++) {
+        result ^= table->t[byte][input[byte]];
+    }
+
+    return result;
+}
+
 #endif /* QEMU_NET_CHECKSUM_H */
@@ -69,6 +69,7 @@ typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 typedef void (NetAnnounce)(NetClientState *);
 typedef bool (SetSteeringEBPF)(NetClientState *, int);
 typedef bool (NetCheckPeerType)(NetClientState *, ObjectClass *, Error **);
+typedef void (SetAioContext)(NetClientState *, AioContext *);
 
 typedef struct NetClientInfo {
     NetClientDriver type;
@@ -98,6 +99,7 @@ typedef struct NetClientInfo {
     NetAnnounce *announce;
     SetSteeringEBPF *set_steering_ebpf;
     NetCheckPeerType *check_peer_type;
+    SetAioContext *set_aio_context;
 } NetClientInfo;
 
 struct NetClientState {
@@ -118,6 +120,13 @@ struct NetClientState {
     bool is_netdev;
     bool do_not_pad; /* do not pad to the minimum ethernet frame length */
     bool is_datapath;
+    /* Processing the packets, NULL for the main loop */
+    AioContext *aio_context;
+    /* The NIC may move this client into an IOThread */
+    bool aio_context_mapped;
+    /* Offloads last applied with qemu_set_offload() */
+    bool offload_tso4;
+    bool offload_tso6;
     QTAILQ_HEAD(, NetFilterState) filters;
 };
 
@@ -176,6 +185,9 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+ssize_t qemu_sendv_packet_async_borrow(NetClientState *nc,
+                                       const struct iovec *iov, int iovcnt,
+                                       NetPacketSent *sent_cb);
 ssize_t qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_receive_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_receive_packet_iov(NetClientState *nc,
@@ -202,6 +214,8 @@ int qemu_get_vnet_hdr_len(NetClientState *nc);
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
 int qemu_set_vnet_le(NetClientState *nc, bool is_le);
 int qemu_set_vnet_be(NetClientState *nc, bool is_be);
+bool qemu_can_set_aio_context(NetClientState *nc);
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
 /**
  * qemu_find_nic_info: Obtain NIC configuration information
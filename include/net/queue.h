@@ -32,6 +32,8 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/* The buffers stay valid until the sent callback runs, queue without a copy */
+#define QEMU_NET_PACKET_FLAG_BORROW  (1 << 1)
 
 /* Returns:
  *   >0 - success
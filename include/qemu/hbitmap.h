@@ -265,10 +265,41 @@ char *hbitmap_sha256(const HBitmap *bitmap, Error **errp);
  * hbitmap_free:
  * @hb: HBitmap to operate on.
  *
- * Free an HBitmap and all of its associated memory.
+ * Free an HBitmap and all of its associated memory.  The meta bitmap, if
+ * any, must have been freed with hbitmap_free_meta() before.
  */
 void hbitmap_free(HBitmap *hb);
 
+/**
+ * hbitmap_create_meta:
+ * @hb: HBitmap to operate on.
+ * @chunk_size: How many bits in @hb does one bit in the meta bitmap track;
+ *              must be a power of two.
+ *
+ * Create a "meta" HBitmap that tracks changes to the bits of @hb: every
+ * set or reset that actually flips a bit of @hb sets the corresponding bit
+ * in the meta bitmap, which uses the same item numbers as @hb.  Operations
+ * that change @hb wholesale mark the whole meta bitmap.  The caller may
+ * reset bits of the meta bitmap, but must not free it.
+ */
+HBitmap *hbitmap_create_meta(HBitmap *hb, int chunk_size);
+
+/**
+ * hbitmap_free_meta:
+ * @hb: HBitmap whose meta bitmap should be released.
+ *
+ * Stop tracking changes of @hb and free its meta bitmap.
+ */
+void hbitmap_free_meta(HBitmap *hb);
+
+/**
+ * hbitmap_meta:
+ * @hb: HBitmap to operate on.
+ *
+ * Returns the meta bitmap of @hb, or NULL if it has none.
+ */
+HBitmap *hbitmap_meta(const HBitmap *hb);
+
 /**
  * hbitmap_iter_init:
  * @hbi: HBitmapIter to initialize.
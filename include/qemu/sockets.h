@@ -153,4 +153,20 @@ SocketAddress *socket_address_flatten(SocketAddressLegacy *addr);
  * Return 0 on success.
  */
 int socket_address_parse_named_fd(SocketAddress *addr, Error **errp);
+
+/**
+ * socket_set_busy_poll:
+ * @fd: the socket
+ * @usecs: how long a system call may busy poll the device queue
+ * @budget: how many packets one busy poll iteration may process
+ * @errp: pointer to uninitialized error object
+ *
+ * Ask the kernel to service the device queue of @fd only when the
+ * application busy polls it (SO_PREFER_BUSY_POLL, SO_BUSY_POLL and
+ * SO_BUSY_POLL_BUDGET), instead of from interrupts.  This usually needs
+ * CAP_NET_ADMIN, and fails if the host does not support it.
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int socket_set_busy_poll(int fd, int usecs, int budget, Error **errp);
 #endif /* QEMU_SOCKETS_H */
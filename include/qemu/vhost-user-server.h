@@ -24,6 +24,7 @@ typedef struct VuFdWatch {
     int fd; /*kick fd*/
     void *pvt;
     vu_watch_cb cb;
+    AioContext *ctx; /* where the fd is monitored, or NULL */
     QTAILQ_ENTRY(VuFdWatch) next;
 } VuFdWatch;
 
@@ -31,17 +32,30 @@ typedef struct VuFdWatch {
  * VuServer:
  * A vhost-user server instance with user-defined VuDevIface callbacks.
  * Vhost-user device backends can be implemented using VuServer. VuDevIface
- * callbacks and virtqueue kicks run in the given AioContext.
+ * callbacks and virtqueue kicks run in the given AioContext, unless an
+ * AioContext is given for each virtqueue, in which case virtqueue kicks run
+ * in the AioContext of the virtqueue.
  */
 typedef struct {
     QIONetListener *listener;
     QEMUBH *restart_listener_bh;
     AioContext *ctx;
+    AioContext **vq_aio_context; /* max_queues elements, or NULL */
     int max_queues;
     const VuDevIface *vu_iface;
 
     unsigned int in_flight; /* atomic */
 
+    /*
+     * Virtqueue processing in other threads is paused while a vhost-user
+     * message is handled. Both atomic.
+     */
+    bool vqs_paused;
+    unsigned int kick_handlers_running;
+
+    /* Protects vu_fd_watches against remove_watch() from virtqueue threads */
+    QemuMutex vu_fd_watches_lock;
+
     /* Protected by ctx lock */
     bool in_qio_channel_yield;
     bool wait_idle;
@@ -57,6 +71,7 @@ typedef struct {
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *unix_socket,
                              AioContext *ctx,
+                             AioContext **vq_aio_context,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp);
@@ -15,6 +15,7 @@
 #define IOTHREAD_H
 
 #include "block/aio.h"
+#include "qapi/qapi-types-common.h"
 #include "qemu/thread.h"
 #include "qom/object.h"
 #include "sysemu/event-loop-base.h"
@@ -39,7 +40,6 @@ struct IOThread {
     int64_t poll_grow;
     int64_t poll_shrink;
 };
-typedef struct IOThread IOThread;
 
 DECLARE_INSTANCE_CHECKER(IOThread, IOTHREAD,
                          TYPE_IOTHREAD)
@@ -49,6 +49,32 @@ IOThread *iothread_by_id(const char *id);
 AioContext *iothread_get_aio_context(IOThread *iothread);
 GMainContext *iothread_get_g_main_context(IOThread *iothread);
 
+/**
+ * iothread_vq_mapping_apply:
+ * @list: The mapping of virtqueues to IOThreads.
+ * @vq_aio_context: The array of AioContext pointers to fill in.
+ * @num_queues: The length of @vq_aio_context.
+ * @errp: If an error occurs, a pointer to the area to store the error.
+ *
+ * Fill in the AioContext for each virtqueue in the @vq_aio_context array given
+ * the iothread-vq-mapping parameter in @list.  A reference is taken on each
+ * IOThread in @list, it must be released with iothread_vq_mapping_cleanup().
+ *
+ * Returns: %true on success, %false on failure.
+ **/
+bool iothread_vq_mapping_apply(IOThreadVirtQueueMappingList *list,
+                               AioContext **vq_aio_context,
+                               uint16_t num_queues,
+                               Error **errp);
+
+/**
+ * iothread_vq_mapping_cleanup:
+ * @list: The mapping of virtqueues to IOThreads.
+ *
+ * Release the IOThread references taken by iothread_vq_mapping_apply().
+ **/
+void iothread_vq_mapping_cleanup(IOThreadVirtQueueMappingList *list);
+
 /*
  * Helpers used to allocate iothreads for internal use.  These
  * iothreads will not be seen by monitor clients when query using
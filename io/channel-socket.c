@@ -164,15 +164,8 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
-#ifdef QEMU_MSG_ZEROCOPY
-    int ret, v = 1;
-    ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
-    if (ret == 0) {
-        /* Zero copy available on host */
-        qio_channel_set_feature(QIO_CHANNEL(ioc),
-                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
-    }
-#endif
+    /* Zero copy is optional, so failure to enable it is not an error */
+    qio_channel_socket_set_zero_copy(ioc, NULL);
 
     qio_channel_set_feature(QIO_CHANNEL(ioc),
                             QIO_CHANNEL_FEATURE_READ_MSG_PEEK);
@@ -181,6 +174,28 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
 }
 
 
+int qio_channel_socket_set_zero_copy(QIOChannelSocket *ioc,
+                                     Error **errp)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    int v = 1;
+
+    if (setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) < 0) {
+        error_setg_errno(errp, errno, "Unable to enable zero copy on socket");
+        return -1;
+    }
+
+    /* Zero copy available on host */
+    qio_channel_set_feature(QIO_CHANNEL(ioc),
+                            QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+    return 0;
+#else
+    error_setg(errp, "Zero copy is not supported on this host");
+    return -1;
+#endif
+}
+
+
 static void qio_channel_socket_connect_worker(QIOTask *task,
                                               gpointer opaque)
 {
@@ -614,7 +629,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
             if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
                 error_setg_errno(errp, errno,
                                  "Process can't lock enough memory for using MSG_ZEROCOPY");
-                return -1;
+                return QIO_CHANNEL_ERR_NOBUFS;
             }
             break;
         }
@@ -725,10 +740,11 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
 
 
 #ifdef QEMU_MSG_ZEROCOPY
-static int qio_channel_socket_flush(QIOChannel *ioc,
-                                    Error **errp)
+static int qio_channel_socket_read_errqueue(QIOChannelSocket *sioc,
+                                            bool block,
+                                            Error **errp)
 {
-    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    QIOChannel *ioc = QIO_CHANNEL(sioc);
     struct msghdr msg = {};
     struct sock_extended_err *serr;
     struct cmsghdr *cm;
@@ -751,6 +767,9 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
         if (received < 0) {
             switch (errno) {
             case EAGAIN:
+                if (!block) {
+                    return QIO_CHANNEL_ERR_BLOCK;
+                }
                 /* Nothing on errqueue, wait until something is available */
                 qio_channel_wait(ioc, G_IO_ERR);
                 continue;
@@ -800,8 +819,25 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
     return ret;
 }
 
+static int qio_channel_socket_flush(QIOChannel *ioc,
+                                    Error **errp)
+{
+    return qio_channel_socket_read_errqueue(QIO_CHANNEL_SOCKET(ioc), true,
+                                            errp);
+}
+
 #endif /* QEMU_MSG_ZEROCOPY */
 
+int qio_channel_socket_zero_copy_reap(QIOChannelSocket *ioc,
+                                      Error **errp)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    return qio_channel_socket_read_errqueue(ioc, false, errp);
+#else
+    return 0;
+#endif
+}
+
 static int
 qio_channel_socket_set_blocking(QIOChannel *ioc,
                                 bool enabled,
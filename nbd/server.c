@@ -28,6 +28,7 @@
 #include "nbd-internal.h"
 #include "qemu/units.h"
 #include "qemu/memalign.h"
+#include "sysemu/iothread.h"
 
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_ALLOCATION_DEPTH 1
@@ -42,6 +43,22 @@
  */
 #define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * MiB / 8)
 
+/*
+ * Read payloads smaller than this are always copied into the socket; pinning
+ * the pages and waiting for the completion notification costs more than the
+ * copy for small buffers.
+ */
+#define NBD_ZERO_COPY_MIN_SIZE (64 * KiB)
+
+/*
+ * Buffers sent with MSG_ZEROCOPY stay allocated until the kernel reports that
+ * it is done with them.  Completions are collected after every send, but once
+ * this much data is pending, the sender waits for them, checking the socket
+ * error queue every NBD_ZERO_COPY_POLL_NS.
+ */
+#define NBD_ZERO_COPY_FLUSH_SIZE (64 * MiB)
+#define NBD_ZERO_COPY_POLL_NS (50 * SCALE_US)
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -83,6 +100,7 @@ struct NBDRequestData {
     NBDClient *client;
     uint8_t *data;
     bool complete;
+    bool zero_copy; /* data was sent with MSG_ZEROCOPY */
 };
 
 struct NBDExport {
@@ -101,6 +119,13 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    /* IOThreads that new client connections are distributed across */
+    IOThread **iothreads;
+    size_t nr_iothreads;
+    size_t next_iothread; /* only accessed from the main loop thread */
+
+    bool zero_copy;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -128,6 +153,7 @@ struct NBDClient {
     QemuMutex lock;
 
     NBDExport *exp;
+    AioContext *ctx; /* NULL to run in the export AioContext */
     QCryptoTLSCreds *tlscreds;
     char *tlsauthz;
     QIOChannelSocket *sioc; /* The underlying data channel */
@@ -138,6 +164,15 @@ struct NBDClient {
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
+    /*
+     * Read payloads are sent with MSG_ZEROCOPY.  Buffers whose transmission
+     * may not have completed yet are kept in zero_copy_bufs until the next
+     * flush.  zero_copy_pending is protected by send_lock.
+     */
+    bool zero_copy;
+    size_t zero_copy_pending;
+    GSList *zero_copy_bufs; /* protected by lock */
+
     bool read_yielding; /* protected by lock */
     bool quiescing; /* protected by lock */
 
@@ -157,6 +192,16 @@ struct NBDClient {
 
 static void nbd_client_receive_next_request(NBDClient *client);
 
+/*
+ * Returns the AioContext in which requests of @client are processed.  This is
+ * either the client's IOThread or the export AioContext, which may change
+ * while the client is quiesced.
+ */
+static AioContext *nbd_client_aio_context(NBDClient *client)
+{
+    return client->ctx ?: client->exp->common.ctx;
+}
+
 /* Basic flow for negotiation
 
    Server         Client
@@ -1510,7 +1555,7 @@ static int coroutine_fn nbd_receive_request(NBDClient *client, NBDRequest *reque
 
 #define MAX_NBD_REQUESTS 16
 
-/* Runs in export AioContext and main loop thread */
+/* Runs in client AioContext and main loop thread */
 void nbd_client_get(NBDClient *client)
 {
     qatomic_inc(&client->refcount);
@@ -1526,6 +1571,13 @@ void nbd_client_put(NBDClient *client)
          */
         assert(client->closing);
 
+        /*
+         * The connection has been shut down, so nothing the client still
+         * waits for can be in flight.  The kernel holds its own references
+         * to pages of any remaining zero copy transmissions.
+         */
+        g_slist_free_full(client->zero_copy_bufs, qemu_vfree);
+
         object_unref(OBJECT(client->sioc));
         object_unref(OBJECT(client->ioc));
         if (client->tlscreds) {
@@ -1591,7 +1643,7 @@ static void client_close(NBDClient *client, bool negotiated)
     }
 }
 
-/* Runs in export AioContext with client->lock held */
+/* Runs in client AioContext with client->lock held */
 static NBDRequestData *nbd_request_get(NBDClient *client)
 {
     NBDRequestData *req;
@@ -1604,12 +1656,16 @@ static NBDRequestData *nbd_request_get(NBDClient *client)
     return req;
 }
 
-/* Runs in export AioContext with client->lock held */
+/* Runs in client AioContext with client->lock held */
 static void nbd_request_put(NBDRequestData *req)
 {
     NBDClient *client = req->client;
 
-    if (req->data) {
+    if (req->zero_copy) {
+        /* Freed by nbd_client_zero_copy_reap() */
+        client->zero_copy_bufs = g_slist_prepend(client->zero_copy_bufs,
+                                                  req->data);
+    } else if (req->data) {
         qemu_vfree(req->data);
     }
     g_free(req);
@@ -1683,7 +1739,7 @@ static void nbd_drained_end(void *opaque)
     }
 }
 
-/* Runs in export AioContext */
+/* Runs in client AioContext */
 static void nbd_wake_read_bh(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1709,7 +1765,7 @@ static bool nbd_drained_poll(void *opaque)
                  * qio_channel_yield().
                  */
                 if (client->recv_coroutine != NULL && client->read_yielding) {
-                    aio_bh_schedule_oneshot(nbd_export_aio_context(client->exp),
+                    aio_bh_schedule_oneshot(nbd_client_aio_context(client),
                                             nbd_wake_read_bh, client);
                 }
 
@@ -1759,6 +1815,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     uint64_t perm, shared_perm;
     bool readonly = !exp_args->writable;
     BlockDirtyBitmapOrStrList *bitmaps;
+    strList *iothreads;
     size_t i;
     int ret;
 
@@ -1785,6 +1842,23 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
         return -EEXIST;
     }
 
+    if (arg->iothreads) {
+        if (exp_args->iothread) {
+            error_setg(errp, "iothread and iothreads cannot be set at the "
+                       "same time");
+            return -EINVAL;
+        }
+
+        for (iothreads = arg->iothreads; iothreads;
+             iothreads = iothreads->next) {
+            if (!iothread_by_id(iothreads->value)) {
+                error_setg(errp, "IOThread \"%s\" object does not exist",
+                           iothreads->value);
+                return -EINVAL;
+            }
+        }
+    }
+
     size = blk_getlength(blk);
     if (size < 0) {
         error_setg_errno(errp, -size,
@@ -1887,6 +1961,17 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
+
+    exp->nr_iothreads = QAPI_LIST_LENGTH(arg->iothreads);
+    exp->iothreads = g_new(IOThread *, exp->nr_iothreads);
+    for (i = 0, iothreads = arg->iothreads; iothreads;
+         i++, iothreads = iothreads->next)
+    {
+        /* Released in nbd_export_delete() */
+        exp->iothreads[i] = iothread_by_id(iothreads->value);
+        object_ref(OBJECT(exp->iothreads[i]));
+    }
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -1977,6 +2062,12 @@ static void nbd_export_delete(BlockExport *blk_exp)
     for (i = 0; i < exp->nr_export_bitmaps; i++) {
         bdrv_dirty_bitmap_set_busy(exp->export_bitmaps[i], false);
     }
+
+    for (i = 0; i < exp->nr_iothreads; i++) {
+        object_unref(OBJECT(exp->iothreads[i]));
+    }
+    g_free(exp->iothreads);
+    exp->iothreads = NULL;
 }
 
 const BlockExportDriver blk_exp_nbd = {
@@ -2004,6 +2095,134 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Collect the completion notifications for data sent with MSG_ZEROCOPY and
+ * free the buffers that were kept alive for it once the kernel is done with
+ * all of them.  If @wait is true, the coroutine waits until that is the case.
+ *
+ * The notifications arrive on the socket error queue, which can't be waited
+ * for in an AioContext without also waking up for every writable socket, so
+ * the coroutine polls it with a short sleep instead of blocking the thread in
+ * qio_channel_flush().  Called with send_lock held.
+ */
+static int coroutine_fn nbd_client_zero_copy_reap(NBDClient *client,
+                                                  bool wait, Error **errp)
+{
+    GSList *bufs;
+    int ret;
+
+    while ((ret = qio_channel_socket_zero_copy_reap(client->sioc, errp)) ==
+           QIO_CHANNEL_ERR_BLOCK) {
+        if (!wait) {
+            return 0;
+        }
+        qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, NBD_ZERO_COPY_POLL_NS);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    if (client->zero_copy_pending) {
+        trace_nbd_client_zero_copy_flush(client->zero_copy_pending, ret == 1);
+        client->zero_copy_pending = 0;
+    }
+
+    /*
+     * Requests add their buffer to the list only after sending it, and
+     * sending is serialized by send_lock, so every buffer on the list has
+     * been covered by the flush.
+     */
+    WITH_QEMU_LOCK_GUARD(&client->lock) {
+        bufs = client->zero_copy_bufs;
+        client->zero_copy_bufs = NULL;
+    }
+    g_slist_free_full(bufs, qemu_vfree);
+
+    return 0;
+}
+
+/*
+ * Sends @payload with MSG_ZEROCOPY.  If the kernel can't pin any more memory
+ * for it, the pending zero copy writes are flushed and the rest is sent by
+ * copying.  Called with send_lock held.
+ */
+static int coroutine_fn nbd_co_send_zero_copy(NBDClient *client,
+                                              struct iovec *payload,
+                                              Error **errp)
+{
+    struct iovec iov = *payload;
+    Error *local_err = NULL;
+    ssize_t len;
+
+    while (iov.iov_len > 0) {
+        len = qio_channel_writev_full(client->ioc, &iov, 1, NULL, 0,
+                                      QIO_CHANNEL_WRITE_FLAG_ZERO_COPY,
+                                      &local_err);
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            continue;
+        }
+        if (len == QIO_CHANNEL_ERR_NOBUFS) {
+            trace_nbd_client_zero_copy_nobufs(iov.iov_len);
+            error_free(local_err);
+            if (nbd_client_zero_copy_reap(client, true, errp) < 0) {
+                return -1;
+            }
+            return qio_channel_writev_all(client->ioc, &iov, 1, errp);
+        }
+        if (len < 0) {
+            error_propagate(errp, local_err);
+            return -1;
+        }
+        iov.iov_base += len;
+        iov.iov_len -= len;
+    }
+
+    return 0;
+}
+
+/*
+ * Like nbd_co_send_iov(), but the last element of @iov is read payload from
+ * the buffer of @req.  If the client uses zero copy, the payload is sent with
+ * MSG_ZEROCOPY and nbd_request_put() keeps the buffer alive until the kernel
+ * has reported completion.  @req may be NULL if the payload is not owned by a
+ * request.
+ */
+static int coroutine_fn nbd_co_send_payload_iov(NBDClient *client,
+                                                NBDRequestData *req,
+                                                struct iovec *iov,
+                                                unsigned niov, Error **errp)
+{
+    struct iovec *payload = &iov[niov - 1];
+    int ret;
+
+    if (!req || !client->zero_copy ||
+        payload->iov_len < NBD_ZERO_COPY_MIN_SIZE) {
+        return nbd_co_send_iov(client, iov, niov, errp);
+    }
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    /* The reply header lives on the stack, so it must be copied */
+    req->zero_copy = true;
+    ret = qio_channel_writev_all(client->ioc, iov, niov - 1, errp);
+    if (ret == 0) {
+        ret = nbd_co_send_zero_copy(client, payload, errp);
+    }
+    if (ret == 0) {
+        client->zero_copy_pending += payload->iov_len;
+        ret = nbd_client_zero_copy_reap(client,
+                                        client->zero_copy_pending >=
+                                        NBD_ZERO_COPY_FLUSH_SIZE, errp);
+    }
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret < 0 ? -EIO : 0;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t cookie)
 {
@@ -2013,6 +2232,7 @@ static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
 }
 
 static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
+                                                 NBDRequestData *req,
                                                  NBDRequest *request,
                                                  uint32_t error,
                                                  void *data,
@@ -2035,7 +2255,7 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
                                    nbd_err_lookup(nbd_err), len);
     set_be_simple_reply(&reply, nbd_err, request->cookie);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_payload_iov(client, req, iov, 2, errp);
 }
 
 /*
@@ -2095,6 +2315,7 @@ static int coroutine_fn nbd_co_send_chunk_done(NBDClient *client,
 }
 
 static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
+                                               NBDRequestData *req,
                                                NBDRequest *request,
                                                uint64_t offset,
                                                void *data,
@@ -2116,7 +2337,7 @@ static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
                  NBD_REPLY_TYPE_OFFSET_DATA, request);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 3, errp);
+    return nbd_co_send_payload_iov(client, req, iov, 3, errp);
 }
 
 static int coroutine_fn nbd_co_send_chunk_error(NBDClient *client,
@@ -2150,6 +2371,7 @@ static int coroutine_fn nbd_co_send_chunk_error(NBDClient *client,
  * reported to the client, at which point this function succeeds.
  */
 static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
+                                                NBDRequestData *req,
                                                 NBDRequest *request,
                                                 uint64_t offset,
                                                 uint8_t *data,
@@ -2202,8 +2424,9 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                 error_setg_errno(errp, -ret, "reading from file failed");
                 break;
             }
-            ret = nbd_co_send_chunk_read(client, request, offset + progress,
-                                         data + progress, pnum, final, errp);
+            ret = nbd_co_send_chunk_read(client, req, request,
+                                         offset + progress, data + progress,
+                                         pnum, final, errp);
         }
 
         if (ret < 0) {
@@ -2789,19 +3012,21 @@ static coroutine_fn int nbd_send_generic_reply(NBDClient *client,
     } else if (client->mode >= NBD_MODE_EXTENDED) {
         return nbd_co_send_chunk_done(client, request, errp);
     } else {
-        return nbd_co_send_simple_reply(client, request, ret < 0 ? -ret : 0,
-                                        NULL, 0, errp);
+        return nbd_co_send_simple_reply(client, NULL, request,
+                                        ret < 0 ? -ret : 0, NULL, 0, errp);
     }
 }
 
 /* Handle NBD_CMD_READ request.
  * Return -errno if sending fails. Other errors are reported directly to the
  * client as an error reply. */
-static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
-                                        uint8_t *data, Error **errp)
+static coroutine_fn int nbd_do_cmd_read(NBDClient *client,
+                                        NBDRequestData *req,
+                                        NBDRequest *request, Error **errp)
 {
     int ret;
     NBDExport *exp = client->exp;
+    uint8_t *data = req->data;
 
     assert(request->type == NBD_CMD_READ);
     assert(request->len <= NBD_MAX_BUFFER_SIZE);
@@ -2818,7 +3043,7 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
     if (client->mode >= NBD_MODE_STRUCTURED &&
         !(request->flags & NBD_CMD_FLAG_DF) && request->len)
     {
-        return nbd_co_send_sparse_read(client, request, request->from,
+        return nbd_co_send_sparse_read(client, req, request, request->from,
                                        data, request->len, errp);
     }
 
@@ -2830,13 +3055,13 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
 
     if (client->mode >= NBD_MODE_STRUCTURED) {
         if (request->len) {
-            return nbd_co_send_chunk_read(client, request, request->from, data,
-                                          request->len, true, errp);
+            return nbd_co_send_chunk_read(client, req, request, request->from,
+                                          data, request->len, true, errp);
         } else {
             return nbd_co_send_chunk_done(client, request, errp);
         }
     } else {
-        return nbd_co_send_simple_reply(client, request, 0,
+        return nbd_co_send_simple_reply(client, req, request, 0,
                                         data, request->len, errp);
     }
 }
@@ -2868,9 +3093,10 @@ static coroutine_fn int nbd_do_cmd_cache(NBDClient *client, NBDRequest *request,
  * Return -errno if sending fails. Other errors are reported directly to the
  * client as an error reply. */
 static coroutine_fn int nbd_handle_request(NBDClient *client,
-                                           NBDRequest *request,
-                                           uint8_t *data, Error **errp)
+                                           NBDRequestData *req,
+                                           NBDRequest *request, Error **errp)
 {
+    uint8_t *data = req->data;
     int ret;
     int flags;
     NBDExport *exp = client->exp;
@@ -2882,7 +3108,7 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         return nbd_do_cmd_cache(client, request, errp);
 
     case NBD_CMD_READ:
-        return nbd_do_cmd_read(client, request, data, errp);
+        return nbd_do_cmd_read(client, req, request, errp);
 
     case NBD_CMD_WRITE:
         flags = 0;
@@ -3084,7 +3310,7 @@ static coroutine_fn void nbd_trip(void *opaque)
                                      error_get_pretty(export_err), &local_err);
         error_free(export_err);
     } else {
-        ret = nbd_handle_request(client, &request, req->data, &local_err);
+        ret = nbd_handle_request(client, req, &request, &local_err);
     }
     if (request.contexts && request.contexts != &client->contexts) {
         assert(request.type == NBD_CMD_BLOCK_STATUS);
@@ -3134,7 +3360,7 @@ disconnect:
 }
 
 /*
- * Runs in export AioContext and main loop thread. Caller must hold
+ * Runs in client AioContext and main loop thread. Caller must hold
  * client->lock.
  */
 static void nbd_client_receive_next_request(NBDClient *client)
@@ -3146,7 +3372,7 @@ static void nbd_client_receive_next_request(NBDClient *client)
         nbd_client_get(client);
         req = nbd_request_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, req);
-        aio_co_schedule(client->exp->common.ctx, client->recv_coroutine);
+        aio_co_schedule(nbd_client_aio_context(client), client->recv_coroutine);
     }
 }
 
@@ -3165,6 +3391,28 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
         return;
     }
 
+    /* Assign the IOThread before the first request coroutine is scheduled */
+    if (client->exp->nr_iothreads) {
+        NBDExport *exp = client->exp;
+        IOThread *iothread;
+
+        iothread = exp->iothreads[exp->next_iothread++ % exp->nr_iothreads];
+        client->ctx = iothread_get_aio_context(iothread);
+        trace_nbd_client_iothread(exp->name,
+                                  object_get_canonical_path_component(
+                                      OBJECT(iothread)));
+    }
+
+    /*
+     * TLS encrypts into its own buffers, so zero copy only applies to plain
+     * connections.  Fall back to copying if the host can't do it.
+     */
+    if (client->exp->zero_copy && client->ioc == QIO_CHANNEL(client->sioc)) {
+        client->zero_copy =
+            qio_channel_socket_set_zero_copy(client->sioc, NULL) == 0;
+        trace_nbd_client_zero_copy(client->exp->name, client->zero_copy);
+    }
+
     WITH_QEMU_LOCK_GUARD(&client->lock) {
         nbd_client_receive_next_request(client);
     }
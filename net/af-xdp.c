@@ -16,17 +16,21 @@
 #include <linux/if_link.h>
 #include <linux/if_xdp.h>
 #include <net/if.h>
+#include <sys/socket.h>
 #include <xdp/xsk.h>
 
+#include "block/aio.h"
 #include "clients.h"
 #include "monitor/monitor.h"
 #include "net/net.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
+#include "qemu/defer-call.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/memalign.h"
+#include "qemu/sockets.h"
 
 
 typedef struct AFXDPState {
@@ -42,7 +46,9 @@ typedef struct AFXDPState {
     int                  ifindex;
     bool                 read_poll;
     bool                 write_poll;
+    bool                 busy_poll;
     uint32_t             outstanding_tx;
+    AioContext           *ctx; /* NULL means the main loop */
 
     uint64_t             *pool;
     uint32_t             n_pool;
@@ -56,16 +62,35 @@ typedef struct AFXDPState {
 
 #define AF_XDP_BATCH_SIZE 64
 
+/* How long the kernel may busy poll the device queue in one system call. */
+#define AF_XDP_BUSY_POLL_USECS 20
+
 static void af_xdp_send(void *opaque);
 static void af_xdp_writable(void *opaque);
+static bool af_xdp_rx_poll(void *opaque);
 
 /* Set the event-loop handlers for the af-xdp backend. */
 static void af_xdp_update_fd_handler(AFXDPState *s)
 {
-    qemu_set_fd_handler(xsk_socket__fd(s->xsk),
-                        s->read_poll ? af_xdp_send : NULL,
-                        s->write_poll ? af_xdp_writable : NULL,
-                        s);
+    int fd = xsk_socket__fd(s->xsk);
+
+    if (s->ctx) {
+        /*
+         * IOThreads poll the rx ring in userspace before falling back to
+         * waiting on the file descriptor.
+         */
+        aio_set_fd_handler(s->ctx, fd,
+                           s->read_poll ? af_xdp_send : NULL,
+                           s->write_poll ? af_xdp_writable : NULL,
+                           s->read_poll ? af_xdp_rx_poll : NULL,
+                           s->read_poll ? af_xdp_send : NULL,
+                           s);
+    } else {
+        qemu_set_fd_handler(fd,
+                            s->read_poll ? af_xdp_send : NULL,
+                            s->write_poll ? af_xdp_writable : NULL,
+                            s);
+    }
 }
 
 /* Update the read handler. */
@@ -226,6 +251,8 @@ static void af_xdp_send(void *opaque)
         return;
     }
 
+    defer_call_begin();
+
     for (i = 0; i < n_rx; i++) {
         const struct xdp_desc *desc;
         struct iovec iov;
@@ -252,11 +279,58 @@ static void af_xdp_send(void *opaque)
         }
     }
 
+    defer_call_end();
+
     /* Release actually sent descriptors and try to re-fill. */
     xsk_ring_cons__release(&s->rx, n_rx);
     af_xdp_fq_refill(s, AF_XDP_BATCH_SIZE);
 }
 
+/*
+ * The io_poll() callback used in IOThreads.  Returns true if the rx ring
+ * has packets for af_xdp_send().
+ */
+static bool af_xdp_rx_poll(void *opaque)
+{
+    AFXDPState *s = opaque;
+    int fd = xsk_socket__fd(s->xsk);
+
+    if (s->busy_poll) {
+        /*
+         * With SO_PREFER_BUSY_POLL the device queue is only serviced when
+         * we ask for it, so run the driver's NAPI loop for rx and tx here.
+         */
+        if (s->outstanding_tx && xsk_ring_prod__needs_wakeup(&s->tx)) {
+            sendto(fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+        }
+        if (!xsk_cons_nb_avail(&s->rx, 1)) {
+            recvfrom(fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+        }
+    }
+
+    return xsk_cons_nb_avail(&s->rx, 1) != 0;
+}
+
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    int fd = xsk_socket__fd(s->xsk);
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    /* Remove the handlers from the old context before installing new ones */
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, fd, NULL, NULL, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    }
+
+    s->ctx = ctx;
+    af_xdp_update_fd_handler(s);
+}
+
 /* Flush and close. */
 static void af_xdp_cleanup(NetClientState *nc)
 {
@@ -396,6 +470,21 @@ static int af_xdp_socket_create(AFXDPState *s,
     return 0;
 }
 
+static int af_xdp_busy_poll_enable(AFXDPState *s, Error **errp)
+{
+    ERRP_GUARD();
+
+    if (socket_set_busy_poll(xsk_socket__fd(s->xsk), AF_XDP_BUSY_POLL_USECS,
+                             AF_XDP_BATCH_SIZE, errp) < 0) {
+        error_prepend(errp, "%s queue_index %d: ",
+                      s->ifname, s->nc.queue_index);
+        return -1;
+    }
+
+    s->busy_poll = true;
+    return 0;
+}
+
 /* NetClientInfo methods. */
 static NetClientInfo net_af_xdp_info = {
     .type = NET_CLIENT_DRIVER_AF_XDP,
@@ -403,6 +492,7 @@ static NetClientInfo net_af_xdp_info = {
     .receive = af_xdp_receive,
     .poll = af_xdp_poll,
     .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
 };
 
 static int *parse_socket_fds(const char *sock_fds_str,
@@ -493,7 +583,9 @@ int net_init_af_xdp(const Netdev *netdev,
         s->n_queues = queues;
 
         if (af_xdp_umem_create(s, sock_fds ? sock_fds[i] : -1, errp)
-            || af_xdp_socket_create(s, opts, errp)) {
+            || af_xdp_socket_create(s, opts, errp)
+            || (opts->has_busy_poll && opts->busy_poll
+                && af_xdp_busy_poll_enable(s, errp))) {
             /* Make sure the XDP program will be removed. */
             s->n_queues = i;
             error_propagate(errp, err);
@@ -7,6 +7,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "block/aio-wait.h"
 #include "qemu/cutils.h"
 #include "net/announce.h"
 #include "net/net.h"
@@ -133,11 +134,23 @@ static const char *qemu_ether_ntoa(const MACAddr *mac)
     return ret;
 }
 
+typedef struct AnnounceSendData {
+    NetClientState *nc;
+    uint8_t buf[60];
+    int len;
+} AnnounceSendData;
+
+static void qemu_announce_self_send(void *opaque)
+{
+    AnnounceSendData *data = opaque;
+
+    qemu_send_packet_raw(data->nc, data->buf, data->len);
+}
+
 static void qemu_announce_self_iter(NICState *nic, void *opaque)
 {
     AnnounceTimer *timer = opaque;
-    uint8_t buf[60];
-    int len;
+    AnnounceSendData data;
     bool skip;
 
     if (timer->params.has_interfaces) {
@@ -162,9 +175,19 @@ static void qemu_announce_self_iter(NICState *nic, void *opaque)
                                   qemu_ether_ntoa(&nic->conf->macaddr), skip);
 
     if (!skip) {
-        len = announce_self_create(buf, nic->conf->macaddr.a);
+        data.nc = qemu_get_queue(nic);
+        data.len = announce_self_create(data.buf, nic->conf->macaddr.a);
 
-        qemu_send_packet_raw(qemu_get_queue(nic), buf, len);
+        /*
+         * If the peer was moved into an IOThread, send from there so that
+         * its incoming queue is not filled from two threads at once.
+         */
+        if (data.nc->peer && data.nc->peer->aio_context) {
+            aio_wait_bh_oneshot(data.nc->peer->aio_context,
+                                qemu_announce_self_send, &data);
+        } else {
+            qemu_announce_self_send(&data);
+        }
 
         /* if the NIC provides it's own announcement support, use it as well */
         if (nic->ncs->info->announce) {
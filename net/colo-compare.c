@@ -53,6 +53,8 @@ static NotifierList colo_compare_notifiers =
 #define REGULAR_PACKET_CHECK_MS 1000
 #define DEFAULT_TIME_OUT_MS 3000
 
+#define COLO_COMPARE_MAX_THREADS 64
+
 /* #define DEBUG_COLO_PACKETS */
 
 static QemuMutex colo_compare_mutex;
@@ -101,6 +103,36 @@ typedef struct SendEntry {
     uint8_t *buf;
 } SendEntry;
 
+/*
+ * Connections are spread over compare_threads shards by the hash of their
+ * connection key.  Shard 0 runs in the compare thread (@iothread), which
+ * also reads and writes all chardevs.  The other shards run in IOThreads
+ * of their own: the compare thread hands parsed packets to them, and they
+ * hand the primary packets that can be released back to the compare thread.
+ */
+typedef struct CompareShard {
+    CompareState *s;
+    /* NULL for shard 0 */
+    IOThread *iothread;
+
+    /*
+     * Record the connection that through the NIC
+     * Element type: Connection
+     */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+    QEMUTimer *packet_check_timer;
+
+    /* Requests from the compare thread, protected by lock */
+    QemuMutex lock;
+    GQueue pri_in;
+    GQueue sec_in;
+    bool flush;
+    unsigned events;
+    QEMUBH *bh;
+} CompareShard;
+
 struct CompareState {
     Object parent;
 
@@ -120,18 +152,18 @@ struct CompareState {
     bool vnet_hdr;
     uint64_t compare_timeout;
     uint32_t expired_scan_cycle;
+    uint32_t compare_threads;
 
-    /*
-     * Record the connection that through the NIC
-     * Element type: Connection
-     */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    CompareShard *shards;
 
     IOThread *iothread;
     GMainContext *worker_context;
-    QEMUTimer *packet_check_timer;
+
+    /* Released primary packets from other shards, protected by out_lock */
+    QemuMutex out_lock;
+    GQueue out_list;
+    bool inconsistent;
+    QEMUBH *out_bh;
 
     QEMUBH *event_bh;
     enum colo_event event;
@@ -192,6 +224,21 @@ static void colo_compare_inconsistency_notify(CompareState *s)
     }
 }
 
+static void colo_shard_inconsistency_notify(CompareShard *shard)
+{
+    CompareState *s = shard->s;
+
+    if (!shard->iothread) {
+        colo_compare_inconsistency_notify(s);
+        return;
+    }
+
+    qemu_mutex_lock(&s->out_lock);
+    s->inconsistent = true;
+    qemu_mutex_unlock(&s->out_lock);
+    qemu_bh_schedule(s->out_bh);
+}
+
 /* Use restricted to colo_insert_packet() */
 static gint seq_sorter(Packet *a, Packet *b, gpointer data)
 {
@@ -238,15 +285,12 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
 }
 
 /*
- * Return 0 on success, if return -1 means the pkt
- * is unsupported(arp and ipv6) and will be sent later
+ * Called from the compare thread.  Return the new packet, or NULL if
+ * the packet is unsupported (arp and ipv6) and will be sent later
  */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+static Packet *packet_parse(CompareState *s, int mode)
 {
-    ConnectionKey key;
-    Packet *pkt = NULL;
-    Connection *conn;
-    int ret;
+    Packet *pkt;
 
     if (mode == PRIMARY_IN) {
         pkt = packet_new(s->pri_rs.buf,
@@ -260,17 +304,25 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
 
     if (parse_packet_early(pkt)) {
         packet_destroy(pkt, NULL);
-        pkt = NULL;
-        return -1;
+        return NULL;
     }
+    return pkt;
+}
+
+static Connection *packet_enqueue(CompareShard *shard, Packet *pkt, int mode)
+{
+    ConnectionKey key;
+    Connection *conn;
+    int ret;
+
     fill_connection_key(pkt, &key, false);
 
-    conn = connection_get(s->connection_track_table,
+    conn = connection_get(shard->connection_track_table,
                           &key,
-                          &s->conn_list);
+                          &shard->conn_list);
 
     if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
+        g_queue_push_tail(&shard->conn_list, conn);
         conn->processing = true;
     }
 
@@ -284,12 +336,9 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
         trace_colo_compare_drop_packet(colo_mode[mode],
             "queue size too big, drop packet");
         packet_destroy(pkt, NULL);
-        pkt = NULL;
     }
 
-    *con = conn;
-
-    return 0;
+    return conn;
 }
 
 static inline bool after(uint32_t seq1, uint32_t seq2)
@@ -297,7 +346,8 @@ static inline bool after(uint32_t seq1, uint32_t seq2)
         return (int32_t)(seq1 - seq2) > 0;
 }
 
-static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
+/* Called from the compare thread */
+static void colo_send_primary_pkt(CompareState *s, Packet *pkt)
 {
     int ret;
     ret = compare_chr_send(s,
@@ -309,10 +359,30 @@ static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
     if (ret < 0) {
         error_report("colo send primary packet failed");
     }
-    trace_colo_compare_main("packet same and release packet");
     packet_destroy_partial(pkt, NULL);
 }
 
+static void colo_shard_send_primary_pkt(CompareShard *shard, Packet *pkt)
+{
+    CompareState *s = shard->s;
+
+    if (!shard->iothread) {
+        colo_send_primary_pkt(s, pkt);
+        return;
+    }
+
+    qemu_mutex_lock(&s->out_lock);
+    g_queue_push_tail(&s->out_list, pkt);
+    qemu_mutex_unlock(&s->out_lock);
+    qemu_bh_schedule(s->out_bh);
+}
+
+static void colo_release_primary_pkt(CompareShard *shard, Packet *pkt)
+{
+    colo_shard_send_primary_pkt(shard, pkt);
+    trace_colo_compare_main("packet same and release packet");
+}
+
 /*
  * The IP packets sent by primary and secondary
  * will be compared in here
@@ -396,7 +466,7 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
     return false;
 }
 
-static void colo_compare_tcp(CompareState *s, Connection *conn)
+static void colo_compare_tcp(CompareShard *shard, Connection *conn)
 {
     Packet *ppkt = NULL, *spkt = NULL;
     int8_t mark;
@@ -428,13 +498,13 @@ sec:
     spkt = g_queue_pop_tail(&conn->secondary_list);
 
     if (ppkt->tcp_seq == ppkt->seq_end) {
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(shard, ppkt);
         ppkt = NULL;
     }
 
     if (ppkt && conn->compare_seq && !after(ppkt->seq_end, conn->compare_seq)) {
         trace_colo_compare_main("pri: this packet has compared");
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(shard, ppkt);
         ppkt = NULL;
     }
 
@@ -474,7 +544,7 @@ sec:
 
         if (mark == COLO_COMPARE_FREE_PRIMARY) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(shard, ppkt);
             g_queue_push_tail(&conn->secondary_list, spkt);
             goto pri;
         } else if (mark == COLO_COMPARE_FREE_SECONDARY) {
@@ -483,7 +553,7 @@ sec:
             goto sec;
         } else if (mark == (COLO_COMPARE_FREE_PRIMARY | COLO_COMPARE_FREE_SECONDARY)) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(shard, ppkt);
             packet_destroy(spkt, NULL);
             goto pri;
         }
@@ -496,7 +566,7 @@ sec:
         qemu_hexdump(stderr, "colo-compare spkt", spkt->data, spkt->size);
 #endif
 
-        colo_compare_inconsistency_notify(s);
+        colo_shard_inconsistency_notify(shard);
     }
 }
 
@@ -621,8 +691,10 @@ void colo_compare_unregister_notifier(Notifier *notify)
 }
 
 static int colo_old_packet_check_one_conn(Connection *conn,
-                                          CompareState *s)
+                                          CompareShard *shard)
 {
+    CompareState *s = shard->s;
+
     if (!g_queue_is_empty(&conn->primary_list)) {
         if (g_queue_find_custom(&conn->primary_list,
                                 &s->compare_timeout,
@@ -641,7 +713,7 @@ static int colo_old_packet_check_one_conn(Connection *conn,
 
 out:
     /* Do checkpoint will flush old packet */
-    colo_compare_inconsistency_notify(s);
+    colo_shard_inconsistency_notify(shard);
     return 0;
 }
 
@@ -652,17 +724,17 @@ out:
  */
 static void colo_old_packet_check(void *opaque)
 {
-    CompareState *s = opaque;
+    CompareShard *shard = opaque;
 
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, s,
+    g_queue_find_custom(&shard->conn_list, shard,
                         (GCompareFunc)colo_old_packet_check_one_conn);
 }
 
-static void colo_compare_packet(CompareState *s, Connection *conn,
+static void colo_compare_packet(CompareShard *shard, Connection *conn,
                                 int (*HandlePacket)(Packet *spkt,
                                 Packet *ppkt))
 {
@@ -676,7 +748,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
                  pkt, (GCompareFunc)HandlePacket);
 
         if (result) {
-            colo_release_primary_pkt(s, pkt);
+            colo_release_primary_pkt(shard, pkt);
             packet_destroy(result->data, NULL);
             g_queue_delete_link(&conn->secondary_list, result);
         } else {
@@ -689,7 +761,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
             trace_colo_compare_main("packet different");
             g_queue_push_tail(&conn->primary_list, pkt);
 
-            colo_compare_inconsistency_notify(s);
+            colo_shard_inconsistency_notify(shard);
             break;
         }
     }
@@ -703,25 +775,149 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
  */
 static void colo_compare_connection(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *shard = user_data;
     Connection *conn = opaque;
 
     switch (conn->ip_proto) {
     case IPPROTO_TCP:
-        colo_compare_tcp(s, conn);
+        colo_compare_tcp(shard, conn);
         break;
     case IPPROTO_UDP:
-        colo_compare_packet(s, conn, colo_packet_compare_udp);
+        colo_compare_packet(shard, conn, colo_packet_compare_udp);
         break;
     case IPPROTO_ICMP:
-        colo_compare_packet(s, conn, colo_packet_compare_icmp);
+        colo_compare_packet(shard, conn, colo_packet_compare_icmp);
         break;
     default:
-        colo_compare_packet(s, conn, colo_packet_compare_other);
+        colo_compare_packet(shard, conn, colo_packet_compare_other);
         break;
     }
 }
 
+static void colo_flush_packets(void *opaque, void *user_data);
+
+static void colo_compare_event_done(void)
+{
+    qemu_mutex_lock(&event_mtx);
+    assert(event_unhandled_count > 0);
+    event_unhandled_count--;
+    qemu_cond_broadcast(&event_complete_cond);
+    qemu_mutex_unlock(&event_mtx);
+}
+
+/* Called from the thread of the shard, or after that thread has exited */
+static void colo_compare_shard_bh(void *opaque)
+{
+    CompareShard *shard = opaque;
+    GQueue pri_in, sec_in;
+    unsigned events;
+    bool flush;
+    Packet *pkt;
+
+    qemu_mutex_lock(&shard->lock);
+    pri_in = shard->pri_in;
+    sec_in = shard->sec_in;
+    g_queue_init(&shard->pri_in);
+    g_queue_init(&shard->sec_in);
+    flush = shard->flush;
+    events = shard->events;
+    shard->flush = false;
+    shard->events = 0;
+    qemu_mutex_unlock(&shard->lock);
+
+    while ((pkt = g_queue_pop_head(&pri_in))) {
+        colo_compare_connection(packet_enqueue(shard, pkt, PRIMARY_IN), shard);
+    }
+    while ((pkt = g_queue_pop_head(&sec_in))) {
+        colo_compare_connection(packet_enqueue(shard, pkt, SECONDARY_IN),
+                                shard);
+    }
+
+    if (flush) {
+        g_queue_foreach(&shard->conn_list, colo_flush_packets, shard);
+    }
+    while (events--) {
+        colo_compare_event_done();
+    }
+}
+
+/* Called from the compare thread */
+static void colo_compare_dispatch(CompareState *s, Packet *pkt, int mode)
+{
+    CompareShard *shard = &s->shards[0];
+    ConnectionKey key;
+
+    if (s->compare_threads > 1) {
+        fill_connection_key(pkt, &key, false);
+        shard = &s->shards[connection_key_hash(&key) % s->compare_threads];
+    }
+
+    if (!shard->iothread) {
+        /* compare packet in the specified connection */
+        colo_compare_connection(packet_enqueue(shard, pkt, mode), shard);
+        return;
+    }
+
+    qemu_mutex_lock(&shard->lock);
+    g_queue_push_tail(mode == PRIMARY_IN ? &shard->pri_in : &shard->sec_in,
+                      pkt);
+    qemu_mutex_unlock(&shard->lock);
+    qemu_bh_schedule(shard->bh);
+}
+
+/*
+ * Called from the compare thread to flush all shards.  If @event is
+ * true, each of the other shards accounts for one more unhandled COLO
+ * event until it has flushed its connections.
+ */
+static void colo_compare_flush(CompareState *s, bool event)
+{
+    uint32_t i;
+
+    g_queue_foreach(&s->shards[0].conn_list, colo_flush_packets,
+                    &s->shards[0]);
+
+    for (i = 1; i < s->compare_threads; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        if (event) {
+            qemu_mutex_lock(&event_mtx);
+            event_unhandled_count++;
+            qemu_mutex_unlock(&event_mtx);
+        }
+
+        qemu_mutex_lock(&shard->lock);
+        shard->flush = true;
+        shard->events += event;
+        qemu_mutex_unlock(&shard->lock);
+        qemu_bh_schedule(shard->bh);
+    }
+}
+
+/* Called from the compare thread for the results of the other shards */
+static void colo_compare_out_bh(void *opaque)
+{
+    CompareState *s = opaque;
+    GQueue out_list;
+    bool inconsistent;
+    Packet *pkt;
+
+    qemu_mutex_lock(&s->out_lock);
+    out_list = s->out_list;
+    g_queue_init(&s->out_list);
+    inconsistent = s->inconsistent;
+    s->inconsistent = false;
+    qemu_mutex_unlock(&s->out_lock);
+
+    while ((pkt = g_queue_pop_head(&out_list))) {
+        colo_send_primary_pkt(s, pkt);
+    }
+
+    if (inconsistent) {
+        colo_compare_inconsistency_notify(s);
+    }
+}
+
 static void coroutine_fn _compare_chr_send(void *opaque)
 {
     SendCo *sendco = opaque;
@@ -891,12 +1087,12 @@ static void compare_notify_chr(void *opaque, const uint8_t *buf, int size)
  */
 static void check_old_packet_regular(void *opaque)
 {
-    CompareState *s = opaque;
+    CompareShard *shard = opaque;
 
     /* if have old packet we will notify checkpoint */
-    colo_old_packet_check(s);
-    timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
-              s->expired_scan_cycle);
+    colo_old_packet_check(shard);
+    timer_mod(shard->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
+              shard->s->expired_scan_cycle);
 }
 
 /* Public API, Used for COLO frame to notify compare event */
@@ -927,24 +1123,34 @@ void colo_notify_compares_event(void *opaque, int event, Error **errp)
 
 static void colo_compare_timer_init(CompareState *s)
 {
-    AioContext *ctx = iothread_get_aio_context(s->iothread);
+    uint32_t i;
+
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *shard = &s->shards[i];
+        IOThread *iothread = shard->iothread ?: s->iothread;
 
-    s->packet_check_timer = aio_timer_new(ctx, QEMU_CLOCK_HOST,
-                                SCALE_MS, check_old_packet_regular,
-                                s);
-    timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
-              s->expired_scan_cycle);
+        shard->packet_check_timer =
+            aio_timer_new(iothread_get_aio_context(iothread),
+                          QEMU_CLOCK_HOST, SCALE_MS,
+                          check_old_packet_regular, shard);
+        timer_mod(shard->packet_check_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_HOST) + s->expired_scan_cycle);
+    }
 }
 
 static void colo_compare_timer_del(CompareState *s)
 {
-    if (s->packet_check_timer) {
-        timer_free(s->packet_check_timer);
-        s->packet_check_timer = NULL;
-    }
- }
+    uint32_t i;
 
-static void colo_flush_packets(void *opaque, void *user_data);
+    for (i = 0; s->shards && i < s->compare_threads; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        if (shard->packet_check_timer) {
+            timer_free(shard->packet_check_timer);
+            shard->packet_check_timer = NULL;
+        }
+    }
+}
 
 static void colo_compare_handle_event(void *opaque)
 {
@@ -952,7 +1158,7 @@ static void colo_compare_handle_event(void *opaque)
 
     switch (s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush(s, true);
         break;
     case COLO_EVENT_FAILOVER:
         break;
@@ -960,11 +1166,102 @@ static void colo_compare_handle_event(void *opaque)
         break;
     }
 
-    qemu_mutex_lock(&event_mtx);
-    assert(event_unhandled_count > 0);
-    event_unhandled_count--;
-    qemu_cond_broadcast(&event_complete_cond);
-    qemu_mutex_unlock(&event_mtx);
+    colo_compare_event_done();
+}
+
+static bool colo_compare_shards_init(CompareState *s, Error **errp)
+{
+    const char *id = object_get_canonical_path_component(OBJECT(s));
+    uint32_t i;
+
+    qemu_mutex_init(&s->out_lock);
+    g_queue_init(&s->out_list);
+
+    s->shards = g_new0(CompareShard, s->compare_threads);
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *shard = &s->shards[i];
+        g_autofree char *name = NULL;
+
+        shard->s = s;
+        g_queue_init(&shard->conn_list);
+        shard->connection_track_table =
+            g_hash_table_new_full(connection_key_hash, connection_key_equal,
+                                  g_free, NULL);
+        qemu_mutex_init(&shard->lock);
+        g_queue_init(&shard->pri_in);
+        g_queue_init(&shard->sec_in);
+
+        if (i == 0) {
+            continue;
+        }
+
+        name = g_strdup_printf("colo-compare-%s-%u", id, i);
+        shard->iothread = iothread_create(name, errp);
+        if (!shard->iothread) {
+            return false;
+        }
+        shard->bh = aio_bh_new(iothread_get_aio_context(shard->iothread),
+                               colo_compare_shard_bh, shard);
+    }
+
+    return true;
+}
+
+/* Called from the thread of the shard */
+static void colo_compare_shard_stop_bh(void *opaque)
+{
+    CompareShard *shard = opaque;
+
+    timer_free(shard->packet_check_timer);
+    shard->packet_check_timer = NULL;
+    qemu_bh_delete(shard->bh);
+    shard->bh = NULL;
+}
+
+/*
+ * Stop the threads of all shards but shard 0.  Requests that were still
+ * pending are then handled by the calling thread.
+ */
+static void colo_compare_shards_stop(CompareState *s)
+{
+    uint32_t i;
+
+    for (i = 1; s->shards && i < s->compare_threads; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        if (!shard->iothread) {
+            continue;
+        }
+
+        aio_wait_bh_oneshot(iothread_get_aio_context(shard->iothread),
+                            colo_compare_shard_stop_bh, shard);
+        iothread_destroy(shard->iothread);
+        shard->iothread = NULL;
+
+        colo_compare_shard_bh(shard);
+    }
+}
+
+static void colo_compare_shards_cleanup(CompareState *s)
+{
+    uint32_t i;
+
+    if (!s->shards) {
+        return;
+    }
+
+    /* Stop at the first shard that colo_compare_shards_init() did not reach */
+    for (i = 0; i < s->compare_threads && s->shards[i].s; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        g_queue_clear(&shard->conn_list);
+        g_hash_table_destroy(shard->connection_track_table);
+        qemu_mutex_destroy(&shard->lock);
+    }
+    g_free(s->shards);
+    s->shards = NULL;
+
+    qemu_mutex_destroy(&s->out_lock);
 }
 
 static void colo_compare_iothread(CompareState *s)
@@ -987,6 +1284,7 @@ static void colo_compare_iothread(CompareState *s)
 
     colo_compare_timer_init(s);
     s->event_bh = aio_bh_new(ctx, colo_compare_handle_event, s);
+    s->out_bh = aio_bh_new(ctx, colo_compare_out_bh, s);
 }
 
 static char *compare_get_pri_indev(Object *obj, Error **errp)
@@ -1121,6 +1419,34 @@ static void compare_set_expired_scan_cycle(Object *obj, Visitor *v,
     s->expired_scan_cycle = value;
 }
 
+static void compare_get_threads(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->compare_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_threads(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value || value > COLO_COMPARE_MAX_THREADS) {
+        error_setg(errp, "Property '%s.%s' must be between 1 and %d",
+                   object_get_typename(obj), name, COLO_COMPARE_MAX_THREADS);
+        return;
+    }
+    s->compare_threads = value;
+}
+
 static void get_max_queue_size(Object *obj, Visitor *v,
                                const char *name, void *opaque,
                                Error **errp)
@@ -1150,9 +1476,9 @@ static void set_max_queue_size(Object *obj, Visitor *v,
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
+    Packet *pkt = packet_parse(s, PRIMARY_IN);
 
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
+    if (!pkt) {
         trace_colo_compare_main("primary: unsupported packet in");
         compare_chr_send(s,
                          pri_rs->buf,
@@ -1161,21 +1487,19 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
                          false,
                          false);
     } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
+        colo_compare_dispatch(s, pkt, PRIMARY_IN);
     }
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
+    Packet *pkt = packet_parse(s, SECONDARY_IN);
 
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
+    if (!pkt) {
         trace_colo_compare_main("secondary: unsupported packet in");
     } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
+        colo_compare_dispatch(s, pkt, SECONDARY_IN);
     }
 }
 
@@ -1197,7 +1521,7 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
                                   notify_rs->buf,
                                   notify_rs->packet_len)) {
         /* colo-compare do checkpoint, flush pri packet and remove sec packet */
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush(s, false);
     } else {
         error_report("COLO compare got unsupported instruction");
     }
@@ -1269,6 +1593,10 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         max_queue_size = MAX_QUEUE_SIZE;
     }
 
+    if (!s->compare_threads) {
+        s->compare_threads = 1;
+    }
+
     if (find_and_check_chardev(&chr, s->pri_indev, errp) ||
         !qemu_chr_fe_init(&s->chr_pri_in, chr, errp)) {
         return;
@@ -1312,12 +1640,9 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         g_queue_init(&s->notify_sendco.send_list);
     }
 
-    g_queue_init(&s->conn_list);
-
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      NULL);
+    if (!colo_compare_shards_init(s, errp)) {
+        return;
+    }
 
     colo_compare_iothread(s);
 
@@ -1335,19 +1660,13 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 
 static void colo_flush_packets(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *shard = user_data;
     Connection *conn = opaque;
     Packet *pkt = NULL;
 
     while (!g_queue_is_empty(&conn->primary_list)) {
         pkt = g_queue_pop_tail(&conn->primary_list);
-        compare_chr_send(s,
-                         pkt->data,
-                         pkt->size,
-                         pkt->vnet_hdr_len,
-                         false,
-                         true);
-        packet_destroy_partial(pkt, NULL);
+        colo_shard_send_primary_pkt(shard, pkt);
     }
     while (!g_queue_is_empty(&conn->secondary_list)) {
         pkt = g_queue_pop_tail(&conn->secondary_list);
@@ -1392,6 +1711,10 @@ static void colo_compare_init(Object *obj)
                         get_max_queue_size,
                         set_max_queue_size, NULL, NULL);
 
+    object_property_add(obj, "compare_threads", "uint32",
+                        compare_get_threads,
+                        compare_set_threads, NULL, NULL);
+
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr);
@@ -1411,6 +1734,7 @@ static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
     CompareState *tmp = NULL;
+    uint32_t i;
 
     qemu_mutex_lock(&colo_compare_mutex);
     QTAILQ_FOREACH(tmp, &net_compares, next) {
@@ -1433,9 +1757,15 @@ static void colo_compare_finalize(Object *obj)
         qemu_chr_fe_deinit(&s->chr_notify_dev, false);
     }
 
+    colo_compare_shards_stop(s);
     colo_compare_timer_del(s);
 
     qemu_bh_delete(s->event_bh);
+    if (s->out_bh) {
+        qemu_bh_delete(s->out_bh);
+        /* Send what the other shards released before they stopped */
+        colo_compare_out_bh(s);
+    }
 
     AioContext *ctx = iothread_get_aio_context(s->iothread);
     AIO_WAIT_WHILE(ctx, !s->out_sendco.done);
@@ -1444,18 +1774,18 @@ static void colo_compare_finalize(Object *obj)
     }
 
     /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+    for (i = 0; s->shards && i < s->compare_threads; i++) {
+        g_queue_foreach(&s->shards[i].conn_list, colo_flush_packets,
+                        &s->shards[i]);
+    }
     AIO_WAIT_WHILE(NULL, !s->out_sendco.done);
 
-    g_queue_clear(&s->conn_list);
     g_queue_clear(&s->out_sendco.send_list);
     if (s->notify_dev) {
         g_queue_clear(&s->notify_sendco.send_list);
     }
 
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
-    }
+    colo_compare_shards_cleanup(s);
 
     object_unref(OBJECT(s->iothread));
 
@@ -0,0 +1,568 @@
+/*
+ * Generic receive offload filter
+ *
+ * Coalesce the consecutive TCP segments of a flow that a backend delivers
+ * in one batch into a single large packet, so that the guest NIC model
+ * handles one packet instead of one per segment.  The batch ends with the
+ * backend's defer_call section; backends without one deliver every packet
+ * unchanged.  With a vnet header, segments are only coalesced when the
+ * guest enabled TSO for their IP version, so that it accepts the GSO
+ * packets that result.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/filter.h"
+#include "net/net.h"
+#include "net/eth.h"
+#include "net/checksum.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/defer-call.h"
+#include "qemu/iov.h"
+#include "qom/object.h"
+#include "standard-headers/linux/virtio_net.h"
+
+#define TYPE_FILTER_GRO "filter-gro"
+
+OBJECT_DECLARE_SIMPLE_TYPE(FilterGROState, FILTER_GRO)
+
+/* Number of flows that are coalesced at the same time */
+#define FILTER_GRO_MAX_FLOWS 8
+
+/* Longest vnet header a backend can prepend */
+#define FILTER_GRO_MAX_VNET_HDR_LEN sizeof(struct virtio_net_hdr_v1_hash)
+
+#define FILTER_GRO_MIN_SIZE ETH_ZLEN
+#define FILTER_GRO_MAX_SIZE (sizeof(struct eth_header) + ETH_MAX_IP_DGRAM_LEN)
+
+/* Offsets into a buffer that holds a TCP segment */
+typedef struct GROPacket {
+    const uint8_t *buf;
+    size_t size;
+    size_t vnet_hdr_len;
+    bool ipv6;
+    size_t l3_off;
+    size_t l4_off;
+    size_t data_off;
+    size_t end;             /* end of the IP datagram, padding excluded */
+    uint32_t seq;
+    uint8_t tcp_flags;
+} GROPacket;
+
+typedef struct GROFlow {
+    bool active;
+    NetClientState *sender;
+    unsigned flags;
+
+    /* The first segment, with the payload of the others appended */
+    uint8_t *buf;
+    size_t size;
+    size_t orig_size;       /* size of the first segment, with padding */
+    size_t vnet_hdr_len;
+    bool ipv6;
+    size_t l3_off;
+    size_t l4_off;
+    size_t data_off;
+
+    uint32_t mss;
+    uint32_t next_seq;
+    unsigned segs;
+} GROFlow;
+
+struct FilterGROState {
+    NetFilterState parent_obj;
+
+    uint32_t max_size;
+    GROFlow flows[FILTER_GRO_MAX_FLOWS];
+    unsigned next_evict;
+    bool flush_pending;
+};
+
+static bool filter_gro_parse(const uint8_t *buf, size_t size,
+                             size_t vnet_hdr_len, GROPacket *p)
+{
+    const tcp_header *tcp;
+    size_t l3_off = vnet_hdr_len + sizeof(struct eth_header);
+    size_t ip_end, tcp_hlen;
+
+    if (size < l3_off) {
+        return false;
+    }
+
+    switch (lduw_be_p(&PKT_GET_ETH_HDR(buf + vnet_hdr_len)->h_proto)) {
+    case ETH_P_IP: {
+        const struct ip_header *ip = (const void *)(buf + l3_off);
+
+        /* No IP options, so that all headers of a flow have the same size */
+        if (size < l3_off + sizeof(*ip) || ip->ip_ver_len != 0x45 ||
+            ip->ip_p != IP_PROTO_TCP ||
+            (lduw_be_p(&ip->ip_off) & (IP_OFFMASK | IP_MF))) {
+            return false;
+        }
+        ip_end = l3_off + lduw_be_p(&ip->ip_len);
+        p->l4_off = l3_off + sizeof(*ip);
+        p->ipv6 = false;
+        break;
+    }
+    case ETH_P_IPV6: {
+        const struct ip6_header *ip6 = (const void *)(buf + l3_off);
+
+        /* No extension headers */
+        if (size < l3_off + sizeof(*ip6) ||
+            (ip6->ip6_ctlun.ip6_un2_vfc >> 4) != IP_HEADER_VERSION_6 ||
+            ip6->ip6_nxt != IP_PROTO_TCP) {
+            return false;
+        }
+        ip_end = l3_off + sizeof(*ip6) + lduw_be_p(&ip6->ip6_plen);
+        p->l4_off = l3_off + sizeof(*ip6);
+        p->ipv6 = true;
+        break;
+    }
+    default:
+        return false;
+    }
+
+    if (ip_end > size || ip_end < p->l4_off + sizeof(tcp_header)) {
+        return false;
+    }
+
+    tcp = (const tcp_header *)(buf + p->l4_off);
+    tcp_hlen = (lduw_be_p(&tcp->th_offset_flags) >> 12) << 2;
+    if (tcp_hlen < sizeof(tcp_header) || p->l4_off + tcp_hlen > ip_end) {
+        return false;
+    }
+
+    p->buf = buf;
+    p->size = size;
+    p->vnet_hdr_len = vnet_hdr_len;
+    p->l3_off = l3_off;
+    p->data_off = p->l4_off + tcp_hlen;
+    p->end = ip_end;
+    p->seq = ldl_be_p(&tcp->th_seq);
+    p->tcp_flags = lduw_be_p(&tcp->th_offset_flags) & 0xff;
+    return true;
+}
+
+static bool filter_gro_csum_valid(const GROPacket *p)
+{
+    const struct virtio_net_hdr *hdr = (const void *)p->buf;
+    uint16_t l4_len = p->end - p->l4_off;
+    uint32_t cso, sum;
+
+    /* The host already verified the checksum or will compute it */
+    if (p->vnet_hdr_len &&
+        (hdr->flags & (VIRTIO_NET_HDR_F_DATA_VALID |
+                       VIRTIO_NET_HDR_F_NEEDS_CSUM))) {
+        return true;
+    }
+
+    if (p->ipv6) {
+        sum = eth_calc_ip6_pseudo_hdr_csum((void *)(p->buf + p->l3_off),
+                                           l4_len, IP_PROTO_TCP, &cso);
+    } else {
+        sum = eth_calc_ip4_pseudo_hdr_csum((void *)(p->buf + p->l3_off),
+                                           l4_len, &cso);
+    }
+    sum += net_checksum_add(l4_len, (uint8_t *)p->buf + p->l4_off);
+
+    return net_checksum_finish(sum) == 0;
+}
+
+/* Can @p be the first segment of a flow or be appended to one? */
+static bool filter_gro_segment_ok(FilterGROState *s, const GROPacket *p)
+{
+    const struct virtio_net_hdr *hdr = (const void *)p->buf;
+    NetClientState *nc = NETFILTER(s)->netdev;
+
+    if (p->vnet_hdr_len &&
+        !(p->ipv6 ? nc->offload_tso6 : nc->offload_tso4)) {
+        return false;
+    }
+
+    /* Anything but plain data ends the flow */
+    if ((p->tcp_flags & ~TH_PUSH) != TH_ACK || p->end == p->data_off) {
+        return false;
+    }
+
+    if (p->size - p->vnet_hdr_len > s->max_size) {
+        return false;
+    }
+
+    /* Already coalesced by the host */
+    if (p->vnet_hdr_len && hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+        return false;
+    }
+
+    return filter_gro_csum_valid(p);
+}
+
+static GROFlow *filter_gro_find_flow(FilterGROState *s, const GROPacket *p)
+{
+    size_t addr_off = p->ipv6 ? offsetof(struct ip6_header, ip6_src)
+                              : offsetof(struct ip_header, ip_src);
+    size_t addr_len = p->ipv6 ? 2 * sizeof(struct in6_address)
+                              : 2 * sizeof(uint32_t);
+    int i;
+
+    for (i = 0; i < FILTER_GRO_MAX_FLOWS; i++) {
+        GROFlow *f = &s->flows[i];
+
+        if (f->active && f->ipv6 == p->ipv6 &&
+            f->vnet_hdr_len == p->vnet_hdr_len &&
+            !memcmp(f->buf + f->vnet_hdr_len, p->buf + p->vnet_hdr_len,
+                    sizeof(struct eth_header)) &&
+            !memcmp(f->buf + f->l3_off + addr_off,
+                    p->buf + p->l3_off + addr_off, addr_len) &&
+            !memcmp(f->buf + f->l4_off, p->buf + p->l4_off,
+                    2 * sizeof(uint16_t))) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static bool filter_gro_can_merge(FilterGROState *s, GROFlow *f,
+                                 const GROPacket *p)
+{
+    const uint8_t *f_l3 = f->buf + f->l3_off, *p_l3 = p->buf + p->l3_off;
+    const tcp_header *f_tcp = (const void *)(f->buf + f->l4_off);
+    const tcp_header *p_tcp = (const void *)(p->buf + p->l4_off);
+    size_t tcp_hlen = f->data_off - f->l4_off;
+    size_t payload = p->end - p->data_off;
+    /* The IPv6 payload length does not include the fixed header */
+    size_t ip_len = f->size + payload - (f->ipv6 ? f->l4_off : f->l3_off);
+
+    if (p->seq != f->next_seq || payload > f->mss ||
+        p->data_off - p->l4_off != tcp_hlen ||
+        f->size + payload > f->vnet_hdr_len + s->max_size ||
+        ip_len > ETH_MAX_IP_DGRAM_LEN) {
+        return false;
+    }
+
+    /* Same acknowledgment and TCP options, e.g. timestamps */
+    if (memcmp(&f_tcp->th_ack, &p_tcp->th_ack, sizeof(f_tcp->th_ack)) ||
+        memcmp(f_tcp + 1, p_tcp + 1, tcp_hlen - sizeof(tcp_header))) {
+        return false;
+    }
+
+    if (f->ipv6) {
+        const struct ip6_header *f_ip6 = (const void *)f_l3;
+        const struct ip6_header *p_ip6 = (const void *)p_l3;
+
+        /* Version, traffic class and flow label, then hop limit */
+        if (memcmp(f_l3, p_l3, sizeof(uint32_t)) ||
+            f_ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim !=
+            p_ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim) {
+            return false;
+        }
+    } else {
+        const struct ip_header *f_ip = (const void *)f_l3;
+        const struct ip_header *p_ip = (const void *)p_l3;
+
+        if (f_ip->ip_tos != p_ip->ip_tos || f_ip->ip_ttl != p_ip->ip_ttl ||
+            lduw_be_p(&f_ip->ip_off) != lduw_be_p(&p_ip->ip_off)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void filter_gro_start(GROFlow *f, NetClientState *sender,
+                             unsigned flags, const GROPacket *p)
+{
+    memcpy(f->buf, p->buf, p->size);
+    f->active = true;
+    f->sender = sender;
+    f->flags = flags;
+    f->size = p->end;
+    f->orig_size = p->size;
+    f->vnet_hdr_len = p->vnet_hdr_len;
+    f->ipv6 = p->ipv6;
+    f->l3_off = p->l3_off;
+    f->l4_off = p->l4_off;
+    f->data_off = p->data_off;
+    f->mss = p->end - p->data_off;
+    f->next_seq = p->seq + f->mss;
+    f->segs = 1;
+}
+
+static void filter_gro_merge(GROFlow *f, const GROPacket *p)
+{
+    tcp_header *f_tcp = (void *)(f->buf + f->l4_off);
+    const tcp_header *p_tcp = (const void *)(p->buf + p->l4_off);
+    size_t payload = p->end - p->data_off;
+
+    memcpy(f->buf + f->size, p->buf + p->data_off, payload);
+    f->size += payload;
+    f->next_seq += payload;
+    f->segs++;
+
+    /* The coalesced packet advertises the latest window */
+    memcpy(&f_tcp->th_win, &p_tcp->th_win, sizeof(f_tcp->th_win));
+    if (p->tcp_flags & TH_PUSH) {
+        stw_be_p(&f_tcp->th_offset_flags,
+                 lduw_be_p(&f_tcp->th_offset_flags) | TH_PUSH);
+    }
+}
+
+/* Fix up the headers of a coalesced packet */
+static void filter_gro_finish(GROFlow *f)
+{
+    uint8_t *l3 = f->buf + f->l3_off;
+    tcp_header *tcp = (void *)(f->buf + f->l4_off);
+    uint16_t l4_len = f->size - f->l4_off;
+    uint32_t cso, sum;
+
+    if (f->ipv6) {
+        struct ip6_header *ip6 = (void *)l3;
+
+        stw_be_p(&ip6->ip6_plen, l4_len);
+        sum = eth_calc_ip6_pseudo_hdr_csum(ip6, l4_len, IP_PROTO_TCP, &cso);
+    } else {
+        struct ip_header *ip = (void *)l3;
+
+        stw_be_p(&ip->ip_len, f->size - f->l3_off);
+        eth_fix_ip4_checksum(ip, sizeof(*ip));
+        sum = eth_calc_ip4_pseudo_hdr_csum(ip, l4_len, &cso);
+    }
+
+    stw_he_p(&tcp->th_sum, 0);
+    sum += net_checksum_add(l4_len, (uint8_t *)tcp);
+    stw_be_p(&tcp->th_sum, net_checksum_finish(sum));
+
+    if (f->vnet_hdr_len) {
+        struct virtio_net_hdr *hdr = (void *)f->buf;
+
+        /*
+         * Describe the packet like the host kernel describes the ones it
+         * coalesced, so that the guest can segment it again.  Backends
+         * use the host byte order for the vnet header.
+         */
+        hdr->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+        hdr->gso_type = f->ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6
+                                : VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->hdr_len = f->data_off - f->vnet_hdr_len;
+        hdr->gso_size = f->mss;
+        hdr->csum_start = 0;
+        hdr->csum_offset = 0;
+    }
+}
+
+static void filter_gro_flush_flow(FilterGROState *s, GROFlow *f)
+{
+    struct iovec iov = {
+        .iov_base = f->buf,
+        .iov_len = f->segs > 1 ? f->size : f->orig_size,
+    };
+
+    if (f->segs > 1) {
+        filter_gro_finish(f);
+    }
+
+    /* The receiver can hand packets back to us while we pass this one on */
+    f->active = false;
+    qemu_netfilter_pass_to_next(f->sender, f->flags, &iov, 1,
+                                NETFILTER(s));
+}
+
+static void filter_gro_flush(FilterGROState *s)
+{
+    int i;
+
+    for (i = 0; i < FILTER_GRO_MAX_FLOWS; i++) {
+        if (s->flows[i].active) {
+            filter_gro_flush_flow(s, &s->flows[i]);
+        }
+    }
+}
+
+static void filter_gro_flush_deferred(void *opaque)
+{
+    FilterGROState *s = opaque;
+
+    s->flush_pending = false;
+    filter_gro_flush(s);
+}
+
+static GROFlow *filter_gro_new_flow(FilterGROState *s)
+{
+    GROFlow *f;
+    int i;
+
+    for (i = 0; i < FILTER_GRO_MAX_FLOWS; i++) {
+        if (!s->flows[i].active) {
+            return &s->flows[i];
+        }
+    }
+
+    f = &s->flows[s->next_evict];
+    s->next_evict = (s->next_evict + 1) % FILTER_GRO_MAX_FLOWS;
+    filter_gro_flush_flow(s, f);
+    return f;
+}
+
+static ssize_t filter_gro_receive_iov(NetFilterState *nf,
+                                      NetClientState *sender,
+                                      unsigned flags,
+                                      const struct iovec *iov,
+                                      int iovcnt,
+                                      NetPacketSent *sent_cb)
+{
+    FilterGROState *s = FILTER_GRO(nf);
+    size_t vnet_hdr_len = 0;
+    GROPacket p;
+    GROFlow *f;
+
+    if (qemu_get_using_vnet_hdr(nf->netdev)) {
+        vnet_hdr_len = qemu_get_vnet_hdr_len(nf->netdev);
+    }
+
+    if ((flags & QEMU_NET_PACKET_FLAG_RAW) || iovcnt != 1 ||
+        vnet_hdr_len > FILTER_GRO_MAX_VNET_HDR_LEN) {
+        /* Could be a segment of a held flow, keep them in order */
+        filter_gro_flush(s);
+        return 0;
+    }
+
+    if (!filter_gro_parse(iov->iov_base, iov->iov_len, vnet_hdr_len, &p)) {
+        return 0;
+    }
+
+    f = filter_gro_find_flow(s, &p);
+    if (f) {
+        if (filter_gro_segment_ok(s, &p) && filter_gro_can_merge(s, f, &p)) {
+            filter_gro_merge(f, &p);
+
+            /* A short segment or a push ends the burst */
+            if (p.end - p.data_off < f->mss || (p.tcp_flags & TH_PUSH)) {
+                filter_gro_flush_flow(s, f);
+            }
+            return iov->iov_len;
+        }
+        filter_gro_flush_flow(s, f);
+    }
+
+    /*
+     * If the receiver is full, let the packet take the normal path so
+     * that the backend stops reading until the receiver drains.
+     */
+    if ((p.tcp_flags & TH_PUSH) || !qemu_can_send_packet(nf->netdev) ||
+        !filter_gro_segment_ok(s, &p)) {
+        return 0;
+    }
+
+    f = filter_gro_new_flow(s);
+    filter_gro_start(f, sender, flags, &p);
+
+    if (!s->flush_pending) {
+        s->flush_pending = true;
+        defer_call(filter_gro_flush_deferred, s);
+    }
+    return iov->iov_len;
+}
+
+static void filter_gro_setup(NetFilterState *nf, Error **errp)
+{
+    FilterGROState *s = FILTER_GRO(nf);
+    int i;
+
+    if (!s->max_size) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-size",
+                   "the largest frame the guest accepts");
+        return;
+    }
+
+    /* Packets the guest sends are segmented by the NIC models already */
+    if (nf->direction != NET_FILTER_DIRECTION_TX) {
+        error_setg(errp, "filter-gro only supports queue=tx");
+        return;
+    }
+
+    for (i = 0; i < FILTER_GRO_MAX_FLOWS; i++) {
+        s->flows[i].buf = g_malloc(FILTER_GRO_MAX_VNET_HDR_LEN + s->max_size);
+    }
+}
+
+static void filter_gro_cleanup(NetFilterState *nf)
+{
+    FilterGROState *s = FILTER_GRO(nf);
+    int i;
+
+    filter_gro_flush(s);
+
+    for (i = 0; i < FILTER_GRO_MAX_FLOWS; i++) {
+        g_free(s->flows[i].buf);
+        s->flows[i].buf = NULL;
+    }
+}
+
+static void filter_gro_status_changed(NetFilterState *nf, Error **errp)
+{
+    if (!nf->on) {
+        filter_gro_flush(FILTER_GRO(nf));
+    }
+}
+
+static void filter_gro_get_max_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    FilterGROState *s = FILTER_GRO(obj);
+    uint32_t value = s->max_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void filter_gro_set_max_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    FilterGROState *s = FILTER_GRO(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value < FILTER_GRO_MIN_SIZE || value > FILTER_GRO_MAX_SIZE) {
+        error_setg(errp, "Property '%s.%s' must be between %d and %zu",
+                   object_get_typename(obj), name,
+                   FILTER_GRO_MIN_SIZE, FILTER_GRO_MAX_SIZE);
+        return;
+    }
+    s->max_size = value;
+}
+
+static void filter_gro_class_init(ObjectClass *oc, void *data)
+{
+    NetFilterClass *nfc = NETFILTER_CLASS(oc);
+
+    object_class_property_add(oc, "max-size", "uint32",
+                              filter_gro_get_max_size,
+                              filter_gro_set_max_size, NULL, NULL);
+
+    nfc->setup = filter_gro_setup;
+    nfc->cleanup = filter_gro_cleanup;
+    nfc->receive_iov = filter_gro_receive_iov;
+    nfc->status_changed = filter_gro_status_changed;
+}
+
+static const TypeInfo filter_gro_info = {
+    .name = TYPE_FILTER_GRO,
+    .parent = TYPE_NETFILTER,
+    .class_init = filter_gro_class_init,
+    .instance_size = sizeof(FilterGROState),
+};
+
+static void register_types(void)
+{
+    type_register_static(&filter_gro_info);
+}
+
+type_init(register_types);
@@ -99,7 +99,6 @@ static void coroutine_fn filter_send_co(void *opaque)
 
     data->ret = _filter_send(data->s, data->buf, data->size);
     data->done = true;
-    g_free(data->buf);
     aio_wait_kick();
 }
 
@@ -108,14 +107,20 @@ static int filter_send(MirrorState *s,
                        int iovcnt)
 {
     ssize_t size = iov_size(iov, iovcnt);
-    char *buf = NULL;
+    g_autofree char *copy = NULL;
+    char *buf;
 
     if (!size) {
         return 0;
     }
 
-    buf = g_malloc(size);
-    iov_to_buf(iov, iovcnt, 0, buf, size);
+    /* We wait for the write below, so a single buffer can be used as is */
+    if (iovcnt == 1) {
+        buf = iov[0].iov_base;
+    } else {
+        buf = copy = g_malloc(size);
+        iov_to_buf(iov, iovcnt, 0, buf, size);
+    }
 
     FilterSendCo data = {
         .s = s,
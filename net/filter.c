@@ -245,6 +245,13 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
         return;
     }
 
+    /* Filters run in the main loop, they cannot follow it into an IOThread */
+    if (ncs[0]->aio_context_mapped) {
+        error_setg(errp, "netdev '%s' is used with iothread-vq-mapping, "
+                   "which does not support filters", ncs[0]->name);
+        return;
+    }
+
     if (strcmp(nf->position, "head") && strcmp(nf->position, "tail")) {
         Object *container;
         Object *obj;
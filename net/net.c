@@ -555,6 +555,8 @@ void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
     }
 
     nc->info->set_offload(nc, csum, tso4, tso6, ecn, ufo, uso4, uso6);
+    nc->offload_tso4 = tso4;
+    nc->offload_tso6 = tso6;
 }
 
 int qemu_get_vnet_hdr_len(NetClientState *nc)
@@ -602,6 +604,27 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+bool qemu_can_set_aio_context(NetClientState *nc)
+{
+    return nc && nc->info->set_aio_context;
+}
+
+/*
+ * Move the I/O handlers of @nc into @ctx, or back into the main loop if @ctx
+ * is NULL.  The caller must make sure that @nc is not processing packets
+ * concurrently, either by holding the BQL while @nc lives in the main loop or
+ * by running in the AioContext that currently owns @nc.
+ */
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!qemu_can_set_aio_context(nc)) {
+        return;
+    }
+
+    nc->info->set_aio_context(nc, ctx);
+    nc->aio_context = ctx;
+}
+
 int qemu_can_receive_packet(NetClientState *nc)
 {
     if (nc->receive_disabled) {
@@ -858,9 +881,11 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_sendv_packet_async_with_flags(NetClientState *sender,
+                                                  unsigned flags,
+                                                  const struct iovec *iov,
+                                                  int iovcnt,
+                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     size_t size = iov_size(iov, iovcnt);
@@ -876,24 +901,46 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
 
     /* Let filters handle the packet first */
     ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags, iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     ret = filter_receive_iov(sender->peer, NET_FILTER_DIRECTION_RX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags, iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     queue = sender->peer->incoming_queue;
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
+    return qemu_net_queue_send_iov(queue, sender, flags,
                                    iov, iovcnt, sent_cb);
 }
 
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NONE,
+                                              iov, iovcnt, sent_cb);
+}
+
+/*
+ * Like qemu_sendv_packet_async(), but if the packet has to be queued the
+ * queue keeps pointers to the buffers instead of copying them.  The caller
+ * must keep the buffers (not the iovec array) valid until @sent_cb runs.
+ */
+ssize_t qemu_sendv_packet_async_borrow(NetClientState *sender,
+                                       const struct iovec *iov, int iovcnt,
+                                       NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_BORROW,
+                                              iov, iovcnt, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
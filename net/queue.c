@@ -24,6 +24,7 @@
 #include "qemu/osdep.h"
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -40,13 +41,29 @@
  * unbounded queueing.
  */
 
+/*
+ * Packets that fit into NET_QUEUE_POOL_PACKET_SIZE bytes, which covers
+ * standard MTU frames with a vnet header, are recycled through a per-queue
+ * pool instead of going back to the allocator.  A queue is only ever used
+ * from the AioContext of its receiving client, so the pool needs no locking.
+ *
+ * A sender that passes QEMU_NET_PACKET_FLAG_BORROW together with a sent
+ * callback promises that the buffers stay valid until the callback has run.
+ * Such packets are queued without copying the payload; only the iovec array
+ * is saved.
+ */
+#define NET_QUEUE_POOL_PACKET_SIZE 2048
+#define NET_QUEUE_POOL_MAX 256
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[];
+    int iovcnt;                 /* > 0 if data holds borrowed iovecs */
+    bool pooled;
+    uint8_t data[] __attribute__((aligned));
 };
 
 struct NetQueue {
@@ -57,6 +74,10 @@ struct NetQueue {
 
     QTAILQ_HEAD(, NetPacket) packets;
 
+    /* Free packets of NET_QUEUE_POOL_PACKET_SIZE bytes */
+    QTAILQ_HEAD(, NetPacket) pool;
+    uint32_t pool_count;
+
     unsigned delivering : 1;
 };
 
@@ -72,12 +93,44 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     queue->deliver = deliver;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->pool);
 
     queue->delivering = 0;
 
     return queue;
 }
 
+static NetPacket *qemu_net_queue_alloc_packet(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+
+    if (sizeof(NetPacket) + size > NET_QUEUE_POOL_PACKET_SIZE) {
+        packet = g_malloc(sizeof(NetPacket) + size);
+        packet->pooled = false;
+        return packet;
+    }
+
+    packet = QTAILQ_FIRST(&queue->pool);
+    if (packet) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        queue->pool_count--;
+    } else {
+        packet = g_malloc(NET_QUEUE_POOL_PACKET_SIZE);
+        packet->pooled = true;
+    }
+    return packet;
+}
+
+static void qemu_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->pooled && queue->pool_count < NET_QUEUE_POOL_MAX) {
+        QTAILQ_INSERT_HEAD(&queue->pool, packet, entry);
+        queue->pool_count++;
+    } else {
+        g_free(packet);
+    }
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
@@ -86,6 +139,10 @@ void qemu_del_net_queue(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         g_free(packet);
     }
+    QTAILQ_FOREACH_SAFE(packet, &queue->pool, entry, next) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        g_free(packet);
+    }
 
     g_free(queue);
 }
@@ -97,20 +154,12 @@ static void qemu_net_queue_append(NetQueue *queue,
                                   size_t size,
                                   NetPacketSent *sent_cb)
 {
-    NetPacket *packet;
-
-    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
-        return; /* drop if queue full and no callback */
-    }
-    packet = g_malloc(sizeof(NetPacket) + size);
-    packet->sender = sender;
-    packet->flags = flags;
-    packet->size = size;
-    packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size
+    };
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_append_iov(queue, sender, flags, &iov, 1, sent_cb);
 }
 
 void qemu_net_queue_append_iov(NetQueue *queue,
@@ -121,28 +170,26 @@ void qemu_net_queue_append_iov(NetQueue *queue,
                                NetPacketSent *sent_cb)
 {
     NetPacket *packet;
-    size_t max_len = 0;
-    int i;
+    size_t size;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    for (i = 0; i < iovcnt; i++) {
-        max_len += iov[i].iov_len;
-    }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    if ((flags & QEMU_NET_PACKET_FLAG_BORROW) && sent_cb) {
+        packet = qemu_net_queue_alloc_packet(queue, iovcnt * sizeof(*iov));
+        packet->iovcnt = iovcnt;
+        packet->size = iov_size(iov, iovcnt);
+        memcpy(packet->data, iov, iovcnt * sizeof(*iov));
+    } else {
+        size = iov_size(iov, iovcnt);
+        packet = qemu_net_queue_alloc_packet(queue, size);
+        packet->iovcnt = 0;
+        packet->size = iov_to_buf(iov, iovcnt, 0, packet->data, size);
+    }
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
-    packet->size = 0;
-
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
-
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
-    }
 
     queue->nq_count++;
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
@@ -265,7 +312,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_queue_free_packet(queue, packet);
         }
     }
 }
@@ -283,11 +330,19 @@ bool qemu_net_queue_flush(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iovcnt) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             (struct iovec *)packet->data,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
@@ -298,7 +353,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_free_packet(queue, packet);
     }
     return true;
 }
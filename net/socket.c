@@ -30,6 +30,7 @@
 #include "qemu/error-report.h"
 #include "qemu/option.h"
 #include "qemu/sockets.h"
+#include "qemu/defer-call.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 
@@ -43,6 +44,7 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+    AioContext *ctx;              /* polling the fd, NULL for the main loop */
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
@@ -50,10 +52,14 @@ static void net_socket_writable(void *opaque);
 
 static void net_socket_update_fd_handler(NetSocketState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll ? s->send_fn : NULL,
-                        s->write_poll ? net_socket_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll ? s->send_fn : NULL;
+    IOHandler *fd_write = s->write_poll ? net_socket_writable : NULL;
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, fd_read, fd_write, NULL, NULL, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
 }
 
 static void net_socket_read_poll(NetSocketState *s, bool enable)
@@ -183,7 +189,10 @@ static void net_socket_send(void *opaque)
     }
     buf = buf1;
 
+    /* Packets from one read form a batch for the receiver and filters */
+    defer_call_begin();
     ret = net_fill_rstate(&s->rs, buf, size);
+    defer_call_end();
 
     if (ret == -1) {
         goto eoc;
@@ -319,11 +328,36 @@ static void net_socket_cleanup(NetClientState *nc)
     }
 }
 
+/* The listening socket, if any, stays in the main loop */
+static void net_socket_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    /* Remove the handlers from the old context before installing new ones */
+    if (s->fd != -1) {
+        if (s->ctx) {
+            aio_set_fd_handler(s->ctx, s->fd, NULL, NULL, NULL, NULL, NULL);
+        } else {
+            qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+        }
+    }
+
+    s->ctx = ctx;
+    if (s->fd != -1) {
+        net_socket_update_fd_handler(s);
+    }
+}
+
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_DRIVER_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
     .cleanup = net_socket_cleanup,
+    .set_aio_context = net_socket_set_aio_context,
 };
 
 static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
@@ -415,6 +449,7 @@ static NetClientInfo net_socket_info = {
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
     .cleanup = net_socket_cleanup,
+    .set_aio_context = net_socket_set_aio_context,
 };
 
 static NetSocketState *net_socket_fd_init_stream(NetClientState *peer,
@@ -32,6 +32,7 @@
 #include "qemu/error-report.h"
 #include "qemu/option.h"
 #include "qemu/sockets.h"
+#include "qemu/defer-call.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/cutils.h"
@@ -182,7 +183,10 @@ static gboolean net_stream_send(QIOChannel *ioc,
     }
     buf = buf1;
 
+    /* Packets from one read form a batch for the receiver and filters */
+    defer_call_begin();
     ret = net_fill_rstate(&s->rs, (const uint8_t *)buf, size);
+    defer_call_end();
 
     if (ret == -1) {
         goto eoc;
@@ -0,0 +1,255 @@
+/*
+ * Batched tap I/O with io_uring
+ *
+ * Reading from and writing to a tap device costs one system call per
+ * packet.  Instead, submit a whole batch of reads or writes with a single
+ * io_uring_enter() call.  The tap file descriptor is non-blocking, so every
+ * request completes (possibly with -EAGAIN) while it is being submitted and
+ * no request is ever left in flight between two calls.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "qemu/iov.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "net/net.h"
+#include "tap_int.h"
+
+struct TapUring {
+    struct io_uring ring;
+    int fd;
+
+    /* Submission failed once, use read()/writev() from now on */
+    bool broken;
+
+    /* Receive buffers, NET_BUFSIZE bytes each */
+    uint8_t *rx_buf;
+    struct iovec rx_iov[TAP_URING_BATCH];
+
+    /* Copies of the packets waiting for tap_uring_flush() */
+    struct iovec tx[TAP_URING_BATCH];
+    int tx_count;
+};
+
+TapUring *tap_uring_new(int fd, Error **errp)
+{
+    TapUring *tu;
+    int flags, ret, i;
+
+    /* Requests must not block, see the comment at the top of the file */
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || !(flags & O_NONBLOCK)) {
+        error_setg(errp,
+                   "io-uring requires a non-blocking tap file descriptor");
+        return NULL;
+    }
+
+    tu = g_new0(TapUring, 1);
+    ret = io_uring_queue_init(TAP_URING_BATCH, &tu->ring, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to initialize io_uring for tap");
+        g_free(tu);
+        return NULL;
+    }
+
+    tu->fd = fd;
+    tu->rx_buf = g_malloc(TAP_URING_BATCH * NET_BUFSIZE);
+    for (i = 0; i < TAP_URING_BATCH; i++) {
+        tu->rx_iov[i].iov_base = tu->rx_buf + i * NET_BUFSIZE;
+        tu->rx_iov[i].iov_len = NET_BUFSIZE;
+    }
+    return tu;
+}
+
+void tap_uring_free(TapUring *tu)
+{
+    int i;
+
+    if (!tu) {
+        return;
+    }
+
+    for (i = 0; i < tu->tx_count; i++) {
+        g_free(tu->tx[i].iov_base);
+    }
+    io_uring_queue_exit(&tu->ring);
+    g_free(tu->rx_buf);
+    g_free(tu);
+}
+
+/*
+ * Submit the @n prepared requests and store the result of request i, as
+ * identified by its user_data, in @res[i].  Requests that could not be
+ * submitted get -ECANCELED.
+ */
+static void tap_uring_submit(TapUring *tu, int n, int *res)
+{
+    struct io_uring_cqe *cqe;
+    int submitted, i, ret;
+
+    for (i = 0; i < n; i++) {
+        res[i] = -ECANCELED;
+    }
+
+    do {
+        submitted = io_uring_submit(&tu->ring);
+    } while (submitted == -EINTR);
+
+    if (submitted != n) {
+        /*
+         * Requests that were not submitted stay in the submission queue and
+         * there is no way to take them back.  Never submit again so that they
+         * cannot run later against stale buffers.
+         */
+        warn_report("tap: io_uring submission failed (%s), "
+                    "falling back to read()/writev()",
+                    submitted < 0 ? strerror(-submitted) : "short submission");
+        tu->broken = true;
+        submitted = MAX(submitted, 0);
+    }
+
+    for (i = 0; i < submitted; i++) {
+        do {
+            ret = io_uring_wait_cqe(&tu->ring, &cqe);
+        } while (ret == -EINTR);
+        if (ret < 0) {
+            /* Cannot happen with non-blocking requests */
+            error_report("tap: waiting for io_uring completion failed: %s",
+                         strerror(-ret));
+            abort();
+        }
+
+        res[(uintptr_t)io_uring_cqe_get_data(cqe)] = cqe->res;
+        io_uring_cqe_seen(&tu->ring, cqe);
+    }
+}
+
+/*
+ * Read up to @n packets.  On return @pkts points to the packets, which stay
+ * valid until the next call.  Returns the number of packets read.
+ */
+int tap_uring_read(TapUring *tu, struct iovec *pkts, int n)
+{
+    int res[TAP_URING_BATCH];
+    int count = 0;
+    int i;
+
+    assert(n <= TAP_URING_BATCH);
+
+    if (tu->broken) {
+        for (i = 0; i < n; i++) {
+            ssize_t len = tap_read_packet(tu->fd, tu->rx_iov[i].iov_base,
+                                          NET_BUFSIZE);
+            if (len <= 0) {
+                break;
+            }
+            pkts[count].iov_base = tu->rx_iov[i].iov_base;
+            pkts[count].iov_len = len;
+            count++;
+        }
+        return count;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&tu->ring);
+
+        io_uring_prep_readv(sqe, tu->fd, &tu->rx_iov[i], 1, 0);
+        io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+    }
+
+    tap_uring_submit(tu, n, res);
+
+    /*
+     * The reads were issued in order, so buffer order is packet order even
+     * if a packet arrived after an earlier read returned -EAGAIN.
+     */
+    for (i = 0; i < n; i++) {
+        if (res[i] > 0) {
+            pkts[count].iov_base = tu->rx_iov[i].iov_base;
+            pkts[count].iov_len = res[i];
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * Copy a packet into the transmit batch.  Returns false if the batch is
+ * full and tap_uring_flush() must be called first.
+ */
+bool tap_uring_queue_write(TapUring *tu, const struct iovec *iov, int iovcnt)
+{
+    size_t size = iov_size(iov, iovcnt);
+    struct iovec *tx;
+
+    if (tu->tx_count == TAP_URING_BATCH) {
+        return false;
+    }
+
+    tx = &tu->tx[tu->tx_count++];
+    tx->iov_base = g_malloc(size);
+    tx->iov_len = iov_to_buf(iov, iovcnt, 0, tx->iov_base, size);
+    return true;
+}
+
+/*
+ * Write the transmit batch.  Returns -EAGAIN if the tap device did not
+ * accept all packets; the rest stays queued in order.  Packets that fail
+ * with another error are dropped, like after a failed writev().
+ */
+int tap_uring_flush(TapUring *tu)
+{
+    int res[TAP_URING_BATCH];
+    int n = tu->tx_count;
+    int i, j;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    if (tu->broken) {
+        for (i = 0; i < n; i++) {
+            res[i] = RETRY_ON_EINTR(writev(tu->fd, &tu->tx[i], 1));
+            if (res[i] < 0) {
+                res[i] = -errno;
+                if (res[i] == -EAGAIN) {
+                    break;
+                }
+            }
+        }
+        for (i++; i < n; i++) {
+            res[i] = -ECANCELED;
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&tu->ring);
+
+            io_uring_prep_writev(sqe, tu->fd, &tu->tx[i], 1, 0);
+            io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+
+            /* Cancel the rest of the batch if a packet does not fit */
+            if (i < n - 1) {
+                io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+            }
+        }
+
+        tap_uring_submit(tu, n, res);
+    }
+
+    for (i = 0, j = 0; i < n; i++) {
+        if (res[i] == -EAGAIN || res[i] == -ECANCELED) {
+            tu->tx[j++] = tu->tx[i];
+        } else {
+            g_free(tu->tx[i].iov_base);
+        }
+    }
+    tu->tx_count = j;
+
+    return j ? -EAGAIN : 0;
+}
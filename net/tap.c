@@ -40,8 +40,11 @@
 #include "qapi/error.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
+#include "qemu/defer-call.h"
+#include "block/aio.h"
 
 #include "net/tap.h"
 
@@ -62,6 +65,10 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    /* AioContext polling the fd, NULL for the main loop */
+    AioContext *ctx;
+    /* Batched reads and writes, NULL unless io-uring=on */
+    TapUring *uring;
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -72,10 +79,15 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *fd_write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, fd_read, fd_write,
+                           NULL, NULL, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -96,13 +108,62 @@ static void tap_writable(void *opaque)
 
     tap_write_poll(s, false);
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* Packets of the last batch go first */
+    if (s->uring && tap_uring_flush(s->uring) == -EAGAIN) {
+        tap_write_poll(s, true);
+        return;
+    }
+#endif
+
     qemu_flush_queued_packets(&s->nc);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static void tap_flush_batch(void *opaque)
+{
+    TAPState *s = opaque;
+
+    if (tap_uring_flush(s->uring) == -EAGAIN) {
+        tap_write_poll(s, true);
+    }
+}
+
+/*
+ * Copy the packet into the current batch, which is written when the
+ * sender's defer_call section ends.
+ */
+static ssize_t tap_write_packet_batched(TAPState *s, const struct iovec *iov,
+                                        int iovcnt)
+{
+    /* Packets already wait for the tap device, do not overtake them */
+    if (s->write_poll) {
+        return 0;
+    }
+
+    if (!tap_uring_queue_write(s->uring, iov, iovcnt)) {
+        tap_flush_batch(s);
+        if (s->write_poll) {
+            return 0;
+        }
+        tap_uring_queue_write(s->uring, iov, iovcnt);
+    }
+
+    defer_call(tap_flush_batch, s);
+    return iov_size(iov, iovcnt);
+}
+#endif
+
 static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt)
 {
     ssize_t len;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        return tap_write_packet_batched(s, iov, iovcnt);
+    }
+#endif
+
     len = RETRY_ON_EINTR(writev(s->fd, iov, iovcnt));
 
     if (len == -1 && errno == EAGAIN) {
@@ -181,35 +242,91 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/*
+ * When the host keeps receiving more packets while tap_send() is running we
+ * can hog the BQL.  Limit the number of packets that are processed per
+ * tap_send() callback to prevent stalling the guest.
+ */
+#define TAP_SEND_BUDGET 50
+
+static ssize_t tap_send_packet(TAPState *s, uint8_t *buf, int size)
+{
+    uint8_t min_pkt[ETH_ZLEN];
+    size_t min_pktsz = sizeof(min_pkt);
+
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        buf  += s->host_vnet_hdr_len;
+        size -= s->host_vnet_hdr_len;
+    }
+
+    if (net_peer_needs_padding(&s->nc)) {
+        if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
+            buf = min_pkt;
+            size = min_pktsz;
+        }
+    }
+
+    return qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+static void tap_send_batched(TAPState *s)
+{
+    struct iovec pkts[TAP_URING_BATCH];
+    int packets = 0;
+    bool stop = false;
+
+    /* Let the receiver notify the guest once per batch */
+    defer_call_begin();
+
+    while (!stop && packets < TAP_SEND_BUDGET) {
+        int n = MIN(TAP_URING_BATCH, TAP_SEND_BUDGET - packets);
+        int count, i;
+
+        count = tap_uring_read(s->uring, pkts, n);
+        for (i = 0; i < count; i++) {
+            /*
+             * The packets were already read, so deliver all of them.  If the
+             * peer cannot take them they are queued in order.
+             */
+            if (tap_send_packet(s, pkts[i].iov_base, pkts[i].iov_len) == 0) {
+                tap_read_poll(s, false);
+                stop = true;
+            }
+        }
+
+        packets += count;
+        if (count < n) {
+            break;
+        }
+    }
+
+    defer_call_end();
+}
+#endif
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
     int packets = 0;
 
-    while (true) {
-        uint8_t *buf = s->buf;
-        uint8_t min_pkt[ETH_ZLEN];
-        size_t min_pktsz = sizeof(min_pkt);
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        tap_send_batched(s);
+        return;
+    }
+#endif
+
+    defer_call_begin();
 
+    while (true) {
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
         if (size <= 0) {
             break;
         }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
-
-        if (net_peer_needs_padding(&s->nc)) {
-            if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
-                buf = min_pkt;
-                size = min_pktsz;
-            }
-        }
-
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+        size = tap_send_packet(s, s->buf, size);
         if (size == 0) {
             tap_read_poll(s, false);
             break;
@@ -217,17 +334,13 @@ static void tap_send(void *opaque)
             break;
         }
 
-        /*
-         * When the host keeps receiving more packets while tap_send() is
-         * running we can hog the BQL.  Limit the number of
-         * packets that are processed per tap_send() callback to prevent
-         * stalling the guest.
-         */
         packets++;
-        if (packets >= 50) {
+        if (packets >= TAP_SEND_BUDGET) {
             break;
         }
     }
+
+    defer_call_end();
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -358,6 +471,10 @@ static void tap_cleanup(NetClientState *nc)
 
     tap_read_poll(s, false);
     tap_write_poll(s, false);
+#ifdef CONFIG_LINUX_IO_URING
+    tap_uring_free(s->uring);
+    s->uring = NULL;
+#endif
     close(s->fd);
     s->fd = -1;
 }
@@ -369,6 +486,25 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    /* Remove the handlers from the old context before installing new ones */
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, NULL, NULL, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+
+    s->ctx = ctx;
+    tap_update_fd_handler(s);
+}
+
 static bool tap_set_steering_ebpf(NetClientState *nc, int prog_fd)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -406,6 +542,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
     .set_steering_ebpf = tap_set_steering_ebpf,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -777,6 +914,22 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         goto failed;
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (tap->has_io_uring && tap->io_uring) {
+        if (s->vhost_net) {
+            error_setg(errp, "io-uring=on is not compatible with vhost");
+            goto failed;
+        }
+        /* The kernel may lack io_uring or have it disabled */
+        s->uring = tap_uring_new(s->fd, &err);
+        if (!s->uring) {
+            warn_reportf_err(err, "tap: using read()/writev() instead of "
+                             "io_uring: ");
+            err = NULL;
+        }
+    }
+#endif
+
     return;
 
 failed:
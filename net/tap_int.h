@@ -48,4 +48,15 @@ int tap_fd_disable(int fd);
 int tap_fd_get_ifname(int fd, char *ifname);
 int tap_fd_set_steering_ebpf(int fd, int prog_fd);
 
+/* Packets per io_uring submission, see tap-uring.c */
+#define TAP_URING_BATCH 16
+
+typedef struct TapUring TapUring;
+
+TapUring *tap_uring_new(int fd, Error **errp);
+void tap_uring_free(TapUring *tu);
+int tap_uring_read(TapUring *tu, struct iovec *pkts, int n);
+bool tap_uring_queue_write(TapUring *tu, const struct iovec *iov, int iovcnt);
+int tap_uring_flush(TapUring *tu);
+
 #endif /* NET_TAP_INT_H */
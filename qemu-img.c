@@ -50,7 +50,9 @@
 #include "block/blockjob.h"
 #include "block/dirty-bitmap.h"
 #include "block/qapi.h"
+#include "block/thread-pool.h"
 #include "crypto/init.h"
+#include "crypto/hash.h"
 #include "trace/control.h"
 #include "qemu/throttle.h"
 #include "block/throttle-groups.h"
@@ -86,6 +88,10 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_STREAM = 278,
+    OPTION_MANIFEST = 279,
+    OPTION_MANIFEST_OUT = 280,
+    OPTION_CHECK_DATA = 281,
 };
 
 typedef enum OutputFormat {
@@ -201,12 +207,16 @@ void help(void)
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
            "       kinds of errors, with a higher risk of choosing the wrong fix or\n"
            "       hiding corruption that has already occurred.\n"
+           "  '--data' also verifies the data of all clusters against the checksums\n"
+           "       that the image keeps for them (qcow2 with data_checksums=on)\n"
            "\n"
            "Parameters to convert subcommand:\n"
            "  '--bitmaps' copies all top-level persistent bitmaps to destination\n"
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--stream' writes a qcow2 image sequentially, e.g. to a pipe or '-'\n"
+           "       for stdout\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -726,6 +736,7 @@ static int img_check(int argc, char **argv)
     int fix = 0;
     int flags = BDRV_O_CHECK;
     bool writethrough;
+    bool check_data = false;
     ImageCheck *check;
     bool quiet = false;
     bool image_opts = false;
@@ -745,6 +756,7 @@ static int img_check(int argc, char **argv)
             {"object", required_argument, 0, OPTION_OBJECT},
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"force-share", no_argument, 0, 'U'},
+            {"data", no_argument, 0, OPTION_CHECK_DATA},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:r:T:qU",
@@ -795,6 +807,9 @@ static int img_check(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_CHECK_DATA:
+            check_data = true;
+            break;
         }
     }
     if (optind != argc - 1) {
@@ -824,11 +839,19 @@ static int img_check(int argc, char **argv)
     }
     bs = blk_bs(blk);
 
+    if (check_data) {
+        fix |= BDRV_CHECK_DATA;
+    }
+
     check = g_new0(ImageCheck, 1);
     ret = collect_image_check(bs, check, filename, fmt, fix);
 
     if (ret == -ENOTSUP) {
-        error_report("This image format does not support checks");
+        if (check_data) {
+            error_report("This image does not support data verification");
+        } else {
+            error_report("This image format does not support checks");
+        }
         ret = 63;
         goto fail;
     }
@@ -854,7 +877,8 @@ static int img_check(int argc, char **argv)
 
         qapi_free_ImageCheck(check);
         check = g_new0(ImageCheck, 1);
-        ret = collect_image_check(bs, check, filename, fmt, 0);
+        ret = collect_image_check(bs, check, filename, fmt,
+                                  fix & BDRV_CHECK_DATA);
 
         check->leaks_fixed          = leaks_fixed;
         check->has_leaks_fixed      = has_leaks_fixed;
@@ -1309,6 +1333,7 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
 }
 
 #define IO_BUF_SIZE (2 * MiB)
+#define MAX_COROUTINES 64
 
 /*
  * Check if passed sectors are empty (not allocated or contain only 0 bytes)
@@ -1348,6 +1373,410 @@ static int check_empty_sectors(BlockBackend *blk, int64_t offset,
     return 0;
 }
 
+/*
+ * Checksum manifests for 'qemu-img compare': a header followed by the
+ * SHA-256 digest of every IMG_MANIFEST_CHUNK_SIZE sized chunk of an image,
+ * so that later comparisons do not need to read the reference image again.
+ */
+#define IMG_MANIFEST_MAGIC "QIMGMANI"
+#define IMG_MANIFEST_VERSION 1
+#define IMG_MANIFEST_CHUNK_SIZE (4 * MiB)
+#define IMG_MANIFEST_HASH_LEN 32
+
+typedef struct ImgManifestHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t hash_len;
+    uint64_t image_size;
+    uint64_t chunk_size;
+} QEMU_PACKED ImgManifestHeader;
+
+typedef struct ImgCompareState {
+    BlockBackend *blk1;
+    BlockBackend *blk2;
+    const char *filename1;
+    const char *filename2;
+    int64_t total_size1;
+    int64_t total_size2;
+    int64_t total_size;
+    uint64_t progress_base;
+    bool strict;
+    bool quiet;
+
+    /* Next offset (two images) or chunk index (manifest) to be compared */
+    int64_t next;
+    bool stop;
+    CoMutex lock;
+    int running_coroutines;
+
+    /* Lowest mismatch found so far, or -1 */
+    int64_t mismatch;
+    bool mismatch_strict;
+    int ret;
+
+    /* Manifest mode */
+    int manifest_in;
+    int manifest_out;
+    int64_t nb_chunks;
+    uint8_t zero_digest[IMG_MANIFEST_HASH_LEN];
+    uint8_t zero_tail_digest[IMG_MANIFEST_HASH_LEN];
+} ImgCompareState;
+
+static void img_compare_mismatch(ImgCompareState *s, int64_t offset,
+                                 bool strict)
+{
+    /*
+     * Work is handed out in offset order, so everything below @offset has
+     * already been scheduled; no need to schedule anything after it.
+     */
+    if (s->mismatch < 0 || offset < s->mismatch) {
+        s->mismatch = offset;
+        s->mismatch_strict = strict;
+    }
+    if (s->manifest_out < 0) {
+        s->stop = true;
+    }
+}
+
+static void img_compare_error(ImgCompareState *s, int ret)
+{
+    if (!s->ret) {
+        s->ret = ret;
+    }
+    s->stop = true;
+}
+
+static int coroutine_fn img_compare_co_read(ImgCompareState *s,
+                                            BlockBackend *blk,
+                                            const char *filename,
+                                            int64_t offset, int64_t bytes,
+                                            uint8_t *buf)
+{
+    int ret = blk_co_pread(blk, offset, bytes, buf, 0);
+    if (ret < 0) {
+        error_report("Error while reading offset %" PRId64 " of %s: %s",
+                     offset, filename, strerror(-ret));
+        img_compare_error(s, 4);
+    }
+    return ret;
+}
+
+static void coroutine_fn img_compare_co_worker(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    BlockDriverState *bs1 = blk_bs(s->blk1);
+    BlockDriverState *bs2 = blk_bs(s->blk2);
+    uint8_t *buf1 = blk_blockalign(s->blk1, IO_BUF_SIZE);
+    uint8_t *buf2 = blk_blockalign(s->blk2, IO_BUF_SIZE);
+
+    while (true) {
+        int64_t offset, chunk, pnum1, pnum2, idx;
+        int status1, status2;
+        bool allocated1, allocated2, differ;
+
+        /* Block status queries may yield, so keep them in order */
+        qemu_co_mutex_lock(&s->lock);
+        if (s->stop || s->next >= s->total_size) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        offset = s->next;
+
+        bdrv_graph_co_rdlock();
+        status1 = bdrv_co_block_status_above(bs1, NULL, offset,
+                                             s->total_size1 - offset, &pnum1,
+                                             NULL, NULL);
+        bdrv_graph_co_rdunlock();
+        if (status1 < 0) {
+            error_report("Sector allocation test failed for %s",
+                         s->filename1);
+            img_compare_error(s, 3);
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+
+        bdrv_graph_co_rdlock();
+        status2 = bdrv_co_block_status_above(bs2, NULL, offset,
+                                             s->total_size2 - offset, &pnum2,
+                                             NULL, NULL);
+        bdrv_graph_co_rdunlock();
+        if (status2 < 0) {
+            error_report("Sector allocation test failed for %s",
+                         s->filename2);
+            img_compare_error(s, 3);
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
+        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
+
+        assert(pnum1 && pnum2);
+        chunk = MIN(pnum1, pnum2);
+
+        if (s->strict && status1 != status2) {
+            img_compare_mismatch(s, offset, true);
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        if (!((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) &&
+            (allocated1 || allocated2)) {
+            chunk = MIN(chunk, IO_BUF_SIZE);
+        }
+        s->next += chunk;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
+            /* nothing to do */
+        } else if (allocated1 && allocated2) {
+            if (img_compare_co_read(s, s->blk1, s->filename1, offset, chunk,
+                                    buf1) < 0 ||
+                img_compare_co_read(s, s->blk2, s->filename2, offset, chunk,
+                                    buf2) < 0) {
+                break;
+            }
+            differ = compare_buffers(buf1, buf2, chunk, 0, &idx);
+            if (differ || idx != chunk) {
+                img_compare_mismatch(s, offset + (differ ? 0 : idx), false);
+            }
+        } else if (allocated1 || allocated2) {
+            BlockBackend *blk = allocated1 ? s->blk1 : s->blk2;
+            const char *filename = allocated1 ? s->filename1 : s->filename2;
+
+            if (img_compare_co_read(s, blk, filename, offset, chunk,
+                                    buf1) < 0) {
+                break;
+            }
+            idx = find_nonzero(buf1, chunk);
+            if (idx >= 0) {
+                img_compare_mismatch(s, offset + idx, false);
+            }
+        }
+        qemu_progress_print(((float) chunk / s->progress_base) * 100, 100);
+    }
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
+}
+
+typedef struct ImgCompareHashReq {
+    const uint8_t *buf;
+    size_t len;
+    uint8_t *digest;
+} ImgCompareHashReq;
+
+static int img_compare_hash_func(void *opaque)
+{
+    ImgCompareHashReq *req = opaque;
+    size_t resultlen = IMG_MANIFEST_HASH_LEN;
+
+    return qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, (const char *)req->buf,
+                              req->len, &req->digest, &resultlen, NULL);
+}
+
+static void coroutine_fn img_compare_co_chunk_worker(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf = blk_blockalign(s->blk1, IMG_MANIFEST_CHUNK_SIZE);
+    uint8_t digest[IMG_MANIFEST_HASH_LEN];
+    uint8_t ref[IMG_MANIFEST_HASH_LEN];
+
+    while (!s->stop && s->next < s->nb_chunks) {
+        int64_t idx = s->next++;
+        int64_t offset = idx * IMG_MANIFEST_CHUNK_SIZE;
+        int64_t bytes = MIN(IMG_MANIFEST_CHUNK_SIZE, s->total_size - offset);
+        off_t manifest_pos = sizeof(ImgManifestHeader) +
+                             idx * IMG_MANIFEST_HASH_LEN;
+        int64_t pos = offset, pnum;
+        int ret = 0;
+
+        /* Chunks that read as zero have a known digest */
+        bdrv_graph_co_rdlock();
+        while (pos < offset + bytes) {
+            ret = bdrv_co_block_status_above(blk_bs(s->blk1), NULL, pos,
+                                             offset + bytes - pos, &pnum,
+                                             NULL, NULL);
+            if (ret < 0 || !(ret & BDRV_BLOCK_ZERO)) {
+                break;
+            }
+            pos += pnum;
+        }
+        bdrv_graph_co_rdunlock();
+        if (ret < 0) {
+            error_report("Sector allocation test failed for %s",
+                         s->filename1);
+            img_compare_error(s, 3);
+            break;
+        }
+
+        if (pos >= offset + bytes) {
+            memcpy(digest, bytes == IMG_MANIFEST_CHUNK_SIZE ?
+                   s->zero_digest : s->zero_tail_digest, sizeof(digest));
+        } else {
+            ImgCompareHashReq req = {
+                .buf = buf,
+                .len = bytes,
+                .digest = digest,
+            };
+
+            if (img_compare_co_read(s, s->blk1, s->filename1, offset, bytes,
+                                    buf) < 0) {
+                break;
+            }
+            if (thread_pool_submit_co(img_compare_hash_func, &req) < 0) {
+                error_report("Failed to hash offset %" PRId64 " of %s",
+                             offset, s->filename1);
+                img_compare_error(s, 2);
+                break;
+            }
+        }
+
+        if (s->manifest_out >= 0 &&
+            pwrite(s->manifest_out, digest, sizeof(digest),
+                   manifest_pos) != sizeof(digest)) {
+            error_report("Error while writing manifest: %s", strerror(errno));
+            img_compare_error(s, 2);
+            break;
+        }
+        if (s->manifest_in >= 0) {
+            if (pread(s->manifest_in, ref, sizeof(ref), manifest_pos) !=
+                sizeof(ref)) {
+                error_report("Error while reading manifest: %s",
+                             strerror(errno));
+                img_compare_error(s, 2);
+                break;
+            }
+            if (memcmp(ref, digest, sizeof(digest))) {
+                img_compare_mismatch(s, offset, false);
+            }
+        }
+        qemu_progress_print(((float) bytes / s->progress_base) * 100, 100);
+    }
+
+    qemu_vfree(buf);
+    s->running_coroutines--;
+}
+
+static int img_compare_run(ImgCompareState *s, CoroutineEntry *entry,
+                           int num_coroutines)
+{
+    Coroutine *co;
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    s->mismatch = -1;
+    s->running_coroutines = num_coroutines;
+    for (i = 0; i < num_coroutines; i++) {
+        co = qemu_coroutine_create(entry, s);
+        qemu_coroutine_enter(co);
+    }
+
+    while (s->running_coroutines) {
+        main_loop_wait(false);
+    }
+
+    if (s->ret) {
+        return s->ret;
+    }
+    if (s->mismatch >= 0) {
+        if (s->mismatch_strict) {
+            qprintf(s->quiet, "Strict mode: Offset %" PRId64
+                    " block status mismatch!\n", s->mismatch);
+        } else {
+            qprintf(s->quiet, "Content mismatch at offset %" PRId64 "!\n",
+                    s->mismatch);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Compare s->blk1 to the manifest in s->manifest_in and/or write its
+ * manifest to s->manifest_out.
+ */
+static int img_compare_manifest(ImgCompareState *s, int num_coroutines)
+{
+    ImgManifestHeader header;
+    uint8_t *zero_buf;
+    ImgCompareHashReq req;
+    struct stat st;
+    bool size_mismatch = false;
+    int64_t tail;
+    int ret;
+
+    s->nb_chunks = DIV_ROUND_UP(s->total_size, IMG_MANIFEST_CHUNK_SIZE);
+    s->progress_base = s->total_size;
+
+    if (s->manifest_in >= 0) {
+        if (pread(s->manifest_in, &header, sizeof(header), 0) !=
+            sizeof(header) ||
+            memcmp(header.magic, IMG_MANIFEST_MAGIC, sizeof(header.magic)) ||
+            be32_to_cpu(header.version) != IMG_MANIFEST_VERSION ||
+            be32_to_cpu(header.hash_len) != IMG_MANIFEST_HASH_LEN ||
+            be64_to_cpu(header.chunk_size) != IMG_MANIFEST_CHUNK_SIZE)
+        {
+            error_report("Invalid or unsupported manifest");
+            return 2;
+        }
+        if (fstat(s->manifest_in, &st) < 0 ||
+            st.st_size != sizeof(header) +
+                DIV_ROUND_UP(be64_to_cpu(header.image_size),
+                             IMG_MANIFEST_CHUNK_SIZE) * IMG_MANIFEST_HASH_LEN)
+        {
+            error_report("Manifest is truncated");
+            return 2;
+        }
+        if (be64_to_cpu(header.image_size) != s->total_size) {
+            qprintf(s->quiet, "Image size mismatch!\n");
+            if (s->manifest_out < 0) {
+                return 1;
+            }
+            /* Still write the new manifest, but don't compare chunks */
+            s->manifest_in = -1;
+            size_mismatch = true;
+        }
+    }
+
+    if (s->manifest_out >= 0) {
+        memcpy(header.magic, IMG_MANIFEST_MAGIC, sizeof(header.magic));
+        header.version = cpu_to_be32(IMG_MANIFEST_VERSION);
+        header.hash_len = cpu_to_be32(IMG_MANIFEST_HASH_LEN);
+        header.image_size = cpu_to_be64(s->total_size);
+        header.chunk_size = cpu_to_be64(IMG_MANIFEST_CHUNK_SIZE);
+        if (qemu_write_full(s->manifest_out, &header, sizeof(header)) !=
+            sizeof(header) ||
+            ftruncate(s->manifest_out, sizeof(header) +
+                      s->nb_chunks * IMG_MANIFEST_HASH_LEN) < 0) {
+            error_report("Error while writing manifest: %s", strerror(errno));
+            return 2;
+        }
+    }
+
+    /* Digests of all-zero chunks, which are never read from the image */
+    zero_buf = g_malloc0(IMG_MANIFEST_CHUNK_SIZE);
+    tail = s->total_size % IMG_MANIFEST_CHUNK_SIZE;
+    req = (ImgCompareHashReq) {
+        .buf = zero_buf,
+        .len = IMG_MANIFEST_CHUNK_SIZE,
+        .digest = s->zero_digest,
+    };
+    ret = img_compare_hash_func(&req);
+    if (!ret) {
+        req.len = tail ?: IMG_MANIFEST_CHUNK_SIZE;
+        req.digest = s->zero_tail_digest;
+        ret = img_compare_hash_func(&req);
+    }
+    g_free(zero_buf);
+    if (ret < 0) {
+        error_report("SHA-256 is not supported");
+        return 2;
+    }
+
+    ret = img_compare_run(s, img_compare_co_chunk_worker, num_coroutines);
+    return ret ?: size_mismatch;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1358,23 +1787,24 @@ static int check_empty_sectors(BlockBackend *blk, int64_t offset,
 static int img_compare(int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
-    BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
+    const char *manifest_in = NULL, *manifest_out = NULL;
+    char *manifest_tmp = NULL;
+    BlockBackend *blk1, *blk2 = NULL;
     int64_t total_size1, total_size2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int64_t pnum1, pnum2;
-    int allocated1, allocated2;
+    uint8_t *buf1 = NULL;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     bool writethrough;
-    int64_t total_size;
-    int64_t offset = 0;
+    int64_t offset;
     int64_t chunk;
     int c;
     uint64_t progress_base;
     bool image_opts = false;
     bool force_share = false;
+    long num_coroutines = 8;
+    ImgCompareState s;
+    Error *err = NULL;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1383,9 +1813,11 @@ static int img_compare(int argc, char **argv)
             {"object", required_argument, 0, OPTION_OBJECT},
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"force-share", no_argument, 0, 'U'},
+            {"manifest", required_argument, 0, OPTION_MANIFEST},
+            {"manifest-out", required_argument, 0, OPTION_MANIFEST_OUT},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:F:T:pqsU",
+        c = getopt_long(argc, argv, ":hf:F:T:pqsUm:",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1421,6 +1853,14 @@ static int img_compare(int argc, char **argv)
         case 'U':
             force_share = true;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                return 2;
+            }
+            break;
         case OPTION_OBJECT:
             {
                 Error *local_err = NULL;
@@ -1439,6 +1879,12 @@ static int img_compare(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_MANIFEST:
+            manifest_in = optarg;
+            break;
+        case OPTION_MANIFEST_OUT:
+            manifest_out = optarg;
+            break;
         }
     }
 
@@ -1448,11 +1894,33 @@ static int img_compare(int argc, char **argv)
     }
 
 
-    if (optind != argc - 2) {
-        error_exit("Expecting two image file names");
+    if (manifest_in || manifest_out) {
+        if (optind != argc - 1) {
+            error_exit("Expecting one image file name with --manifest or "
+                       "--manifest-out");
+        }
+        if (strict) {
+            error_exit("Strict mode cannot be used with --manifest or "
+                       "--manifest-out");
+        }
+        filename1 = argv[optind++];
+        filename2 = NULL;
+    } else {
+        if (optind != argc - 2) {
+            error_exit("Expecting two image file names");
+        }
+        filename1 = argv[optind++];
+        filename2 = argv[optind++];
     }
-    filename1 = argv[optind++];
-    filename2 = argv[optind++];
+
+    s = (ImgCompareState) {
+        .filename1 = filename1,
+        .filename2 = filename2,
+        .strict = strict,
+        .quiet = quiet,
+        .manifest_in = -1,
+        .manifest_out = -1,
+    };
 
     /* Initialize before goto out */
     qemu_progress_init(progress, 2.0);
@@ -1472,17 +1940,6 @@ static int img_compare(int argc, char **argv)
         goto out3;
     }
 
-    blk2 = img_open(image_opts, filename2, fmt2, flags, writethrough, quiet,
-                    force_share);
-    if (!blk2) {
-        ret = 2;
-        goto out2;
-    }
-    bs1 = blk_bs(blk1);
-    bs2 = blk_bs(blk2);
-
-    buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_size1 = blk_getlength(blk1);
     if (total_size1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1490,6 +1947,66 @@ static int img_compare(int argc, char **argv)
         ret = 4;
         goto out;
     }
+
+    if (!filename2) {
+        s.blk1 = blk1;
+        s.total_size = total_size1;
+
+        if (manifest_in) {
+            s.manifest_in = qemu_open(manifest_in, O_RDONLY | O_BINARY,
+                                      &err);
+            if (s.manifest_in < 0) {
+                error_report_err(err);
+                ret = 2;
+                goto out;
+            }
+        }
+        if (manifest_out) {
+            /*
+             * The new manifest only replaces @manifest_out once it is
+             * complete, so @manifest_in may be the same file.
+             */
+            manifest_tmp = g_strdup_printf("%s.XXXXXX", manifest_out);
+            s.manifest_out = g_mkstemp_full(manifest_tmp, O_WRONLY | O_BINARY,
+                                            0644);
+            if (s.manifest_out < 0) {
+                error_report("Could not create '%s': %s", manifest_tmp,
+                             strerror(errno));
+                g_free(manifest_tmp);
+                manifest_tmp = NULL;
+                ret = 2;
+                goto out;
+            }
+        }
+
+        qemu_progress_print(0, 100);
+        ret = img_compare_manifest(&s, num_coroutines);
+        if (ret <= 1 && manifest_tmp) {
+            qemu_close(s.manifest_out);
+            s.manifest_out = -1;
+            if (rename(manifest_tmp, manifest_out) < 0) {
+                error_report("Could not replace '%s': %s", manifest_out,
+                             strerror(errno));
+                ret = 2;
+                goto out;
+            }
+            g_free(manifest_tmp);
+            manifest_tmp = NULL;
+        }
+        if (!ret && manifest_in) {
+            qprintf(quiet, "Images are identical.\n");
+        }
+        goto out;
+    }
+
+    blk2 = img_open(image_opts, filename2, fmt2, flags, writethrough, quiet,
+                    force_share);
+    if (!blk2) {
+        ret = 2;
+        goto out;
+    }
+
+    buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
     total_size2 = blk_getlength(blk2);
     if (total_size2 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1497,7 +2014,6 @@ static int img_compare(int argc, char **argv)
         ret = 4;
         goto out;
     }
-    total_size = MIN(total_size1, total_size2);
     progress_base = MAX(total_size1, total_size2);
 
     qemu_progress_print(0, 100);
@@ -1508,87 +2024,21 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    while (offset < total_size) {
-        int status1, status2;
-
-        status1 = bdrv_block_status_above(bs1, NULL, offset,
-                                          total_size1 - offset, &pnum1, NULL,
-                                          NULL);
-        if (status1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
-
-        status2 = bdrv_block_status_above(bs2, NULL, offset,
-                                          total_size2 - offset, &pnum2, NULL,
-                                          NULL);
-        if (status2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
-
-        assert(pnum1 && pnum2);
-        chunk = MIN(pnum1, pnum2);
-
-        if (strict) {
-            if (status1 != status2) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " block status mismatch!\n", offset);
-                goto out;
-            }
-        }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
-            /* nothing to do */
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                int64_t pnum;
-
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = blk_pread(blk1, offset, chunk, buf1, 0);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename1, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_pread(blk2, offset, chunk, buf2, 0);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_buffers(buf1, buf2, chunk, 0, &pnum);
-                if (ret || pnum != chunk) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            offset + (ret ? 0 : pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
-        } else {
-            chunk = MIN(chunk, IO_BUF_SIZE);
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, offset, chunk,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, offset, chunk,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                goto out;
-            }
-        }
-        offset += chunk;
-        qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+    /*
+     * Compare the common part in parallel.  Regions that are zero in both
+     * images according to their block status are never read.
+     */
+    s.blk1 = blk1;
+    s.blk2 = blk2;
+    s.total_size1 = total_size1;
+    s.total_size2 = total_size2;
+    s.total_size = MIN(total_size1, total_size2);
+    s.progress_base = progress_base;
+    ret = img_compare_run(&s, img_compare_co_worker, num_coroutines);
+    if (ret) {
+        goto out;
     }
+    offset = s.total_size;
 
     if (total_size1 != total_size2) {
         BlockBackend *blk_over;
@@ -1631,10 +2081,18 @@ static int img_compare(int argc, char **argv)
     ret = 0;
 
 out:
+    if (s.manifest_in >= 0) {
+        qemu_close(s.manifest_in);
+    }
+    if (s.manifest_out >= 0) {
+        qemu_close(s.manifest_out);
+    }
+    if (manifest_tmp) {
+        unlink(manifest_tmp);
+        g_free(manifest_tmp);
+    }
     qemu_vfree(buf1);
-    qemu_vfree(buf2);
     blk_unref(blk2);
-out2:
     blk_unref(blk1);
 out3:
     qemu_progress_end();
@@ -1664,7 +2122,6 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
 typedef struct ImgConvertState {
@@ -1680,8 +2137,10 @@ typedef struct ImgConvertState {
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
+    BlockSeqWriter *stream;
     bool has_zero_init;
     bool compressed;
+    bool multi_cluster_compressed;
     bool target_is_new;
     bool target_has_backing;
     int64_t target_backing_sectors; /* negative if unknown */
@@ -1874,15 +2333,50 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
+/*
+ * Returns the length of the run of whole clusters at the start of @buf that
+ * are either all zero or all non-zero, and stores which one in @zero.
+ */
+static int convert_compressed_run(ImgConvertState *s, const uint8_t *buf,
+                                  int nb_sectors, bool *zero)
+{
+    int n = 0;
+
+    while (n < nb_sectors) {
+        int len = MIN(nb_sectors - n, s->cluster_sectors);
+        bool is_zero = buffer_is_zero(buf + n * BDRV_SECTOR_SIZE,
+                                      len * BDRV_SECTOR_SIZE);
+
+        if (n == 0) {
+            *zero = is_zero;
+        } else if (is_zero != *zero) {
+            break;
+        }
+        n += len;
+    }
+
+    return n;
+}
+
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
                                          enum ImgConvertBlockStatus status)
 {
     int ret;
 
+    /* Areas without data are left out of streamed images */
+    if (s->stream) {
+        if (status != BLK_DATA) {
+            return 0;
+        }
+        return bdrv_seq_writer_write(s->stream, sector_num << BDRV_SECTOR_BITS,
+                                     nb_sectors << BDRV_SECTOR_BITS, buf);
+    }
+
     while (nb_sectors > 0) {
         int n = nb_sectors;
         BdrvRequestFlags flags = s->compressed ? BDRV_REQ_WRITE_COMPRESSED : 0;
+        bool zero = false;
 
         switch (status) {
         case BLK_BACKING_FILE:
@@ -1893,18 +2387,23 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
             break;
 
         case BLK_DATA:
-            /* If we're told to keep the target fully allocated (-S 0) or there
+            /*
+             * If we're told to keep the target fully allocated (-S 0) or there
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
+             * case we can only save the write for completely zeroed clusters.
+             * Consecutive non-zero clusters are written together so that the
+             * driver can compress them in parallel.
+             */
+            if (s->compressed && s->min_sparse) {
+                n = convert_compressed_run(s, buf, n, &zero);
+            }
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
                                           sector_num, s->alignment)) ||
-                (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                (s->compressed && !zero))
             {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
@@ -2105,14 +2604,22 @@ static int convert_do_copy(ImgConvertState *s)
         bdrv_graph_rdunlock_main_loop();
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /*
+     * Allocate buffer for copied data. For compressed images, the buffer
+     * must consist of whole clusters, and only one cluster can be copied at a
+     * time unless the driver compresses multi-cluster writes itself.
+     */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        if (s->multi_cluster_compressed) {
+            s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors,
+                                             s->cluster_sectors);
+        } else {
+            s->buf_sectors = s->cluster_sectors;
+        }
     }
 
     while (sector_num < s->total_sectors) {
@@ -2125,10 +2632,26 @@ static int convert_do_copy(ImgConvertState *s)
         if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
         {
             s->allocated_sectors += n;
+            if (s->stream) {
+                bdrv_seq_writer_add_data(s->stream,
+                                         sector_num << BDRV_SECTOR_BITS,
+                                         (int64_t)n << BDRV_SECTOR_BITS);
+            }
         }
         sector_num += n;
     }
 
+    /* Streamed images have their metadata in front of the data */
+    if (s->stream) {
+        Error *local_err = NULL;
+
+        ret = bdrv_seq_writer_start(s->stream, &local_err);
+        if (ret < 0) {
+            error_report_err(local_err);
+            return ret;
+        }
+    }
+
     /* Do the copy */
     s->sector_next_status = 0;
     s->ret = -EINPROGRESS;
@@ -2152,9 +2675,69 @@ static int convert_do_copy(ImgConvertState *s)
         }
     }
 
+    if (s->stream && !s->ret) {
+        Error *local_err = NULL;
+
+        ret = bdrv_seq_writer_finish(s->stream, &local_err);
+        if (ret < 0) {
+            error_report_err(local_err);
+            return ret;
+        }
+    }
+
     return s->ret;
 }
 
+/*
+ * Streaming output (--stream): the image is written strictly sequentially by
+ * the format driver, so that it can be sent to stdout or a pipe.  Reading the
+ * source uses the same coroutines as a normal convert, only the writes are
+ * always done in order.
+ */
+static int convert_stream(ImgConvertState *s, BlockDriver *drv,
+                          const char *out_filename, QemuOpts *opts)
+{
+    Error *local_err = NULL;
+    int fd;
+    int ret;
+
+    if (!strcmp(out_filename, "-")) {
+        fd = STDOUT_FILENO;
+    } else {
+        fd = qemu_create(out_filename, O_WRONLY | O_TRUNC | O_BINARY, 0644,
+                         &local_err);
+        if (fd < 0) {
+            error_report_err(local_err);
+            return -EIO;
+        }
+    }
+
+    s->stream = bdrv_seq_writer_new(drv, fd,
+                                    s->total_sectors * BDRV_SECTOR_SIZE,
+                                    opts, &local_err);
+    if (!s->stream) {
+        error_report_err(local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* Areas without data read as zeroes from the new image */
+    s->has_zero_init = true;
+    s->target_backing_sectors = -1;
+    s->alignment = MAX(pow2floor(s->min_sparse), 1);
+
+    ret = convert_do_copy(s);
+
+out:
+    bdrv_seq_writer_free(s->stream);
+    s->stream = NULL;
+    if (fd != STDOUT_FILENO && qemu_close(fd) < 0 && ret == 0) {
+        ret = -errno;
+        error_report("error while closing output: %s", strerror(-ret));
+    }
+    return ret;
+}
+
 /* Check that bitmaps can be copied, or output an error */
 static int convert_check_bitmaps(BlockDriverState *src, bool skip_broken)
 {
@@ -2253,6 +2836,7 @@ static int img_convert(int argc, char **argv)
     bool explict_min_sparse = false;
     bool bitmaps = false;
     bool skip_broken = false;
+    bool stream = false;
     int64_t rate_limit = 0;
 
     ImgConvertState s = (ImgConvertState) {
@@ -2275,6 +2859,7 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"stream", no_argument, 0, OPTION_STREAM},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
@@ -2409,6 +2994,9 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_STREAM:
+            stream = true;
+            break;
         }
     }
 
@@ -2454,6 +3042,20 @@ static int img_convert(int argc, char **argv)
     s.src_num = argc - optind - 1;
     out_filename = s.src_num >= 1 ? argv[argc - 1] : NULL;
 
+    if (stream) {
+        if (skip_create || s.compressed || s.copy_range || out_baseimg ||
+            backing_fmt || bitmaps || s.salvage || rate_limit ||
+            !s.wr_in_order) {
+            error_report("--stream cannot be combined with -n, -c, -C, -B, "
+                         "-F, -r, -W, --salvage or --bitmaps");
+            goto fail_getopt;
+        }
+        if (progress && out_filename && !strcmp(out_filename, "-")) {
+            error_report("Cannot show progress when streaming to stdout");
+            goto fail_getopt;
+        }
+    }
+
     if (options && has_help_option(options)) {
         if (out_fmt) {
             ret = print_block_option_help(out_filename, out_fmt);
@@ -2534,6 +3136,26 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
+    if (stream) {
+        drv = bdrv_find_format(out_fmt);
+        if (!drv) {
+            error_report("Unknown file format '%s'", out_fmt);
+            ret = -1;
+            goto out;
+        }
+
+        create_opts = qemu_opts_append(create_opts, drv->create_opts);
+        opts = qemu_opts_create(create_opts, NULL, 0, &error_abort);
+        if (options && !qemu_opts_do_parse(opts, options, NULL, &local_err)) {
+            error_report_err(local_err);
+            ret = -1;
+            goto out;
+        }
+
+        ret = convert_stream(&s, drv, out_filename, opts);
+        goto out;
+    }
+
     if (!skip_create) {
         /* Find driver and parse its options */
         drv = bdrv_find_format(out_fmt);
@@ -2776,6 +3398,7 @@ static int img_convert(int argc, char **argv)
         }
     } else {
         s.compressed = s.compressed || bdi.needs_compressed_writes;
+        s.multi_cluster_compressed = bdi.multi_cluster_compressed_writes;
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
@@ -3531,6 +4154,29 @@ static int img_snapshot(int argc, char **argv)
     return 0;
 }
 
+/*
+ * Returns true if the block status of @blk says that [offset, offset + bytes)
+ * reads as zeroes.  Everything beyond @size (which is 0 if @blk is NULL) reads
+ * as zeroes, too.
+ */
+static bool rebase_reads_zeroes(BlockBackend *blk, int64_t size,
+                                int64_t offset, int64_t bytes)
+{
+    int64_t end = MIN(offset + bytes, size);
+    int64_t pnum;
+    int ret;
+
+    while (offset < end) {
+        ret = bdrv_block_status_above(blk_bs(blk), NULL, offset, end - offset,
+                                      &pnum, NULL, NULL);
+        if (ret < 0 || !(ret & BDRV_BLOCK_ZERO)) {
+            return false;
+        }
+        offset += pnum;
+    }
+    return true;
+}
+
 static int img_rebase(int argc, char **argv)
 {
     BlockBackend *blk = NULL, *blk_old_backing = NULL, *blk_new_backing = NULL;
@@ -3914,6 +4560,18 @@ static int img_rebase(int argc, char **argv)
             assert(!bdrv_is_allocated(unfiltered_bs, offset, n, &n_alloc) &&
                    n_alloc == n);
 
+            /*
+             * If both backing files read as zeroes here, they cannot differ
+             * and there is no need to read them.
+             */
+            if (rebase_reads_zeroes(blk_old_backing, old_backing_size,
+                                    offset, n) &&
+                rebase_reads_zeroes(blk_new_backing, new_backing_size,
+                                    offset, n)) {
+                qemu_progress_print(local_progress, 100);
+                continue;
+            }
+
             /*
              * Much like with the target image, we'll try to read as much
              * of the old and new backings as we can.
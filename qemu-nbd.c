@@ -46,6 +46,7 @@
 #include "crypto/tlscreds.h"
 #include "trace/control.h"
 #include "qemu-version.h"
+#include "sysemu/iothread.h"
 
 #ifdef CONFIG_SELINUX
 #include <selinux/selinux.h>
@@ -70,6 +71,8 @@
 #define QEMU_NBD_OPT_PID_FILE      265
 #define QEMU_NBD_OPT_SELINUX_LABEL 266
 #define QEMU_NBD_OPT_TLSHOSTNAME   267
+#define QEMU_NBD_OPT_IOTHREADS     268
+#define QEMU_NBD_OPT_ZERO_COPY     269
 
 #define MBR_SIZE 512
 
@@ -101,6 +104,9 @@ static void usage(const char *name)
 "  -v, --verbose             display extra debugging information\n"
 "  -x, --export-name=NAME    expose export by name (default is empty string)\n"
 "  -D, --description=TEXT    export a human-readable description\n"
+"      --iothreads=NUM       process client connections in NUM threads\n"
+"                            (default '0', i.e. in the main loop)\n"
+"      --zero-copy           send read data without copying it, if supported\n"
 "\n"
 "Exposing part of the image:\n"
 "  -o, --offset=OFFSET       offset into the image\n"
@@ -576,6 +582,8 @@ int main(int argc, char **argv)
         { "pid-file", required_argument, NULL, QEMU_NBD_OPT_PID_FILE },
         { "selinux-label", required_argument, NULL,
           QEMU_NBD_OPT_SELINUX_LABEL },
+        { "iothreads", required_argument, NULL, QEMU_NBD_OPT_IOTHREADS },
+        { "zero-copy", no_argument, NULL, QEMU_NBD_OPT_ZERO_COPY },
         { NULL, 0, NULL, 0 }
     };
     int ch;
@@ -602,6 +610,9 @@ int main(int argc, char **argv)
     unsigned socket_activation;
     const char *pid_file_name = NULL;
     const char *selinux_label = NULL;
+    int nr_iothreads = 0;
+    strList *iothreads = NULL, **iothreads_tail;
+    bool zero_copy = false;
     BlockExportOptions *export_opts;
     struct NbdClientOpts opts = {
         .fork_process = false,
@@ -812,6 +823,16 @@ int main(int argc, char **argv)
         case QEMU_NBD_OPT_SELINUX_LABEL:
             selinux_label = optarg;
             break;
+        case QEMU_NBD_OPT_IOTHREADS:
+            if (qemu_strtoi(optarg, NULL, 0, &nr_iothreads) < 0 ||
+                nr_iothreads < 0) {
+                error_report("Invalid number of iothreads '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case QEMU_NBD_OPT_ZERO_COPY:
+            zero_copy = true;
+            break;
         }
     }
 
@@ -822,7 +843,8 @@ int main(int argc, char **argv)
         }
         if (export_name || export_description || dev_offset ||
             opts.device || disconnect || fmt || sn_id_or_name || bitmaps ||
-            alloc_depth || seen_aio || seen_discard || seen_cache) {
+            alloc_depth || seen_aio || seen_discard || seen_cache ||
+            nr_iothreads || zero_copy) {
             error_report("List mode is incompatible with per-device settings");
             exit(EXIT_FAILURE);
         }
@@ -1151,6 +1173,16 @@ int main(int argc, char **argv)
 
     nbd_server_is_qemu_nbd(shared);
 
+    /* Threads do not survive fork(), so only create them here */
+    iothreads_tail = &iothreads;
+    for (int i = 0; i < nr_iothreads; i++) {
+        char *id = g_strdup_printf("qemu-nbd-iothread%d", i);
+
+        object_new_with_props(TYPE_IOTHREAD, object_get_objects_root(), id,
+                              &error_fatal, NULL);
+        QAPI_LIST_APPEND(iothreads_tail, id);
+    }
+
     export_opts = g_new(BlockExportOptions, 1);
     *export_opts = (BlockExportOptions) {
         .type               = BLOCK_EXPORT_TYPE_NBD,
@@ -1167,6 +1199,10 @@ int main(int argc, char **argv)
             .bitmaps              = bitmaps,
             .has_allocation_depth = alloc_depth,
             .allocation_depth     = alloc_depth,
+            .has_iothreads        = !!iothreads,
+            .iothreads            = iothreads,
+            .has_zero_copy        = true,
+            .zero_copy            = zero_copy,
         },
     };
     blk_exp_add(export_opts, &error_fatal);
@@ -0,0 +1,8 @@
+#include "qemu/osdep.h"
+#include "sysemu/iothread.h"
+
+/* Tools can't create IOThreads, so nothing can ask for their AioContext */
+AioContext *iothread_get_aio_context(IOThread *iothread)
+{
+    abort();
+}
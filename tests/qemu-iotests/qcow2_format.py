@@ -282,7 +282,9 @@ class Magic(Enum):
             0x6803f857: 'Feature table',
             0x0537be77: 'Crypto header',
             QCOW2_EXT_MAGIC_BITMAPS: 'Bitmaps',
-            0x44415441: 'Data file'
+            0x44415441: 'Data file',
+            0x44454455: 'Dedup index',
+            0x44435243: 'Data checksums'
         }
 
         def to_json(self):
@@ -378,8 +378,16 @@ uint32_t qvirtqueue_add_indirect(QTestState *qts, QVirtQueue *vq,
     return vq->free_head++; /* Return and increase, in this order */
 }
 
-void qvirtqueue_kick(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
-                     uint32_t free_head)
+/*
+ * qvirtqueue_kick_batch:
+ * @free_heads: The vq->desc[] indices of the chains to make available
+ * @n: The number of chains
+ *
+ * This function makes @n chains available with a single update of the avail
+ * index, and notifies the device unless it suppressed the notification.
+ */
+void qvirtqueue_kick_batch(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
+                           const uint32_t *free_heads, unsigned int n)
 {
     /* vq->avail->idx */
     uint16_t idx = qvirtio_readw(d, qts, vq->avail + 2);
@@ -387,24 +395,47 @@ void qvirtqueue_kick(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
     uint16_t flags;
     /* vq->used->avail_event */
     uint16_t avail_event;
+    unsigned int i;
 
-    /* vq->avail->ring[idx % vq->size] */
-    qvirtio_writew(d, qts, vq->avail + 4 + (2 * (idx % vq->size)), free_head);
+    for (i = 0; i < n; i++) {
+        /* vq->avail->ring[(idx + i) % vq->size] */
+        qvirtio_writew(d, qts,
+                       vq->avail + 4 + (2 * ((uint16_t)(idx + i) % vq->size)),
+                       free_heads[i]);
+    }
     /* vq->avail->idx */
-    qvirtio_writew(d, qts, vq->avail + 2, idx + 1);
+    qvirtio_writew(d, qts, vq->avail + 2, idx + n);
 
     /* Must read after idx is updated */
     flags = qvirtio_readw(d, qts, vq->used);
     avail_event = qvirtio_readw(d, qts, vq->used + 4 +
                                 sizeof(struct vring_used_elem) * vq->size);
 
-    /* < 1 because we add elements to avail queue one by one */
+    /* Notify if avail_event lies within the indices we just added */
     if ((flags & VRING_USED_F_NO_NOTIFY) == 0 &&
-                            (!vq->event || (uint16_t)(idx-avail_event) < 1)) {
+        (!vq->event || (uint16_t)(idx + n - avail_event - 1) < n)) {
         d->bus->virtqueue_kick(d, vq);
     }
 }
 
+void qvirtqueue_kick(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
+                     uint32_t free_head)
+{
+    qvirtqueue_kick_batch(qts, d, vq, &free_head, 1);
+}
+
+/*
+ * qvirtqueue_recycle:
+ *
+ * This function lets qvirtqueue_add() reuse all descriptors of @vq.  All
+ * chains that were added before must have been used by the device.
+ */
+void qvirtqueue_recycle(QVirtQueue *vq)
+{
+    vq->free_head = 0;
+    vq->num_free = vq->size;
+}
+
 /*
  * qvirtqueue_get_buf:
  * @desc_idx: A pointer that is filled with the vq->desc[] index, may be NULL
@@ -15,6 +15,12 @@
 #include "libqos/pci.h"
 #include "include/block/nvme.h"
 
+#define NVME_TEST_TIMEOUT_US    (30 * 1000 * 1000)
+#define NVME_TEST_ADMIN_QSIZE   8
+#define NVME_TEST_IO_QSIZE      32
+#define NVME_TEST_NUM_WRITES    16
+#define PCI_SLOT_HP             0x06
+
 typedef struct QNvme QNvme;
 
 struct QNvme {
@@ -91,6 +97,246 @@ static void nvmetest_reg_read_test(void *obj, void *data, QGuestAllocator *alloc
     qpci_iounmap(pdev, bar);
 }
 
+typedef struct NvmeTestQueue {
+    uint16_t qid;
+    uint16_t size;
+    uint64_t sq_addr;
+    uint64_t cq_addr;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;
+} NvmeTestQueue;
+
+typedef struct NvmeTestCtrl {
+    QTestState *qts;
+    QPCIDevice *pdev;
+    QPCIBar bar;
+    QGuestAllocator *alloc;
+    uint64_t dbs;
+    uint64_t eis;
+    NvmeTestQueue admin;
+} NvmeTestCtrl;
+
+static void nvmetest_queue_init(NvmeTestCtrl *c, NvmeTestQueue *q,
+                                uint16_t qid, uint16_t size)
+{
+    *q = (NvmeTestQueue) {
+        .qid     = qid,
+        .size    = size,
+        .sq_addr = guest_alloc(c->alloc, size * sizeof(NvmeCmd)),
+        .cq_addr = guest_alloc(c->alloc, size * sizeof(NvmeCqe)),
+        .phase   = 1,
+    };
+    qtest_memset(c->qts, q->cq_addr, 0, size * sizeof(NvmeCqe));
+}
+
+static void nvmetest_queue_cleanup(NvmeTestCtrl *c, NvmeTestQueue *q)
+{
+    guest_free(c->alloc, q->sq_addr);
+    guest_free(c->alloc, q->cq_addr);
+}
+
+/* The doorbell stride is 0, i.e. doorbells are 4 bytes apart */
+static void nvmetest_ring(NvmeTestCtrl *c, uint16_t qid, bool cq,
+                          uint16_t val)
+{
+    uint32_t off = (2 * qid + cq) * 4;
+
+    if (c->dbs) {
+        qtest_writel(c->qts, c->dbs + off, val);
+    }
+    qpci_io_writel(c->pdev, c->bar, 0x1000 + off, val);
+}
+
+static void nvmetest_submit(NvmeTestCtrl *c, NvmeTestQueue *q, NvmeCmd *cmd,
+                            bool ring)
+{
+    cmd->cid = cpu_to_le16(q->sq_tail);
+    qtest_memwrite(c->qts, q->sq_addr + q->sq_tail * sizeof(*cmd), cmd,
+                   sizeof(*cmd));
+    q->sq_tail = (q->sq_tail + 1) % q->size;
+
+    if (ring) {
+        nvmetest_ring(c, q->qid, false, q->sq_tail);
+    }
+}
+
+static uint16_t nvmetest_wait(NvmeTestCtrl *c, NvmeTestQueue *q)
+{
+    gint64 start_time = g_get_monotonic_time();
+    NvmeCqe cqe;
+
+    for (;;) {
+        qtest_clock_step(c->qts, 100);
+        qtest_memread(c->qts, q->cq_addr + q->cq_head * sizeof(cqe), &cqe,
+                      sizeof(cqe));
+        if ((le16_to_cpu(cqe.status) & 1) == q->phase) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() - start_time <= NVME_TEST_TIMEOUT_US);
+    }
+
+    q->cq_head = (q->cq_head + 1) % q->size;
+    if (!q->cq_head) {
+        q->phase ^= 1;
+    }
+    nvmetest_ring(c, q->qid, true, q->cq_head);
+
+    return le16_to_cpu(cqe.status) >> 1;
+}
+
+static void nvmetest_admin_cmd(NvmeTestCtrl *c, NvmeCmd *cmd)
+{
+    nvmetest_submit(c, &c->admin, cmd, true);
+    g_assert_cmphex(nvmetest_wait(c, &c->admin), ==, NVME_SUCCESS);
+}
+
+static void nvmetest_wait_ready(NvmeTestCtrl *c, bool ready)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (!!(qpci_io_readl(c->pdev, c->bar, 0x1c) & NVME_CSTS_READY) !=
+           ready) {
+        qtest_clock_step(c->qts, 100);
+        g_assert(g_get_monotonic_time() - start_time <= NVME_TEST_TIMEOUT_US);
+    }
+}
+
+static void nvmetest_enable(NvmeTestCtrl *c)
+{
+    uint32_t cc = 0;
+
+    c->dbs = 0;
+    nvmetest_queue_init(c, &c->admin, 0, NVME_TEST_ADMIN_QSIZE);
+
+    qpci_io_writel(c->pdev, c->bar, 0x24,
+                   (NVME_TEST_ADMIN_QSIZE - 1) |
+                   (NVME_TEST_ADMIN_QSIZE - 1) << 16);
+    qpci_io_writeq(c->pdev, c->bar, 0x28, c->admin.sq_addr);
+    qpci_io_writeq(c->pdev, c->bar, 0x30, c->admin.cq_addr);
+
+    NVME_SET_CC_EN(cc, 1);
+    NVME_SET_CC_IOSQES(cc, 6);
+    NVME_SET_CC_IOCQES(cc, 4);
+    qpci_io_writel(c->pdev, c->bar, 0x14, cc);
+    nvmetest_wait_ready(c, true);
+}
+
+static void nvmetest_disable(NvmeTestCtrl *c)
+{
+    qpci_io_writel(c->pdev, c->bar, 0x14, 0);
+    nvmetest_wait_ready(c, false);
+    nvmetest_queue_cleanup(c, &c->admin);
+}
+
+/*
+ * Resets a controller while writes are in flight on an I/O queue pair that
+ * runs in an IOThread.  This used to free the submission queues while the
+ * completion queue bottom half could still run in the IOThread.
+ */
+static void nvmetest_iothread_reset_test(void *obj, void *data,
+                                         QGuestAllocator *alloc)
+{
+    QNvme *nvme = obj;
+    QPCIBus *bus = nvme->dev.bus;
+    NvmeTestCtrl c = {
+        .qts = bus->qts,
+        .alloc = alloc,
+    };
+    NvmeTestQueue ioq;
+    uint64_t buf;
+    NvmeCmd cmd;
+    int i;
+
+    if (bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    qtest_qmp_device_add(c.qts, "nvme", "nvme-hp",
+                         "{'addr': %s, 'drive': 'drv-hp', 'serial': 'hp',"
+                         " 'max_ioqpairs': 2, 'ioeventfd': true,"
+                         " 'iothread-queue-mapping': ["
+                         "   {'iothread': 'thread0'}]}",
+                         stringify(PCI_SLOT_HP) ".0");
+
+    c.pdev = qpci_device_find(bus, QPCI_DEVFN(PCI_SLOT_HP, 0));
+    g_assert_nonnull(c.pdev);
+    qpci_device_enable(c.pdev);
+
+    /* Queues only move to the IOThread with MSI-X and shadow doorbells */
+    qpci_msix_enable(c.pdev);
+    c.bar = qpci_iomap(c.pdev, 0, NULL);
+
+    nvmetest_enable(&c);
+
+    c.dbs = guest_alloc(alloc, 4096);
+    c.eis = guest_alloc(alloc, 4096);
+    qtest_memset(c.qts, c.dbs, 0, 4096);
+    qtest_memset(c.qts, c.eis, 0, 4096);
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_DBBUF_CONFIG,
+        .dptr.prp1 = cpu_to_le64(c.dbs),
+        .dptr.prp2 = cpu_to_le64(c.eis),
+    };
+    nvmetest_admin_cmd(&c, &cmd);
+
+    nvmetest_queue_init(&c, &ioq, 1, NVME_TEST_IO_QSIZE);
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_CREATE_CQ,
+        .dptr.prp1 = cpu_to_le64(ioq.cq_addr),
+        .cdw10 = cpu_to_le32(ioq.qid | (ioq.size - 1) << 16),
+        .cdw11 = cpu_to_le32(NVME_CQ_PC | NVME_CQ_IEN | 1 << 16),
+    };
+    nvmetest_admin_cmd(&c, &cmd);
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_CREATE_SQ,
+        .dptr.prp1 = cpu_to_le64(ioq.sq_addr),
+        .cdw10 = cpu_to_le32(ioq.qid | (ioq.size - 1) << 16),
+        .cdw11 = cpu_to_le32(NVME_SQ_PC | ioq.qid << 16),
+    };
+    nvmetest_admin_cmd(&c, &cmd);
+
+    /* One write completes before the reset, the others are in flight */
+    buf = guest_alloc(alloc, 4096);
+    for (i = 0; i < NVME_TEST_NUM_WRITES; i++) {
+        cmd = (NvmeCmd) {
+            .opcode = NVME_CMD_WRITE,
+            .nsid = cpu_to_le32(1),
+            .dptr.prp1 = cpu_to_le64(buf),
+            .cdw10 = cpu_to_le32(i * 8),
+            .cdw12 = cpu_to_le32(7),
+        };
+        nvmetest_submit(&c, &ioq, &cmd, i == 0 ||
+                        i == NVME_TEST_NUM_WRITES - 1);
+        if (i == 0) {
+            g_assert_cmphex(nvmetest_wait(&c, &ioq), ==, NVME_SUCCESS);
+        }
+    }
+
+    nvmetest_disable(&c);
+    nvmetest_queue_cleanup(&c, &ioq);
+
+    /* The controller must still work after the reset */
+    nvmetest_enable(&c);
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_IDENTIFY,
+        .dptr.prp1 = cpu_to_le64(buf),
+        .cdw10 = cpu_to_le32(NVME_ID_CNS_CTRL),
+    };
+    nvmetest_admin_cmd(&c, &cmd);
+    nvmetest_disable(&c);
+
+    guest_free(alloc, buf);
+    guest_free(alloc, c.dbs);
+    guest_free(alloc, c.eis);
+
+    qpci_iounmap(c.pdev, c.bar);
+    g_free(c.pdev);
+
+    qpci_unplug_acpi_device_test(c.qts, "nvme-hp", PCI_SLOT_HP);
+}
+
 static void nvmetest_pmr_reg_test(void *obj, void *data, QGuestAllocator *alloc)
 {
     QNvme *nvme = obj;
@@ -168,6 +414,13 @@ static void nvme_register_nodes(void)
     });
 
     qos_add_test("reg-read", "nvme", nvmetest_reg_read_test, NULL);
+
+    qos_add_test("iothread-reset", "nvme", nvmetest_iothread_reset_test,
+                 &(QOSGraphTestOptions) {
+        .edge.before_cmd_line = "-object iothread,id=thread0 "
+                                "-blockdev driver=null-co,node-name=drv-hp,"
+                                "latency-ns=1000000",
+    });
 }
 
 libqos_init(nvme_register_nodes);
@@ -0,0 +1,332 @@
+/*
+ * QTest testcase for colo-compare
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ * The test plays both guests and the COLO frame.  Checkpoints are
+ * requested and reported through notify_dev, as with Xen COLO:
+ *
+ * +---------+                                   +---------+
+ * |  pri    +------+                    +------->+  out    |
+ * +---------+      |  +--------------+  |        +---------+
+ *                  +->+              +--+
+ * +---------+      |  | colo-compare |           +---------+
+ * |  sec    +------+  |              +<--------->+ notify  |
+ * +---------+         +--------------+           +---------+
+ *
+ * Every test runs with one compare thread and with several of them, which
+ * spreads the connections over shards.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+
+#define N_CONNS 16
+#define N_SEGS 8
+#define SEG_PAYLOAD 64
+#define SEG_HDR_LEN (14 + 20 + 20)
+#define SEG_LEN (SEG_HDR_LEN + SEG_PAYLOAD)
+#define SEG_SEQ 0x1000
+#define SEG_PORT 1000
+
+typedef struct TestState {
+    QTestState *qts;
+    int pri, sec, out, notify;
+} TestState;
+
+/*
+ * Build segment @seg of the TCP connection @conn.  colo-compare doesn't
+ * check the checksums, so they are left empty.
+ */
+static void build_segment(uint8_t *pkt, int conn, int seg, uint8_t fill)
+{
+    static const uint8_t hdr[SEG_HDR_LEN] = {
+        /* Ethernet */
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,
+        0x08, 0x00,
+        /* IPv4, TTL 64, 10.0.0.1 -> 10.0.0.2 */
+        0x45, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00,
+        0x40, 0x06, 0x00, 0x00,
+        10, 0, 0, 1,
+        10, 0, 0, 2,
+        /* TCP ? -> 80, ACK */
+        0x00, 0x00, 0x00, 0x50,
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x01,
+        0x50, 0x10, 0x20, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+    };
+    uint8_t *ip = pkt + 14, *tcp = ip + 20;
+
+    memcpy(pkt, hdr, sizeof(hdr));
+    memset(pkt + SEG_HDR_LEN, fill, SEG_PAYLOAD);
+
+    stw_be_p(ip + 2, 20 + 20 + SEG_PAYLOAD);
+    stw_be_p(tcp, SEG_PORT + conn);
+    stl_be_p(tcp + 4, SEG_SEQ + seg * SEG_PAYLOAD);
+}
+
+static uint8_t segment_fill(int conn, int seg)
+{
+    return conn * N_SEGS + seg;
+}
+
+/* Send @n packets of @len bytes each with a single write */
+static void send_packets(int fd, const uint8_t *pkts, size_t len, int n)
+{
+    g_autofree struct iovec *iov = g_new(struct iovec, 2 * n);
+    g_autofree uint32_t *be_len = g_new(uint32_t, n);
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        be_len[i] = htonl(len);
+        iov[2 * i] = (struct iovec) {
+            .iov_base = &be_len[i], .iov_len = sizeof(be_len[i])
+        };
+        iov[2 * i + 1] = (struct iovec) {
+            .iov_base = (void *)(pkts + i * len), .iov_len = len
+        };
+    }
+
+    ret = iov_send(fd, iov, 2 * n, 0, n * (sizeof(uint32_t) + len));
+    g_assert_cmpint(ret, ==, n * (sizeof(uint32_t) + len));
+}
+
+static void send_str(int fd, const char *str)
+{
+    send_packets(fd, (const uint8_t *)str, strlen(str), 1);
+}
+
+static size_t recv_packet(int fd, uint8_t *buf, size_t size)
+{
+    uint32_t len;
+
+    g_assert_cmpint(recv(fd, &len, sizeof(len), MSG_WAITALL), ==,
+                    sizeof(len));
+    len = ntohl(len);
+    g_assert_cmpint(len, <=, size);
+    g_assert_cmpint(recv(fd, buf, len, MSG_WAITALL), ==, len);
+
+    return len;
+}
+
+/* Wait for a notification from colo-compare */
+static void expect_notify(TestState *t, const char *str)
+{
+    char buf[64];
+    size_t len;
+
+    len = recv_packet(t->notify, (uint8_t *)buf, sizeof(buf) - 1);
+    buf[len] = 0;
+    g_assert_cmpstr(buf, ==, str);
+}
+
+/* Receive a released segment, returning its connection */
+static int recv_segment(TestState *t, int *seg)
+{
+    uint8_t pkt[SEG_LEN];
+    uint32_t seq;
+    int conn;
+
+    g_assert_cmpint(recv_packet(t->out, pkt, sizeof(pkt)), ==, SEG_LEN);
+
+    conn = lduw_be_p(pkt + 14 + 20) - SEG_PORT;
+    seq = ldl_be_p(pkt + 14 + 20 + 4);
+    g_assert_cmpint(conn, >=, 0);
+    g_assert_cmpint(conn, <=, N_CONNS);
+    *seg = (seq - SEG_SEQ) / SEG_PAYLOAD;
+    g_assert_cmphex(pkt[SEG_HDR_LEN], ==, segment_fill(conn, *seg));
+
+    return conn;
+}
+
+/*
+ * Receive @n segments of the first N_CONNS connections and check that
+ * each connection keeps its order.  @next holds the next expected
+ * segment of each connection.
+ */
+static void recv_in_order(TestState *t, int *next, int n)
+{
+    int conn, seg;
+
+    while (n--) {
+        conn = recv_segment(t, &seg);
+        g_assert_cmpint(conn, <, N_CONNS);
+        g_assert_cmpint(seg, ==, next[conn]);
+        next[conn]++;
+    }
+}
+
+static void start_qemu(TestState *t, int threads)
+{
+    int pri[2], sec[2], out[2], notify[2];
+
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, pri), !=, -1);
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, sec), !=, -1);
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, out), !=, -1);
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, notify), !=, -1);
+
+    /* The timeouts are long enough that only the test checkpoints */
+    t->qts = qtest_initf(
+        "-object iothread,id=qtest-io0 "
+        "-chardev socket,id=qtest-pri0,fd=%d "
+        "-chardev socket,id=qtest-sec0,fd=%d "
+        "-chardev socket,id=qtest-out0,fd=%d "
+        "-chardev socket,id=qtest-notify0,fd=%d "
+        "-object colo-compare,id=qtest-comp0,primary_in=qtest-pri0,"
+        "secondary_in=qtest-sec0,outdev=qtest-out0,"
+        "notify_dev=qtest-notify0,iothread=qtest-io0,compare_threads=%d,"
+        "compare_timeout=600000,expired_scan_cycle=600000",
+        pri[1], sec[1], out[1], notify[1], threads);
+
+    close(pri[1]);
+    close(sec[1]);
+    close(out[1]);
+    close(notify[1]);
+    t->pri = pri[0];
+    t->sec = sec[0];
+    t->out = out[0];
+    t->notify = notify[0];
+}
+
+static void stop_qemu(TestState *t)
+{
+    qtest_quit(t->qts);
+    close(t->pri);
+    close(t->sec);
+    close(t->out);
+    close(t->notify);
+}
+
+/*
+ * The segments of all connections, interleaved, in the order in which a
+ * guest sends them.  Segment @seg of connection @conn is at index
+ * @seg * N_CONNS + @conn.
+ */
+static uint8_t *build_all_segments(void)
+{
+    uint8_t *pkts = g_malloc(N_CONNS * N_SEGS * SEG_LEN);
+    int conn, seg;
+
+    for (seg = 0; seg < N_SEGS; seg++) {
+        for (conn = 0; conn < N_CONNS; conn++) {
+            build_segment(pkts + (seg * N_CONNS + conn) * SEG_LEN,
+                          conn, seg, segment_fill(conn, seg));
+        }
+    }
+    return pkts;
+}
+
+/*
+ * Segments are released in order, no matter whether the primary or the
+ * secondary segments arrive first.
+ */
+static void test_compare_order(int threads, bool secondary_first)
+{
+    g_autofree uint8_t *pkts = build_all_segments();
+    int next[N_CONNS] = { 0 };
+    TestState t;
+
+    start_qemu(&t, threads);
+
+    send_packets(secondary_first ? t.sec : t.pri, pkts, SEG_LEN,
+                 N_CONNS * N_SEGS);
+    send_packets(secondary_first ? t.pri : t.sec, pkts, SEG_LEN,
+                 N_CONNS * N_SEGS);
+    recv_in_order(&t, next, N_CONNS * N_SEGS);
+
+    stop_qemu(&t);
+}
+
+static void test_compare_order_primary(const void *opaque)
+{
+    test_compare_order(GPOINTER_TO_INT(opaque), false);
+}
+
+static void test_compare_order_secondary(const void *opaque)
+{
+    test_compare_order(GPOINTER_TO_INT(opaque), true);
+}
+
+/*
+ * A checkpoint releases the primary segments of all shards in order, and
+ * a miscompare in any shard requests a checkpoint.
+ */
+static void test_compare_checkpoint(const void *opaque)
+{
+    g_autofree uint8_t *pkts = build_all_segments();
+    uint8_t sentinel[SEG_LEN], pkt[SEG_LEN];
+    int next[N_CONNS] = { 0 };
+    TestState t;
+    int conn, seg;
+
+    start_qemu(&t, GPOINTER_TO_INT(opaque));
+
+    /* The secondary doesn't answer, so all segments are held */
+    send_packets(t.pri, pkts, SEG_LEN, N_CONNS * N_SEGS);
+
+    /*
+     * Once a matching segment of another connection is released, all
+     * earlier primary segments were read, and none of them was released.
+     */
+    build_segment(sentinel, N_CONNS, 0, segment_fill(N_CONNS, 0));
+    send_packets(t.pri, sentinel, SEG_LEN, 1);
+    send_packets(t.sec, sentinel, SEG_LEN, 1);
+    conn = recv_segment(&t, &seg);
+    g_assert_cmpint(conn, ==, N_CONNS);
+
+    send_str(t.notify, "COLO_CHECKPOINT");
+    recv_in_order(&t, next, N_CONNS * N_SEGS);
+
+    /* A miscompare on every connection requests a checkpoint */
+    for (conn = 0; conn < N_CONNS; conn++) {
+        build_segment(pkt, conn, N_SEGS, segment_fill(conn, N_SEGS));
+        send_packets(t.pri, pkt, SEG_LEN, 1);
+        build_segment(pkt, conn, N_SEGS, ~segment_fill(conn, N_SEGS));
+        send_packets(t.sec, pkt, SEG_LEN, 1);
+        expect_notify(&t, "DO_CHECKPOINT");
+    }
+
+    /* The checkpoint releases the primary version */
+    send_str(t.notify, "COLO_CHECKPOINT");
+    recv_in_order(&t, next, N_CONNS);
+    for (conn = 0; conn < N_CONNS; conn++) {
+        g_assert_cmpint(next[conn], ==, N_SEGS + 1);
+    }
+
+    stop_qemu(&t);
+}
+
+int main(int argc, char **argv)
+{
+    static const int threads[] = { 1, 4 };
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        g_autofree char *order_pri = g_strdup_printf(
+            "/colo-compare/threads-%d/order-primary-first", threads[i]);
+        g_autofree char *order_sec = g_strdup_printf(
+            "/colo-compare/threads-%d/order-secondary-first", threads[i]);
+        g_autofree char *checkpoint = g_strdup_printf(
+            "/colo-compare/threads-%d/checkpoint", threads[i]);
+
+        qtest_add_data_func(order_pri, GINT_TO_POINTER(threads[i]),
+                            test_compare_order_primary);
+        qtest_add_data_func(order_sec, GINT_TO_POINTER(threads[i]),
+                            test_compare_order_secondary);
+        qtest_add_data_func(checkpoint, GINT_TO_POINTER(threads[i]),
+                            test_compare_checkpoint);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,244 @@
+/*
+ * QTest testcase for filter-gro
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ * The socket backend delivers the packets of one read as a batch.  The
+ * coalesced packets are captured with filter-redirector:
+ *
+ * +-------+  +---------+  +------------+  +----------+   +-------+
+ * | sock0 +-->+ backend +-->+ filter-gro +-->+redirector+--->+ sock1 |
+ * +-------+  +---------+  +------------+  +----------+   +-------+
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+
+#define SEG_PAYLOAD 100
+#define SEG_HDR_LEN (14 + 20 + 20)
+#define SEG_SEQ 0x1000
+
+static uint16_t csum_finish(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static uint32_t csum_add(const uint8_t *buf, size_t len)
+{
+    uint32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (buf[i] << 8) | buf[i + 1];
+    }
+    if (i < len) {
+        sum += buf[i] << 8;
+    }
+    return sum;
+}
+
+static uint16_t tcp_csum(const uint8_t *ip, size_t tcp_len)
+{
+    uint32_t sum = csum_add(ip + 12, 8) + 6 + tcp_len;
+
+    return csum_finish(sum + csum_add(ip + 20, tcp_len));
+}
+
+/* Build an IPv4 TCP segment carrying @payload bytes of @fill */
+static size_t build_segment(uint8_t *pkt, uint32_t seq, size_t payload,
+                            uint8_t fill)
+{
+    static const uint8_t hdr[SEG_HDR_LEN] = {
+        /* Ethernet */
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,
+        0x08, 0x00,
+        /* IPv4, DF, TTL 64, 10.0.0.1 -> 10.0.0.2 */
+        0x45, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00,
+        0x40, 0x06, 0x00, 0x00,
+        10, 0, 0, 1,
+        10, 0, 0, 2,
+        /* TCP 1234 -> 80, ACK */
+        0x04, 0xd2, 0x00, 0x50,
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x01,
+        0x50, 0x10, 0x20, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+    };
+    uint8_t *ip = pkt + 14, *tcp = ip + 20;
+    size_t ip_len = 20 + 20 + payload;
+
+    memcpy(pkt, hdr, sizeof(hdr));
+    memset(pkt + SEG_HDR_LEN, fill, payload);
+
+    stw_be_p(ip + 2, ip_len);
+    stw_be_p(ip + 10, csum_finish(csum_add(ip, 20)));
+    stl_be_p(tcp + 4, seq);
+    stw_be_p(tcp + 16, tcp_csum(ip, 20 + payload));
+
+    return SEG_HDR_LEN + payload;
+}
+
+static QTestState *start_qemu(int backend_fd, const char *sock_path)
+{
+    /*
+     * The hub accepts packets at any time, unlike a NIC model without a
+     * guest driver, so that filter-gro does not bypass itself.
+     */
+    return qtest_initf(
+        "-netdev socket,id=qtest-bn0,fd=%d "
+        "-netdev hubport,id=qtest-hp0,hubid=0,netdev=qtest-bn0 "
+        "-netdev hubport,id=qtest-hp1,hubid=0 "
+        "-chardev socket,id=gro0,path=%s,server=on,wait=off "
+        "-object filter-gro,id=qtest-f0,netdev=qtest-bn0,queue=tx,"
+        "max-size=9014 "
+        "-object filter-redirector,id=qtest-f1,netdev=qtest-bn0,"
+        "queue=tx,outdev=gro0",
+        backend_fd, sock_path);
+}
+
+/* Send @n packets to the backend with a single write */
+static void send_packets(int fd, uint8_t pkts[][SEG_HDR_LEN + SEG_PAYLOAD],
+                         size_t *lens, int n)
+{
+    struct iovec iov[2 * 4];
+    uint32_t be_lens[4];
+    size_t total = 0;
+    ssize_t ret;
+    int i;
+
+    g_assert(n <= 4);
+    for (i = 0; i < n; i++) {
+        be_lens[i] = htonl(lens[i]);
+        iov[2 * i].iov_base = &be_lens[i];
+        iov[2 * i].iov_len = sizeof(be_lens[i]);
+        iov[2 * i + 1].iov_base = pkts[i];
+        iov[2 * i + 1].iov_len = lens[i];
+        total += sizeof(be_lens[i]) + lens[i];
+    }
+
+    ret = iov_send(fd, iov, 2 * n, 0, total);
+    g_assert_cmpint(ret, ==, total);
+}
+
+static uint8_t *recv_packet(int fd, uint32_t *len)
+{
+    uint8_t *buf;
+    ssize_t ret;
+
+    ret = recv(fd, len, sizeof(*len), MSG_WAITALL);
+    g_assert_cmpint(ret, ==, sizeof(*len));
+    *len = ntohl(*len);
+
+    buf = g_malloc(*len);
+    ret = recv(fd, buf, *len, MSG_WAITALL);
+    g_assert_cmpint(ret, ==, *len);
+    return buf;
+}
+
+static void test_gro_coalesce(void)
+{
+    uint8_t pkts[3][SEG_HDR_LEN + SEG_PAYLOAD];
+    size_t lens[3];
+    int backend_sock[2], recv_sock;
+    char sock_path[] = "filter-gro.XXXXXX";
+    g_autofree uint8_t *buf = NULL;
+    uint8_t *ip, *tcp;
+    QTestState *qts;
+    uint32_t len;
+    int i, ret;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, backend_sock);
+    g_assert_cmpint(ret, !=, -1);
+    ret = mkstemp(sock_path);
+    g_assert_cmpint(ret, !=, -1);
+
+    qts = start_qemu(backend_sock[1], sock_path);
+    recv_sock = unix_connect(sock_path, NULL);
+    g_assert_cmpint(recv_sock, !=, -1);
+
+    /* send a qmp command to guarantee that 'connected' is setting to true. */
+    qtest_qmp_assert_success(qts, "{ 'execute' : 'query-status'}");
+
+    for (i = 0; i < 3; i++) {
+        lens[i] = build_segment(pkts[i], SEG_SEQ + i * SEG_PAYLOAD,
+                                SEG_PAYLOAD, 'a' + i);
+    }
+    send_packets(backend_sock[0], pkts, lens, 3);
+
+    buf = recv_packet(recv_sock, &len);
+    g_assert_cmpint(len, ==, SEG_HDR_LEN + 3 * SEG_PAYLOAD);
+
+    ip = buf + 14;
+    tcp = ip + 20;
+    g_assert_cmpint(lduw_be_p(ip + 2), ==, 20 + 20 + 3 * SEG_PAYLOAD);
+    g_assert_cmphex(csum_finish(csum_add(ip, 20)), ==, 0);
+    g_assert_cmphex(tcp_csum(ip, 20 + 3 * SEG_PAYLOAD), ==, 0);
+    g_assert_cmphex(ldl_be_p(tcp + 4), ==, SEG_SEQ);
+    for (i = 0; i < 3; i++) {
+        g_assert_cmpint(buf[SEG_HDR_LEN + i * SEG_PAYLOAD], ==, 'a' + i);
+    }
+
+    close(backend_sock[0]);
+    close(recv_sock);
+    unlink(sock_path);
+    qtest_quit(qts);
+}
+
+static void test_gro_out_of_order(void)
+{
+    uint8_t pkts[2][SEG_HDR_LEN + SEG_PAYLOAD];
+    size_t lens[2];
+    int backend_sock[2], recv_sock;
+    char sock_path[] = "filter-gro.XXXXXX";
+    QTestState *qts;
+    uint32_t len;
+    int i, ret;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, backend_sock);
+    g_assert_cmpint(ret, !=, -1);
+    ret = mkstemp(sock_path);
+    g_assert_cmpint(ret, !=, -1);
+
+    qts = start_qemu(backend_sock[1], sock_path);
+    recv_sock = unix_connect(sock_path, NULL);
+    g_assert_cmpint(recv_sock, !=, -1);
+
+    qtest_qmp_assert_success(qts, "{ 'execute' : 'query-status'}");
+
+    /* A gap in the sequence numbers must not be closed */
+    lens[0] = build_segment(pkts[0], SEG_SEQ, SEG_PAYLOAD, 'a');
+    lens[1] = build_segment(pkts[1], SEG_SEQ + 2 * SEG_PAYLOAD,
+                            SEG_PAYLOAD, 'c');
+    send_packets(backend_sock[0], pkts, lens, 2);
+
+    for (i = 0; i < 2; i++) {
+        g_autofree uint8_t *buf = recv_packet(recv_sock, &len);
+
+        g_assert_cmpint(len, ==, lens[i]);
+        g_assert(memcmp(buf, pkts[i], len) == 0);
+    }
+
+    close(backend_sock[0]);
+    close(recv_sock);
+    unlink(sock_path);
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/netfilter/gro/coalesce", test_gro_coalesce);
+    qtest_add_func("/netfilter/gro/out-of-order", test_gro_out_of_order);
+
+    return g_test_run();
+}
@@ -764,6 +764,147 @@ static void multiqueue(void *obj, void *data, QGuestAllocator *t_alloc)
     qpci_unplug_acpi_device_test(qts, "drv1", PCI_SLOT_HP);
 }
 
+/* Submit a 512 byte request on @vq and wait for it to complete */
+static void mq_request(QVirtioDevice *dev, QGuestAllocator *alloc,
+                       QVirtQueue *vq, uint32_t type, uint64_t sector,
+                       char *data)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint8_t status;
+    QTestState *qts = global_qtest;
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    if (type == VIRTIO_BLK_T_OUT) {
+        memcpy(req.data, data, 512);
+    }
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 512, type == VIRTIO_BLK_T_IN, true);
+    qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    if (type == VIRTIO_BLK_T_IN) {
+        qtest_memread(qts, req_addr + 16, data, 512);
+    }
+
+    guest_free(alloc, req_addr);
+}
+
+/*
+ * Write sector i through virtqueue i and read it back through the next one,
+ * so that requests are processed in every IOThread of the mapping.
+ */
+static void mq_check_io(QVirtioDevice *dev, QGuestAllocator *alloc,
+                        QVirtQueue **vqs, int num_queues, int gen)
+{
+    char data[512], expected[512];
+    int i;
+
+    for (i = 0; i < num_queues; i++) {
+        memset(expected, 0, sizeof(expected));
+        snprintf(expected, sizeof(expected), "TEST %d %d", gen, i);
+        mq_request(dev, alloc, vqs[i], VIRTIO_BLK_T_OUT, i, expected);
+    }
+
+    for (i = 0; i < num_queues; i++) {
+        memset(expected, 0, sizeof(expected));
+        snprintf(expected, sizeof(expected), "TEST %d %d", gen, i);
+        mq_request(dev, alloc, vqs[(i + 1) % num_queues], VIRTIO_BLK_T_IN, i,
+                   data);
+        g_assert_cmpstr(data, ==, expected);
+    }
+}
+
+#define MQ_NUM_QUEUES 4
+
+static void iothread_vq_mapping(void *obj, void *data,
+                                QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *pdev1 = obj;
+    QVirtioPCIDevice *pdev;
+    QVirtioDevice *dev;
+    QVirtQueue *vqs[MQ_NUM_QUEUES];
+    QTestState *qts = pdev1->pdev->bus->qts;
+    uint64_t features;
+    int i;
+
+    if (pdev1->pdev->bus->not_hotpluggable) {
+        g_test_skip("bus pci.0 does not support hotplug");
+        return;
+    }
+
+    /* The export on char2 spreads its queues across two IOThreads */
+    qtest_qmp_device_add(qts, "vhost-user-blk-pci", "drv1",
+                         "{'addr': %s, 'chardev': 'char2', 'num-queues': %d}",
+                         stringify(PCI_SLOT_HP) ".0", MQ_NUM_QUEUES);
+
+    pdev = virtio_pci_new(pdev1->pdev->bus,
+                          &(QPCIAddress) {
+                              .devfn = QPCI_DEVFN(PCI_SLOT_HP, 0)
+                          });
+    g_assert_nonnull(pdev);
+    g_assert_cmpint(pdev->vdev.device_type, ==, VIRTIO_ID_BLOCK);
+
+    qos_object_start_hw(&pdev->obj);
+
+    dev = &pdev->vdev;
+    features = qvirtio_get_features(dev);
+    g_assert_cmpint(features & (1u << VIRTIO_BLK_F_MQ),
+                    ==,
+                    (1u << VIRTIO_BLK_F_MQ));
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_F_NOTIFY_ON_EMPTY) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        vqs[i] = qvirtqueue_setup(dev, t_alloc, i);
+    }
+    qvirtio_set_driver_ok(dev);
+
+    mq_check_io(dev, t_alloc, vqs, MQ_NUM_QUEUES, 0);
+
+    /* The export must survive the device being stopped and restarted */
+    qtest_qmp_assert_success(qts, "{ 'execute': 'stop' }");
+    qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        char data[512], expected[512];
+
+        memset(expected, 0, sizeof(expected));
+        snprintf(expected, sizeof(expected), "TEST %d %d", 0, i);
+        mq_request(dev, t_alloc, vqs[i], VIRTIO_BLK_T_IN, i, data);
+        g_assert_cmpstr(data, ==, expected);
+    }
+    mq_check_io(dev, t_alloc, vqs, MQ_NUM_QUEUES, 1);
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        qvirtqueue_cleanup(dev->bus, vqs[i], t_alloc);
+    }
+    qvirtio_pci_device_disable(pdev);
+    qos_object_destroy(&pdev->obj);
+
+    /* unplug secondary disk */
+    qpci_unplug_acpi_device_test(qts, "drv1", PCI_SLOT_HP);
+}
+
 /*
  * Check that setting the vring addr on a non-existent virtqueue does
  * not crash.
@@ -892,8 +1033,12 @@ static void quit_storage_daemon(void *data)
     g_free(data);
 }
 
+/*
+ * With @iothread_vq_mapping, the virtqueues of each export are spread
+ * across two IOThreads.
+ */
 static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
-                                 int num_queues)
+                                 int num_queues, bool iothread_vq_mapping)
 {
     const char *vhost_user_blk_bin = qtest_qemu_storage_daemon_binary();
     int i;
@@ -904,6 +1049,11 @@ static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
     g_string_append_printf(storage_daemon_command,
                            "exec %s ",
                            vhost_user_blk_bin);
+    if (iothread_vq_mapping) {
+        g_string_append(storage_daemon_command,
+                        "--object iothread,id=iothread0 "
+                        "--object iothread,id=iothread1 ");
+    }
 
     g_string_append_printf(cmd_line,
             " -object memory-backend-memfd,id=mem,size=256M,share=on "
@@ -918,8 +1068,14 @@ static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
         g_string_append_printf(storage_daemon_command,
             "--blockdev driver=file,node-name=disk%d,filename=%s "
             "--export type=vhost-user-blk,id=disk%d,addr.type=fd,addr.str=%d,"
-            "node-name=disk%i,writable=on,num-queues=%d ",
+            "node-name=disk%i,writable=on,num-queues=%d",
             i, img_path, i, fd, i, num_queues);
+        if (iothread_vq_mapping) {
+            g_string_append(storage_daemon_command,
+                            ",iothread-vq-mapping.0.iothread=iothread0"
+                            ",iothread-vq-mapping.1.iothread=iothread1");
+        }
+        g_string_append_c(storage_daemon_command, ' ');
 
         g_string_append_printf(cmd_line, "-chardev socket,id=char%d,path=%s ",
                                i + 1, sock_path);
@@ -953,7 +1109,7 @@ static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
 
 static void *vhost_user_blk_test_setup(GString *cmd_line, void *arg)
 {
-    start_vhost_user_blk(cmd_line, 1, 1);
+    start_vhost_user_blk(cmd_line, 1, 1, false);
     return arg;
 }
 
@@ -967,13 +1123,20 @@ static void *vhost_user_blk_test_setup(GString *cmd_line, void *arg)
 static void *vhost_user_blk_hotplug_test_setup(GString *cmd_line, void *arg)
 {
     /* "-chardev socket,id=char2" is used for pci_hotplug*/
-    start_vhost_user_blk(cmd_line, 2, 1);
+    start_vhost_user_blk(cmd_line, 2, 1, false);
     return arg;
 }
 
 static void *vhost_user_blk_multiqueue_test_setup(GString *cmd_line, void *arg)
 {
-    start_vhost_user_blk(cmd_line, 2, 8);
+    start_vhost_user_blk(cmd_line, 2, 8, false);
+    return arg;
+}
+
+static void *vhost_user_blk_iothread_vq_mapping_test_setup(GString *cmd_line,
+                                                           void *arg)
+{
+    start_vhost_user_blk(cmd_line, 2, MQ_NUM_QUEUES, true);
     return arg;
 }
 
@@ -1009,6 +1172,10 @@ static void register_vhost_user_blk_test(void)
 
     opts.before = vhost_user_blk_multiqueue_test_setup;
     qos_add_test("multiqueue", "vhost-user-blk-pci", multiqueue, &opts);
+
+    opts.before = vhost_user_blk_iothread_vq_mapping_test_setup;
+    qos_add_test("iothread-vq-mapping", "vhost-user-blk-pci",
+                 iothread_vq_mapping, &opts);
 }
 
 libqos_init(register_vhost_user_blk_test);
@@ -12,6 +12,7 @@
 #include "libqtest-single.h"
 #include "qemu/bswap.h"
 #include "qemu/module.h"
+#include "qemu/timer.h"
 #include "standard-headers/linux/virtio_blk.h"
 #include "standard-headers/linux/virtio_pci.h"
 #include "libqos/qgraph.h"
@@ -694,6 +695,376 @@ static void idx(void *obj, void *u_data, QGuestAllocator *t_alloc)
     qvirtqueue_cleanup(dev->bus, vq, t_alloc);
 }
 
+/*
+ * Submit requests in batches that are larger than what the device takes
+ * from the virtqueue at once, until the rings have wrapped around.  With
+ * EVENT_IDX, only the completion of the last request of a batch raises an
+ * interrupt.
+ */
+#define BATCH_REQS 40
+
+static void batch(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QVirtioBlkReq req;
+    uint64_t req_addr[BATCH_REQS];
+    uint32_t free_head[BATCH_REQS];
+    bool used[BATCH_REQS];
+    uint64_t features;
+    uint32_t desc_idx;
+    uint16_t submitted = 0;
+    char expected[512];
+    char *data;
+    bool write;
+    int i;
+    QTestState *qts = global_qtest;
+    QVirtQueue *vq;
+
+    features = qvirtio_get_features(dev);
+    g_assert(features & (1u << VIRTIO_RING_F_EVENT_IDX));
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+    g_assert(vq->event);
+    g_assert_cmpint(vq->size, >=, 3 * BATCH_REQS);
+
+    qvirtio_set_driver_ok(dev);
+
+    /* Alternate between writing sectors and reading them back */
+    for (write = true; submitted <= vq->size + BATCH_REQS; write = !write) {
+        for (i = 0; i < BATCH_REQS; i++) {
+            req.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+            req.ioprio = 1;
+            req.sector = i;
+            req.data = g_malloc0(512);
+            if (write) {
+                sprintf(req.data, "TEST %d/%d", submitted, i);
+            }
+
+            req_addr[i] = virtio_blk_request(t_alloc, dev, &req, 512);
+
+            g_free(req.data);
+
+            free_head[i] = qvirtqueue_add(qts, vq, req_addr[i], 16, false,
+                                          true);
+            qvirtqueue_add(qts, vq, req_addr[i] + 16, 512, !write, true);
+            qvirtqueue_add(qts, vq, req_addr[i] + 528, 1, true, false);
+            used[i] = false;
+        }
+
+        qvirtqueue_set_used_event(qts, vq,
+                                  vq->last_used_idx + BATCH_REQS - 1);
+        qvirtqueue_kick_batch(qts, dev, vq, free_head, BATCH_REQS);
+        qvirtio_wait_queue_isr(qts, dev, vq, QVIRTIO_BLK_TIMEOUT_US);
+
+        /* All requests are done, though not necessarily in order */
+        for (i = 0; i < BATCH_REQS; i++) {
+            g_assert(qvirtqueue_get_buf(qts, vq, &desc_idx, NULL));
+            g_assert_cmpint(desc_idx % 3, ==, 0);
+            g_assert_cmpint(desc_idx / 3, <, BATCH_REQS);
+            g_assert(!used[desc_idx / 3]);
+            used[desc_idx / 3] = true;
+        }
+        g_assert(!qvirtqueue_get_buf(qts, vq, NULL, NULL));
+
+        for (i = 0; i < BATCH_REQS; i++) {
+            g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+
+            if (!write) {
+                data = g_malloc0(512);
+                memread(req_addr[i] + 16, data, 512);
+                sprintf(expected, "TEST %d/%d",
+                        (uint16_t)(submitted - BATCH_REQS), i);
+                g_assert_cmpstr(data, ==, expected);
+                g_free(data);
+            }
+
+            guest_free(t_alloc, req_addr[i]);
+        }
+
+        submitted += BATCH_REQS;
+        qvirtqueue_recycle(vq);
+    }
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+/*
+ * With VIRTIO_F_IN_ORDER, a request that completes before the ones submitted
+ * earlier is held back: the guest sees all of them in submission order once
+ * the earlier ones are done, too.  Writes are throttled, so a read submitted
+ * after a write completes first.
+ */
+static void in_order(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QVirtioBlkReq req;
+    uint64_t req_addr[3];
+    uint32_t free_head[3];
+    uint64_t features;
+    uint32_t desc_idx;
+    uint8_t status;
+    char *data;
+    int i;
+    QTestState *qts = global_qtest;
+    QVirtQueue *vq;
+
+    features = qvirtio_get_features(dev);
+    if (!(features & (1ull << VIRTIO_F_IN_ORDER))) {
+        g_test_skip("VIRTIO_F_IN_ORDER not offered by the transport");
+        return;
+    }
+    g_assert(features & (1u << VIRTIO_RING_F_EVENT_IDX));
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+    g_assert(vq->event);
+
+    qvirtio_set_driver_ok(dev);
+
+    /* Write sector 0 and 1, then read back sector 0 */
+    for (i = 0; i < 3; i++) {
+        req.type = i < 2 ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = i % 2;
+        req.data = g_malloc0(512);
+        if (i < 2) {
+            sprintf(req.data, "TEST %d", i);
+        }
+
+        req_addr[i] = virtio_blk_request(t_alloc, dev, &req, 512);
+
+        g_free(req.data);
+
+        free_head[i] = qvirtqueue_add(qts, vq, req_addr[i], 16, false, true);
+        qvirtqueue_add(qts, vq, req_addr[i] + 16, 512, i == 2, true);
+        qvirtqueue_add(qts, vq, req_addr[i] + 528, 1, true, false);
+    }
+
+    /* The first write uses up the budget of the throttle group */
+    qvirtqueue_kick(qts, dev, vq, free_head[0]);
+    qvirtio_wait_used_elem(qts, dev, vq, free_head[0], NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(readb(req_addr[0] + 528), ==, 0);
+
+    /*
+     * The second write waits for the throttle timer, which only runs when
+     * the test steps the clock.  The read completes in the meantime, but
+     * nothing is used and no interrupt is raised.
+     */
+    qvirtqueue_set_used_event(qts, vq, vq->last_used_idx);
+    qvirtqueue_kick_batch(qts, dev, vq, &free_head[1], 2);
+    status = qvirtio_wait_status_byte_no_isr(qts, dev, vq, req_addr[2] + 528,
+                                             QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(status, ==, 0);
+    g_assert_cmpint(readb(req_addr[1] + 528), ==, 0xff);
+    g_assert(!qvirtqueue_get_buf(qts, vq, NULL, NULL));
+
+    data = g_malloc0(512);
+    memread(req_addr[2] + 16, data, 512);
+    g_assert_cmpstr(data, ==, "TEST 0");
+    g_free(data);
+
+    /* Both requests are used in submission order once the write is done */
+    qtest_clock_step(qts, 2 * NANOSECONDS_PER_SECOND);
+    qvirtio_wait_queue_isr(qts, dev, vq, QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(readb(req_addr[1] + 528), ==, 0);
+    g_assert(qvirtqueue_get_buf(qts, vq, &desc_idx, NULL));
+    g_assert_cmpint(desc_idx, ==, free_head[1]);
+    g_assert(qvirtqueue_get_buf(qts, vq, &desc_idx, NULL));
+    g_assert_cmpint(desc_idx, ==, free_head[2]);
+    g_assert(!qvirtqueue_get_buf(qts, vq, NULL, NULL));
+
+    for (i = 0; i < 3; i++) {
+        guest_free(t_alloc, req_addr[i]);
+    }
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+/*
+ * With interrupt coalescing, a queue interrupt is held back for up to
+ * irq-coalesce-usecs, or until irq-coalesce-frames completions are waiting.
+ * Adaptive mode is off so that the window doesn't depend on timing.
+ */
+#define IRQ_COALESCE_USECS  100000
+#define IRQ_COALESCE_FRAMES 3
+
+/* Submit a write of @sector, returns the request address */
+static uint64_t irq_coalesce_write(QVirtioDevice *dev, QVirtQueue *vq,
+                                   QGuestAllocator *alloc, uint64_t sector,
+                                   uint32_t *free_head)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    QTestState *qts = global_qtest;
+
+    req.type = VIRTIO_BLK_T_OUT;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    strcpy(req.data, "TEST");
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    *free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 512, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+    qvirtqueue_kick(qts, dev, vq, *free_head);
+
+    return req_addr;
+}
+
+/* Check that the requests were used in order, and free them */
+static void irq_coalesce_check_used(QVirtQueue *vq, QGuestAllocator *alloc,
+                                    const uint64_t *req_addr,
+                                    const uint32_t *free_head, int n)
+{
+    uint32_t desc_idx;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        g_assert(qvirtqueue_get_buf(global_qtest, vq, &desc_idx, NULL));
+        g_assert_cmpint(desc_idx, ==, free_head[i]);
+        guest_free(alloc, req_addr[i]);
+    }
+    g_assert(!qvirtqueue_get_buf(global_qtest, vq, NULL, NULL));
+}
+
+static void irq_coalesce(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    uint64_t req_addr[IRQ_COALESCE_FRAMES];
+    uint32_t free_head[IRQ_COALESCE_FRAMES];
+    uint64_t features;
+    uint8_t status;
+    gint64 start_time;
+    int i;
+    QTestState *qts = global_qtest;
+    QVirtQueue *vq;
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+
+    qvirtio_set_driver_ok(dev);
+
+    /* Completions within the window share one interrupt at its end */
+    for (i = 0; i < IRQ_COALESCE_FRAMES - 1; i++) {
+        req_addr[i] = irq_coalesce_write(dev, vq, t_alloc, i, &free_head[i]);
+        status = qvirtio_wait_status_byte_no_isr(qts, dev, vq,
+                                                 req_addr[i] + 528,
+                                                 QVIRTIO_BLK_TIMEOUT_US);
+        g_assert_cmpint(status, ==, 0);
+    }
+    qtest_clock_step(qts, IRQ_COALESCE_USECS * SCALE_US);
+    g_assert(dev->bus->get_queue_isr_status(dev, vq));
+    irq_coalesce_check_used(vq, t_alloc, req_addr, free_head,
+                            IRQ_COALESCE_FRAMES - 1);
+
+    /*
+     * The last of IRQ_COALESCE_FRAMES completions injects the interrupt.
+     * The clock doesn't move, so it can't be the timer.
+     */
+    for (i = 0; i < IRQ_COALESCE_FRAMES; i++) {
+        req_addr[i] = irq_coalesce_write(dev, vq, t_alloc, i, &free_head[i]);
+        if (i < IRQ_COALESCE_FRAMES - 1) {
+            status = qvirtio_wait_status_byte_no_isr(qts, dev, vq,
+                                                     req_addr[i] + 528,
+                                                     QVIRTIO_BLK_TIMEOUT_US);
+            g_assert_cmpint(status, ==, 0);
+        }
+    }
+    start_time = g_get_monotonic_time();
+    while (!dev->bus->get_queue_isr_status(dev, vq)) {
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_BLK_TIMEOUT_US);
+        g_usleep(1000);
+    }
+    irq_coalesce_check_used(vq, t_alloc, req_addr, free_head,
+                            IRQ_COALESCE_FRAMES);
+
+    /* Stopping the VM injects a held back interrupt right away */
+    req_addr[0] = irq_coalesce_write(dev, vq, t_alloc, 0, &free_head[0]);
+    status = qvirtio_wait_status_byte_no_isr(qts, dev, vq, req_addr[0] + 528,
+                                             QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(status, ==, 0);
+    qtest_qmp_assert_success(qts, "{ 'execute': 'stop' }");
+    g_assert(dev->bus->get_queue_isr_status(dev, vq));
+    qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+    irq_coalesce_check_used(vq, t_alloc, req_addr, free_head, 1);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+/*
+ * An interrupt held back for the irqfd of an IOThread is injected when the
+ * guest notifiers are torn down.  A device reset does this before it drops
+ * the coalescing state.  The MSI-X message stays in guest memory across the
+ * reset.
+ */
+static void irq_coalesce_teardown(void *obj, void *u_data,
+                                  QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioPCIDevice *pdev = &blk->pci_vdev;
+    QVirtioDevice *dev = &pdev->vdev;
+    QOSGraphObject *blk_object = obj;
+    QPCIDevice *pci_dev = blk_object->get_driver(blk_object, "pci-device");
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint64_t features;
+    uint8_t status;
+    QTestState *qts = global_qtest;
+    QVirtQueue *vq;
+
+    if (qpci_check_buggy_msi(pci_dev)) {
+        return;
+    }
+
+    qpci_msix_enable(pdev->pdev);
+    qvirtio_pci_set_msix_configuration_vector(pdev, t_alloc, 0);
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+    qvirtqueue_pci_msix_setup(pdev, (QVirtQueuePCI *)vq, t_alloc, 1);
+
+    qvirtio_set_driver_ok(dev);
+
+    req_addr = irq_coalesce_write(dev, vq, t_alloc, 0, &free_head);
+    status = qvirtio_wait_status_byte_no_isr(qts, dev, vq, req_addr + 528,
+                                             QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(status, ==, 0);
+
+    qvirtio_reset(dev);
+    g_assert(dev->bus->get_queue_isr_status(dev, vq));
+
+    guest_free(t_alloc, req_addr);
+    qpci_msix_disable(pdev->pdev);
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
 static void pci_hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
 {
     QVirtioPCIDevice *dev1 = obj;
@@ -785,16 +1156,53 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+/* Like virtio_blk_test_setup(), but allow only one write per second */
+static void *virtio_blk_throttle_setup(GString *cmd_line, void *arg)
+{
+    char *tmp_path = drive_create();
+
+    g_string_append_printf(cmd_line,
+                           " -drive if=none,id=drive0,file=%s,"
+                           "format=raw,auto-read-only=off,"
+                           "throttling.iops-write=1 ",
+                           tmp_path);
+
+    return arg;
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
         .before = virtio_blk_test_setup,
     };
+    QOSGraphTestOptions in_order_opts = {
+        .before = virtio_blk_throttle_setup,
+        .edge.extra_device_opts = "in-order=on",
+    };
+    QOSGraphTestOptions irq_coalesce_opts = {
+        .before = virtio_blk_test_setup,
+        .edge.extra_device_opts =
+            "irq-coalesce-usecs=" stringify(IRQ_COALESCE_USECS) ","
+            "irq-coalesce-frames=" stringify(IRQ_COALESCE_FRAMES) ","
+            "irq-coalesce-adaptive=off",
+    };
+    QOSGraphTestOptions irq_coalesce_iothread_opts = {
+        .before = virtio_blk_test_setup,
+        .edge.before_cmd_line = "-object iothread,id=thread0",
+        .edge.extra_device_opts =
+            "iothread=thread0,"
+            "irq-coalesce-usecs=" stringify(IRQ_COALESCE_USECS) ","
+            "irq-coalesce-adaptive=off",
+    };
 
     qos_add_test("indirect", "virtio-blk", indirect, &opts);
     qos_add_test("config", "virtio-blk", config, &opts);
     qos_add_test("basic", "virtio-blk", basic, &opts);
     qos_add_test("resize", "virtio-blk", resize, &opts);
+    qos_add_test("batch", "virtio-blk", batch, &opts);
+    qos_add_test("in-order", "virtio-blk", in_order, &in_order_opts);
+    qos_add_test("irq-coalesce", "virtio-blk", irq_coalesce,
+                 &irq_coalesce_opts);
 
     /* tests just for virtio-blk-pci */
     qos_add_test("msix", "virtio-blk-pci", msix, &opts);
@@ -802,6 +1210,8 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+    qos_add_test("irq-coalesce-teardown", "virtio-blk-pci",
+                 irq_coalesce_teardown, &irq_coalesce_iothread_opts);
 }
 
 libqos_init(register_virtio_blk_test);
@@ -15,6 +15,8 @@
 #include "hw/virtio/virtio-net.h"
 #include "libqos/qgraph.h"
 #include "libqos/virtio-net.h"
+#include "libqos/virtio-pci.h"
+#include "standard-headers/linux/virtio_ids.h"
 
 #ifndef ETH_P_RARP
 #define ETH_P_RARP 0x8035
@@ -185,6 +187,209 @@ static void hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
     }
 }
 
+/*
+ * Set up the rx, tx and ctrl queues of the NIC that was hotplugged into
+ * PCI_SLOT_HP.  @features are not negotiated.
+ */
+static QVirtioPCIDevice *hotplug_net_start(QVirtioPCIDevice *pdev,
+                                           QGuestAllocator *t_alloc,
+                                           uint64_t features,
+                                           QVirtQueue **vqs)
+{
+    QVirtioPCIDevice *dev;
+    int i;
+
+    dev = virtio_pci_new(pdev->pdev->bus, &(QPCIAddress) {
+                             .devfn = QPCI_DEVFN(PCI_SLOT_HP, 0)
+                         });
+    g_assert_nonnull(dev);
+    g_assert_cmpint(dev->vdev.device_type, ==, VIRTIO_ID_NET);
+    qvirtio_pci_device_enable(dev);
+    qvirtio_start_device(&dev->vdev);
+
+    features = qvirtio_get_features(&dev->vdev) &
+               ~(QVIRTIO_F_BAD_FEATURE | features);
+    qvirtio_set_features(&dev->vdev, features);
+
+    for (i = 0; i < 3; i++) {
+        vqs[i] = qvirtqueue_setup(&dev->vdev, t_alloc, i);
+    }
+    qvirtio_set_driver_ok(&dev->vdev);
+
+    return dev;
+}
+
+/* Reset and unplug the NIC @id that hotplug_net_start() set up */
+static void hotplug_net_stop(QVirtioPCIDevice *dev, const char *id,
+                             QGuestAllocator *t_alloc, QVirtQueue **vqs)
+{
+    QTestState *qts = dev->pdev->bus->qts;
+    const char *arch = qtest_get_arch();
+    int i;
+
+    qvirtio_reset(&dev->vdev);
+    for (i = 0; i < 3; i++) {
+        qvirtqueue_cleanup(dev->vdev.bus, vqs[i], t_alloc);
+    }
+
+    qvirtio_pci_device_disable(dev);
+    qos_object_destroy((QOSGraphObject *)dev);
+
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        qpci_unplug_acpi_device_test(qts, id, PCI_SLOT_HP);
+    }
+}
+
+/*
+ * Receive and send packets on a hotplugged NIC whose queue pair is processed
+ * in an IOThread, across a stop/cont cycle and a self-announcement, then
+ * reset and unplug it.
+ */
+static void iothread_vq_mapping(void *obj, void *data,
+                                QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *pdev = obj;
+    QTestState *qts = pdev->pdev->bus->qts;
+    QVirtioPCIDevice *dev;
+    QVirtQueue *vqs[3];
+    char buffer[64];
+    uint16_t *proto = (uint16_t *)&buffer[12];
+    uint32_t len;
+    QDict *rsp;
+    int *sv = data;
+    int ret;
+
+    if (pdev->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    qtest_qmp_device_add(qts, "virtio-net-pci", "net-hp",
+                         "{'addr': %s, 'netdev': 'hs1',"
+                         " 'iothread-vq-mapping': [{'iothread': 'thread0'}]}",
+                         stringify(PCI_SLOT_HP));
+    dev = hotplug_net_start(pdev, t_alloc,
+                            (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1ull << VIRTIO_RING_F_EVENT_IDX),
+                            vqs);
+
+    rx_test(&dev->vdev, t_alloc, vqs[0], sv[2]);
+    tx_test(&dev->vdev, t_alloc, vqs[1], sv[2]);
+
+    /* Packets arriving while the VM is stopped are delivered on cont */
+    rx_stop_cont_test(&dev->vdev, t_alloc, vqs[0], sv[2]);
+    tx_test(&dev->vdev, t_alloc, vqs[1], sv[2]);
+
+    /*
+     * The main loop sends self-announcements through the IOThread, between
+     * packets of the datapath.
+     */
+    qtest_qmp_assert_success(qts, "{ 'execute': 'announce-self', "
+                             " 'arguments': { 'initial': 50, 'max': 550,"
+                             " 'rounds': 1, 'step': 50,"
+                             " 'interfaces': ['net-hp'] } }");
+    ret = recv(sv[2], &len, sizeof(len), 0);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    len = ntohl(len);
+    g_assert_cmpint(len, <=, sizeof(buffer));
+    ret = recv(sv[2], buffer, len, MSG_WAITALL);
+    g_assert_cmpint(ret, ==, len);
+    g_assert_cmpint(*proto, ==, htons(ETH_P_RARP));
+    tx_test(&dev->vdev, t_alloc, vqs[1], sv[2]);
+
+    /* Filters would run in the main loop, they are refused */
+    rsp = qtest_qmp(qts, "{ 'execute': 'object-add', 'arguments': {"
+                    " 'qom-type': 'filter-buffer', 'id': 'fb0',"
+                    " 'netdev': 'hs1', 'interval': 1000 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    /* Moves the queue pair back out of the IOThread */
+    hotplug_net_stop(dev, "net-hp", t_alloc, vqs);
+}
+
+/*
+ * Send packets in batches that are larger than what the device takes from
+ * the tx virtqueue at once, until the rings have wrapped around.  With
+ * EVENT_IDX, only the last packet of a batch raises an interrupt.
+ */
+#define TX_BATCH_PKTS 48
+#define TX_BATCH_PKT_LEN 16
+
+static void tx_batch(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *pdev = obj;
+    QTestState *qts = pdev->pdev->bus->qts;
+    QVirtioPCIDevice *dev;
+    QVirtQueue *vqs[3], *vq;
+    uint32_t free_head[TX_BATCH_PKTS];
+    uint32_t desc_idx, len;
+    uint64_t req_addr, addr;
+    char buffer[64], expected[TX_BATCH_PKT_LEN];
+    unsigned int sent = 0;
+    int *sv = data;
+    int i, ret;
+
+    if (pdev->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    qtest_qmp_device_add(qts, "virtio-net-pci", "net-batch",
+                         "{'addr': %s, 'netdev': 'hs1'}",
+                         stringify(PCI_SLOT_HP));
+    dev = hotplug_net_start(pdev, t_alloc,
+                            1ull << VIRTIO_RING_F_INDIRECT_DESC, vqs);
+    vq = vqs[1];
+    g_assert(vq->event);
+    g_assert_cmpint(vq->size, >=, TX_BATCH_PKTS);
+
+    req_addr = guest_alloc(t_alloc, TX_BATCH_PKTS * 64);
+
+    while (sent <= vq->size + TX_BATCH_PKTS) {
+        for (i = 0; i < TX_BATCH_PKTS; i++) {
+            addr = req_addr + i * 64;
+            memset(buffer, 0, sizeof(buffer));
+            snprintf(buffer + VNET_HDR_SIZE, TX_BATCH_PKT_LEN, "TEST %u",
+                     sent + i);
+            memwrite(addr, buffer, VNET_HDR_SIZE + TX_BATCH_PKT_LEN);
+            free_head[i] = qvirtqueue_add(qts, vq, addr,
+                                          VNET_HDR_SIZE + TX_BATCH_PKT_LEN,
+                                          false, false);
+        }
+
+        qvirtqueue_set_used_event(qts, vq,
+                                  vq->last_used_idx + TX_BATCH_PKTS - 1);
+        qvirtqueue_kick_batch(qts, &dev->vdev, vq, free_head, TX_BATCH_PKTS);
+        qvirtio_wait_queue_isr(qts, &dev->vdev, vq, QVIRTIO_NET_TIMEOUT_US);
+
+        /* All packets were sent, in order */
+        for (i = 0; i < TX_BATCH_PKTS; i++) {
+            g_assert(qvirtqueue_get_buf(qts, vq, &desc_idx, NULL));
+            g_assert_cmpint(desc_idx, ==, free_head[i]);
+        }
+        g_assert(!qvirtqueue_get_buf(qts, vq, NULL, NULL));
+
+        for (i = 0; i < TX_BATCH_PKTS; i++) {
+            ret = recv(sv[2], &len, sizeof(len), 0);
+            g_assert_cmpint(ret, ==, sizeof(len));
+            len = ntohl(len);
+            g_assert_cmpint(len, ==, TX_BATCH_PKT_LEN);
+
+            ret = recv(sv[2], buffer, len, 0);
+            g_assert_cmpint(ret, ==, len);
+            snprintf(expected, sizeof(expected), "TEST %u", sent + i);
+            g_assert_cmpstr(buffer, ==, expected);
+        }
+
+        sent += TX_BATCH_PKTS;
+        qvirtqueue_recycle(vq);
+    }
+
+    guest_free(t_alloc, req_addr);
+    hotplug_net_stop(dev, "net-batch", t_alloc, vqs);
+}
+
 static void announce_self(void *obj, void *data, QGuestAllocator *t_alloc)
 {
     int *sv = data;
@@ -285,6 +490,41 @@ static void *virtio_net_test_setup(GString *cmd_line, void *arg)
     return sv;
 }
 
+static void virtio_net_test_iothread_cleanup(void *sockets)
+{
+    int *sv = sockets;
+
+    close(sv[0]);
+    close(sv[2]);
+    qos_invalidate_command_line();
+    close(sv[1]);
+    close(sv[3]);
+    g_free(sv);
+}
+
+/*
+ * hs0 for the device of the qos graph, hs1 for a hotplugged one, and an
+ * IOThread that it can use
+ */
+static void *virtio_net_test_setup_iothread(GString *cmd_line, void *arg)
+{
+    int ret;
+    int *sv = g_new(int, 4);
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv + 2);
+    g_assert_cmpint(ret, !=, -1);
+
+    g_string_append_printf(cmd_line,
+                           " -netdev socket,fd=%d,id=hs0"
+                           " -netdev socket,fd=%d,id=hs1"
+                           " -object iothread,id=thread0 ", sv[1], sv[3]);
+
+    g_test_queue_destroy(virtio_net_test_iothread_cleanup, sv);
+    return sv;
+}
+
 #endif /* _WIN32 */
 
 static void large_tx(void *obj, void *data, QGuestAllocator *t_alloc)
@@ -328,6 +568,11 @@ static void register_virtio_net_test(void)
     qos_add_test("basic", "virtio-net", send_recv_test, &opts);
     qos_add_test("rx_stop_cont", "virtio-net", stop_cont_test, &opts);
     qos_add_test("announce-self", "virtio-net", announce_self, &opts);
+
+    opts.before = virtio_net_test_setup_iothread;
+    qos_add_test("iothread-vq-mapping", "virtio-net-pci",
+                 iothread_vq_mapping, &opts);
+    qos_add_test("tx-batch", "virtio-net-pci", tx_batch, &opts);
 #endif
 
     /* These tests do not need a loopback backend.  */
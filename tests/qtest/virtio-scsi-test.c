@@ -24,6 +24,7 @@
 
 #define PCI_SLOT                0x02
 #define PCI_FN                  0x00
+#define PCI_SLOT_HP             0x06
 #define QVIRTIO_SCSI_TIMEOUT_US (1 * 1000 * 1000)
 
 #define MAX_NUM_QUEUES 64
@@ -59,14 +60,14 @@ static uint64_t qvirtio_scsi_alloc(QVirtioSCSIQueues *vs, size_t alloc_size,
     return addr;
 }
 
-static uint8_t virtio_scsi_do_command(QVirtioSCSIQueues *vs,
-                                      const uint8_t *cdb,
-                                      const uint8_t *data_in,
-                                      size_t data_in_len,
-                                      uint8_t *data_out, size_t data_out_len,
-                                      struct virtio_scsi_cmd_resp *resp_out)
+static uint8_t virtio_scsi_do_command_vq(QVirtioSCSIQueues *vs, QVirtQueue *vq,
+                                         const uint8_t *cdb,
+                                         const uint8_t *data_in,
+                                         size_t data_in_len,
+                                         uint8_t *data_out,
+                                         size_t data_out_len,
+                                         struct virtio_scsi_cmd_resp *resp_out)
 {
-    QVirtQueue *vq;
     struct virtio_scsi_cmd_req req = { { 0 } };
     struct virtio_scsi_cmd_resp resp = { .response = 0xff, .status = 0xff };
     uint64_t req_addr, resp_addr, data_in_addr = 0, data_out_addr = 0;
@@ -74,8 +75,6 @@ static uint8_t virtio_scsi_do_command(QVirtioSCSIQueues *vs,
     uint32_t free_head;
     QTestState *qts = global_qtest;
 
-    vq = vs->vq[2];
-
     req.lun[0] = 1; /* Select LUN */
     req.lun[1] = 1; /* Select target 1 */
     memcpy(req.cdb, cdb, VIRTIO_SCSI_CDB_SIZE);
@@ -118,6 +117,17 @@ static uint8_t virtio_scsi_do_command(QVirtioSCSIQueues *vs,
     return response;
 }
 
+static uint8_t virtio_scsi_do_command(QVirtioSCSIQueues *vs,
+                                      const uint8_t *cdb,
+                                      const uint8_t *data_in,
+                                      size_t data_in_len,
+                                      uint8_t *data_out, size_t data_out_len,
+                                      struct virtio_scsi_cmd_resp *resp_out)
+{
+    return virtio_scsi_do_command_vq(vs, vs->vq[2], cdb, data_in, data_in_len,
+                                     data_out, data_out_len, resp_out);
+}
+
 static QVirtioSCSIQueues *qvirtio_scsi_init(QVirtioDevice *dev)
 {
     QVirtioSCSIQueues *vs;
@@ -311,6 +321,77 @@ fail:
     unlink(tmp_path);
 }
 
+/*
+ * Send requests on every command virtqueue of a controller whose virtqueues
+ * are spread across two IOThreads, then reset and unplug it.
+ */
+static void test_iothread_vq_mapping(void *obj, void *data,
+                                     QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *pdev = obj;
+    QTestState *qts = pdev->pdev->bus->qts;
+    QVirtioPCIDevice *dev;
+    QVirtioSCSIQueues *vs;
+    int i;
+
+    uint8_t buf[512] = { 0 };
+    const uint8_t write_cdb[VIRTIO_SCSI_CDB_SIZE] = {
+        /* WRITE(10) to LBA 0, transfer length 1 */
+        0x2a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00
+    };
+    const uint8_t read_cdb[VIRTIO_SCSI_CDB_SIZE] = {
+        /* READ(10) from LBA 0, transfer length 1 */
+        0x28, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00
+    };
+
+    if (pdev->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    alloc = t_alloc;
+
+    qtest_qmp_device_add(qts, "virtio-scsi-pci", "scsi-hp",
+                         "{'addr': %s, 'num_queues': 4,"
+                         " 'iothread-vq-mapping': ["
+                         "   {'iothread': 'thread0', 'vqs': [0, 2]},"
+                         "   {'iothread': 'thread1', 'vqs': [1, 3]}]}",
+                         stringify(PCI_SLOT_HP) ".0");
+    qtest_qmp_device_add(qts, "scsi-hd", "hd-hp",
+                         "{'bus': 'scsi-hp.0', 'drive': 'null0',"
+                         " 'scsi-id': 1, 'lun': 0}");
+
+    dev = virtio_pci_new(pdev->pdev->bus,
+                         &(QPCIAddress) { .devfn = QPCI_DEVFN(PCI_SLOT_HP, 0) });
+    g_assert_nonnull(dev);
+    g_assert_cmpint(dev->vdev.device_type, ==, VIRTIO_ID_SCSI);
+    qvirtio_pci_device_enable(dev);
+    qvirtio_start_device(&dev->vdev);
+
+    vs = qvirtio_scsi_init(&dev->vdev);
+    g_assert_cmpint(vs->num_queues, ==, 4);
+
+    for (i = 0; i < vs->num_queues; i++) {
+        g_assert_cmphex(virtio_scsi_do_command_vq(vs, vs->vq[i + 2],
+                                                  write_cdb, NULL, 0,
+                                                  buf, 512, NULL),
+                        ==, 0);
+        g_assert_cmphex(virtio_scsi_do_command_vq(vs, vs->vq[i + 2],
+                                                  read_cdb, buf, 512,
+                                                  NULL, 0, NULL),
+                        ==, 0);
+    }
+
+    /* Stops the virtqueues in both IOThreads */
+    qvirtio_reset(&dev->vdev);
+    qvirtio_scsi_pci_free(vs);
+
+    qvirtio_pci_device_disable(dev);
+    qos_object_destroy((QOSGraphObject *)dev);
+
+    qpci_unplug_acpi_device_test(qts, "scsi-hp", PCI_SLOT_HP);
+}
+
 static void *virtio_scsi_hotplug_setup(GString *cmd_line, void *arg)
 {
     g_string_append(cmd_line,
@@ -359,6 +440,16 @@ static void *virtio_scsi_setup_iothread(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_scsi_setup_iothread_vq_mapping(GString *cmd_line,
+                                                   void *arg)
+{
+    g_string_append(cmd_line,
+                    " -object iothread,id=thread0"
+                    " -object iothread,id=thread1"
+                    " -blockdev driver=null-co,read-zeroes=on,node-name=null0");
+    return arg;
+}
+
 static void register_virtio_scsi_test(void)
 {
     QOSGraphTestOptions opts = { };
@@ -383,6 +474,11 @@ static void register_virtio_scsi_test(void)
     };
     qos_add_test("iothread-attach-node", "virtio-scsi-pci",
                  test_iothread_attach_node, &opts);
+
+    opts.before = virtio_scsi_setup_iothread_vq_mapping;
+    opts.edge = (QOSGraphEdgeOptions) { };
+    qos_add_test("iothread-vq-mapping", "virtio-scsi-pci",
+                 test_iothread_vq_mapping, &opts);
 }
 
 libqos_init(register_virtio_scsi_test);
@@ -135,6 +135,9 @@ static void hbitmap_test_teardown(TestHBitmapData *data,
                                   const void *unused)
 {
     if (data->hb) {
+        if (hbitmap_meta(data->hb)) {
+            hbitmap_free_meta(data->hb);
+        }
         hbitmap_free(data->hb);
         data->hb = NULL;
     }
@@ -1042,6 +1045,89 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+static void test_hbitmap_meta_set_reset(TestHBitmapData *data,
+                                        const void *unused)
+{
+    HBitmap *meta;
+
+    hbitmap_test_init(data, L3, 0);
+    meta = hbitmap_create_meta(data->hb, 64);
+    g_assert_cmpint(hbitmap_granularity(meta), ==, 6);
+    g_assert(hbitmap_empty(meta));
+
+    /* Changes are tracked in chunks of 64 bits */
+    hbitmap_test_set(data, 100, 10);
+    g_assert_cmpint(hbitmap_count(meta), ==, 64);
+    g_assert(hbitmap_get(meta, 64));
+    g_assert_cmpint(hbitmap_next_dirty(meta, 0, L3), ==, 64);
+
+    /* Setting bits that are set already does not change anything */
+    hbitmap_reset(meta, 0, L3);
+    hbitmap_test_set(data, 100, 10);
+    g_assert(hbitmap_empty(meta));
+
+    /* Same for resetting clean bits */
+    hbitmap_test_reset(data, 1000, 10);
+    g_assert(hbitmap_empty(meta));
+
+    hbitmap_test_reset(data, 105, 100);
+    g_assert_cmpint(hbitmap_count(meta), ==, 64);
+    g_assert(hbitmap_get(meta, 64));
+}
+
+static void test_hbitmap_meta_bulk(TestHBitmapData *data,
+                                   const void *unused)
+{
+    HBitmap *meta;
+    uint64_t el_size;
+
+    hbitmap_test_init(data, L3, 0);
+    meta = hbitmap_create_meta(data->hb, 64);
+    el_size = hbitmap_serialization_align(data->hb);
+
+    /* Clearing an empty bitmap changes nothing */
+    hbitmap_reset_all(data->hb);
+    g_assert(hbitmap_empty(meta));
+
+    hbitmap_set(data->hb, L2, 1);
+    hbitmap_reset(meta, 0, L3);
+    hbitmap_reset_all(data->hb);
+    g_assert_cmpint(hbitmap_count(meta), ==, L3);
+
+    hbitmap_reset(meta, 0, L3);
+    hbitmap_deserialize_ones(data->hb, el_size, el_size, true);
+    g_assert_cmpint(hbitmap_next_dirty(meta, 0, L3), ==, el_size);
+    g_assert_cmpint(hbitmap_count(meta), ==, el_size);
+}
+
+static void test_hbitmap_meta_serialize(TestHBitmapData *data,
+                                        const void *unused)
+{
+    HBitmap *meta;
+    uint64_t el_size;
+    size_t buf_size;
+    g_autofree uint8_t *buf = NULL;
+
+    hbitmap_test_init(data, L3, 0);
+    meta = hbitmap_create_meta(data->hb, 64);
+    el_size = hbitmap_serialization_align(data->hb);
+    buf_size = hbitmap_serialization_size(data->hb, 0, el_size);
+    buf = g_malloc0(buf_size);
+
+    hbitmap_set(data->hb, 10, 20);
+    hbitmap_reset(meta, 0, L3);
+
+    /* Reading the bitmap doesn't change it */
+    hbitmap_serialize_part(data->hb, buf, 0, el_size);
+    g_assert(hbitmap_empty(meta));
+
+    hbitmap_deserialize_part(data->hb, buf, el_size, el_size, true);
+    g_assert_cmpint(hbitmap_next_dirty(meta, 0, L3), ==, el_size);
+    g_assert_cmpint(hbitmap_count(meta), ==, el_size);
+    g_assert_cmpint(hbitmap_next_dirty(data->hb, el_size, L3), ==,
+                    el_size + 10);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1199,10 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    hbitmap_test_add("/hbitmap/meta/set_reset", test_hbitmap_meta_set_reset);
+    hbitmap_test_add("/hbitmap/meta/bulk", test_hbitmap_meta_bulk);
+    hbitmap_test_add("/hbitmap/meta/serialize", test_hbitmap_meta_serialize);
+
     g_test_run();
 
     return 0;
@@ -0,0 +1,304 @@
+/*
+ * Tests for the packet queue of net clients
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "net/net.h"
+#include "net/queue.h"
+
+/* Used by queue.c to decide whether to deliver right away */
+bool qemu_can_send_packet(NetClientState *sender)
+{
+    return true;
+}
+
+typedef struct TestState {
+    NetQueue *queue;
+    bool ready;                 /* the receiver accepts packets */
+    GPtrArray *received;        /* copies of the delivered payloads */
+    GPtrArray *addrs;           /* iov_base of the first delivered iovec */
+    int sent;                   /* sent_cb invocations */
+    ssize_t last_sent_ret;
+} TestState;
+
+static TestState ts;
+static NetClientState sender_a, sender_b;
+
+static ssize_t test_deliver(NetClientState *sender, unsigned flags,
+                            const struct iovec *iov, int iovcnt,
+                            void *opaque)
+{
+    TestState *s = opaque;
+    size_t size = iov_size(iov, iovcnt);
+    GByteArray *data;
+
+    if (!s->ready) {
+        return 0;
+    }
+
+    data = g_byte_array_sized_new(size);
+    g_byte_array_set_size(data, size);
+    iov_to_buf(iov, iovcnt, 0, data->data, size);
+    g_ptr_array_add(s->received, data);
+    g_ptr_array_add(s->addrs, iov[0].iov_base);
+
+    return size;
+}
+
+static void test_sent(NetClientState *sender, ssize_t ret)
+{
+    ts.sent++;
+    ts.last_sent_ret = ret;
+}
+
+static void setup(void)
+{
+    ts = (TestState) {
+        .received = g_ptr_array_new_with_free_func(
+                        (GDestroyNotify)g_byte_array_unref),
+        .addrs = g_ptr_array_new(),
+    };
+    ts.queue = qemu_new_net_queue(test_deliver, &ts);
+}
+
+static void teardown(void)
+{
+    qemu_del_net_queue(ts.queue);
+    g_ptr_array_free(ts.received, true);
+    g_ptr_array_free(ts.addrs, true);
+}
+
+static void fill(uint8_t *buf, size_t size, uint8_t seed)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        buf[i] = seed + i;
+    }
+}
+
+static void check_received(guint index, size_t size, uint8_t seed)
+{
+    g_autofree uint8_t *expected = g_malloc(size);
+    GByteArray *data;
+
+    g_assert_cmpuint(index, <, ts.received->len);
+    data = g_ptr_array_index(ts.received, index);
+    fill(expected, size, seed);
+    g_assert_cmpmem(data->data, data->len, expected, size);
+}
+
+/* Packets of all sizes, pooled or not, are delivered unchanged and in order */
+static void test_copy_sizes(void)
+{
+    static const size_t sizes[] = {
+        1, 60, 1514, 1536, 2000, 2048, 4096, 65536
+    };
+    uint8_t *buf = g_malloc(65536);
+    int round, i;
+
+    setup();
+
+    for (round = 0; round < 2; round++) {
+        ts.ready = false;
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            fill(buf, sizes[i], i);
+            g_assert_cmpint(qemu_net_queue_send(ts.queue, &sender_a, 0, buf,
+                                                sizes[i], test_sent), ==, 0);
+            /* The queue holds a copy */
+            memset(buf, 0xff, sizes[i]);
+        }
+
+        ts.ready = true;
+        g_assert_true(qemu_net_queue_flush(ts.queue));
+        g_assert_cmpint(ts.sent, ==, (round + 1) * ARRAY_SIZE(sizes));
+
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            check_received(round * ARRAY_SIZE(sizes) + i, sizes[i], i);
+        }
+    }
+
+    teardown();
+    g_free(buf);
+}
+
+/* Freed small packets are reused for the next ones */
+static void test_pool_reuse(void)
+{
+    uint8_t buf[64];
+    void *first;
+    int i;
+
+    setup();
+
+    fill(buf, sizeof(buf), 0);
+    ts.ready = false;
+    qemu_net_queue_send(ts.queue, &sender_a, 0, buf, sizeof(buf), test_sent);
+    ts.ready = true;
+    g_assert_true(qemu_net_queue_flush(ts.queue));
+    first = g_ptr_array_index(ts.addrs, 0);
+
+    for (i = 1; i <= 10; i++) {
+        fill(buf, sizeof(buf), i);
+        ts.ready = false;
+        qemu_net_queue_send(ts.queue, &sender_a, 0, buf, sizeof(buf),
+                            test_sent);
+        ts.ready = true;
+        g_assert_true(qemu_net_queue_flush(ts.queue));
+
+        g_assert_true(g_ptr_array_index(ts.addrs, i) == first);
+        check_received(i, sizeof(buf), i);
+    }
+
+    teardown();
+}
+
+/*
+ * More packets than the pool holds can be queued, and packets come back
+ * from the pool after a purge as well.
+ */
+static void test_pool_overflow(void)
+{
+    uint8_t buf[128];
+    int round, i;
+
+    setup();
+
+    for (round = 0; round < 3; round++) {
+        ts.ready = false;
+        for (i = 0; i < 1000; i++) {
+            fill(buf, sizeof(buf), i);
+            qemu_net_queue_send(ts.queue, i % 2 ? &sender_b : &sender_a, 0,
+                                buf, sizeof(buf), test_sent);
+        }
+
+        /* sent_cb reports the purged packets as not sent */
+        ts.sent = 0;
+        qemu_net_queue_purge(ts.queue, &sender_b);
+        g_assert_cmpint(ts.sent, ==, 500);
+        g_assert_cmpint(ts.last_sent_ret, ==, 0);
+
+        ts.ready = true;
+        g_ptr_array_set_size(ts.received, 0);
+        g_assert_true(qemu_net_queue_flush(ts.queue));
+        g_assert_cmpint(ts.received->len, ==, 500);
+        for (i = 0; i < 500; i++) {
+            check_received(i, sizeof(buf), i * 2);
+        }
+    }
+
+    /* Leave packets queued; qemu_del_net_queue() frees them with the pool */
+    ts.ready = false;
+    for (i = 0; i < 10; i++) {
+        qemu_net_queue_send(ts.queue, &sender_a, 0, buf, sizeof(buf),
+                            test_sent);
+    }
+
+    teardown();
+}
+
+/* A failed delivery puts the packet back at the head of the queue */
+static void test_flush_requeue(void)
+{
+    uint8_t buf[100];
+    int i;
+
+    setup();
+
+    ts.ready = false;
+    for (i = 0; i < 3; i++) {
+        fill(buf, sizeof(buf), i);
+        qemu_net_queue_send(ts.queue, &sender_a, 0, buf, sizeof(buf),
+                            test_sent);
+    }
+    g_assert_false(qemu_net_queue_flush(ts.queue));
+    g_assert_cmpint(ts.sent, ==, 0);
+
+    ts.ready = true;
+    g_assert_true(qemu_net_queue_flush(ts.queue));
+    g_assert_cmpint(ts.sent, ==, 3);
+    for (i = 0; i < 3; i++) {
+        check_received(i, sizeof(buf), i);
+    }
+
+    teardown();
+}
+
+/* Borrowed buffers are queued by reference until sent_cb runs */
+static void test_borrow(void)
+{
+    uint8_t hdr[12], payload[1000];
+    struct iovec iov[] = {
+        { .iov_base = hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = payload, .iov_len = sizeof(payload) },
+    };
+    uint8_t expected[sizeof(hdr) + sizeof(payload)];
+
+    setup();
+
+    fill(hdr, sizeof(hdr), 0);
+    fill(payload, sizeof(payload), 1);
+    ts.ready = false;
+    g_assert_cmpint(qemu_net_queue_send_iov(ts.queue, &sender_a,
+                                            QEMU_NET_PACKET_FLAG_BORROW,
+                                            iov, ARRAY_SIZE(iov),
+                                            test_sent), ==, 0);
+
+    /* The sender still owns the buffers, changes are visible on delivery */
+    fill(payload, sizeof(payload), 2);
+
+    ts.ready = true;
+    g_assert_true(qemu_net_queue_flush(ts.queue));
+    g_assert_cmpint(ts.sent, ==, 1);
+    g_assert_cmpint(ts.last_sent_ret, ==, sizeof(expected));
+    g_assert_true(g_ptr_array_index(ts.addrs, 0) == hdr);
+
+    fill(expected, sizeof(hdr), 0);
+    fill(expected + sizeof(hdr), sizeof(payload), 2);
+    g_assert_cmpmem(((GByteArray *)g_ptr_array_index(ts.received, 0))->data,
+                    sizeof(expected), expected, sizeof(expected));
+
+    teardown();
+}
+
+/* Without a sent callback, the buffers are copied despite the flag */
+static void test_borrow_no_sent_cb(void)
+{
+    uint8_t buf[500];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    setup();
+
+    fill(buf, sizeof(buf), 3);
+    ts.ready = false;
+    qemu_net_queue_send_iov(ts.queue, &sender_a, QEMU_NET_PACKET_FLAG_BORROW,
+                            &iov, 1, NULL);
+    memset(buf, 0, sizeof(buf));
+
+    ts.ready = true;
+    g_assert_true(qemu_net_queue_flush(ts.queue));
+    g_assert_true(g_ptr_array_index(ts.addrs, 0) != buf);
+    check_received(0, sizeof(buf), 3);
+
+    teardown();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/net/queue/copy-sizes", test_copy_sizes);
+    g_test_add_func("/net/queue/pool-reuse", test_pool_reuse);
+    g_test_add_func("/net/queue/pool-overflow", test_pool_overflow);
+    g_test_add_func("/net/queue/flush-requeue", test_flush_requeue);
+    g_test_add_func("/net/queue/borrow", test_borrow);
+    g_test_add_func("/net/queue/borrow-no-sent-cb", test_borrow_no_sent_cb);
+
+    return g_test_run();
+}
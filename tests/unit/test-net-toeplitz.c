@@ -0,0 +1,124 @@
+/*
+ * Toeplitz RSS hash tests
+ *
+ * Checks the bit-serial net_toeplitz_add() and the table driven
+ * net_toeplitz_table_hash() against the Microsoft RSS verification suite.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+static uint8_t key[] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+typedef struct ToeplitzVector {
+    const char *name;
+    uint8_t input[NET_TOEPLITZ_MAX_INPUT];
+    uint32_t len;
+    uint32_t hash;
+} ToeplitzVector;
+
+static const ToeplitzVector vectors[] = {
+    {
+        .name = "ipv4",
+        .input = { 66, 9, 149, 187, 161, 142, 100, 80 },
+        .len = 8,
+        .hash = 0x323e8fc2,
+    }, {
+        .name = "ipv4-tcp",
+        .input = { 66, 9, 149, 187, 161, 142, 100, 80,
+                   0x0a, 0xea, 0x06, 0xe6 },
+        .len = 12,
+        .hash = 0x51ccc178,
+    }, {
+        .name = "ipv6",
+        .input = { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+                   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07,
+                   0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+                   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01 },
+        .len = 32,
+        .hash = 0x2cc18cd5,
+    }, {
+        .name = "ipv6-tcp",
+        .input = { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+                   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07,
+                   0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+                   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+                   0x0a, 0xea, 0x06, 0xe6 },
+        .len = 36,
+        .hash = 0x40207d3d,
+    },
+};
+
+static void test_toeplitz_vector(const void *opaque)
+{
+    const ToeplitzVector *v = opaque;
+    g_autofree NetToeplitzTable *table = g_new(NetToeplitzTable, 1);
+    uint8_t input[NET_TOEPLITZ_MAX_INPUT];
+    net_toeplitz_key key_data;
+    uint32_t hash = 0;
+
+    memcpy(input, v->input, sizeof(input));
+
+    net_toeplitz_key_init(&key_data, key);
+    net_toeplitz_add(&hash, input, v->len, &key_data);
+    g_assert_cmphex(hash, ==, v->hash);
+
+    net_toeplitz_table_init(table, key);
+    g_assert_cmphex(net_toeplitz_table_hash(table, input, v->len),
+                    ==, v->hash);
+}
+
+/* Both implementations agree for every value of every input byte */
+static void test_toeplitz_table(void)
+{
+    g_autofree NetToeplitzTable *table = g_new(NetToeplitzTable, 1);
+    uint8_t input[NET_TOEPLITZ_MAX_INPUT];
+    net_toeplitz_key key_data;
+    uint32_t byte, value, hash;
+
+    net_toeplitz_table_init(table, key);
+    memcpy(input, vectors[ARRAY_SIZE(vectors) - 1].input, sizeof(input));
+
+    for (byte = 0; byte < NET_TOEPLITZ_MAX_INPUT; byte++) {
+        uint8_t saved = input[byte];
+
+        for (value = 0; value < 256; value++) {
+            input[byte] = value;
+            hash = 0;
+            net_toeplitz_key_init(&key_data, key);
+            net_toeplitz_add(&hash, input, sizeof(input), &key_data);
+            g_assert_cmphex(net_toeplitz_table_hash(table, input,
+                                                    sizeof(input)),
+                            ==, hash);
+        }
+        input[byte] = saved;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char name[64];
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(vectors); i++) {
+        snprintf(name, sizeof(name), "/net/toeplitz/vector/%s",
+                 vectors[i].name);
+        g_test_add_data_func(name, &vectors[i], test_toeplitz_vector);
+    }
+    g_test_add_func("/net/toeplitz/table", test_toeplitz_table);
+
+    return g_test_run();
+}
@@ -0,0 +1,213 @@
+/*
+ * Tests for batched tap I/O with io_uring
+ *
+ * A SOCK_SEQPACKET socketpair stands in for the tap device: like a tap
+ * file descriptor, it transfers one packet per read or write.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "net/net.h"
+#include "../net/tap_int.h"
+
+/* Used by tap-uring.c once submitting has failed */
+ssize_t tap_read_packet(int tapfd, uint8_t *buf, int maxlen)
+{
+    return RETRY_ON_EINTR(read(tapfd, buf, maxlen));
+}
+
+typedef struct TestFixture {
+    int sv[2];
+    TapUring *tu;
+} TestFixture;
+
+static void fixture_setup(TestFixture *f, const void *data)
+{
+    Error *local_err = NULL;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, f->sv), ==, 0);
+    g_assert_true(g_unix_set_fd_nonblocking(f->sv[0], true, NULL));
+
+    f->tu = tap_uring_new(f->sv[0], &local_err);
+    if (!f->tu) {
+        /* This is where the tap backend falls back to read()/writev() */
+        g_test_skip(error_get_pretty(local_err));
+        error_free(local_err);
+    }
+}
+
+static void fixture_teardown(TestFixture *f, const void *data)
+{
+    tap_uring_free(f->tu);
+    close(f->sv[0]);
+    close(f->sv[1]);
+}
+
+static void send_packet(int fd, uint8_t pattern, size_t len)
+{
+    g_autofree uint8_t *buf = g_malloc(len);
+
+    memset(buf, pattern, len);
+    g_assert_cmpint(send(fd, buf, len, 0), ==, len);
+}
+
+static void check_packet(const struct iovec *iov, uint8_t pattern, size_t len)
+{
+    size_t i;
+
+    g_assert_cmpint(iov->iov_len, ==, len);
+    for (i = 0; i < len; i++) {
+        g_assert_cmphex(((uint8_t *)iov->iov_base)[i], ==, pattern);
+    }
+}
+
+static void test_blocking_fd(void)
+{
+    Error *local_err = NULL;
+    int sv[2];
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), ==, 0);
+
+    g_assert_null(tap_uring_new(sv[0], &local_err));
+    error_free_or_abort(&local_err);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void test_read_batch(TestFixture *f, const void *data)
+{
+    struct iovec pkts[TAP_URING_BATCH];
+    int i;
+
+    if (!f->tu) {
+        return;
+    }
+
+    /* Nothing to read yet */
+    g_assert_cmpint(tap_uring_read(f->tu, pkts, TAP_URING_BATCH), ==, 0);
+
+    for (i = 0; i < 5; i++) {
+        send_packet(f->sv[1], i + 1, 60 + i * 100);
+    }
+
+    /* One submission returns all of them, in order */
+    g_assert_cmpint(tap_uring_read(f->tu, pkts, TAP_URING_BATCH), ==, 5);
+    for (i = 0; i < 5; i++) {
+        check_packet(&pkts[i], i + 1, 60 + i * 100);
+    }
+
+    /* No more than requested */
+    for (i = 0; i < 3; i++) {
+        send_packet(f->sv[1], 0x10 + i, 64);
+    }
+    g_assert_cmpint(tap_uring_read(f->tu, pkts, 2), ==, 2);
+    check_packet(&pkts[0], 0x10, 64);
+    check_packet(&pkts[1], 0x11, 64);
+    g_assert_cmpint(tap_uring_read(f->tu, pkts, TAP_URING_BATCH), ==, 1);
+    check_packet(&pkts[0], 0x12, 64);
+}
+
+static void test_write_batch(TestFixture *f, const void *data)
+{
+    uint8_t buf[NET_BUFSIZE];
+    struct iovec iov;
+    int i;
+
+    if (!f->tu) {
+        return;
+    }
+
+    for (i = 0; i < TAP_URING_BATCH; i++) {
+        memset(buf, i, 100);
+        iov = (struct iovec) { .iov_base = buf, .iov_len = 100 };
+        g_assert_true(tap_uring_queue_write(f->tu, &iov, 1));
+    }
+
+    /* The batch is full */
+    iov = (struct iovec) { .iov_base = buf, .iov_len = 100 };
+    g_assert_false(tap_uring_queue_write(f->tu, &iov, 1));
+
+    g_assert_cmpint(tap_uring_flush(f->tu), ==, 0);
+
+    /* Packets were copied, so reusing buf didn't change them */
+    for (i = 0; i < TAP_URING_BATCH; i++) {
+        ssize_t len = recv(f->sv[1], buf, sizeof(buf), MSG_DONTWAIT);
+
+        iov = (struct iovec) { .iov_base = buf, .iov_len = len };
+        check_packet(&iov, i, 100);
+    }
+    g_assert_cmpint(recv(f->sv[1], buf, sizeof(buf), MSG_DONTWAIT), ==, -1);
+    g_assert_cmpint(errno, ==, EAGAIN);
+}
+
+/*
+ * When the device is full, the rest of the batch stays queued in order and
+ * is written by the next flush.
+ */
+static void test_write_eagain(TestFixture *f, const void *data)
+{
+    uint8_t buf[NET_BUFSIZE];
+    struct iovec iov;
+    int sndbuf = 4096;
+    int written = 0, received = 0;
+    int ret, i;
+
+    if (!f->tu) {
+        return;
+    }
+
+    setsockopt(f->sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    /* Fill the socket until a flush cannot write everything */
+    do {
+        for (i = 0; i < TAP_URING_BATCH; i++) {
+            memset(buf, written + i, 1000);
+            iov = (struct iovec) { .iov_base = buf, .iov_len = 1000 };
+            if (!tap_uring_queue_write(f->tu, &iov, 1)) {
+                break;
+            }
+        }
+        written += i;
+        ret = tap_uring_flush(f->tu);
+    } while (ret == 0);
+    g_assert_cmpint(ret, ==, -EAGAIN);
+
+    /* Drain and flush until everything got through */
+    do {
+        while ((ret = recv(f->sv[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            iov = (struct iovec) { .iov_base = buf, .iov_len = ret };
+            check_packet(&iov, (uint8_t)received, 1000);
+            received++;
+        }
+        ret = tap_uring_flush(f->tu);
+    } while (ret == -EAGAIN);
+    g_assert_cmpint(ret, ==, 0);
+
+    while ((ret = recv(f->sv[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        iov = (struct iovec) { .iov_base = buf, .iov_len = ret };
+        check_packet(&iov, (uint8_t)received, 1000);
+        received++;
+    }
+    g_assert_cmpint(received, ==, written);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/tap-uring/blocking-fd", test_blocking_fd);
+    g_test_add("/tap-uring/read-batch", TestFixture, NULL,
+               fixture_setup, test_read_batch, fixture_teardown);
+    g_test_add("/tap-uring/write-batch", TestFixture, NULL,
+               fixture_setup, test_write_batch, fixture_teardown);
+    g_test_add("/tap-uring/write-eagain", TestFixture, NULL,
+               fixture_setup, test_write_eagain, fixture_teardown);
+
+    return g_test_run();
+}
@@ -49,6 +49,32 @@ static void test_fd_is_socket_good(void)
     close(fd);
 }
 
+/*
+ * Busy polling is either not supported by the host, or usually needs
+ * CAP_NET_ADMIN.  Either way, the caller must get a clean error.
+ */
+static void test_socket_set_busy_poll(void)
+{
+    Error *err = NULL;
+    int fd = qemu_socket(PF_INET, SOCK_DGRAM, 0);
+    int ret;
+
+    g_assert(fd >= 0);
+
+    ret = socket_set_busy_poll(fd, 20, 64, &err);
+#if defined(SO_PREFER_BUSY_POLL) && defined(SO_BUSY_POLL_BUDGET)
+    g_assert_cmpint(ret, ==, err ? -1 : 0);
+    error_free(err);
+#else
+    g_assert_cmpint(ret, ==, -1);
+    g_assert_cmpstr(error_get_pretty(err), ==,
+                    "busy polling is not supported by this host");
+    error_free(err);
+#endif
+
+    close(fd);
+}
+
 static int mon_fd = -1;
 static const char *mon_fdname;
 __thread Monitor *cur_mon;
@@ -356,6 +382,8 @@ int main(int argc, char **argv)
                         test_fd_is_socket_bad);
         g_test_add_func("/util/socket/is-socket/good",
                         test_fd_is_socket_good);
+        g_test_add_func("/util/socket/busy-poll",
+                        test_socket_set_busy_poll);
 #ifndef _WIN32
         g_test_add_func("/socket/fd-pass/name/good",
                         test_socket_fd_pass_name_good);
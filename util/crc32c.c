@@ -27,6 +27,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/crc32c.h"
+#include "host/cpuinfo.h"
 
 /*
  * This is the CRC-32C table
@@ -105,8 +106,44 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
+#if defined(__x86_64__) && defined(CONFIG_CPUID_H)
+/*
+ * The SSE4.2 CRC32 instruction implements exactly the table based update
+ * step below, but for up to eight bytes at a time.
+ */
+static uint32_t __attribute__((target("sse4.2")))
+crc32c_sse42(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    uint64_t crc64;
+
+    while (length && ((uintptr_t)data & 7)) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+        length--;
+    }
+
+    crc64 = crc;
+    while (length >= 8) {
+        crc64 = __builtin_ia32_crc32di(crc64, *(const uint64_t *)data);
+        data += 8;
+        length -= 8;
+    }
+    crc = crc64;
+
+    while (length--) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+    }
+    return crc ^ 0xffffffff;
+}
+#endif
+
 uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
 {
+#if defined(__x86_64__) && defined(CONFIG_CPUID_H)
+    if (cpuinfo & CPUINFO_SSE42) {
+        return crc32c_sse42(crc, data, length);
+    }
+#endif
+
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
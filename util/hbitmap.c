@@ -593,6 +593,9 @@ void hbitmap_reset_all(HBitmap *hb)
     }
 
     hb->levels[0][0] = 1UL << (BITS_PER_LONG - 1);
+    if (hb->count && hb->meta) {
+        hbitmap_set(hb->meta, 0, hb->orig_size);
+    }
     hb->count = 0;
 }
 
@@ -704,6 +707,9 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     }
     serialization_chunk(hb, start, count, &cur, &el_count);
     end = cur + el_count;
+    if (hb->meta) {
+        hbitmap_set(hb->meta, start, count);
+    }
 
     while (cur != end) {
         memcpy(cur, buf, sizeof(*cur));
@@ -732,6 +738,9 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
+    if (hb->meta) {
+        hbitmap_set(hb->meta, start, count);
+    }
 
     memset(first, 0, el_count * sizeof(unsigned long));
     if (finish) {
@@ -749,6 +758,9 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
+    if (hb->meta) {
+        hbitmap_set(hb->meta, start, count);
+    }
 
     memset(first, 0xff, el_count * sizeof(unsigned long));
     if (finish) {
@@ -791,6 +803,27 @@ void hbitmap_free(HBitmap *hb)
     g_free(hb);
 }
 
+HBitmap *hbitmap_create_meta(HBitmap *hb, int chunk_size)
+{
+    assert(chunk_size > 0 && is_power_of_2(chunk_size));
+    assert(!hb->meta);
+    hb->meta = hbitmap_alloc(hb->orig_size,
+                             hb->granularity + ctz32(chunk_size));
+    return hb->meta;
+}
+
+void hbitmap_free_meta(HBitmap *hb)
+{
+    assert(hb->meta);
+    hbitmap_free(hb->meta);
+    hb->meta = NULL;
+}
+
+HBitmap *hbitmap_meta(const HBitmap *hb)
+{
+    return hb->meta;
+}
+
 HBitmap *hbitmap_alloc(uint64_t size, int granularity)
 {
     HBitmap *hb = g_new0(struct HBitmap, 1);
@@ -939,6 +972,9 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
+    if (result->meta) {
+        hbitmap_set(result->meta, 0, result->orig_size);
+    }
 
     /* Recompute the dirty count */
     result->count = hb_count_between(result, 0, result->size - 1);
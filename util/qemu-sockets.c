@@ -1473,3 +1473,25 @@ SocketAddress *socket_address_flatten(SocketAddressLegacy *addr_legacy)
 
     return addr;
 }
+
+int socket_set_busy_poll(int fd, int usecs, int budget, Error **errp)
+{
+#if defined(SO_PREFER_BUSY_POLL) && defined(SO_BUSY_POLL_BUDGET)
+    int prefer = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                   &prefer, sizeof(prefer)) < 0
+        || setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                      &usecs, sizeof(usecs)) < 0
+        || setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+                      &budget, sizeof(budget)) < 0) {
+        error_setg_errno(errp, errno, "failed to enable busy polling");
+        return -1;
+    }
+
+    return 0;
+#else
+    error_setg(errp, "busy polling is not supported by this host");
+    return -1;
+#endif
+}
@@ -8,7 +8,9 @@
  * later.  See the COPYING file in the top-level directory.
  */
 #include "qemu/osdep.h"
+#include "qemu/coroutine.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/main-loop.h"
 #include "qemu/vhost-user-server.h"
 #include "block/aio-wait.h"
@@ -52,6 +54,15 @@
  * possible by QIOChannel's support for spurious coroutine re-entry in
  * qio_channel_yield(). The coroutine will restart I/O when re-entered from the
  * new AioContext.
+ *
+ * If the server is started with an AioContext for each virtqueue, the kick fd
+ * of each virtqueue is monitored in the AioContext of that virtqueue instead,
+ * so that virtqueues are processed in parallel in different threads.
+ * libvhost-user itself is not thread-safe, so vu_client_trip() pauses
+ * virtqueue processing in all threads while it handles a vhost-user message:
+ * it stops monitoring kick fds and waits until running kick handlers and
+ * in-flight requests have completed. Virtqueue processing resumes when the
+ * message has been handled.
  */
 
 static void vmsg_close_fds(VhostUserMsg *vmsg)
@@ -92,7 +103,108 @@ void vhost_user_server_dec_in_flight(VuServer *server)
 
 bool vhost_user_server_has_in_flight(VuServer *server)
 {
-    return qatomic_load_acquire(&server->in_flight) > 0;
+    /* Kick handlers running in other threads may still submit requests */
+    return qatomic_load_acquire(&server->in_flight) > 0 ||
+           qatomic_load_acquire(&server->kick_handlers_running) > 0;
+}
+
+static void kick_handler(void *opaque);
+
+static AioContext *vu_fd_watch_aio_context(VuServer *server,
+                                           VuFdWatch *vu_fd_watch)
+{
+    if (server->vq_aio_context) {
+        /* libvhost-user only watches kick fds, pvt is the virtqueue index */
+        uintptr_t idx = (uintptr_t)vu_fd_watch->pvt;
+
+        assert(idx < server->max_queues);
+        return server->vq_aio_context[idx];
+    }
+    return server->ctx;
+}
+
+/* Called with vu_fd_watches_lock held */
+static void vu_fd_watch_attach(VuServer *server, VuFdWatch *vu_fd_watch)
+{
+    AioContext *ctx = vu_fd_watch_aio_context(server, vu_fd_watch);
+
+    assert(!vu_fd_watch->ctx);
+    vu_fd_watch->ctx = ctx;
+    aio_set_fd_handler(ctx, vu_fd_watch->fd, kick_handler, NULL, NULL, NULL,
+                       vu_fd_watch);
+}
+
+/* Called with vu_fd_watches_lock held */
+static void vu_fd_watch_detach(VuFdWatch *vu_fd_watch)
+{
+    if (vu_fd_watch->ctx) {
+        aio_set_fd_handler(vu_fd_watch->ctx, vu_fd_watch->fd,
+                           NULL, NULL, NULL, NULL, NULL);
+        vu_fd_watch->ctx = NULL;
+    }
+}
+
+/*
+ * Stop processing virtqueues in other threads so that a vhost-user message can
+ * safely change the device state.
+ */
+static void coroutine_fn vu_pause_vqs(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    if (!server->vq_aio_context) {
+        return;
+    }
+
+    qatomic_set(&server->vqs_paused, true);
+    smp_mb();
+
+    qemu_mutex_lock(&server->vu_fd_watches_lock);
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        vu_fd_watch_detach(vu_fd_watch);
+    }
+    qemu_mutex_unlock(&server->vu_fd_watches_lock);
+
+    /*
+     * Requests complete in other threads, so there is nobody to wake us up.
+     * Messages are rare compared to requests, just poll.
+     */
+    while (vhost_user_server_has_in_flight(server)) {
+        qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, 10 * SCALE_US);
+    }
+}
+
+static void vu_resume_vqs(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    if (!qatomic_read(&server->vqs_paused)) {
+        return;
+    }
+
+    qatomic_set(&server->vqs_paused, false);
+
+    /* If detached, vhost_user_server_attach_aio_context() resumes monitoring */
+    if (server->ctx) {
+        qemu_mutex_lock(&server->vu_fd_watches_lock);
+        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            vu_fd_watch_attach(server, vu_fd_watch);
+        }
+        qemu_mutex_unlock(&server->vu_fd_watches_lock);
+    }
+}
+
+static void coroutine_fn vu_wait_idle(VuServer *server)
+{
+    if (server->vq_aio_context) {
+        while (vhost_user_server_has_in_flight(server)) {
+            qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, 10 * SCALE_US);
+        }
+    } else if (vhost_user_server_has_in_flight(server)) {
+        server->wait_idle = true;
+        qemu_coroutine_yield();
+        server->wait_idle = false;
+    }
 }
 
 static bool coroutine_fn
@@ -163,6 +275,9 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         read_bytes += rc;
     } while (read_bytes != VHOST_USER_HDR_SIZE);
 
+    /* The message is handled by libvhost-user once we return */
+    vu_pause_vqs(server);
+
     /* qio_channel_readv_full will make socket fds blocking, unblock them */
     vmsg_unblock_fds(vmsg);
     if (vmsg->size > sizeof(vmsg->payload)) {
@@ -210,17 +325,15 @@ static coroutine_fn void vu_client_trip(void *opaque)
         if (!vu_dispatch(vu_dev) && server->ctx) {
             break;
         }
+        vu_resume_vqs(server);
     }
 
-    if (vhost_user_server_has_in_flight(server)) {
-        /* Wait for requests to complete before we can unmap the memory */
-        server->wait_idle = true;
-        qemu_coroutine_yield();
-        server->wait_idle = false;
-    }
+    /* Wait for requests to complete before we can unmap the memory */
+    vu_wait_idle(server);
     assert(!vhost_user_server_has_in_flight(server));
 
     vu_deinit(vu_dev);
+    qatomic_set(&server->vqs_paused, false);
 
     /* vu_deinit() should have called remove_watch() */
     assert(QTAILQ_EMPTY(&server->vu_fd_watches));
@@ -249,15 +362,27 @@ static void kick_handler(void *opaque)
 {
     VuFdWatch *vu_fd_watch = opaque;
     VuDev *vu_dev = vu_fd_watch->vu_dev;
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
 
-    vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
+    /* Pairs with smp_mb() in vu_pause_vqs() */
+    qatomic_inc(&server->kick_handlers_running);
+    smp_mb__after_rmw();
 
-    /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
-    if (vu_dev->broken) {
-        VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    /*
+     * The fd may already be detached in vu_pause_vqs(), but this thread was
+     * about to dispatch it.  Leave the kick pending, the eventfd is polled
+     * again when virtqueue processing resumes.
+     */
+    if (!qatomic_read(&server->vqs_paused)) {
+        vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
 
-        qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
+        if (vu_dev->broken) {
+            qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
     }
+
+    qatomic_dec(&server->kick_handlers_running);
 }
 
 static VuFdWatch *find_vu_fd_watch(VuServer *server, int fd)
@@ -282,6 +407,8 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
     g_assert(fd >= 0);
     g_assert(cb);
 
+    QEMU_LOCK_GUARD(&server->vu_fd_watches_lock);
+
     VuFdWatch *vu_fd_watch = find_vu_fd_watch(server, fd);
 
     if (!vu_fd_watch) {
@@ -292,10 +419,13 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
         qemu_socket_set_nonblock(fd);
-        aio_set_fd_handler(server->ctx, fd, kick_handler,
-                           NULL, NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+
+        /* Otherwise monitoring starts in vu_resume_vqs() */
+        if (!qatomic_read(&server->vqs_paused)) {
+            vu_fd_watch_attach(server, vu_fd_watch);
+        }
     }
 }
 
@@ -308,12 +438,14 @@ static void remove_watch(VuDev *vu_dev, int fd)
 
     server = container_of(vu_dev, VuServer, vu_dev);
 
+    QEMU_LOCK_GUARD(&server->vu_fd_watches_lock);
+
     VuFdWatch *vu_fd_watch = find_vu_fd_watch(server, fd);
 
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ctx, fd, NULL, NULL, NULL, NULL, NULL);
+    vu_fd_watch_detach(vu_fd_watch);
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
     g_free(vu_fd_watch);
@@ -372,9 +504,10 @@ void vhost_user_server_stop(VuServer *server)
     if (server->sioc) {
         VuFdWatch *vu_fd_watch;
 
-        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+        WITH_QEMU_LOCK_GUARD(&server->vu_fd_watches_lock) {
+            QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+                vu_fd_watch_detach(vu_fd_watch);
+            }
         }
 
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
@@ -386,6 +519,8 @@ void vhost_user_server_stop(VuServer *server)
         qio_net_listener_disconnect(server->listener);
         object_unref(OBJECT(server->listener));
     }
+
+    qemu_mutex_destroy(&server->vu_fd_watches_lock);
 }
 
 /*
@@ -411,9 +546,11 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
         return;
     }
 
-    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, kick_handler, NULL,
-                           NULL, NULL, vu_fd_watch);
+    if (!qatomic_read(&server->vqs_paused)) {
+        QEMU_LOCK_GUARD(&server->vu_fd_watches_lock);
+        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            vu_fd_watch_attach(server, vu_fd_watch);
+        }
     }
 
     if (server->co_trip) {
@@ -443,9 +580,9 @@ void vhost_user_server_detach_aio_context(VuServer *server)
     if (server->sioc) {
         VuFdWatch *vu_fd_watch;
 
+        QEMU_LOCK_GUARD(&server->vu_fd_watches_lock);
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+            vu_fd_watch_detach(vu_fd_watch);
         }
     }
 
@@ -462,6 +599,7 @@ void vhost_user_server_detach_aio_context(VuServer *server)
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *socket_addr,
                              AioContext *ctx,
+                             AioContext **vq_aio_context,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp)
@@ -491,6 +629,7 @@ bool vhost_user_server_start(VuServer *server,
         .vu_iface              = vu_iface,
         .max_queues            = max_queues,
         .ctx                   = ctx,
+        .vq_aio_context        = vq_aio_context,
     };
 
     qio_net_listener_set_name(server->listener, "vhost-user-backend-listener");
@@ -500,6 +639,7 @@ bool vhost_user_server_start(VuServer *server,
                                      server,
                                      NULL);
 
+    qemu_mutex_init(&server->vu_fd_watches_lock);
     QTAILQ_INIT(&server->vu_fd_watches);
     return true;
 }